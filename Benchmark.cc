@@ -1,92 +1,176 @@
 #include "Benchmark.h"
 
+#include <cassert>
 #include <iostream>
 
-#include <libmemcached/memcached.h>
 #include "Cycles.h"
 
 using RAMCloud::Cycles;
 
+/**
+ * Connect to the memcached server on 127.0.0.1:#port, or on the Unix
+ * socket #socketPath if it isn't empty.
+ */
+ConnectionPool::ConnectionPool(size_t port, const std::string& socketPath)
+  : ConnectionPool{"memcached",
+                   BackendConfig{{socketPath.empty()
+                                  ? std::make_pair(std::string{"127.0.0.1"},
+                                                   int(port))
+                                  : std::make_pair(socketPath, 0)}, {}}}
+{}
+
+/**
+ * Connect through the backend registered as #backend; exits if there is
+ * no such backend.
+ */
+ConnectionPool::ConnectionPool(const std::string& backend,
+                               const BackendConfig& config)
+  : factory{KVBackendRegistry::create(backend, config)}
+  , clients{}
+{
+  if (!factory) {
+    std::cerr << "Unknown backend " << backend << "; known backends:"
+              << std::endl;
+    KVBackendRegistry::list(stderr);
+    exit(-1);
+  }
+}
+
+ConnectionPool::~ConnectionPool()
+{
+}
+
+/**
+ * Make sure threads [0, nThreads) each have nConnections connections, so
+ * none are created while a benchmark is being timed.
+ */
+void
+ConnectionPool::reserve(size_t nThreads, size_t nConnections)
+{
+  if (clients.size() < nThreads)
+    clients.resize(nThreads);
+  for (size_t t = 0; t < nThreads; ++t) {
+    while (clients[t].size() < nConnections)
+      clients[t].emplace_back(factory->connect());
+  }
+}
+
 Benchmark::Benchmark(size_t port, size_t nThreads, double seconds)
-  : port{port}
-  , nThreads{nThreads}
+  : Benchmark{std::make_shared<ConnectionPool>(port), nThreads, seconds}
+{}
+
+/**
+ * Construct a benchmark whose threads use (and leave open) connections
+ * from #pool; each thread gets nConnections of them.
+ */
+Benchmark::Benchmark(std::shared_ptr<ConnectionPool> pool, size_t nThreads,
+                     double seconds, size_t nConnections)
+  : nThreads{nThreads}
   , seconds{seconds}
-  , clients{}
+  , nConnections{nConnections}
+  , pool{pool}
   , threads{}
+  , phases{}
+  , phaseIndex{}
+  , threadStats{}
+  , results{}
+  , quiet{}
   , lastDumpSeconds{}
-  , nReady{}
-  , go{}
+  , barrier{nThreads + 1}
+  , finished{}
   , stop{}
   , nDone{}
 {
-  for (size_t i = 0; i < nThreads; ++i) {
-    memcached_st* memc = memcached_create(NULL);
-
-    memcached_return rc =
-      memcached_behavior_set(memc, MEMCACHED_BEHAVIOR_NO_BLOCK, 1);
-    if (rc != MEMCACHED_SUCCESS) {
-      std::cerr << "failed to set non-blocking IO" << std::endl;
-      exit(1);
-    }
-
-    memcached_server_st* servers =
-      memcached_server_list_append(NULL, "127.0.0.1", port, &rc);
-    if (servers == NULL) {
-      std::cerr << "memcached_server_list_append failed: " << (int)rc
-                << std::endl;
-        exit(1);
-    }
-    rc = memcached_server_push(memc, servers);
-    if (rc != MEMCACHED_SUCCESS) {
-      std::cerr << "memcached_server_push failed: " << (int)rc << " "
-                <<  memcached_strerror(memc, rc) << std::endl;
-        exit(1);
-    }
-
-    clients.emplace_back(memc);
-  }
+  pool->reserve(nThreads, nConnections);
+  for (size_t i = 0; i < nThreads; ++i)
+    threadStats.emplace_back(new ThreadStats{});
 }
 
 Benchmark::~Benchmark()
 {
-  for (auto& memc : clients)
-    memcached_free(memc);
+}
+
+/**
+ * Append a phase to the benchmark; phases run in the order they are added.
+ * If none are added, start() runs a single "measure" phase of run() on
+ * every thread for the configured number of seconds. phaseDone() may add
+ * phases too, so a benchmark can decide what to run next from what it has
+ * measured.
+ */
+void
+Benchmark::addPhase(const Phase& phase)
+{
+  assert(phase.nThreads <= nThreads);
+  phases.push_back(phase);
 }
 
 void
 Benchmark::start()
 {
-  dumpHeader();
+  if (phases.empty())
+    phases.push_back({"measure", seconds, nThreads,
+                      [this](size_t threadId) { run(threadId); }});
+
+  if (!quiet)
+    dumpHeader();
 
   for (size_t i = 0; i < nThreads; ++i)
     threads.emplace_back(&Benchmark::entry, this, i);
 
-  while (nReady < nThreads)
-    std::this_thread::yield();
-  go = true;
-
   using namespace std::chrono_literals;
-  uint64_t start = Cycles::rdtsc();
-  uint64_t endTs = start + Cycles::fromSeconds(seconds);
-  uint64_t nextDumpTs = start + Cycles::fromSeconds(1.0);
+  for (phaseIndex = 0; phaseIndex < phases.size(); ++phaseIndex) {
+    const Phase& phase = phases[phaseIndex];
+    stop = false;
+    nDone = 0;
+    lastDumpSeconds = 0;
+    for (auto& stats : threadStats) {
+      stats->ops = 0;
+      stats->latency.clear();
+    }
+    phaseStart(phase);
 
-  while (true) {
-    uint64_t now = Cycles::rdtsc();
-    if (nextDumpTs < now) {
-      double nowSeconds = Cycles::toSeconds(now - start);
-      dump(nowSeconds, nowSeconds - lastDumpSeconds);
-      lastDumpSeconds = nowSeconds;
-      nextDumpTs = nextDumpTs + Cycles::fromSeconds(1.0);
+    // Release the threads into the phase.
+    uint64_t start = Cycles::rdtsc();
+    barrier.wait();
+
+    uint64_t endTs = start + Cycles::fromSeconds(phase.seconds);
+    uint64_t nextDumpTs = start + Cycles::fromSeconds(1.0);
+
+    while (true) {
+      uint64_t now = Cycles::rdtsc();
+      if (nextDumpTs < now) {
+        double nowSeconds = Cycles::toSeconds(now - start);
+        if (!quiet)
+          dump(nowSeconds, nowSeconds - lastDumpSeconds);
+        lastDumpSeconds = nowSeconds;
+        nextDumpTs = nextDumpTs + Cycles::fromSeconds(1.0);
+      }
+      if ((phase.seconds > 0 && endTs < now) || nDone == nThreads)
+        break;
+      std::this_thread::sleep_for(1ms);
     }
-    if (endTs < now || nDone == nThreads)
-      break;
-    std::this_thread::sleep_for(1ms);
+
+    stop = true;
+
+    // Wait for every thread to leave the phase.
+    barrier.wait();
+    const double elapsed = Cycles::toSeconds(Cycles::rdtsc() - start);
+
+    PhaseResult result{phase.name, phase.nThreads, elapsed, 0, {}};
+    for (auto& stats : threadStats) {
+      result.ops += stats->ops;
+      result.latency.merge(stats->latency);
+    }
+    results.push_back(result);
+    phaseDone(phase, elapsed);
   }
 
-  stop = true;
+  finished = true;
+  barrier.wait();
 
   for (auto& thread : threads)
     thread.join();
+  threads.clear();
 }
 
 void
@@ -94,13 +178,78 @@ Benchmark::entry(size_t threadId)
 {
   warmup(threadId);
 
-  ++nReady;
-  while (!go)
-    std::this_thread::yield();
+  while (true) {
+    barrier.wait();
+    if (finished)
+      break;
+
+    const Phase& phase = phases[phaseIndex];
+    if (threadId < phase.nThreads)
+      phase.workload(threadId);
+    ++nDone;
+
+    barrier.wait();
+  }
+}
 
-  run(threadId);
+Barrier::Barrier(size_t nThreads)
+  : nThreads{nThreads}
+  , nWaiting{}
+  , generation{}
+  , mutex{}
+  , cond{}
+{}
 
-  ++nDone;
+void
+Barrier::wait()
+{
+  std::unique_lock<std::mutex> lock{mutex};
+  const uint64_t arrivedIn = generation;
+  if (++nWaiting == nThreads) {
+    nWaiting = 0;
+    ++generation;
+    cond.notify_all();
+    return;
+  }
+  cond.wait(lock, [this, arrivedIn] { return generation != arrivedIn; });
+}
+
+BenchmarkRegistry::Registration::Registration(const std::string& name,
+                                              const std::string& description,
+                                              Factory factory)
+{
+  entries()[name] = Entry{description, factory};
+}
+
+std::map<std::string, BenchmarkRegistry::Entry>&
+BenchmarkRegistry::entries()
+{
+  // Constructed on first use so Registrations in any translation unit can
+  // run during static initialization.
+  static std::map<std::string, Entry> entries{};
+  return entries;
+}
+
+/**
+ * Construct the benchmark registered as #name, or return nullptr if there
+ * is no such benchmark.
+ */
+std::unique_ptr<Benchmark>
+BenchmarkRegistry::create(const std::string& name,
+                          const BenchmarkOptions& options)
+{
+  auto it = entries().find(name);
+  if (it == entries().end())
+    return nullptr;
+  return it->second.factory(options);
+}
+
+void
+BenchmarkRegistry::list(std::ostream& out)
+{
+  for (auto& entry : entries())
+    out << "  " << entry.first << ": " << entry.second.description
+        << std::endl;
 }
 
 PRNG::PRNG()
@@ -109,10 +258,11 @@ PRNG::PRNG()
   , z{521288629}
 {}
 
+// Shift counts are masked so that arbitrary 64-bit seeds are well defined.
 PRNG::PRNG(uint64_t seed)
-  : x{123456789lu * ~(seed << seed)}
-  , y{362436069 * ~(seed << (seed + 1))}
-  , z{521288629 * ~(seed << (seed + 2))}
+  : x{123456789lu * ~(seed << (seed & 63))}
+  , y{362436069 * ~(seed << ((seed + 1) & 63))}
+  , z{521288629 * ~(seed << ((seed + 2) & 63))}
 {}
 
 void
@@ -1,4 +1,12 @@
 #include <cinttypes>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <iosfwd>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
 #include <vector>
 #include <thread>
 #include <atomic>
@@ -6,41 +14,193 @@
 #ifndef BENCHMARK_H
 #define BENCHMARK_H
 
-class memcached_st;
+#include "Histogram.h"
+#include "KVBackend.h"
+
+/**
+ * A reusable barrier: each call to wait() blocks until nThreads callers
+ * have arrived, after which the barrier is ready for the next round.
+ */
+class Barrier {
+ public:
+  explicit Barrier(size_t nThreads);
+  void wait();
+
+ private:
+  const size_t nThreads;
+  size_t nWaiting;
+  uint64_t generation;
+  std::mutex mutex;
+  std::condition_variable cond;
+};
+
+/**
+ * Backend connections for each benchmark thread: memcached on
+ * 127.0.0.1:port (or on a Unix socket), or any registered KVBackend. A pool
+ * can outlive the benchmarks using it, so a sweep over many configurations
+ * can reuse its connections.
+ */
+class ConnectionPool {
+ public:
+  explicit ConnectionPool(size_t port, const std::string& socketPath = "");
+  ConnectionPool(const std::string& backend, const BackendConfig& config);
+  ~ConnectionPool();
+
+  void reserve(size_t nThreads, size_t nConnections);
+  KVBackend* get(size_t threadId, size_t connection = 0) {
+    return clients.at(threadId).at(connection).get();
+  }
+
+  /// Print the store's end-of-run summary, if it has one.
+  void report(FILE* out) { factory->report(out); }
+
+ private:
+  std::unique_ptr<KVBackendFactory> factory;
+  std::vector<std::vector<std::unique_ptr<KVBackend>>> clients;
+};
 
 class Benchmark {
  public:
+  /**
+   * One stage of a benchmark (e.g. fill, warm, measure, cool-down). Threads
+   * [0, nThreads) run workload until it returns or seconds elapse; with
+   * seconds == 0 the phase lasts until every thread's workload returns.
+   */
+  struct Phase {
+    std::string name;
+    double seconds;
+    size_t nThreads;
+    std::function<void(size_t threadId)> workload;
+  };
+
+  /// What a phase accomplished, as reported by its workloads through
+  /// recordOp().
+  struct PhaseResult {
+    std::string name;
+    size_t nThreads;
+    double seconds;
+    uint64_t ops;
+    Histogram latency;
+  };
+
   Benchmark(size_t port, size_t nThreads, double seconds);
-  ~Benchmark();
+  Benchmark(std::shared_ptr<ConnectionPool> pool, size_t nThreads,
+            double seconds, size_t nConnections = 1);
+  virtual ~Benchmark();
+
+  KVBackend* getClient(size_t threadId, size_t connection = 0) {
+    return pool->get(threadId, connection);
+  }
+  size_t getNConnections() { return nConnections; }
+  void setQuiet(bool quiet) { this->quiet = quiet; }
+  bool isQuiet() { return quiet; }
 
-  memcached_st* getClient(size_t threadId) { return clients.at(threadId); }
+  /// Count #nOps completed operations taking #latencyNs in total against
+  /// the current phase. Only call from thread #threadId.
+  void recordOp(size_t threadId, uint64_t latencyNs, uint64_t nOps = 1) {
+    ThreadStats& stats = *threadStats[threadId];
+    stats.ops += nOps;
+    stats.latency.record(latencyNs);
+  }
+  const std::vector<PhaseResult>& getResults() { return results; }
   bool getStop() { return stop; }
+  const Phase& getPhase() { return phases.at(phaseIndex); }
 
+  void addPhase(const Phase& phase);
   virtual void start();
 
+  /// Whether the keys still hold the values the fill loaded once the
+  /// benchmark is done, so a sweep's next point can skip its fill.
+  virtual bool keepsDataSet() { return true; }
+
  private:
   virtual void warmup(size_t threadId) {}
   virtual void run(size_t threadId) = 0;
   virtual void dumpHeader() {}
   virtual void dump(double time, double interval) {}
+  virtual void phaseStart(const Phase& phase) {}
+  virtual void phaseDone(const Phase& phase, double seconds) {}
 
   void entry(size_t threadId);
 
-  const size_t port;
+  // Kept in separate allocations so threads don't share cache lines.
+  struct ThreadStats {
+    uint64_t ops;
+    Histogram latency;
+  };
+
   const size_t nThreads;
   const double seconds;
+  const size_t nConnections;
 
-  std::vector<memcached_st*> clients;
+  std::shared_ptr<ConnectionPool> pool;
   std::vector<std::thread> threads;
 
+  // A deque, so phaseDone() can add phases without invalidating the one
+  // that just ran.
+  std::deque<Phase> phases;
+  size_t phaseIndex;
+  std::vector<std::unique_ptr<ThreadStats>> threadStats;
+  std::vector<PhaseResult> results;
+  bool quiet;
+
   double lastDumpSeconds;
 
-  std::atomic<size_t> nReady;
-  std::atomic<bool> go;
+  Barrier barrier;
+  std::atomic<bool> finished;
   std::atomic<bool> stop;
   std::atomic<size_t> nDone;
 };
 
+/// Command-line parameters handed to a benchmark's factory.
+struct BenchmarkOptions {
+  size_t port;
+  size_t nThreads;
+  double seconds;
+  size_t valueLen;
+  size_t nKeys;
+  size_t batchSize;
+  size_t nConnections;
+
+  /// Connections to use; if null the benchmark opens its own.
+  std::shared_ptr<ConnectionPool> pool;
+
+  /// Assume an earlier benchmark already loaded the same data set.
+  bool skipFill;
+
+  /// Value sizes over time, for size-shift (see bench.cc).
+  std::string schedule;
+
+  /// Latency and error-rate targets, for capacity (see bench.cc).
+  std::string slo;
+};
+
+/**
+ * Benchmarks by name, so that bench can choose a scenario on the command
+ * line. Scenarios register themselves with a static Registration.
+ */
+class BenchmarkRegistry {
+ public:
+  using Factory =
+    std::function<std::unique_ptr<Benchmark>(const BenchmarkOptions&)>;
+
+  struct Registration {
+    Registration(const std::string& name, const std::string& description,
+                 Factory factory);
+  };
+
+  static std::unique_ptr<Benchmark> create(const std::string& name,
+                                           const BenchmarkOptions& options);
+  static void list(std::ostream& out);
+
+ private:
+  struct Entry {
+    std::string description;
+    Factory factory;
+  };
+  static std::map<std::string, Entry>& entries();
+};
+
 class PRNG {
  public:
   PRNG();
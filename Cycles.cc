@@ -13,8 +13,14 @@
  * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
  */
 
+#include <cpuid.h>
 #include <errno.h>
-#include <sys/time.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <string>
 
 #include "Common.h"
 #include "Cycles.h"
@@ -23,6 +29,8 @@
 namespace RAMCloud {
 
 double Cycles::cyclesPerSec = 0;
+uint64_t Cycles::nsPerCycleFixed = 0;
+bool Cycles::invariant = false;
 uint64_t Cycles::mockTscValue = 0;
 static Initialize _(Cycles::init);
 
@@ -38,51 +46,242 @@ Cycles::init() {
     if (cyclesPerSec != 0)
         return;
 
-    // Compute the frequency of the fine-grained CPU timer: to do this,
-    // take parallel time readings using both rdtsc and gettimeofday.
-    // After 10ms have elapsed, take the ratio between these readings.
+    uint32_t eax, ebx, ecx, edx;
+    if (__get_cpuid(0x80000007, &eax, &ebx, &ecx, &edx))
+        invariant = (edx >> 8) & 1;
+    if (!invariant) {
+        fprintf(stderr, "Cycles::init: TSC is not invariant; times may be "
+                "skewed by frequency changes\n");
+    }
+
+    // Busy-waiting against the system clock costs every program tens of
+    // milliseconds before main(), so first try the value an earlier process
+    // measured during this boot, then the frequency the processor (or the
+    // hypervisor) advertises.
+    cyclesPerSec = frequencyFromCache();
+    if (cyclesPerSec == 0)
+        cyclesPerSec = frequencyFromCpuid();
+    if (cyclesPerSec == 0) {
+        cyclesPerSec = calibrate();
+        saveToCache();
+    }
+
+    nsPerCycleFixed = (uint64_t)(1e09 *
+                                 (double)(1UL << NS_PER_CYCLE_SHIFT) /
+                                 cyclesPerSec + 0.5);
+}
 
-    struct timeval startTime, stopTime;
-    uint64_t startCycles, stopCycles, micros;
-    double oldCycles;
+/**
+ * Return the counter frequency reported by CPUID, or 0 if it isn't
+ * available. Leaf 0x15 gives the TSC/crystal ratio (and, on most recent
+ * parts, the crystal frequency); hypervisors that follow the VMware
+ * convention report the guest's TSC frequency in leaf 0x40000010.
+ */
+double
+Cycles::frequencyFromCpuid()
+{
+    uint32_t eax, ebx, ecx, edx;
+
+    if (__get_cpuid_max(0, NULL) >= 0x15) {
+        __cpuid(0x15, eax, ebx, ecx, edx);
+        if (eax != 0 && ebx != 0 && ecx != 0)
+            return (double)ecx * (double)ebx / (double)eax;
+    }
+
+    __cpuid(1, eax, ebx, ecx, edx);
+    bool hypervisor = (ecx >> 31) & 1;
+    if (hypervisor) {
+        __cpuid(0x40000000, eax, ebx, ecx, edx);
+        if (eax >= 0x40000010) {
+            __cpuid(0x40000010, eax, ebx, ecx, edx);
+            if (eax != 0)
+                return (double)eax * 1000.0;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Return the path of the file used to remember a calibration across
+ * processes, or an empty string if there is nowhere private to keep it. It
+ * lives in $XDG_RUNTIME_DIR, or else in $HOME/.cache, so no other user can
+ * plant or redirect it; $CYCLES_CALIBRATION_FILE overrides both.
+ */
+static std::string
+cacheFile()
+{
+    const char* path = getenv("CYCLES_CALIBRATION_FILE");
+    if (path != NULL)
+        return path;
+    const char* dir = getenv("XDG_RUNTIME_DIR");
+    if (dir != NULL && dir[0] == '/')
+        return std::string(dir) + "/cycles_per_sec";
+    dir = getenv("HOME");
+    if (dir != NULL && dir[0] == '/') {
+        std::string cache = std::string(dir) + "/.cache";
+        mkdir(cache.c_str(), 0700);
+        return cache + "/cycles_per_sec";
+    }
+    return "";
+}
+
+/**
+ * Read this machine's boot id into #bootId (37 bytes); a calibration is only
+ * trusted within the boot that produced it.
+ */
+static bool
+readBootId(char* bootId)
+{
+    FILE* f = fopen("/proc/sys/kernel/random/boot_id", "r");
+    if (f == NULL)
+        return false;
+    bool ok = (fscanf(f, "%36s", bootId) == 1);
+    fclose(f);
+    return ok;
+}
+
+/**
+ * Return the frequency recorded by saveToCache() during this boot, or 0.
+ * The file must be a regular one of ours that nobody else can write, and
+ * the value must agree with a quick measurement.
+ */
+double
+Cycles::frequencyFromCache()
+{
+    char bootId[37], cachedBootId[37];
+    double cached = 0;
+
+    std::string path = cacheFile();
+    if (path.empty() || !readBootId(bootId))
+        return 0;
+    int fd = open(path.c_str(), O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+    if (fd < 0)
+        return 0;
+    struct stat st;
+    if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) ||
+            st.st_uid != geteuid() || (st.st_mode & (S_IWGRP | S_IWOTH))) {
+        close(fd);
+        return 0;
+    }
+    FILE* f = fdopen(fd, "r");
+    if (f == NULL) {
+        close(fd);
+        return 0;
+    }
+    if (fscanf(f, "%36s %lf", cachedBootId, &cached) != 2 ||
+            strcmp(bootId, cachedBootId) != 0) {
+        cached = 0;
+    }
+    fclose(f);
+
+    // A millisecond against the system clock is enough to catch a value
+    // that is wrong, if not to replace it.
+    if (cached > 0) {
+        double measured = measure(1000000);
+        if (cached < measured * 0.99 || cached > measured * 1.01)
+            cached = 0;
+    }
+    return cached;
+}
+
+/**
+ * Record cyclesPerSec for later processes; failures are ignored. The file
+ * is written under a fresh name and renamed into place, so a reader never
+ * sees half of it and an existing file or link there is never written
+ * through.
+ */
+void
+Cycles::saveToCache()
+{
+    char bootId[37];
+
+    std::string path = cacheFile();
+    if (path.empty() || !readBootId(bootId))
+        return;
+    std::string temp = path + "." + std::to_string(getpid());
+    int fd = open(temp.c_str(),
+                  O_WRONLY | O_CREAT | O_EXCL | O_NOFOLLOW | O_CLOEXEC, 0600);
+    if (fd < 0)
+        return;
+    char line[64];
+    int length = snprintf(line, sizeof(line), "%s %.1f\n", bootId,
+                          cyclesPerSec);
+    bool ok = write(fd, line, length) == length;
+    if (close(fd) != 0)
+        ok = false;
+    if (!ok || rename(temp.c_str(), path.c_str()) != 0)
+        unlink(temp.c_str());
+}
+
+/**
+ * Measure the frequency of the fine-grained CPU timer: to do this, take
+ * parallel time readings using both rdtsc and the monotonic clock. After
+ * 10ms have elapsed, take the ratio between these readings.
+ */
+double
+Cycles::calibrate()
+{
+    double oldCycles, cycles = 0;
 
     // There is one tricky aspect, which is that we could get interrupted
-    // between calling gettimeofday and reading the cycle counter, in which
+    // between reading the clock and reading the cycle counter, in which
     // case we won't have corresponding readings.  To handle this (unlikely)
     // case, compute the overall result repeatedly, and wait until we get
     // two successive calculations that are within 0.1% of each other.
     oldCycles = 0;
     while (1) {
-        if (gettimeofday(&startTime, NULL) != 0) {
-            fprintf(stderr, "Cycles::init couldn't read clock: %s", strerror(errno));
-            exit(1);
+        cycles = measure(10000000);
+        double delta = cycles/1000.0;
+        if ((oldCycles > (cycles - delta)) &&
+                (oldCycles < (cycles + delta))) {
+            return cycles;
         }
-        startCycles = rdtsc();
-        while (1) {
-            if (gettimeofday(&stopTime, NULL) != 0) {
-                fprintf(stderr, "Cycles::init couldn't read clock: %s",
-                        strerror(errno));
-                exit(1);
-            }
-            stopCycles = rdtsc();
-            micros = (stopTime.tv_usec - startTime.tv_usec) +
-                    (stopTime.tv_sec - startTime.tv_sec)*1000000;
-            if (micros > 10000) {
-                cyclesPerSec = static_cast<double>(stopCycles - startCycles);
-                cyclesPerSec = 1000000.0*cyclesPerSec/
-                        static_cast<double>(micros);
-                break;
-            }
+        oldCycles = cycles;
+    }
+}
+
+/**
+ * Return the counter's frequency as measured against the monotonic clock
+ * over at least #nanos nanoseconds.
+ */
+double
+Cycles::measure(uint64_t nanos)
+{
+    struct timespec startTime, stopTime;
+    uint64_t startCycles, stopCycles, elapsed;
+
+    if (clock_gettime(CLOCK_MONOTONIC_RAW, &startTime) != 0) {
+        fprintf(stderr, "Cycles::init couldn't read clock: %s", strerror(errno));
+        exit(1);
+    }
+    startCycles = rdtscStart();
+    while (1) {
+        if (clock_gettime(CLOCK_MONOTONIC_RAW, &stopTime) != 0) {
+            fprintf(stderr, "Cycles::init couldn't read clock: %s",
+                    strerror(errno));
+            exit(1);
         }
-        double delta = cyclesPerSec/1000.0;
-        if ((oldCycles > (cyclesPerSec - delta)) &&
-                (oldCycles < (cyclesPerSec + delta))) {
-            return;
+        stopCycles = rdtscStart();
+        elapsed = (stopTime.tv_nsec - startTime.tv_nsec) +
+                  (stopTime.tv_sec - startTime.tv_sec)*1000000000;
+        if (elapsed > nanos) {
+            double cycles = static_cast<double>(stopCycles - startCycles);
+            return 1e09*cycles/static_cast<double>(elapsed);
         }
-        oldCycles = cyclesPerSec;
     }
 }
 
+/**
+ * Return true if the cycle counter is invariant, i.e. it runs at a constant
+ * rate in every P-, C- and T-state, so cycle differences are proportional
+ * to wall-clock time.
+ */
+bool
+Cycles::isInvariant()
+{
+    return invariant;
+}
+
 /**
  * Return the number of CPU cycles per second.
  */
@@ -156,8 +355,8 @@ Cycles::toMicroseconds(uint64_t cycles, double cyclesPerSec)
 
 /**
  * Given an elapsed time measured in cycles, return an integer
- * giving the corresponding time in nanoseconds. Note: toSeconds()
- * is faster than this method.
+ * giving the corresponding time in nanoseconds. Note: when converting
+ * local cycle counts, toNanosecondsFast() is faster than this method.
  * \param cycles
  *      Difference between the results of two calls to rdtsc.
  * \param cyclesPerSec
@@ -172,7 +371,7 @@ uint64_t
 Cycles::toNanoseconds(uint64_t cycles, double cyclesPerSec)
 {
     if (cyclesPerSec == 0)
-        cyclesPerSec = Cycles::cyclesPerSec;
+        return toNanosecondsFast(cycles);
     return (uint64_t) (1e09*static_cast<double>(cycles)/cyclesPerSec + 0.5);
 }
 
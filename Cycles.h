@@ -16,6 +16,8 @@
 #ifndef RAMCLOUD_CYCLES_H
 #define RAMCLOUD_CYCLES_H
 
+#include <cstdint>
+
 namespace RAMCloud {
 
 /**
@@ -44,6 +46,61 @@ class Cycles {
         return (((uint64_t)hi << 32) | lo);
     }
 
+    /**
+     * Return the cycle counter for the start of a timed interval. Unlike
+     * rdtsc(), the counter isn't read until all earlier instructions have
+     * completed, so work ahead of the call isn't billed to the interval.
+     */
+    static __inline __attribute__((always_inline))
+    uint64_t
+    rdtscStart()
+    {
+#if TESTING
+        if (mockTscValue)
+            return mockTscValue;
+#endif
+        uint32_t lo, hi;
+        __asm__ __volatile__("lfence\n\trdtsc" : "=a" (lo), "=d" (hi)
+                             :: "memory");
+        return (((uint64_t)hi << 32) | lo);
+    }
+
+    /**
+     * Return the cycle counter for the end of a timed interval. The counter
+     * is read only after the work being timed has completed, and later
+     * instructions can't start before it is read.
+     */
+    static __inline __attribute__((always_inline))
+    uint64_t
+    rdtscStop()
+    {
+#if TESTING
+        if (mockTscValue)
+            return mockTscValue;
+#endif
+        uint32_t lo, hi;
+        __asm__ __volatile__("rdtscp\n\tlfence" : "=a" (lo), "=d" (hi)
+                             :: "rcx", "memory");
+        return (((uint64_t)hi << 32) | lo);
+    }
+
+    /**
+     * Given an elapsed time measured in cycles, return the corresponding
+     * number of nanoseconds (rounded) using the local counter's frequency.
+     * This is a multiply and a shift, so it's cheap enough to apply to
+     * every sample.
+     */
+    static __inline __attribute__((always_inline))
+    uint64_t
+    toNanosecondsFast(uint64_t cycles)
+    {
+        __extension__ typedef unsigned __int128 uint128_t;
+        return (uint64_t)(((uint128_t)cycles * nsPerCycleFixed +
+                           (1UL << (NS_PER_CYCLE_SHIFT - 1)))
+                          >> NS_PER_CYCLE_SHIFT);
+    }
+
+    static bool isInvariant();
     static double perSecond();
     static double toSeconds(uint64_t cycles, double cyclesPerSec = 0);
     static uint64_t fromSeconds(double seconds, double cyclesPerSec = 0);
@@ -54,10 +111,25 @@ class Cycles {
   private:
     Cycles();
 
+    static double frequencyFromCpuid();
+    static double frequencyFromCache();
+    static double calibrate();
+    static double measure(uint64_t nanos);
+    static void saveToCache();
+
     /// Conversion factor between cycles and the seconds; computed by
     /// Cycles::init.
     static double cyclesPerSec;
 
+    /// Nanoseconds per cycle as a fixed-point number with
+    /// NS_PER_CYCLE_SHIFT fractional bits; computed by Cycles::init.
+    static uint64_t nsPerCycleFixed;
+    static const int NS_PER_CYCLE_SHIFT = 32;
+
+    /// True if CPUID says the counter ticks at a constant rate regardless
+    /// of frequency scaling and sleep states.
+    static bool invariant;
+
     /// Used for testing: if nonzero then this will be returned as the result
     /// of the next call to rdtsc().
     static uint64_t mockTscValue;
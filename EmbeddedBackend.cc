@@ -0,0 +1,1149 @@
+#include "KVBackend.h"
+#include "Epoch.h"
+#include "TraceParser.h"
+
+#include <algorithm>
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <random>
+#include <vector>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#include <boost/smart_ptr/detail/spinlock.hpp>
+
+namespace {
+
+typedef boost::detail::spinlock SpinLock;
+
+/**
+ * One key-value pair, allocated as a single block with the key and then the
+ * value following the header. The key, value and hash never change once the
+ * item is published, so readers may look at them without locks as long as
+ * they are inside an epoch.
+ */
+struct Item {
+    uint64_t hash;
+
+    /// Next item in the same ChainedTable bucket.
+    Item* chainNext;
+
+    /// Neighbours in the eviction segment's list; only touched with the
+    /// segment locked.
+    Item* prev;
+    Item* next;
+    bool linked;
+
+    /// CLOCK reference bit, set by readers.
+    std::atomic<bool> referenced;
+
+    uint32_t keyLength;
+    uint32_t valueLength;
+
+    /// KVBackend::clockSeconds() when the item expires, or 0.
+    uint32_t expiry;
+
+    const char* key() const { return reinterpret_cast<const char*>(this + 1); }
+    const char* value() const { return key() + keyLength; }
+    size_t size() const { return sizeof(Item) + keyLength + valueLength; }
+
+    bool
+    matches(uint64_t h, const char* k, size_t length) const
+    {
+        return hash == h && keyLength == length &&
+               memcmp(key(), k, length) == 0;
+    }
+
+    static Item*
+    create(uint64_t hash, const char* key, size_t keyLength,
+           const char* value, size_t valueLength, uint32_t expiry)
+    {
+        void* memory = malloc(sizeof(Item) + keyLength + valueLength);
+        if (memory == NULL) {
+            fprintf(stderr, "out of memory allocating an item\n");
+            exit(1);
+        }
+        Item* item = new(memory) Item();
+        item->hash = hash;
+        item->chainNext = NULL;
+        item->prev = item->next = NULL;
+        item->linked = false;
+        item->referenced = false;
+        item->keyLength = uint32_t(keyLength);
+        item->valueLength = uint32_t(valueLength);
+        item->expiry = expiry;
+        char* data = reinterpret_cast<char*>(item + 1);
+        memcpy(data, key, keyLength);
+        memcpy(data + keyLength, value, valueLength);
+        return item;
+    }
+
+    static void
+    destroy(void* item)
+    {
+        static_cast<Item*>(item)->~Item();
+        free(item);
+    }
+};
+
+size_t
+nextPowerOfTwo(size_t n)
+{
+    size_t p = 1;
+    while (p < n)
+        p <<= 1;
+    return p;
+}
+
+/**
+ * A concurrent map from keys to Items. Callers must be inside an epoch, and
+ * must retire (not free) any item a table hands back as replaced or
+ * removed.
+ */
+class Table {
+  public:
+    virtual ~Table() {}
+
+    virtual Item* find(uint64_t hash, const char* key, size_t keyLength) = 0;
+
+    /**
+     * Store #item, replacing any item with the same key.
+     * \param[out] replaced
+     *      The item displaced, or NULL.
+     * \return
+     *      False if the table has no room for the item.
+     */
+    virtual bool insert(Item* item, Item** replaced) = 0;
+
+    /// Remove #item if it is still the one stored under its key.
+    virtual bool erase(Item* item) = 0;
+
+    /// Remove and return the item stored under #key, or NULL.
+    virtual Item* remove(uint64_t hash, const char* key,
+                         size_t keyLength) = 0;
+
+    /// Call #f on every item; only while no other thread uses the table.
+    virtual void forEach(const std::function<void(Item*)>& f) = 0;
+};
+
+/**
+ * Separate chaining with a fixed array of buckets; every operation takes
+ * the spinlock of the stripe its bucket belongs to.
+ */
+class ChainedTable : public Table {
+  public:
+    explicit ChainedTable(size_t capacity)
+        : mask(nextPowerOfTwo(std::max(capacity, size_t(N_STRIPES))) - 1)
+        , buckets(mask + 1)
+        , stripes(N_STRIPES)
+    {
+        for (Stripe& stripe : stripes)
+            stripe.lock.v_ = 0;
+    }
+
+    Item*
+    find(uint64_t hash, const char* key, size_t keyLength)
+    {
+        size_t b = hash & mask;
+        std::lock_guard<SpinLock> _(stripeFor(b));
+        for (Item* item = buckets[b]; item != NULL; item = item->chainNext) {
+            if (item->matches(hash, key, keyLength))
+                return item;
+        }
+        return NULL;
+    }
+
+    bool
+    insert(Item* item, Item** replaced)
+    {
+        size_t b = item->hash & mask;
+        std::lock_guard<SpinLock> _(stripeFor(b));
+        *replaced = NULL;
+        for (Item** link = &buckets[b]; *link != NULL;
+             link = &(*link)->chainNext) {
+            if ((*link)->matches(item->hash, item->key(), item->keyLength)) {
+                *replaced = *link;
+                item->chainNext = (*link)->chainNext;
+                *link = item;
+                return true;
+            }
+        }
+        item->chainNext = buckets[b];
+        buckets[b] = item;
+        return true;
+    }
+
+    bool
+    erase(Item* item)
+    {
+        size_t b = item->hash & mask;
+        std::lock_guard<SpinLock> _(stripeFor(b));
+        for (Item** link = &buckets[b]; *link != NULL;
+             link = &(*link)->chainNext) {
+            if (*link == item) {
+                *link = item->chainNext;
+                return true;
+            }
+        }
+        return false;
+    }
+
+    Item*
+    remove(uint64_t hash, const char* key, size_t keyLength)
+    {
+        size_t b = hash & mask;
+        std::lock_guard<SpinLock> _(stripeFor(b));
+        for (Item** link = &buckets[b]; *link != NULL;
+             link = &(*link)->chainNext) {
+            Item* item = *link;
+            if (item->matches(hash, key, keyLength)) {
+                *link = item->chainNext;
+                return item;
+            }
+        }
+        return NULL;
+    }
+
+    void
+    forEach(const std::function<void(Item*)>& f)
+    {
+        for (Item* head : buckets) {
+            for (Item* item = head; item != NULL; ) {
+                Item* next = item->chainNext;
+                f(item);
+                item = next;
+            }
+        }
+    }
+
+  private:
+    static const size_t N_STRIPES = 4096;
+
+    // Padded so neighbouring stripes don't share a cache line.
+    struct Stripe {
+        SpinLock lock;
+        char pad[64 - sizeof(SpinLock)];
+    };
+
+    SpinLock&
+    stripeFor(size_t bucket)
+    {
+        return stripes[bucket & (N_STRIPES - 1)].lock;
+    }
+
+    const size_t mask;
+    std::vector<Item*> buckets;
+    std::vector<Stripe> stripes;
+};
+
+/**
+ * Optimistic cuckoo hashing after MemC3: 4-way buckets, two candidate
+ * buckets per key, and one writer at a time. Readers take no locks; they
+ * read a bucket between two loads of its version counter and retry if a
+ * writer was active. Writers make room by moving a chain of items along a
+ * cuckoo path, back to front, so every item stays findable throughout.
+ */
+class CuckooTable : public Table {
+  public:
+    explicit CuckooTable(size_t capacity)
+        : mask(nextPowerOfTwo(std::max<size_t>(capacity * 5 / 16, 16)) - 1)
+        , buckets(new Bucket[mask + 1])
+        , versions(new std::atomic<uint32_t>[N_VERSIONS])
+        , writeLock()
+        , random(1)
+    {
+        for (size_t b = 0; b <= mask; b++) {
+            for (int s = 0; s < SLOTS; s++) {
+                buckets[b].tags[s] = 0;
+                buckets[b].items[s] = NULL;
+            }
+        }
+        for (size_t i = 0; i < N_VERSIONS; i++)
+            versions[i] = 0;
+    }
+
+    Item*
+    find(uint64_t hash, const char* key, size_t keyLength)
+    {
+        const uint8_t tag = tagOf(hash);
+        const size_t b1 = hash & mask;
+        const size_t b2 = alternate(b1, tag);
+        while (true) {
+            const uint32_t v1 = version(b1).load(std::memory_order_acquire);
+            const uint32_t v2 = version(b2).load(std::memory_order_acquire);
+            if ((v1 | v2) & 1)
+                continue;
+
+            Item* found = search(b1, tag, hash, key, keyLength);
+            if (found == NULL)
+                found = search(b2, tag, hash, key, keyLength);
+
+            std::atomic_thread_fence(std::memory_order_acquire);
+            if (version(b1).load(std::memory_order_relaxed) == v1 &&
+                version(b2).load(std::memory_order_relaxed) == v2) {
+                return found;
+            }
+        }
+    }
+
+    bool
+    insert(Item* item, Item** replaced)
+    {
+        std::lock_guard<std::mutex> _(writeLock);
+        const uint8_t tag = tagOf(item->hash);
+        const size_t b1 = item->hash & mask;
+        const size_t b2 = alternate(b1, tag);
+        *replaced = NULL;
+
+        for (size_t b : {b1, b2}) {
+            for (int s = 0; s < SLOTS; s++) {
+                Item* old = buckets[b].items[s].load(std::memory_order_relaxed);
+                if (old != NULL && buckets[b].tags[s] == tag &&
+                    old->matches(item->hash, item->key(), item->keyLength)) {
+                    beginWrite(b);
+                    buckets[b].items[s].store(item, std::memory_order_relaxed);
+                    endWrite(b);
+                    *replaced = old;
+                    return true;
+                }
+            }
+        }
+
+        for (size_t b : {b1, b2}) {
+            int s = emptySlot(b);
+            if (s >= 0) {
+                place(b, s, tag, item);
+                return true;
+            }
+        }
+
+        // Find a path of displacements ending in a free slot, then shift
+        // the items along it starting from the free end.
+        PathEntry path[MAX_PATH];
+        int length = 0;
+        size_t bucket = (random() & 1) ? b1 : b2;
+        while (length < MAX_PATH) {
+            int start = int(random() % SLOTS);
+            int s = -1;
+            for (int i = 0; i < SLOTS && s < 0; i++) {
+                int candidate = (start + i) % SLOTS;
+                if (!onPath(path, length, bucket, candidate))
+                    s = candidate;
+            }
+            if (s < 0)
+                return false;
+            path[length++] = {bucket, s};
+            size_t next = alternate(bucket, buckets[bucket].tags[s]);
+            int free = emptySlot(next);
+            if (free >= 0) {
+                size_t toBucket = next;
+                int toSlot = free;
+                for (int i = length - 1; i >= 0; i--) {
+                    size_t from = path[i].bucket;
+                    int fromSlot = path[i].slot;
+                    beginWrite(toBucket);
+                    if (&version(from) != &version(toBucket))
+                        beginWrite(from);
+                    buckets[toBucket].tags[toSlot].store(
+                        buckets[from].tags[fromSlot].load(
+                            std::memory_order_relaxed),
+                        std::memory_order_relaxed);
+                    buckets[toBucket].items[toSlot].store(
+                        buckets[from].items[fromSlot].load(
+                            std::memory_order_relaxed),
+                        std::memory_order_relaxed);
+                    if (&version(from) != &version(toBucket))
+                        endWrite(from);
+                    endWrite(toBucket);
+                    toBucket = from;
+                    toSlot = fromSlot;
+                }
+                place(toBucket, toSlot, tag, item);
+                return true;
+            }
+            bucket = next;
+        }
+        return false;
+    }
+
+    bool
+    erase(Item* item)
+    {
+        std::lock_guard<std::mutex> _(writeLock);
+        const uint8_t tag = tagOf(item->hash);
+        const size_t b1 = item->hash & mask;
+        for (size_t b : {b1, alternate(b1, tag)}) {
+            for (int s = 0; s < SLOTS; s++) {
+                if (buckets[b].items[s].load(std::memory_order_relaxed) ==
+                    item) {
+                    place(b, s, 0, NULL);
+                    return true;
+                }
+            }
+        }
+        return false;
+    }
+
+    Item*
+    remove(uint64_t hash, const char* key, size_t keyLength)
+    {
+        std::lock_guard<std::mutex> _(writeLock);
+        const uint8_t tag = tagOf(hash);
+        const size_t b1 = hash & mask;
+        for (size_t b : {b1, alternate(b1, tag)}) {
+            for (int s = 0; s < SLOTS; s++) {
+                Item* item = buckets[b].items[s].load(std::memory_order_relaxed);
+                if (item != NULL && buckets[b].tags[s] == tag &&
+                    item->matches(hash, key, keyLength)) {
+                    place(b, s, 0, NULL);
+                    return item;
+                }
+            }
+        }
+        return NULL;
+    }
+
+    void
+    forEach(const std::function<void(Item*)>& f)
+    {
+        for (size_t b = 0; b <= mask; b++) {
+            for (int s = 0; s < SLOTS; s++) {
+                Item* item = buckets[b].items[s].load();
+                if (item != NULL)
+                    f(item);
+            }
+        }
+    }
+
+  private:
+    static const int SLOTS = 4;
+    static const size_t N_VERSIONS = 8192;
+    static const int MAX_PATH = 128;
+
+    struct Bucket {
+        std::atomic<uint8_t> tags[SLOTS];
+        std::atomic<Item*> items[SLOTS];
+    };
+
+    struct PathEntry {
+        size_t bucket;
+        int slot;
+    };
+
+    static uint8_t
+    tagOf(uint64_t hash)
+    {
+        return uint8_t(hash >> 56) | 1;
+    }
+
+    size_t
+    alternate(size_t bucket, uint8_t tag)
+    {
+        return (bucket ^ (size_t(tag) * 0x5bd1e995)) & mask;
+    }
+
+    std::atomic<uint32_t>&
+    version(size_t bucket)
+    {
+        return versions[bucket & (N_VERSIONS - 1)];
+    }
+
+    void
+    beginWrite(size_t bucket)
+    {
+        version(bucket).fetch_add(1, std::memory_order_acq_rel);
+    }
+
+    void
+    endWrite(size_t bucket)
+    {
+        version(bucket).fetch_add(1, std::memory_order_release);
+    }
+
+    Item*
+    search(size_t b, uint8_t tag, uint64_t hash, const char* key,
+           size_t keyLength)
+    {
+        for (int s = 0; s < SLOTS; s++) {
+            if (buckets[b].tags[s].load(std::memory_order_relaxed) != tag)
+                continue;
+            Item* item = buckets[b].items[s].load(std::memory_order_relaxed);
+            if (item != NULL && item->matches(hash, key, keyLength))
+                return item;
+        }
+        return NULL;
+    }
+
+    int
+    emptySlot(size_t b)
+    {
+        for (int s = 0; s < SLOTS; s++) {
+            if (buckets[b].items[s].load(std::memory_order_relaxed) == NULL)
+                return s;
+        }
+        return -1;
+    }
+
+    void
+    place(size_t b, int s, uint8_t tag, Item* item)
+    {
+        beginWrite(b);
+        buckets[b].tags[s].store(tag, std::memory_order_relaxed);
+        buckets[b].items[s].store(item, std::memory_order_relaxed);
+        endWrite(b);
+    }
+
+    static bool
+    onPath(const PathEntry* path, int length, size_t bucket, int slot)
+    {
+        for (int i = 0; i < length; i++) {
+            if (path[i].bucket == bucket && path[i].slot == slot)
+                return true;
+        }
+        return false;
+    }
+
+    const size_t mask;
+    std::unique_ptr<Bucket[]> buckets;
+    std::unique_ptr<std::atomic<uint32_t>[]> versions;
+    std::mutex writeLock;
+    std::minstd_rand random;
+};
+
+/**
+ * Open addressing in the style of Swiss tables: a byte of control data per
+ * slot holds 7 bits of the hash, and lookups compare 16 of them at once
+ * with SSE2 (or a scalar loop elsewhere), probing group by group. The table
+ * is split into independently locked shards chosen by the top hash bits;
+ * a shard doubles in place when it fills up.
+ */
+class SimdTable : public Table {
+  public:
+    explicit SimdTable(size_t capacity)
+        : shards(N_SHARDS)
+    {
+        size_t groups = std::max<size_t>(
+            nextPowerOfTwo(capacity * 8 / 7 / N_SHARDS / GROUP + 1), 1);
+        for (Shard& shard : shards) {
+            shard.lock.v_ = 0;
+            shard.groupMask = groups - 1;
+            shard.control.assign(groups * GROUP, EMPTY);
+            shard.slots.assign(groups * GROUP, NULL);
+            shard.used = 0;
+        }
+    }
+
+    Item*
+    find(uint64_t hash, const char* key, size_t keyLength)
+    {
+        Shard& shard = shardFor(hash);
+        std::lock_guard<SpinLock> _(shard.lock);
+        ssize_t i = lookup(shard, hash, key, keyLength);
+        return i < 0 ? NULL : shard.slots[i];
+    }
+
+    bool
+    insert(Item* item, Item** replaced)
+    {
+        Shard& shard = shardFor(item->hash);
+        std::lock_guard<SpinLock> _(shard.lock);
+        *replaced = NULL;
+        ssize_t i = lookup(shard, item->hash, item->key(), item->keyLength);
+        if (i >= 0) {
+            *replaced = shard.slots[i];
+            shard.slots[i] = item;
+            return true;
+        }
+
+        // Keep at least an eighth of the slots empty so probes terminate
+        // quickly: drop tombstones, and double the shard if that isn't
+        // enough.
+        const size_t capacity = shard.control.size();
+        if (shard.used + 1 > capacity - capacity / 8) {
+            rehash(shard, capacity);
+            if (shard.used + 1 > capacity - capacity / 8)
+                rehash(shard, 2 * capacity);
+        }
+
+        size_t slot = freeSlot(shard, item->hash);
+        if (shard.control[slot] == EMPTY)
+            shard.used++;
+        shard.control[slot] = h2(item->hash);
+        shard.slots[slot] = item;
+        return true;
+    }
+
+    bool
+    erase(Item* item)
+    {
+        Shard& shard = shardFor(item->hash);
+        std::lock_guard<SpinLock> _(shard.lock);
+        ssize_t i = lookup(shard, item->hash, item->key(), item->keyLength);
+        if (i < 0 || shard.slots[i] != item)
+            return false;
+        shard.control[i] = DELETED;
+        shard.slots[i] = NULL;
+        return true;
+    }
+
+    Item*
+    remove(uint64_t hash, const char* key, size_t keyLength)
+    {
+        Shard& shard = shardFor(hash);
+        std::lock_guard<SpinLock> _(shard.lock);
+        ssize_t i = lookup(shard, hash, key, keyLength);
+        if (i < 0)
+            return NULL;
+        Item* item = shard.slots[i];
+        shard.control[i] = DELETED;
+        shard.slots[i] = NULL;
+        return item;
+    }
+
+    void
+    forEach(const std::function<void(Item*)>& f)
+    {
+        for (Shard& shard : shards) {
+            for (Item* item : shard.slots) {
+                if (item != NULL)
+                    f(item);
+            }
+        }
+    }
+
+  private:
+    static const size_t N_SHARDS = 256;
+    static const size_t GROUP = 16;
+    enum : int8_t { EMPTY = -128, DELETED = -2 };
+
+    struct Shard {
+        SpinLock lock;
+        size_t groupMask;
+        std::vector<int8_t> control;
+        std::vector<Item*> slots;
+
+        /// Slots not EMPTY: live items plus tombstones.
+        size_t used;
+    };
+
+    Shard&
+    shardFor(uint64_t hash)
+    {
+        return shards[hash >> 56];
+    }
+
+    static int8_t
+    h2(uint64_t hash)
+    {
+        return int8_t(hash & 0x7f);
+    }
+
+    static size_t
+    h1(uint64_t hash)
+    {
+        return hash >> 7;
+    }
+
+    /// Bit i set where control byte i of the group at #control equals #b.
+    static uint32_t
+    match(const int8_t* control, int8_t b)
+    {
+#if defined(__SSE2__)
+        __m128i group = _mm_loadu_si128(
+            reinterpret_cast<const __m128i*>(control));
+        return uint32_t(_mm_movemask_epi8(
+            _mm_cmpeq_epi8(group, _mm_set1_epi8(b))));
+#else
+        uint32_t mask = 0;
+        for (size_t i = 0; i < GROUP; i++) {
+            if (control[i] == b)
+                mask |= 1u << i;
+        }
+        return mask;
+#endif
+    }
+
+    ssize_t
+    lookup(Shard& shard, uint64_t hash, const char* key, size_t keyLength)
+    {
+        const int8_t tag = h2(hash);
+        size_t group = h1(hash) & shard.groupMask;
+        for (size_t probes = 0; probes <= shard.groupMask; probes++) {
+            const size_t base = group * GROUP;
+            const int8_t* control = &shard.control[base];
+            for (uint32_t m = match(control, tag); m != 0; m &= m - 1) {
+                size_t i = base + __builtin_ctz(m);
+                if (shard.slots[i]->matches(hash, key, keyLength))
+                    return ssize_t(i);
+            }
+            if (match(control, EMPTY) != 0)
+                return -1;
+            group = (group + 1) & shard.groupMask;
+        }
+        return -1;
+    }
+
+    size_t
+    freeSlot(Shard& shard, uint64_t hash)
+    {
+        size_t group = h1(hash) & shard.groupMask;
+        while (true) {
+            const size_t base = group * GROUP;
+            const int8_t* control = &shard.control[base];
+            uint32_t m = match(control, EMPTY) | match(control, DELETED);
+            if (m != 0)
+                return base + __builtin_ctz(m);
+            group = (group + 1) & shard.groupMask;
+        }
+    }
+
+    /// Reinsert the live items into #capacity slots, dropping tombstones.
+    void
+    rehash(Shard& shard, size_t capacity)
+    {
+        std::vector<Item*> live;
+        for (Item* item : shard.slots) {
+            if (item != NULL)
+                live.push_back(item);
+        }
+        shard.groupMask = capacity / GROUP - 1;
+        shard.control.assign(capacity, EMPTY);
+        shard.slots.assign(capacity, NULL);
+        shard.used = 0;
+        for (Item* item : live) {
+            size_t slot = freeSlot(shard, item->hash);
+            shard.control[slot] = h2(item->hash);
+            shard.slots[slot] = item;
+            shard.used++;
+        }
+    }
+
+    std::vector<Shard> shards;
+};
+
+/**
+ * The items of one slice of the hash space in eviction order, with a share
+ * of the memory limit. LRU keeps the list in recency order (readers move
+ * items to the front when the lock is free); CLOCK sweeps a hand around it,
+ * sparing items whose reference bit readers have set since the last pass.
+ */
+class Segment {
+  public:
+    enum Policy { LRU, CLOCK };
+
+    Segment()
+        : lock()
+        , head()
+        , hand(&head)
+        , used(0)
+        , items(0)
+        , evictions(0)
+        , expirations(0)
+    {
+        lock.v_ = 0;
+        head.prev = head.next = &head;
+    }
+
+    void
+    link(Item* item)
+    {
+        // New items go at the front for LRU, and just behind the hand (so
+        // they are the last it reaches) for CLOCK.
+        Item* after = (hand == &head) ? &head : hand->prev;
+        item->prev = after;
+        item->next = after->next;
+        after->next->prev = item;
+        after->next = item;
+        item->linked = true;
+        used += item->size();
+        items++;
+    }
+
+    void
+    unlink(Item* item)
+    {
+        if (hand == item)
+            hand = item->next;
+        item->prev->next = item->next;
+        item->next->prev = item->prev;
+        item->linked = false;
+        used -= item->size();
+        items--;
+    }
+
+    /// Choose and unlink an item to evict, never #keep; NULL if none.
+    Item*
+    evict(Policy policy, Item* keep)
+    {
+        if (policy == LRU) {
+            for (Item* item = head.prev; item != &head; item = item->prev) {
+                if (item != keep) {
+                    unlink(item);
+                    evictions++;
+                    return item;
+                }
+            }
+            return NULL;
+        }
+
+        // At most two laps: the first may only clear reference bits.
+        for (size_t steps = 0; steps < 2 * items + 2; steps++) {
+            if (hand == &head) {
+                hand = head.next;
+                continue;
+            }
+            Item* item = hand;
+            hand = item->next;
+            if (item == keep)
+                continue;
+            if (item->referenced.load(std::memory_order_relaxed)) {
+                item->referenced.store(false, std::memory_order_relaxed);
+                continue;
+            }
+            unlink(item);
+            evictions++;
+            return item;
+        }
+        return NULL;
+    }
+
+    /// Move #item to the front of an LRU list.
+    void
+    bump(Item* item)
+    {
+        if (!item->linked || head.next == item)
+            return;
+        item->prev->next = item->next;
+        item->next->prev = item->prev;
+        item->prev = &head;
+        item->next = head.next;
+        head.next->prev = item;
+        head.next = item;
+    }
+
+    SpinLock lock;
+    Item head;
+    Item* hand;
+    size_t used;
+    size_t items;
+    uint64_t evictions;
+
+    /// Items removed by the first read after they expired.
+    uint64_t expirations;
+};
+
+/**
+ * The shared state behind the "embedded" backend: one table, the eviction
+ * segments and the epoch manager.
+ */
+class EmbeddedStore : public KVBackendFactory {
+  public:
+    static const size_t N_SEGMENTS = 64;
+
+    explicit EmbeddedStore(const BackendConfig& config)
+        : table()
+        , policy(Segment::CLOCK)
+        , segmentBudget()
+        , segments(N_SEGMENTS)
+        , epochs(Item::destroy)
+        , countersLock()
+        , counters()
+    {
+        const std::string tableName =
+            config.options.count("table") ? config.options.at("table")
+                                          : "chain";
+        const std::string policyName =
+            config.options.count("policy") ? config.options.at("policy")
+                                           : "clock";
+        const size_t memory = config.getOption("memory_mb", 256) << 20;
+        const size_t capacity = config.getOption("items", memory / 128);
+
+        if (tableName == "chain") {
+            table.reset(new ChainedTable(capacity));
+        } else if (tableName == "cuckoo") {
+            table.reset(new CuckooTable(capacity));
+        } else if (tableName == "simd") {
+            table.reset(new SimdTable(capacity));
+        } else {
+            fprintf(stderr, "unknown embedded table %s (chain, cuckoo or "
+                    "simd)\n", tableName.c_str());
+            exit(1);
+        }
+        if (policyName == "lru") {
+            policy = Segment::LRU;
+        } else if (policyName != "clock") {
+            fprintf(stderr, "unknown eviction policy %s (lru or clock)\n",
+                    policyName.c_str());
+            exit(1);
+        }
+        segmentBudget = memory / N_SEGMENTS;
+        printf("# embedded store: %s table, %s eviction, %lu MB, sized for "
+               "%lu items\n", tableName.c_str(), policyName.c_str(),
+               memory >> 20, capacity);
+    }
+
+    ~EmbeddedStore()
+    {
+        table->forEach(Item::destroy);
+    }
+
+    std::unique_ptr<KVBackend> connect();
+
+    void
+    report(FILE* out)
+    {
+        KVBackend::ServerStats sum;
+        stats(&sum);
+        uint64_t expirations = 0;
+        for (Segment& segment : segments) {
+            std::lock_guard<SpinLock> _(segment.lock);
+            expirations += segment.expirations;
+        }
+        fprintf(out, "# embedded store: %lu items   %.1f MB   %.3f%% hits   "
+                "%lu evictions   %lu expired\n", sum.currItems,
+                double(sum.bytes) / 1e6,
+                sum.cmdGet ? double(sum.getHits) / double(sum.cmdGet) * 100
+                           : 0.0,
+                sum.evictions, expirations);
+    }
+
+    /// Per-thread operation counts, summed for serverStats().
+    struct Counters {
+        std::atomic<uint64_t> gets;
+        std::atomic<uint64_t> hits;
+        char pad[64 - 2 * sizeof(std::atomic<uint64_t>)];
+    };
+
+    Counters*
+    addCounters()
+    {
+        std::lock_guard<std::mutex> _(countersLock);
+        counters.emplace_back(new Counters());
+        counters.back()->gets = 0;
+        counters.back()->hits = 0;
+        return counters.back().get();
+    }
+
+    void
+    stats(KVBackend::ServerStats* sum)
+    {
+        *sum = KVBackend::ServerStats{};
+        for (Segment& segment : segments) {
+            std::lock_guard<SpinLock> _(segment.lock);
+            sum->evictions += segment.evictions;
+            sum->bytes += segment.used;
+            sum->currItems += segment.items;
+        }
+        std::lock_guard<std::mutex> _(countersLock);
+        for (auto& c : counters) {
+            sum->cmdGet += c->gets.load(std::memory_order_relaxed);
+            sum->getHits += c->hits.load(std::memory_order_relaxed);
+        }
+    }
+
+    Segment&
+    segmentFor(uint64_t hash)
+    {
+        return segments[(hash >> 20) % N_SEGMENTS];
+    }
+
+    std::unique_ptr<Table> table;
+    Segment::Policy policy;
+    size_t segmentBudget;
+    std::vector<Segment> segments;
+    EpochManager epochs;
+
+    std::mutex countersLock;
+    std::vector<std::unique_ptr<Counters>> counters;
+};
+
+/**
+ * One thread's handle on an EmbeddedStore: operations go straight to the
+ * table, with no serialization or system calls in between.
+ */
+class EmbeddedBackend : public KVBackend {
+  public:
+    explicit EmbeddedBackend(EmbeddedStore& store)
+        : store(store)
+        , epoch(store.epochs)
+        , counters(store.addCounters())
+        , victims()
+        , lastError("ok")
+    {
+    }
+
+    Status
+    get(const char* key, size_t keyLength, size_t* valueLength,
+        std::string* value)
+    {
+        const uint64_t hash = hashTraceKey(key, keyLength);
+        counters->gets.store(counters->gets.load(std::memory_order_relaxed) + 1,
+                             std::memory_order_relaxed);
+        epoch.enter();
+        Item* item = store.table->find(hash, key, keyLength);
+        if (item != NULL && expired(item->expiry)) {
+            reclaim(item);
+            item = NULL;
+        }
+        if (item == NULL) {
+            epoch.exit();
+            return MISS;
+        }
+        *valueLength = item->valueLength;
+        if (value != NULL)
+            value->assign(item->value(), item->valueLength);
+        touch(item);
+        epoch.exit();
+        counters->hits.store(counters->hits.load(std::memory_order_relaxed) + 1,
+                             std::memory_order_relaxed);
+        return OK;
+    }
+
+    Status
+    set(const char* key, size_t keyLength, const char* value,
+        size_t valueLength, uint32_t ttl)
+    {
+        const uint64_t hash = hashTraceKey(key, keyLength);
+        Item* item = Item::create(hash, key, keyLength, value, valueLength,
+                                  expiryFor(ttl));
+        Segment& segment = store.segmentFor(hash);
+
+        epoch.enter();
+
+        // Account for the item first so eviction can make room for it;
+        // the victims are unlinked here but removed from the table below,
+        // outside the segment lock.
+        victims.clear();
+        {
+            std::lock_guard<SpinLock> _(segment.lock);
+            segment.link(item);
+            while (segment.used > store.segmentBudget) {
+                Item* victim = segment.evict(store.policy, item);
+                if (victim == NULL)
+                    break;
+                victims.push_back(victim);
+            }
+        }
+
+        Item* replaced = NULL;
+        bool inserted = store.table->insert(item, &replaced);
+        if (!inserted)
+            replaced = item;
+        if (replaced != NULL) {
+            {
+                std::lock_guard<SpinLock> _(segment.lock);
+                if (replaced->linked)
+                    segment.unlink(replaced);
+            }
+            epoch.retire(replaced);
+        }
+        for (Item* victim : victims) {
+            if (store.table->erase(victim))
+                epoch.retire(victim);
+        }
+
+        epoch.exit();
+        if (!inserted) {
+            lastError = "hash table full";
+            return ERROR;
+        }
+        return OK;
+    }
+
+    Status
+    remove(const char* key, size_t keyLength)
+    {
+        const uint64_t hash = hashTraceKey(key, keyLength);
+        epoch.enter();
+        Item* item = store.table->remove(hash, key, keyLength);
+        if (item != NULL) {
+            Segment& segment = store.segmentFor(hash);
+            {
+                std::lock_guard<SpinLock> _(segment.lock);
+                if (item->linked)
+                    segment.unlink(item);
+            }
+            epoch.retire(item);
+        }
+        epoch.exit();
+        return item != NULL ? OK : MISS;
+    }
+
+    bool
+    serverStats(ServerStats* stats)
+    {
+        store.stats(stats);
+        return true;
+    }
+
+    const char*
+    errorString()
+    {
+        return lastError;
+    }
+
+  private:
+    /// Remove #item, found expired, unless a writer got there first; the
+    /// caller is inside an epoch.
+    void
+    reclaim(Item* item)
+    {
+        if (!store.table->erase(item))
+            return;
+        Segment& segment = store.segmentFor(item->hash);
+        {
+            std::lock_guard<SpinLock> _(segment.lock);
+            if (item->linked)
+                segment.unlink(item);
+            segment.expirations++;
+        }
+        epoch.retire(item);
+    }
+
+    /// Record a hit for the eviction policy.
+    void
+    touch(Item* item)
+    {
+        if (store.policy == Segment::CLOCK) {
+            if (!item->referenced.load(std::memory_order_relaxed))
+                item->referenced.store(true, std::memory_order_relaxed);
+            return;
+        }
+        // Under contention, skip the bump rather than wait for it.
+        Segment& segment = store.segmentFor(item->hash);
+        if (segment.lock.try_lock()) {
+            segment.bump(item);
+            segment.lock.unlock();
+        }
+    }
+
+    EmbeddedStore& store;
+    EpochManager::Participant epoch;
+    EmbeddedStore::Counters* counters;
+    std::vector<Item*> victims;
+    const char* lastError;
+};
+
+std::unique_ptr<KVBackend>
+EmbeddedStore::connect()
+{
+    return std::unique_ptr<KVBackend>(new EmbeddedBackend(*this));
+}
+
+KVBackendRegistry::Registration embeddedBackend{
+    "embedded",
+    "in-process concurrent hash table; -o table=chain|cuckoo|simd, "
+    "-o policy=lru|clock, -o memory_mb=N (default 256), -o items=N to size "
+    "the table",
+    [](const BackendConfig& config) {
+        return std::unique_ptr<KVBackendFactory>(new EmbeddedStore(config));
+    }};
+
+} // anonymous namespace
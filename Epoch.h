@@ -0,0 +1,170 @@
+#ifndef EPOCH_H_
+#define EPOCH_H_
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <functional>
+#include <mutex>
+#include <utility>
+#include <vector>
+
+/**
+ * Epoch-based reclamation for the in-process stores, whose readers follow
+ * pointers without holding the locks that writers free objects under.
+ *
+ * Each thread registers once and brackets every operation with enter() and
+ * exit(). Objects unlinked from a shared structure are passed to retire()
+ * and only freed once every thread that was inside an operation at the
+ * time has left it, which takes two advances of the global epoch.
+ */
+class EpochManager {
+  private:
+    static const uint64_t IDLE = ~0ul;
+
+    // Padded so threads publishing their epochs don't share cache lines.
+    struct Slot {
+        std::atomic<uint64_t> epoch;
+        std::atomic<bool> used;
+        char pad[64 - sizeof(std::atomic<uint64_t>) - sizeof(bool)];
+    };
+
+  public:
+    static const int MAX_THREADS = 512;
+
+    explicit EpochManager(std::function<void(void*)> free)
+        : global(2)
+        , free(free)
+        , slots()
+        , nextSlot(0)
+        , orphanMutex()
+        , orphans()
+    {
+        for (Slot& slot : slots) {
+            slot.epoch = IDLE;
+            slot.used = false;
+        }
+    }
+
+    /// Free everything still waiting; no thread may be inside an operation.
+    ~EpochManager()
+    {
+        for (auto& retired : orphans)
+            free(retired.second);
+    }
+
+    /**
+     * A thread's registration: its published epoch and the objects it has
+     * retired. Not shared between threads.
+     */
+    class Participant {
+      public:
+        explicit Participant(EpochManager& manager)
+            : manager(manager)
+            , slot(manager.claimSlot())
+            , retired()
+        {
+        }
+
+        /// Hand anything not yet freed to the manager.
+        ~Participant()
+        {
+            slot.used = false;
+            std::lock_guard<std::mutex> _(manager.orphanMutex);
+            manager.orphans.insert(manager.orphans.end(), retired.begin(),
+                                   retired.end());
+        }
+
+        void
+        enter()
+        {
+            slot.epoch.store(manager.global.load(std::memory_order_relaxed),
+                             std::memory_order_seq_cst);
+        }
+
+        void
+        exit()
+        {
+            slot.epoch.store(IDLE, std::memory_order_release);
+        }
+
+        /// Free #object once no current operation can still see it.
+        void
+        retire(void* object)
+        {
+            retired.emplace_back(manager.global.load(), object);
+            if (retired.size() >= 64)
+                reclaim();
+        }
+
+      private:
+        void
+        reclaim()
+        {
+            uint64_t safe = manager.tryAdvance() - 2;
+            size_t kept = 0;
+            for (auto& entry : retired) {
+                if (entry.first <= safe)
+                    manager.free(entry.second);
+                else
+                    retired[kept++] = entry;
+            }
+            retired.resize(kept);
+        }
+
+        EpochManager& manager;
+        Slot& slot;
+        std::vector<std::pair<uint64_t, void*>> retired;
+    };
+
+  private:
+    /// Reuse a slot given up by an earlier participant, or take a new one.
+    Slot&
+    claimSlot()
+    {
+        for (int i = 0; i < MAX_THREADS; i++) {
+            bool expected = false;
+            if (slots[i].used.compare_exchange_strong(expected, true)) {
+                int highWater = nextSlot.load();
+                while (highWater <= i &&
+                       !nextSlot.compare_exchange_weak(highWater, i + 1)) {
+                }
+                return slots[i];
+            }
+        }
+        fprintf(stderr, "more than %d threads using one store\n",
+                MAX_THREADS);
+        exit(1);
+    }
+
+    /// Move the global epoch on if every active thread has caught up with
+    /// it; return the (possibly new) global epoch.
+    uint64_t
+    tryAdvance()
+    {
+        uint64_t current = global.load();
+        int n = nextSlot.load();
+        for (int i = 0; i < n; i++) {
+            uint64_t e = slots[i].epoch.load();
+            if (e != IDLE && e != current)
+                return current;
+        }
+        global.compare_exchange_strong(current, current + 1);
+        return global.load();
+    }
+
+    std::atomic<uint64_t> global;
+    std::function<void(void*)> free;
+    Slot slots[MAX_THREADS];
+
+    /// One past the highest slot ever claimed.
+    std::atomic<int> nextSlot;
+
+    /// Objects retired by threads that have since gone away.
+    std::mutex orphanMutex;
+    std::vector<std::pair<uint64_t, void*>> orphans;
+};
+
+#endif /* !EPOCH_H_ */
@@ -0,0 +1,120 @@
+#ifndef HASHINDEX_H_
+#define HASHINDEX_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+#include <boost/smart_ptr/detail/spinlock.hpp>
+
+/**
+ * The index of the in-process stores that manage their own memory: maps a
+ * key's 64-bit hash to a store-defined reference to where the item lives,
+ * in independently locked shards.
+ *
+ * Keys are kept only in the store. A store compares the key on lookup and
+ * lets a second key with the same hash replace the first; for a cache that
+ * just costs a refill. Stores move or free an item only with its shard
+ * locked and the index updated, so a reader holding the shard lock may read
+ * the item in place.
+ */
+class HashIndex {
+  public:
+    static const uint64_t NONE = ~0ul;
+
+    typedef boost::detail::spinlock Lock;
+
+    explicit HashIndex(size_t capacity)
+        : shards(N_SHARDS)
+    {
+        for (Shard& shard : shards) {
+            shard.lock.v_ = 0;
+            shard.map.reserve(capacity / N_SHARDS + 1);
+        }
+    }
+
+    Lock&
+    lockFor(uint64_t hash)
+    {
+        return shardFor(hash).lock;
+    }
+
+    // The rest must be called with lockFor(hash) held.
+
+    uint64_t
+    lookup(uint64_t hash)
+    {
+        Shard& shard = shardFor(hash);
+        auto it = shard.map.find(hash);
+        return it == shard.map.end() ? NONE : it->second;
+    }
+
+    /// Point #hash at #ref; return what it pointed at before, or NONE.
+    uint64_t
+    insert(uint64_t hash, uint64_t ref)
+    {
+        auto result = shardFor(hash).map.emplace(hash, ref);
+        if (result.second)
+            return NONE;
+        uint64_t old = result.first->second;
+        result.first->second = ref;
+        return old;
+    }
+
+    /// Remove #hash if it still points at #ref.
+    bool
+    remove(uint64_t hash, uint64_t ref)
+    {
+        Shard& shard = shardFor(hash);
+        auto it = shard.map.find(hash);
+        if (it == shard.map.end() || it->second != ref)
+            return false;
+        shard.map.erase(it);
+        return true;
+    }
+
+    /// Repoint #hash from #oldRef to #newRef, if it still points at #oldRef.
+    bool
+    relocate(uint64_t hash, uint64_t oldRef, uint64_t newRef)
+    {
+        Shard& shard = shardFor(hash);
+        auto it = shard.map.find(hash);
+        if (it == shard.map.end() || it->second != oldRef)
+            return false;
+        it->second = newRef;
+        return true;
+    }
+
+    /// Bytes the index itself occupies, roughly.
+    size_t
+    memoryUsed()
+    {
+        size_t bytes = 0;
+        for (Shard& shard : shards) {
+            std::lock_guard<Lock> _(shard.lock);
+            bytes += shard.map.bucket_count() * sizeof(void*) +
+                     shard.map.size() * (2 * sizeof(uint64_t) + sizeof(void*));
+        }
+        return bytes;
+    }
+
+  private:
+    static const size_t N_SHARDS = 256;
+
+    struct Shard {
+        Lock lock;
+        std::unordered_map<uint64_t, uint64_t> map;
+    };
+
+    Shard&
+    shardFor(uint64_t hash)
+    {
+        return shards[(hash >> 48) % N_SHARDS];
+    }
+
+    std::vector<Shard> shards;
+};
+
+#endif /* !HASHINDEX_H_ */
@@ -0,0 +1,115 @@
+#include <algorithm>
+#include <cinttypes>
+#include <cstddef>
+#include <vector>
+
+#ifndef HISTOGRAM_H
+#define HISTOGRAM_H
+
+/**
+ * A log-linear histogram of non-negative integer samples (typically
+ * latencies in nanoseconds). Each power of two is split into 2^SUB_BITS
+ * equal buckets, so any recorded value is reported within about 3% of its
+ * true value while the whole histogram stays a few KB. Not thread safe:
+ * keep one per thread and merge() them.
+ */
+class Histogram {
+ public:
+  static const int SUB_BITS = 5;
+  static const int N_BUCKETS = (64 - SUB_BITS + 1) << SUB_BITS;
+
+  Histogram()
+    : counts(N_BUCKETS)
+    , total{}
+    , sum{}
+    , max{}
+  {}
+
+  void record(uint64_t value) {
+    ++counts[bucket(value)];
+    ++total;
+    sum += value;
+    if (value > max)
+      max = value;
+  }
+
+  void merge(const Histogram& other) {
+    for (size_t i = 0; i < counts.size(); ++i)
+      counts[i] += other.counts[i];
+    total += other.total;
+    sum += other.sum;
+    if (other.max > max)
+      max = other.max;
+  }
+
+  /// Add samples shipped from elsewhere as raw bucket counts (see
+  /// getCounts()), along with their sum and maximum.
+  void merge(const uint64_t* otherCounts, uint64_t otherSum,
+             uint64_t otherMax) {
+    for (size_t i = 0; i < counts.size(); ++i) {
+      counts[i] += otherCounts[i];
+      total += otherCounts[i];
+    }
+    sum += otherSum;
+    if (otherMax > max)
+      max = otherMax;
+  }
+
+  void clear() {
+    std::fill(counts.begin(), counts.end(), 0);
+    total = sum = max = 0;
+  }
+
+  uint64_t count() const { return total; }
+  uint64_t getMax() const { return max; }
+  uint64_t getSum() const { return sum; }
+  double mean() const { return total ? double(sum) / double(total) : 0; }
+
+  /// Return the smallest value v such that at least a fraction q of the
+  /// samples are <= v (to within one bucket), or 0 if there are none.
+  uint64_t percentile(double q) const {
+    if (total == 0)
+      return 0;
+    uint64_t rank = uint64_t(q * double(total));
+    if (rank >= total)
+      rank = total - 1;
+    uint64_t seen = 0;
+    for (size_t i = 0; i < counts.size(); ++i) {
+      seen += counts[i];
+      if (seen > rank) {
+        uint64_t upper = bucketUpperBound(i);
+        return upper < max ? upper : max;
+      }
+    }
+    return max;
+  }
+
+  /// Raw bucket counts, for shipping the histogram elsewhere.
+  const std::vector<uint64_t>& getCounts() const { return counts; }
+
+  static size_t bucket(uint64_t value) {
+    if (value < (1ul << SUB_BITS))
+      return size_t(value);
+    const int magnitude = 63 - __builtin_clzl(value);
+    const int shift = magnitude - SUB_BITS;
+    const uint64_t sub = (value >> shift) & ((1ul << SUB_BITS) - 1);
+    return (size_t(shift + 1) << SUB_BITS) + sub;
+  }
+
+  static uint64_t bucketUpperBound(size_t index) {
+    if (index < (1ul << SUB_BITS))
+      return index;
+    const int shift = int(index >> SUB_BITS) - 1;
+    const uint64_t sub = index & ((1ul << SUB_BITS) - 1);
+    const uint64_t base = ((1ul << SUB_BITS) + sub) << shift;
+    return base + ((1ul << shift) - 1);
+  }
+
+ private:
+  std::vector<uint64_t> counts;
+  uint64_t total;
+  uint64_t sum;
+  uint64_t max;
+};
+
+#endif
@@ -0,0 +1,241 @@
+#include "KVBackend.h"
+#include "TraceParser.h"
+
+#include <stdlib.h>
+#include <time.h>
+
+void
+KVBackend::multiGet(Request* requests, size_t count)
+{
+    for (size_t i = 0; i < count; i++) {
+        Request& r = requests[i];
+        if (r.type == Request::GET)
+            r.status = get(r.key, r.keyLength, &r.valueLength, r.data);
+    }
+}
+
+void
+KVBackend::submit(Request* requests, size_t count)
+{
+    for (size_t i = 0; i < count; i++) {
+        Request& r = requests[i];
+        switch (r.type) {
+        case Request::GET:
+            r.status = get(r.key, r.keyLength, &r.valueLength, r.data);
+            break;
+        case Request::SET:
+            r.status = set(r.key, r.keyLength, r.value, r.valueLength,
+                           r.ttl);
+            break;
+        case Request::DELETE:
+            r.status = remove(r.key, r.keyLength);
+            break;
+        case Request::TOUCH:
+            r.status = touch(r.key, r.keyLength, r.ttl);
+            break;
+        case Request::GETS:
+            r.status = gets(r.key, r.keyLength, &r.valueLength, &r.cas);
+            break;
+        case Request::CAS:
+            r.status = cas(r.key, r.keyLength, r.value, r.valueLength, r.ttl,
+                           r.cas);
+            break;
+        case Request::APPEND:
+        case Request::PREPEND:
+            r.status = append(r.key, r.keyLength, r.value, r.valueLength,
+                              r.type == Request::PREPEND);
+            break;
+        case Request::INCR:
+        case Request::DECR:
+            r.status = incr(r.key, r.keyLength, r.amount,
+                            r.type == Request::DECR, &r.amount);
+            break;
+        }
+    }
+}
+
+/**
+ * Give #key a new TTL without reading it; MISS if it is absent.
+ */
+KVBackend::Status
+KVBackend::touch(const char* key, size_t keyLength, uint32_t ttl)
+{
+    std::string value;
+    size_t valueLength;
+    Status status = get(key, keyLength, &valueLength, &value);
+    if (status != OK)
+        return status;
+    return set(key, keyLength, value.data(), value.size(), ttl);
+}
+
+/**
+ * Look up #key along with a token for cas() that changes whenever the value
+ * does. This default derives the token from the value's contents, so a
+ * write of identical bytes goes unnoticed.
+ */
+KVBackend::Status
+KVBackend::gets(const char* key, size_t keyLength, size_t* valueLength,
+                uint64_t* cas)
+{
+    std::string value;
+    Status status = get(key, keyLength, valueLength, &value);
+    if (status == OK)
+        *cas = hashTraceKey(value.data(), value.size());
+    return status;
+}
+
+/**
+ * Store #value under #key only if it still has the token #cas from gets():
+ * EXISTS if it has changed since, MISS if it is gone.
+ */
+KVBackend::Status
+KVBackend::cas(const char* key, size_t keyLength, const char* value,
+               size_t valueLength, uint32_t ttl, uint64_t cas)
+{
+    size_t foundLength;
+    uint64_t token;
+    Status status = gets(key, keyLength, &foundLength, &token);
+    if (status != OK)
+        return status;
+    if (token != cas)
+        return EXISTS;
+    return set(key, keyLength, value, valueLength, ttl);
+}
+
+/**
+ * Add #value to the end (or with #prepend, the start) of #key's value;
+ * MISS if there is none.
+ */
+KVBackend::Status
+KVBackend::append(const char* key, size_t keyLength, const char* value,
+                  size_t valueLength, bool prepend)
+{
+    std::string current;
+    size_t currentLength;
+    Status status = get(key, keyLength, &currentLength, &current);
+    if (status != OK)
+        return status;
+    if (prepend)
+        current.insert(0, value, valueLength);
+    else
+        current.append(value, valueLength);
+    return set(key, keyLength, current.data(), current.size());
+}
+
+/**
+ * Add #amount to the counter stored under #key, or with #decrement take it
+ * away, stopping at 0, as memcached does. The value must be a decimal
+ * number below 2^64; NON_NUMERIC if it is not, MISS if there is none.
+ * \param[out] counter
+ *      Set to the counter's new value.
+ */
+KVBackend::Status
+KVBackend::incr(const char* key, size_t keyLength, uint64_t amount,
+                bool decrement, uint64_t* counter)
+{
+    std::string current;
+    size_t currentLength;
+    Status status = get(key, keyLength, &currentLength, &current);
+    if (status != OK)
+        return status;
+    if (current.empty() || current.size() > 20)
+        return NON_NUMERIC;
+    uint64_t number = 0;
+    for (char c : current) {
+        if (c < '0' || c > '9' || number > (UINT64_MAX - (c - '0')) / 10)
+            return NON_NUMERIC;
+        number = number * 10 + (c - '0');
+    }
+    if (decrement)
+        number = number > amount ? number - amount : 0;
+    else
+        number += amount;
+    std::string updated = std::to_string(number);
+    status = set(key, keyLength, updated.data(), updated.size());
+    if (status == OK)
+        *counter = number;
+    return status;
+}
+
+/**
+ * Read #key the way a look-aside cache user would: if it is missing (or,
+ * when #refillChanged, holds a value of a length other than #valueLength)
+ * store #value in its place.
+ * \param[out] setStatus
+ *      Outcome of the write-back, if there was one.
+ * \param ttl
+ *      TTL of the value written back.
+ */
+KVBackend::ReadResult
+KVBackend::getOrRefill(const char* key, size_t keyLength,
+                       const char* value, size_t valueLength,
+                       bool refillChanged, Status* setStatus, uint32_t ttl)
+{
+    size_t foundLength = 0;
+    Status status = get(key, keyLength, &foundLength);
+    if (status == ERROR)
+        return FAILED;
+    if (status == OK && (!refillChanged || foundLength == valueLength))
+        return HIT;
+    *setStatus = set(key, keyLength, value, valueLength, ttl);
+    return status == MISS ? REFILLED : REPLACED;
+}
+
+/**
+ * Whole seconds on a monotonic clock that is cheap to read, for the stores
+ * that expire items themselves. Never 0.
+ */
+uint32_t
+KVBackend::clockSeconds()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+    return uint32_t(ts.tv_sec) + 1;
+}
+
+uint64_t
+BackendConfig::getOption(const std::string& name, uint64_t defaultValue) const
+{
+    auto it = options.find(name);
+    if (it == options.end())
+        return defaultValue;
+    return strtoull(it->second.c_str(), NULL, 0);
+}
+
+KVBackendRegistry::Registration::Registration(const std::string& name,
+                                              const std::string& description,
+                                              Maker maker)
+{
+    entries()[name] = Entry{description, maker};
+}
+
+std::map<std::string, KVBackendRegistry::Entry>&
+KVBackendRegistry::entries()
+{
+    // Constructed on first use so Registrations in any translation unit can
+    // run during static initialization.
+    static std::map<std::string, Entry> entries{};
+    return entries;
+}
+
+/**
+ * Make a factory for the backend registered as #name, or return nullptr if
+ * there is no such backend.
+ */
+std::unique_ptr<KVBackendFactory>
+KVBackendRegistry::create(const std::string& name,
+                          const BackendConfig& config)
+{
+    auto it = entries().find(name);
+    if (it == entries().end())
+        return nullptr;
+    return it->second.maker(config);
+}
+
+void
+KVBackendRegistry::list(FILE* out)
+{
+    for (auto& entry : entries())
+        fprintf(out, "  %s: %s\n", entry.first.c_str(),
+                entry.second.description.c_str());
+}
@@ -0,0 +1,237 @@
+#ifndef KVBACKEND_H_
+#define KVBACKEND_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <functional>
+#include <map>
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
+/**
+ * A client of some key-value store, as seen by the trace replayer and the
+ * benchmarks. Each thread uses its own KVBackend, made by a shared
+ * KVBackendFactory; instances are not thread safe.
+ *
+ * Only get, set and delete are required. multiGet() and submit() default
+ * to issuing requests one at a time; backends that can batch or pipeline
+ * override them. The rest of memcached's commands (touch, gets and cas,
+ * append and prepend, incr and decr) default to emulations built from get
+ * and set, which are not atomic and leave the value without a TTL;
+ * backends whose stores have the real thing override them.
+ *
+ * A TTL is given in seconds, as memcached's relative exptime; 0 means the
+ * value never expires. Stores that expire items themselves do so lazily,
+ * on the first read after clockSeconds() passes the deadline.
+ */
+class KVBackend {
+  public:
+    enum Status {
+        OK,
+        MISS,
+
+        /// A cas() found the value changed since its gets().
+        EXISTS,
+
+        /// An incr() found a value that is not a decimal number.
+        NON_NUMERIC,
+
+        /// Anything else; errorString() says what.
+        ERROR
+    };
+
+    /// One operation in a multiGet() or submit() batch.
+    struct Request {
+        enum Type {
+            GET,
+            SET,
+            DELETE,
+            TOUCH,
+            GETS,
+            CAS,
+            APPEND,
+            PREPEND,
+            INCR,
+            DECR
+        };
+
+        Type type;
+        const char* key;
+        size_t keyLength;
+
+        /// For SET, CAS, APPEND and PREPEND, the value to store; unused
+        /// otherwise.
+        const char* value;
+
+        /// The length of #value; for a GET or GETS that hits, set to the
+        /// length of the value found.
+        size_t valueLength;
+
+        /// Filled in by the backend.
+        Status status;
+
+        /// For SET, CAS and TOUCH, the value's TTL; unused otherwise.
+        uint32_t ttl;
+
+        /// For a GETS that hits, set to the value's CAS token; for CAS, the
+        /// token the value must still have.
+        uint64_t cas;
+
+        /// For INCR and DECR, the amount; on success, set to the counter's
+        /// new value.
+        uint64_t amount;
+
+        /// For a GET, if not NULL, receives a copy of the value on a hit.
+        std::string* data;
+    };
+
+    /// What getOrRefill() found.
+    enum ReadResult {
+        HIT,
+
+        /// Not present; the value was written back.
+        REFILLED,
+
+        /// Present with the wrong length; the value was written back.
+        REPLACED,
+
+        /// The read itself failed; errorString() says why.
+        FAILED
+    };
+
+    /// Counters a backend can report about the store behind it, summed
+    /// over all its servers.
+    struct ServerStats {
+        uint64_t evictions;
+        uint64_t getHits;
+        uint64_t cmdGet;
+        uint64_t bytes;
+        uint64_t currItems;
+        double cpuSeconds;
+    };
+
+    virtual ~KVBackend() {}
+
+    /**
+     * Look up #key.
+     * \param[out] valueLength
+     *      Set to the length of the value on a hit.
+     * \param[out] value
+     *      If not NULL, receives a copy of the value on a hit.
+     */
+    virtual Status get(const char* key, size_t keyLength,
+                       size_t* valueLength, std::string* value = NULL) = 0;
+    virtual Status set(const char* key, size_t keyLength,
+                       const char* value, size_t valueLength,
+                       uint32_t ttl = 0) = 0;
+    virtual Status remove(const char* key, size_t keyLength) = 0;
+
+    virtual Status touch(const char* key, size_t keyLength, uint32_t ttl);
+    virtual Status gets(const char* key, size_t keyLength,
+                        size_t* valueLength, uint64_t* cas);
+    virtual Status cas(const char* key, size_t keyLength, const char* value,
+                       size_t valueLength, uint32_t ttl, uint64_t cas);
+    virtual Status append(const char* key, size_t keyLength,
+                          const char* value, size_t valueLength,
+                          bool prepend);
+    virtual Status incr(const char* key, size_t keyLength, uint64_t amount,
+                        bool decrement, uint64_t* counter);
+
+    /// Look up every GET in #requests, filling in status and valueLength
+    /// (and data, if asked for).
+    virtual void multiGet(Request* requests, size_t count);
+
+    /// Execute #requests in order, filling in each one's status.
+    virtual void submit(Request* requests, size_t count);
+
+    /// Fetch server-side counters summed over every server; false if the
+    /// backend has none or any server failed to answer.
+    virtual bool serverStats(ServerStats* stats) { return false; }
+
+    /// Describe the most recent ERROR.
+    virtual const char* errorString() { return "unknown error"; }
+
+    ReadResult getOrRefill(const char* key, size_t keyLength,
+                           const char* value, size_t valueLength,
+                           bool refillChanged, Status* setStatus,
+                           uint32_t ttl = 0);
+
+    static uint32_t clockSeconds();
+
+    /// The clockSeconds() at which a value written now with #ttl expires,
+    /// or 0 if it never does.
+    static uint32_t
+    expiryFor(uint32_t ttl)
+    {
+        return ttl == 0 ? 0 : clockSeconds() + ttl;
+    }
+
+    static bool
+    expired(uint32_t expiry)
+    {
+        return expiry != 0 && expiry <= clockSeconds();
+    }
+};
+
+/**
+ * Where a backend should connect and how it should behave, as given on
+ * the command line.
+ */
+struct BackendConfig {
+    /// (host, port) pairs; Unix sockets are given by path with port 0.
+    std::vector<std::pair<std::string, int>> servers;
+
+    /// Backend-specific "-o name=value" settings.
+    std::map<std::string, std::string> options;
+
+    /// Return option #name as a number, or #defaultValue if it isn't set.
+    uint64_t getOption(const std::string& name, uint64_t defaultValue) const;
+};
+
+/**
+ * Makes the per-thread KVBackends for one run and holds whatever they
+ * share, such as an in-process store.
+ */
+class KVBackendFactory {
+  public:
+    virtual ~KVBackendFactory() {}
+    virtual std::unique_ptr<KVBackend> connect() = 0;
+
+    /// Print a summary of the store at the end of a run; only in-process
+    /// stores have anything to add to the client's own counters.
+    virtual void report(FILE* out) {}
+
+    /// False if the store keeps values regardless of their TTLs.
+    virtual bool expiresItems() { return true; }
+};
+
+/**
+ * Backends by name, so the player and bench can choose one at run time.
+ * Backends register themselves with a static Registration.
+ */
+class KVBackendRegistry {
+  public:
+    using Maker = std::function<
+        std::unique_ptr<KVBackendFactory>(const BackendConfig&)>;
+
+    struct Registration {
+        Registration(const std::string& name, const std::string& description,
+                     Maker maker);
+    };
+
+    static std::unique_ptr<KVBackendFactory>
+    create(const std::string& name, const BackendConfig& config);
+    static void list(FILE* out);
+
+  private:
+    struct Entry {
+        std::string description;
+        Maker maker;
+    };
+    static std::map<std::string, Entry>& entries();
+};
+
+#endif /* !KVBACKEND_H_ */
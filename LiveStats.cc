@@ -0,0 +1,64 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include <new>
+
+#include "LiveStats.h"
+
+/**
+ * Create (or replace) the segment at #path, holding an empty snapshot.
+ */
+LiveStats::LiveStats(const char* path, double intervalSeconds,
+                     const char* backend)
+    : segment(NULL)
+{
+    int fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0 || ftruncate(fd, sizeof(Segment)) != 0) {
+        fprintf(stderr, "couldn't create stats segment %s: %s\n", path,
+                strerror(errno));
+        exit(1);
+    }
+    void* p = mmap(NULL, sizeof(Segment), PROT_READ | PROT_WRITE,
+                   MAP_SHARED, fd, 0);
+    close(fd);
+    if (p == MAP_FAILED) {
+        fprintf(stderr, "couldn't map stats segment %s: %s\n", path,
+                strerror(errno));
+        exit(1);
+    }
+
+    // The file is all zeros; fill in everything but the magic number, which
+    // goes last so readers never see a half-initialized header.
+    segment = new(p) Segment();
+    segment->version = VERSION;
+    segment->snapshotBytes = sizeof(Snapshot);
+    segment->pid = getpid();
+    segment->intervalSeconds = intervalSeconds;
+    snprintf(segment->backend, sizeof(segment->backend), "%s", backend);
+    segment->sequence.store(0, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    memcpy(segment->magic, magic(), sizeof(segment->magic));
+}
+
+LiveStats::~LiveStats()
+{
+    munmap(segment, sizeof(Segment));
+}
+
+/**
+ * Replace the published snapshot. Only one thread may publish.
+ */
+void
+LiveStats::publish(const Snapshot& snapshot)
+{
+    uint64_t sequence = segment->sequence.load(std::memory_order_relaxed);
+    segment->sequence.store(sequence + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    memcpy(&segment->snapshot, &snapshot, sizeof(snapshot));
+    segment->sequence.store(sequence + 2, std::memory_order_release);
+}
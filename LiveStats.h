@@ -0,0 +1,151 @@
+#ifndef LIVESTATS_H_
+#define LIVESTATS_H_
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+/**
+ * A memory-mapped file through which a running ycsb_player publishes its
+ * counters, rates, queue depths and latency percentiles, so that ycsb_top or
+ * any other collector can watch a replay without parsing its output or
+ * slowing it down.
+ *
+ * The player fills in a Snapshot off the replay's critical path and copies
+ * it into the segment under a seqlock: the sequence number is odd while a
+ * copy is in progress. Readers map the file read-only and call read() until
+ * it returns a copy that no update overlapped; they never block the writer.
+ * The file is left behind when the player exits, holding the final
+ * snapshot with #finished set.
+ *
+ * Readers must check the magic number, version and snapshot size before
+ * using a segment; the layout changes only along with VERSION.
+ */
+class LiveStats {
+  public:
+    static const uint32_t VERSION = 1;
+    static const int MAX_WORKERS = 256;
+
+    /// First bytes of every segment, without a terminator.
+    static const char*
+    magic()
+    {
+        return "YCSBLIVE";
+    }
+
+    /// A latency distribution in ns; all zero if nothing was timed.
+    struct Latency {
+        uint64_t count;
+        uint64_t mean;
+        uint64_t p50;
+        uint64_t p99;
+        uint64_t p999;
+        uint64_t max;
+    };
+
+    struct Worker {
+        uint64_t gets;
+        uint64_t getMisses;
+        uint64_t sets;
+        uint64_t setFailures;
+
+        /// Operations waiting in this worker's queue (in deterministic
+        /// mode; otherwise every worker shares queue 0).
+        uint64_t queueDepth;
+
+        /// Over the last interval.
+        Latency get;
+        Latency set;
+        Latency batch;
+    };
+
+    /// Counters from KVBackend::serverStats(), summed over the servers.
+    struct Server {
+        uint64_t valid;
+        uint64_t evictions;
+        uint64_t getHits;
+        uint64_t cmdGet;
+        uint64_t bytes;
+        uint64_t items;
+        double cpuSeconds;
+    };
+
+    struct Snapshot {
+        /// Wall-clock time of the snapshot, ns since the Unix epoch.
+        uint64_t sampledAtNs;
+        double elapsedSeconds;
+        uint64_t finished;
+
+        uint64_t lines;
+        uint64_t gets;
+        uint64_t getMisses;
+        uint64_t sets;
+        uint64_t setFailures;
+        double opsPerSecond;
+        double recentOpsPerSecond;
+
+        /// Fraction of the last interval the dispatcher spent waiting for
+        /// parsed input, and for room in the worker queues. A wait still
+        /// under way counts up to the sample; approximate, at most 1.
+        double inputStarved;
+        double queueBlocked;
+        uint64_t queueDepth;
+
+        /// Since the start, and over the last interval; only with -l.
+        Latency get;
+        Latency set;
+        Latency batch;
+        Latency recentGet;
+        Latency recentSet;
+        Latency recentBatch;
+
+        Server server;
+
+        uint32_t nWorkers;
+        uint32_t unused;
+        Worker workers[MAX_WORKERS];
+    };
+
+    struct Segment {
+        char magic[8];
+        uint32_t version;
+        uint32_t snapshotBytes;
+        uint64_t pid;
+        double intervalSeconds;
+        char backend[64];
+        std::atomic<uint64_t> sequence;
+        Snapshot snapshot;
+    };
+
+    LiveStats(const char* path, double intervalSeconds, const char* backend);
+    ~LiveStats();
+
+    void publish(const Snapshot& snapshot);
+
+    /**
+     * Copy a consistent snapshot out of #segment, which another process may
+     * be updating.
+     *
+     * \return
+     *      False if the writer is mid-update; try again shortly.
+     */
+    static bool
+    read(const Segment* segment, Snapshot* snapshot)
+    {
+        uint64_t before = segment->sequence.load(std::memory_order_acquire);
+        if (before & 1)
+            return false;
+        memcpy(snapshot, &segment->snapshot, sizeof(*snapshot));
+        std::atomic_thread_fence(std::memory_order_acquire);
+        return segment->sequence.load(std::memory_order_relaxed) == before;
+    }
+
+  private:
+    Segment* segment;
+
+    LiveStats(const LiveStats&) = delete;
+    LiveStats& operator=(const LiveStats&) = delete;
+};
+
+#endif /* !LIVESTATS_H_ */
@@ -0,0 +1,707 @@
+#include "KVBackend.h"
+#include "Common.h"
+#include "HashIndex.h"
+#include "TraceParser.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+namespace {
+
+using RAMCloud::ServerConfig;
+
+/// What precedes each key and value in a segment.
+struct EntryHeader {
+    uint64_t hash;
+    uint32_t keyLength;
+    uint32_t valueLength;
+
+    /// Bytes the entry takes in its segment, padded so the next header is
+    /// aligned.
+    size_t
+    size() const
+    {
+        return (sizeof(EntryHeader) + keyLength + valueLength + 7) & ~7ul;
+    }
+
+    const char* key() const { return reinterpret_cast<const char*>(this + 1); }
+    const char* value() const { return key() + keyLength; }
+};
+
+/// A HashIndex reference: segment number above, byte offset below.
+uint64_t
+makeRef(uint32_t segment, uint32_t offset)
+{
+    return (uint64_t(segment) << 32) | offset;
+}
+
+uint64_t
+threadCpuNs()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return uint64_t(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+}
+
+/**
+ * One fixed-size region of the log. Entries are only ever appended; space
+ * comes back when the cleaner copies the live entries out and frees the
+ * whole segment, or when the segment is evicted.
+ */
+struct Segment {
+    enum State {
+        FREE,
+
+        /// Taking new writes.
+        HEAD,
+
+        /// Taking entries a cleaner is relocating.
+        SURVIVOR,
+
+        /// Full; a candidate for cleaning or eviction.
+        SEALED,
+        CLEANING,
+        EVICTING
+    };
+
+    char* memory;
+    uint32_t id;
+
+    // The rest is guarded by LogStore::mutex, except that the owner of a
+    // HEAD or SURVIVOR segment appends to it.
+    State state;
+
+    /// Bytes of entries written so far.
+    uint32_t appended;
+
+    /// LogStore::clock when sealed, for the cleaner's age estimate.
+    uint64_t sealedAt;
+
+    /// Bytes of entries the index still points to.
+    std::atomic<int64_t> liveBytes;
+
+    /// Writers that have appended an entry here but not yet indexed it;
+    /// the segment may not be cleaned or evicted until they are done, or
+    /// their entries would be left behind.
+    std::atomic<int> writers;
+
+    const EntryHeader*
+    entry(uint32_t offset) const
+    {
+        return reinterpret_cast<const EntryHeader*>(memory + offset);
+    }
+};
+
+/**
+ * A log-structured in-memory cache in the manner of RAMCloud: all entries
+ * are appended to a log of ServerConfig::segmentSize segments, found
+ * through a HashIndex, and background cleaner threads
+ * (ServerConfig::Master::cleanerThreadCount) reclaim the space of
+ * overwritten and deleted entries by copying the survivors of sparsely
+ * used segments into fresh ones.
+ *
+ * Memory is handed out a whole segment at a time (segletSize equals
+ * segmentSize and in-memory compaction is disabled in ServerConfig), so
+ * cleaning is always the copying kind. Cleaning pays only while segments
+ * have dead space: segments are picked by RAMCloud's cost-benefit score,
+ * and none is cleaned whose write cost (bytes written per byte freed)
+ * exceeds cleanerWriteCostThreshold, or 10 when that is 0. When writers
+ * find no free segment they evict the oldest sealed one instead, as a
+ * cache must.
+ */
+class LogStore : public KVBackendFactory {
+  public:
+    explicit LogStore(const BackendConfig& config)
+        : segmentSize(uint32_t(config.getOption("segment",
+                                                ServerConfig::segmentSize)))
+        , nCleaners(int(config.getOption(
+              "cleaners", ServerConfig::Master::cleanerThreadCount)))
+        , maxWriteCost(double(config.getOption(
+              "writecost",
+              uint64_t(ServerConfig::Master::cleanerWriteCostThreshold))))
+        , segments()
+        , nSegments(0)
+        , index()
+        , mutex()
+        , freed()
+        , cleanerWake()
+        , freeList()
+        , head(NULL)
+        , clock(0)
+        , stopCleaners(false)
+        , cleaners()
+        , countersLock()
+        , counters()
+        , liveData(0)
+        , liveItems(0)
+        , appendedBytes(0)
+        , relocatedBytes(0)
+        , segmentsCleaned(0)
+        , cleanerNs(0)
+        , segmentsEvicted(0)
+        , itemsEvicted(0)
+    {
+        const uint64_t memory = config.getOption("memory_mb", 256) << 20;
+        nSegments = memory / segmentSize;
+        if (maxWriteCost <= 0)
+            maxWriteCost = 10;
+        if (nSegments < size_t(nCleaners) + 2) {
+            fprintf(stderr, "log store needs at least %d segments of %u "
+                    "bytes\n", nCleaners + 2, segmentSize);
+            exit(1);
+        }
+
+        segments.reset(new Segment[nSegments]);
+        for (size_t i = 0; i < nSegments; i++) {
+            Segment& segment = segments[i];
+            segment.memory = static_cast<char*>(malloc(segmentSize));
+            if (segment.memory == NULL) {
+                fprintf(stderr, "out of memory allocating the log\n");
+                exit(1);
+            }
+            segment.id = uint32_t(i);
+            segment.state = Segment::FREE;
+            segment.appended = 0;
+            segment.sealedAt = 0;
+            segment.liveBytes = 0;
+            segment.writers = 0;
+            freeList.push_back(&segment);
+        }
+        index.reset(new HashIndex(config.getOption("items", memory / 128)));
+
+        for (int i = 0; i < nCleaners; i++)
+            cleaners.emplace_back(&LogStore::cleanerMain, this);
+        printf("# log store: %lu segments of %u bytes, %d cleaner threads, "
+               "write cost limit %.1f\n", nSegments, segmentSize, nCleaners,
+               maxWriteCost);
+    }
+
+    ~LogStore()
+    {
+        {
+            std::lock_guard<std::mutex> _(mutex);
+            stopCleaners = true;
+        }
+        cleanerWake.notify_all();
+        for (std::thread& cleaner : cleaners)
+            cleaner.join();
+        for (size_t i = 0; i < nSegments; i++)
+            free(segments[i].memory);
+    }
+
+    std::unique_ptr<KVBackend> connect();
+
+    bool
+    expiresItems()
+    {
+        return false;
+    }
+
+    void
+    report(FILE* out)
+    {
+        uint64_t gets = 0, hits = 0;
+        sumCounters(&gets, &hits);
+        size_t inUse = 0;
+        {
+            std::lock_guard<std::mutex> _(mutex);
+            inUse = nSegments - freeList.size();
+        }
+        const double footprint = double(inUse) * segmentSize;
+        const double indexBytes = double(index->memoryUsed());
+        const uint64_t appended = appendedBytes;
+        const uint64_t relocated = relocatedBytes;
+        fprintf(out, "# log store: %.1f MB live in %lu segments (%.1f MB), "
+                "%.1f%% efficiency (%.1f%% counting the %.1f MB index)   "
+                "%.3f%% hits\n",
+                double(liveData) / 1e6, inUse, footprint / 1e6,
+                footprint > 0 ? double(liveData) / footprint * 100 : 0.0,
+                double(liveData) / (footprint + indexBytes) * 100,
+                indexBytes / 1e6,
+                gets ? double(hits) / double(gets) * 100 : 0.0);
+        fprintf(out, "# log cleaner: %lu segments cleaned   %.1f MB "
+                "relocated   write cost %.3f   %.3f s cpu   %lu segments "
+                "evicted (%lu items)\n",
+                uint64_t(segmentsCleaned), double(relocated) / 1e6,
+                appended ? double(appended + relocated) / double(appended)
+                         : 1.0,
+                double(cleanerNs) / 1e9, uint64_t(segmentsEvicted),
+                uint64_t(itemsEvicted));
+    }
+
+    /// Per-thread operation counts, summed for serverStats().
+    struct Counters {
+        std::atomic<uint64_t> gets;
+        std::atomic<uint64_t> hits;
+        char pad[64 - 2 * sizeof(std::atomic<uint64_t>)];
+    };
+
+    Counters*
+    addCounters()
+    {
+        std::lock_guard<std::mutex> _(countersLock);
+        counters.emplace_back(new Counters());
+        counters.back()->gets = 0;
+        counters.back()->hits = 0;
+        return counters.back().get();
+    }
+
+    void
+    stats(KVBackend::ServerStats* stats)
+    {
+        *stats = KVBackend::ServerStats{};
+        sumCounters(&stats->cmdGet, &stats->getHits);
+        stats->evictions = itemsEvicted;
+        stats->bytes = liveData;
+        stats->currItems = liveItems;
+    }
+
+    bool
+    read(uint64_t hash, const char* key, size_t keyLength,
+         size_t* valueLength, std::string* value)
+    {
+        std::lock_guard<HashIndex::Lock> _(index->lockFor(hash));
+        const EntryHeader* entry = find(hash, key, keyLength);
+        if (entry == NULL)
+            return false;
+        *valueLength = entry->valueLength;
+        if (value != NULL)
+            value->assign(entry->value(), entry->valueLength);
+        return true;
+    }
+
+    bool
+    write(uint64_t hash, const char* key, size_t keyLength,
+          const char* value, size_t valueLength)
+    {
+        const EntryHeader header{hash, uint32_t(keyLength),
+                                 uint32_t(valueLength)};
+        const size_t size = header.size();
+        if (size > segmentSize)
+            return false;
+
+        uint64_t ref;
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            while (head == NULL || head->appended + size > segmentSize)
+                newHead(lock);
+            ref = makeRef(head->id, head->appended);
+            char* p = head->memory + head->appended;
+            memcpy(p, &header, sizeof(header));
+            memcpy(p + sizeof(header), key, keyLength);
+            memcpy(p + sizeof(header) + keyLength, value, valueLength);
+            head->appended += uint32_t(size);
+            head->liveBytes += size;
+            head->writers++;
+        }
+        appendedBytes += size;
+
+        Segment& segment = segments[ref >> 32];
+        {
+            std::lock_guard<HashIndex::Lock> _(index->lockFor(hash));
+            uint64_t old = index->insert(hash, ref);
+            if (old != HashIndex::NONE)
+                kill(old);
+            else
+                liveItems++;
+            liveData += keyLength + valueLength;
+        }
+        segment.writers--;
+        return true;
+    }
+
+    bool
+    erase(uint64_t hash, const char* key, size_t keyLength)
+    {
+        std::lock_guard<HashIndex::Lock> _(index->lockFor(hash));
+        if (find(hash, key, keyLength) == NULL)
+            return false;
+        uint64_t ref = index->lookup(hash);
+        index->remove(hash, ref);
+        kill(ref);
+        liveItems--;
+        return true;
+    }
+
+  private:
+    const EntryHeader*
+    entryAt(uint64_t ref)
+    {
+        return segments[ref >> 32].entry(uint32_t(ref));
+    }
+
+    /// The entry for #key; the caller holds its index lock.
+    const EntryHeader*
+    find(uint64_t hash, const char* key, size_t keyLength)
+    {
+        uint64_t ref = index->lookup(hash);
+        if (ref == HashIndex::NONE)
+            return NULL;
+        const EntryHeader* entry = entryAt(ref);
+        if (entry->keyLength != keyLength ||
+            memcmp(entry->key(), key, keyLength) != 0) {
+            return NULL;
+        }
+        return entry;
+    }
+
+    /// Account for the entry at #ref no longer being live; the caller
+    /// holds its index lock, so the segment is still there.
+    void
+    kill(uint64_t ref)
+    {
+        const EntryHeader* entry = entryAt(ref);
+        segments[ref >> 32].liveBytes -= entry->size();
+        liveData -= entry->keyLength + entry->valueLength;
+    }
+
+    void
+    seal(Segment* segment)
+    {
+        segment->state = Segment::SEALED;
+        segment->sealedAt = clock++;
+    }
+
+    /// Take a free segment for #state; the caller holds #mutex.
+    Segment*
+    takeFree(Segment::State state)
+    {
+        Segment* segment = freeList.back();
+        freeList.pop_back();
+        segment->state = state;
+        segment->appended = 0;
+        segment->liveBytes = 0;
+        if (freeList.size() < lowWater())
+            cleanerWake.notify_all();
+        return segment;
+    }
+
+    void
+    release(Segment* segment)
+    {
+        segment->state = Segment::FREE;
+        freeList.push_back(segment);
+        freed.notify_all();
+    }
+
+    /// Free segments below which the cleaners start work.
+    size_t
+    lowWater()
+    {
+        return size_t(nCleaners) + std::max<size_t>(2, nSegments / 8);
+    }
+
+    /**
+     * Seal the head and replace it, evicting the oldest sealed segment if
+     * the only free ones left are the cleaners' reserve. Drops #lock while
+     * evicting, so the caller must recheck the head afterwards.
+     */
+    void
+    newHead(std::unique_lock<std::mutex>& lock)
+    {
+        if (head != NULL) {
+            seal(head);
+            head = NULL;
+        }
+        if (freeList.size() > size_t(nCleaners)) {
+            head = takeFree(Segment::HEAD);
+            return;
+        }
+
+        Segment* victim = NULL;
+        for (size_t i = 0; i < nSegments; i++) {
+            Segment& s = segments[i];
+            if (s.state == Segment::SEALED &&
+                (victim == NULL || s.sealedAt < victim->sealedAt)) {
+                victim = &s;
+            }
+        }
+        if (victim == NULL) {
+            // Everything is being cleaned or evicted; wait for some of it.
+            freed.wait(lock);
+            return;
+        }
+        victim->state = Segment::EVICTING;
+        lock.unlock();
+        drain(victim);
+        uint64_t evicted = 0;
+        forEachLive(victim, [&](const EntryHeader* entry, uint64_t ref) {
+            if (index->remove(entry->hash, ref)) {
+                liveData -= entry->keyLength + entry->valueLength;
+                liveItems--;
+                evicted++;
+            }
+        });
+        itemsEvicted += evicted;
+        segmentsEvicted++;
+        lock.lock();
+        release(victim);
+    }
+
+    /// Wait for the writers still indexing entries in #segment, which is
+    /// no longer the head, so no more can start.
+    void
+    drain(Segment* segment)
+    {
+        while (segment->writers.load() != 0)
+            std::this_thread::yield();
+    }
+
+    /// Call #f on each entry of #segment with its index lock held.
+    template<typename F>
+    void
+    forEachLive(Segment* segment, F f)
+    {
+        for (uint32_t offset = 0; offset < segment->appended; ) {
+            const EntryHeader* entry = segment->entry(offset);
+            uint64_t ref = makeRef(segment->id, offset);
+            {
+                std::lock_guard<HashIndex::Lock> _(index->lockFor(entry->hash));
+                f(entry, ref);
+            }
+            offset += uint32_t(entry->size());
+        }
+    }
+
+    /// The sealed segment most worth cleaning, or NULL; the caller holds
+    /// #mutex.
+    Segment*
+    chooseVictim()
+    {
+        Segment* best = NULL;
+        double bestScore = 0;
+        for (size_t i = 0; i < nSegments; i++) {
+            Segment& s = segments[i];
+            if (s.state != Segment::SEALED)
+                continue;
+            double u = double(s.liveBytes) / double(segmentSize);
+            if (u >= 1 || 1 / (1 - u) > maxWriteCost)
+                continue;
+            double age = double(clock - s.sealedAt + 1);
+            double score = (1 - u) * age / (1 + u);
+            if (best == NULL || score > bestScore) {
+                best = &s;
+                bestScore = score;
+            }
+        }
+        return best;
+    }
+
+    void
+    cleanerMain()
+    {
+        Segment* survivor = NULL;
+        std::unique_lock<std::mutex> lock(mutex);
+        while (!stopCleaners) {
+            Segment* victim = NULL;
+            if (freeList.size() < lowWater())
+                victim = chooseVictim();
+            if (victim == NULL) {
+                cleanerWake.wait_for(lock, std::chrono::milliseconds(10));
+                continue;
+            }
+            victim->state = Segment::CLEANING;
+            lock.unlock();
+            drain(victim);
+
+            uint64_t start = threadCpuNs();
+            bool done = clean(victim, &survivor);
+            cleanerNs += threadCpuNs() - start;
+
+            lock.lock();
+            if (done) {
+                release(victim);
+                segmentsCleaned++;
+            } else {
+                victim->state = Segment::SEALED;
+                cleanerWake.wait_for(lock, std::chrono::milliseconds(1));
+            }
+        }
+        if (survivor != NULL)
+            seal(survivor);
+    }
+
+    /**
+     * Copy the live entries of #victim into #survivor, taking new survivor
+     * segments as they fill. Returns false, with some entries not yet
+     * moved, if no free segment is left to copy into.
+     */
+    bool
+    clean(Segment* victim, Segment** survivor)
+    {
+        for (uint32_t offset = 0; offset < victim->appended; ) {
+            const EntryHeader* entry = victim->entry(offset);
+            const uint32_t size = uint32_t(entry->size());
+            const uint64_t ref = makeRef(victim->id, offset);
+            HashIndex::Lock& entryLock = index->lockFor(entry->hash);
+
+            if (*survivor == NULL ||
+                (*survivor)->appended + size > segmentSize) {
+                entryLock.lock();
+                bool live = index->lookup(entry->hash) == ref;
+                entryLock.unlock();
+                if (!live) {
+                    offset += size;
+                    continue;
+                }
+                std::lock_guard<std::mutex> _(mutex);
+                if (*survivor != NULL)
+                    seal(*survivor);
+                *survivor = NULL;
+                if (freeList.empty())
+                    return false;
+                *survivor = takeFree(Segment::SURVIVOR);
+            }
+
+            std::lock_guard<HashIndex::Lock> _(entryLock);
+            if (index->lookup(entry->hash) == ref) {
+                Segment* to = *survivor;
+                memcpy(to->memory + to->appended, entry, size);
+                index->relocate(entry->hash, ref,
+                                makeRef(to->id, to->appended));
+                to->appended += size;
+                to->liveBytes += size;
+                victim->liveBytes -= size;
+                relocatedBytes += size;
+            }
+            offset += size;
+        }
+        return true;
+    }
+
+    void
+    sumCounters(uint64_t* gets, uint64_t* hits)
+    {
+        std::lock_guard<std::mutex> _(countersLock);
+        *gets = *hits = 0;
+        for (auto& c : counters) {
+            *gets += c->gets.load(std::memory_order_relaxed);
+            *hits += c->hits.load(std::memory_order_relaxed);
+        }
+    }
+
+    const uint32_t segmentSize;
+    const int nCleaners;
+    double maxWriteCost;
+
+    std::unique_ptr<Segment[]> segments;
+    size_t nSegments;
+    std::unique_ptr<HashIndex> index;
+
+    /// Guards segment states, #freeList, #head and #clock.
+    std::mutex mutex;
+    std::condition_variable freed;
+    std::condition_variable cleanerWake;
+    std::vector<Segment*> freeList;
+    Segment* head;
+
+    /// Counts sealed segments; a segment's age is how far it has advanced
+    /// since the segment was sealed.
+    uint64_t clock;
+
+    bool stopCleaners;
+    std::vector<std::thread> cleaners;
+
+    std::mutex countersLock;
+    std::vector<std::unique_ptr<Counters>> counters;
+
+    /// Key and value bytes of the items the index points to.
+    std::atomic<int64_t> liveData;
+    std::atomic<int64_t> liveItems;
+
+    std::atomic<uint64_t> appendedBytes;
+    std::atomic<uint64_t> relocatedBytes;
+    std::atomic<uint64_t> segmentsCleaned;
+    std::atomic<uint64_t> cleanerNs;
+    std::atomic<uint64_t> segmentsEvicted;
+    std::atomic<uint64_t> itemsEvicted;
+};
+
+/// One thread's handle on a LogStore.
+class LogBackend : public KVBackend {
+  public:
+    explicit LogBackend(LogStore& store)
+        : store(store)
+        , counters(store.addCounters())
+    {
+    }
+
+    Status
+    get(const char* key, size_t keyLength, size_t* valueLength,
+        std::string* value)
+    {
+        counters->gets.store(counters->gets.load(std::memory_order_relaxed) + 1,
+                             std::memory_order_relaxed);
+        if (!store.read(hashTraceKey(key, keyLength), key, keyLength,
+                        valueLength, value)) {
+            return MISS;
+        }
+        counters->hits.store(counters->hits.load(std::memory_order_relaxed) + 1,
+                             std::memory_order_relaxed);
+        return OK;
+    }
+
+    /// Entries carry no expiry, as in RAMCloud; #ttl is ignored.
+    Status
+    set(const char* key, size_t keyLength, const char* value,
+        size_t valueLength, uint32_t ttl)
+    {
+        if (!store.write(hashTraceKey(key, keyLength), key, keyLength, value,
+                         valueLength)) {
+            return ERROR;
+        }
+        return OK;
+    }
+
+    Status
+    remove(const char* key, size_t keyLength)
+    {
+        return store.erase(hashTraceKey(key, keyLength), key, keyLength)
+                   ? OK : MISS;
+    }
+
+    bool
+    serverStats(ServerStats* stats)
+    {
+        store.stats(stats);
+        return true;
+    }
+
+    const char*
+    errorString()
+    {
+        return "item larger than a segment";
+    }
+
+  private:
+    LogStore& store;
+    LogStore::Counters* counters;
+};
+
+std::unique_ptr<KVBackend>
+LogStore::connect()
+{
+    return std::unique_ptr<KVBackend>(new LogBackend(*this));
+}
+
+KVBackendRegistry::Registration logBackend{
+    "log",
+    "in-process log-structured store with a background cleaner; "
+    "-o memory_mb=N (default 256), -o segment=bytes, -o cleaners=N, "
+    "-o writecost=N (defaults from ServerConfig); ignores TTLs",
+    [](const BackendConfig& config) {
+        return std::unique_ptr<KVBackendFactory>(new LogStore(config));
+    }};
+
+} // anonymous namespace
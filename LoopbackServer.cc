@@ -0,0 +1,731 @@
+#include "LoopbackServer.h"
+
+#include <algorithm>
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+/**
+ * One client connection: bytes received but not yet executed, and replies
+ * not yet written.
+ */
+class LoopbackServer::Connection {
+  public:
+    explicit Connection(int fd)
+        : fd(fd)
+        , in()
+        , inPos(0)
+        , out()
+        , outPos(0)
+        , writing(false)
+    {
+    }
+
+    ~Connection()
+    {
+        close(fd);
+    }
+
+    int fd;
+    std::string in;
+    size_t inPos;
+    std::string out;
+    size_t outPos;
+
+    /// True while the connection is registered for EPOLLOUT.
+    bool writing;
+};
+
+namespace {
+
+/// Longest command line accepted before the connection is dropped.
+const size_t MAX_LINE = 64 * 1024;
+
+/// Largest value accepted by a storage command.
+const size_t MAX_VALUE = 64 * 1024 * 1024;
+
+/// execute() results other than a count of data bytes consumed.
+const size_t NEED_MORE = ~size_t(0);
+const size_t CLOSE = ~size_t(0) - 1;
+
+struct Token {
+    const char* start;
+    size_t length;
+
+    bool is(const char* word) const
+    {
+        return strlen(word) == length && memcmp(start, word, length) == 0;
+    }
+};
+
+/// Split [line, end) on spaces into #tokens.
+void
+tokenize(const char* line, const char* end, std::vector<Token>& tokens)
+{
+    tokens.clear();
+    const char* p = line;
+    while (p < end) {
+        while (p < end && *p == ' ')
+            p++;
+        const char* start = p;
+        while (p < end && *p != ' ')
+            p++;
+        if (p > start)
+            tokens.push_back({start, size_t(p - start)});
+    }
+}
+
+/// Parse a whole token as an unsigned decimal number.
+bool
+toUint64(const Token& token, uint64_t* value)
+{
+    if (token.length == 0 || token.length > 20)
+        return false;
+    uint64_t v = 0;
+    for (size_t i = 0; i < token.length; i++) {
+        char c = token.start[i];
+        if (c < '0' || c > '9')
+            return false;
+        uint64_t next = v * 10 + (c - '0');
+        if (next < v)
+            return false;
+        v = next;
+    }
+    *value = v;
+    return true;
+}
+
+/// Parse a whole token as a signed decimal number.
+bool
+toInt64(const Token& token, int64_t* value)
+{
+    if (token.length > 0 && token.start[0] == '-') {
+        uint64_t v;
+        if (!toUint64({token.start + 1, token.length - 1}, &v))
+            return false;
+        *value = -int64_t(v);
+        return true;
+    }
+    uint64_t v;
+    if (!toUint64(token, &v))
+        return false;
+    *value = int64_t(v);
+    return true;
+}
+
+/**
+ * Convert a protocol exptime into an absolute Unix time, or 0 for items
+ * that never expire. As in memcached, values up to 30 days are relative
+ * and negative values expire the item immediately.
+ */
+int64_t
+toExpiry(int64_t exptime)
+{
+    if (exptime == 0)
+        return 0;
+    if (exptime < 0)
+        return 1;
+    if (exptime <= 60 * 60 * 24 * 30)
+        return int64_t(time(NULL)) + exptime;
+    return exptime;
+}
+
+bool
+expired(int64_t expiry)
+{
+    return expiry != 0 && expiry <= int64_t(time(NULL));
+}
+
+void
+appendNumber(std::string& out, uint64_t value)
+{
+    char buf[24];
+    int n = snprintf(buf, sizeof(buf), "%lu", value);
+    out.append(buf, n);
+}
+
+} // anonymous namespace
+
+/**
+ * Start serving.
+ * \param address
+ *      "host:port" to listen on TCP ("127.0.0.1:0" picks a free port), or
+ *      the path of a Unix socket to create (anything starting with '/').
+ * \param nThreads
+ *      Number of worker threads; connections are spread over them.
+ * \param nullMode
+ *      Acknowledge updates without storing anything.
+ */
+LoopbackServer::LoopbackServer(const std::string& address, size_t nThreads,
+                               bool nullMode)
+    : nullMode(nullMode)
+    , port(0)
+    , socketPath()
+    , listenFd(-1)
+    , wakeFd(-1)
+    , quit(false)
+    , nextCas(1)
+    , stats()
+    , shards(N_SHARDS)
+    , epollFds()
+    , nextEpoll(0)
+    , threads()
+    , connectionsMutex()
+    , connections()
+{
+    if (!address.empty() && address[0] == '/') {
+        socketPath = address;
+        sockaddr_un addr = {};
+        addr.sun_family = AF_UNIX;
+        if (socketPath.size() >= sizeof(addr.sun_path)) {
+            fprintf(stderr, "socket path too long: %s\n", socketPath.c_str());
+            exit(1);
+        }
+        strcpy(addr.sun_path, socketPath.c_str());
+        unlink(socketPath.c_str());
+        listenFd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0);
+        if (listenFd < 0 ||
+            bind(listenFd, reinterpret_cast<sockaddr*>(&addr),
+                 sizeof(addr)) != 0) {
+            fprintf(stderr, "couldn't bind %s: %s\n", socketPath.c_str(),
+                    strerror(errno));
+            exit(1);
+        }
+    } else {
+        std::string host = address;
+        int requestedPort = 0;
+        size_t colon = address.rfind(':');
+        if (colon != std::string::npos) {
+            host = address.substr(0, colon);
+            requestedPort = atoi(address.c_str() + colon + 1);
+        }
+        if (host.empty() || host == "localhost")
+            host = "127.0.0.1";
+
+        sockaddr_in addr = {};
+        addr.sin_family = AF_INET;
+        addr.sin_port = htons(requestedPort);
+        if (inet_pton(AF_INET, host.c_str(), &addr.sin_addr) != 1) {
+            fprintf(stderr, "bad loopback server address %s\n",
+                    address.c_str());
+            exit(1);
+        }
+        listenFd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+        int one = 1;
+        if (listenFd >= 0)
+            setsockopt(listenFd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+        if (listenFd < 0 ||
+            bind(listenFd, reinterpret_cast<sockaddr*>(&addr),
+                 sizeof(addr)) != 0) {
+            fprintf(stderr, "couldn't bind %s: %s\n", address.c_str(),
+                    strerror(errno));
+            exit(1);
+        }
+        socklen_t length = sizeof(addr);
+        getsockname(listenFd, reinterpret_cast<sockaddr*>(&addr), &length);
+        port = ntohs(addr.sin_port);
+    }
+
+    if (listen(listenFd, 1024) != 0) {
+        fprintf(stderr, "listen failed: %s\n", strerror(errno));
+        exit(1);
+    }
+    wakeFd = eventfd(0, EFD_NONBLOCK);
+
+    // Every worker waits on the listening socket (EPOLLEXCLUSIVE wakes just
+    // one of them per connection), but whichever accepts a connection hands
+    // it to the next worker in turn so they share the load evenly.
+    for (size_t i = 0; i < std::max<size_t>(nThreads, 1); i++) {
+        int epollFd = epoll_create1(0);
+        epoll_event listenEvent = {};
+        listenEvent.events = EPOLLIN | EPOLLEXCLUSIVE;
+        listenEvent.data.ptr = &listenFd;
+        epoll_event wakeEvent = {};
+        wakeEvent.events = EPOLLIN;
+        wakeEvent.data.ptr = &wakeFd;
+        if (epollFd < 0 ||
+            epoll_ctl(epollFd, EPOLL_CTL_ADD, listenFd, &listenEvent) != 0 ||
+            epoll_ctl(epollFd, EPOLL_CTL_ADD, wakeFd, &wakeEvent) != 0) {
+            fprintf(stderr, "epoll setup failed: %s\n", strerror(errno));
+            exit(1);
+        }
+        epollFds.push_back(epollFd);
+    }
+    for (int epollFd : epollFds)
+        threads.emplace_back(&LoopbackServer::workerThread, this, epollFd);
+}
+
+LoopbackServer::~LoopbackServer()
+{
+    quit = true;
+    uint64_t one = 1;
+    if (write(wakeFd, &one, sizeof(one)) != sizeof(one))
+        fprintf(stderr, "couldn't wake loopback server threads\n");
+    for (std::thread& thread : threads)
+        thread.join();
+
+    for (Connection* conn : connections)
+        delete conn;
+    for (int epollFd : epollFds)
+        close(epollFd);
+    close(wakeFd);
+    close(listenFd);
+    if (!socketPath.empty())
+        unlink(socketPath.c_str());
+}
+
+void
+LoopbackServer::workerThread(int epollFd)
+{
+    epoll_event events[64];
+    while (!quit) {
+        int n = epoll_wait(epollFd, events, 64, -1);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0) {
+            fprintf(stderr, "epoll_wait failed: %s\n", strerror(errno));
+            exit(1);
+        }
+        for (int i = 0; i < n; i++) {
+            void* ptr = events[i].data.ptr;
+            if (ptr == &wakeFd)
+                return;
+            if (ptr == &listenFd) {
+                acceptConnections();
+                continue;
+            }
+            Connection* conn = static_cast<Connection*>(ptr);
+            bool open = true;
+            if (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR))
+                open = serve(epollFd, conn);
+            else if (events[i].events & EPOLLOUT)
+                open = flush(epollFd, conn);
+            if (!open)
+                closeConnection(epollFd, conn);
+        }
+    }
+}
+
+/**
+ * Accept every pending connection, registering each with the next worker.
+ */
+void
+LoopbackServer::acceptConnections()
+{
+    while (true) {
+        int fd = accept4(listenFd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd < 0) {
+            if (errno == EINTR || errno == ECONNABORTED)
+                continue;
+            return;
+        }
+        if (socketPath.empty()) {
+            int one = 1;
+            setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        }
+
+        Connection* conn = new Connection(fd);
+        {
+            std::lock_guard<std::mutex> _(connectionsMutex);
+            connections.insert(conn);
+        }
+        stats.connections++;
+
+        epoll_event event = {};
+        event.events = EPOLLIN | EPOLLRDHUP;
+        event.data.ptr = conn;
+        int epollFd = epollFds[nextEpoll++ % epollFds.size()];
+        if (epoll_ctl(epollFd, EPOLL_CTL_ADD, fd, &event) != 0) {
+            fprintf(stderr, "epoll_ctl failed: %s\n", strerror(errno));
+            exit(1);
+        }
+    }
+}
+
+void
+LoopbackServer::closeConnection(int epollFd, Connection* conn)
+{
+    epoll_ctl(epollFd, EPOLL_CTL_DEL, conn->fd, NULL);
+    {
+        std::lock_guard<std::mutex> _(connectionsMutex);
+        connections.erase(conn);
+    }
+    stats.connections--;
+    delete conn;
+}
+
+/**
+ * Read whatever the client has sent, execute every complete command in it
+ * and start writing the replies.
+ * \return
+ *      False if the connection should be closed.
+ */
+bool
+LoopbackServer::serve(int epollFd, Connection* conn)
+{
+    static const size_t READ_SIZE = 64 * 1024;
+    bool eof = false;
+    while (true) {
+        size_t old = conn->in.size();
+        conn->in.resize(old + READ_SIZE);
+        ssize_t n = read(conn->fd, &conn->in[old], READ_SIZE);
+        conn->in.resize(old + std::max<ssize_t>(n, 0));
+        if (n > 0) {
+            if (size_t(n) < READ_SIZE)
+                break;
+            continue;
+        }
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            break;
+        eof = true;
+        break;
+    }
+
+    bool open = !eof;
+    while (conn->inPos < conn->in.size()) {
+        const char* base = conn->in.data();
+        const char* line = base + conn->inPos;
+        const char* limit = base + conn->in.size();
+        const char* newline =
+            static_cast<const char*>(memchr(line, '\n', limit - line));
+        if (newline == NULL) {
+            if (size_t(limit - line) > MAX_LINE) {
+                conn->out += "CLIENT_ERROR line too long\r\n";
+                open = false;
+            }
+            break;
+        }
+        const char* end = newline;
+        if (end > line && end[-1] == '\r')
+            end--;
+
+        size_t consumed = execute(conn, line, end, newline + 1,
+                                  limit - (newline + 1));
+        if (consumed == NEED_MORE)
+            break;
+        if (consumed == CLOSE) {
+            open = false;
+            break;
+        }
+        conn->inPos = (newline + 1 - base) + consumed;
+    }
+
+    if (conn->inPos == conn->in.size()) {
+        conn->in.clear();
+        conn->inPos = 0;
+    } else if (conn->inPos > MAX_LINE) {
+        conn->in.erase(0, conn->inPos);
+        conn->inPos = 0;
+    }
+
+    return flush(epollFd, conn) && open;
+}
+
+/**
+ * Write as much of the pending output as the socket will take, and watch
+ * for writability only while some remains.
+ * \return
+ *      False if the connection should be closed.
+ */
+bool
+LoopbackServer::flush(int epollFd, Connection* conn)
+{
+    while (conn->outPos < conn->out.size()) {
+        ssize_t n = write(conn->fd, conn->out.data() + conn->outPos,
+                          conn->out.size() - conn->outPos);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            break;
+        if (n < 0)
+            return false;
+        conn->outPos += n;
+    }
+
+    bool pending = conn->outPos < conn->out.size();
+    if (!pending) {
+        conn->out.clear();
+        conn->outPos = 0;
+    }
+    if (pending != conn->writing) {
+        epoll_event event = {};
+        event.events = EPOLLIN | EPOLLRDHUP | (pending ? EPOLLOUT : 0);
+        event.data.ptr = conn;
+        epoll_ctl(epollFd, EPOLL_CTL_MOD, conn->fd, &event);
+        conn->writing = pending;
+    }
+    return true;
+}
+
+LoopbackServer::Shard&
+LoopbackServer::shardFor(const std::string& key)
+{
+    return shards[std::hash<std::string>()(key) % N_SHARDS];
+}
+
+/**
+ * Execute the command on [line, end), appending its reply to conn->out.
+ * \param data
+ *      The bytes following the command line, which hold the value of a
+ *      storage command.
+ * \param available
+ *      Number of bytes at #data received so far.
+ * \return
+ *      The number of bytes of #data the command used, NEED_MORE if its
+ *      value has not all arrived yet, or CLOSE to drop the connection.
+ */
+size_t
+LoopbackServer::execute(Connection* conn, const char* line, const char* end,
+                        const char* data, size_t available)
+{
+    static thread_local std::vector<Token> tokens;
+    static thread_local std::string key;
+    tokenize(line, end, tokens);
+    if (tokens.empty()) {
+        conn->out += "ERROR\r\n";
+        return 0;
+    }
+
+    const Token& command = tokens[0];
+    const bool noreply = tokens.size() > 1 && tokens.back().is("noreply");
+    const size_t nArgs = tokens.size() - (noreply ? 1 : 0);
+    const size_t replyStart = conn->out.size();
+    std::string& out = conn->out;
+    size_t consumed = 0;
+
+    if (command.is("get") || command.is("gets")) {
+        const bool withCas = command.is("gets");
+        for (size_t i = 1; i < tokens.size(); i++) {
+            stats.gets++;
+            if (nullMode)
+                continue;
+            key.assign(tokens[i].start, tokens[i].length);
+            Shard& shard = shardFor(key);
+            std::lock_guard<std::mutex> _(shard.mutex);
+            auto it = shard.items.find(key);
+            if (it == shard.items.end())
+                continue;
+            if (expired(it->second.expiry)) {
+                shard.items.erase(it);
+                continue;
+            }
+            const Item& item = it->second;
+            stats.hits++;
+            out += "VALUE ";
+            out += key;
+            out += ' ';
+            appendNumber(out, item.flags);
+            out += ' ';
+            appendNumber(out, item.value.size());
+            if (withCas) {
+                out += ' ';
+                appendNumber(out, item.cas);
+            }
+            out += "\r\n";
+            out += item.value;
+            out += "\r\n";
+        }
+        out += "END\r\n";
+        return 0;
+    }
+
+    if (command.is("set") || command.is("add") || command.is("replace") ||
+        command.is("append") || command.is("prepend") || command.is("cas")) {
+        const bool isCas = command.is("cas");
+        uint64_t flags, length, casUnique = 0;
+        int64_t exptime;
+        if (nArgs != (isCas ? 6u : 5u) ||
+            !toUint64(tokens[2], &flags) ||
+            !toInt64(tokens[3], &exptime) ||
+            !toUint64(tokens[4], &length) ||
+            (isCas && !toUint64(tokens[5], &casUnique)) ||
+            tokens[1].length > 250 || length > MAX_VALUE) {
+            out += "CLIENT_ERROR bad command line format\r\n";
+            return CLOSE;
+        }
+        if (available < length + 2)
+            return NEED_MORE;
+        consumed = length + 2;
+        if (data[length] != '\r' || data[length + 1] != '\n') {
+            out += "CLIENT_ERROR bad data chunk\r\n";
+            return consumed;
+        }
+        stats.sets++;
+        key.assign(tokens[1].start, tokens[1].length);
+        out += store(std::string(command.start, command.length), key,
+                     uint32_t(flags), toExpiry(exptime), casUnique, data,
+                     length);
+    } else if (command.is("delete") && nArgs >= 2) {
+        if (nullMode) {
+            out += "DELETED\r\n";
+        } else {
+            key.assign(tokens[1].start, tokens[1].length);
+            Shard& shard = shardFor(key);
+            std::lock_guard<std::mutex> _(shard.mutex);
+            auto it = shard.items.find(key);
+            bool found = it != shard.items.end() &&
+                         !expired(it->second.expiry);
+            if (it != shard.items.end())
+                shard.items.erase(it);
+            out += found ? "DELETED\r\n" : "NOT_FOUND\r\n";
+        }
+    } else if ((command.is("incr") || command.is("decr")) && nArgs == 3) {
+        uint64_t delta;
+        if (!toUint64(tokens[2], &delta)) {
+            out += "CLIENT_ERROR invalid numeric delta argument\r\n";
+        } else if (nullMode) {
+            out += "NOT_FOUND\r\n";
+        } else {
+            key.assign(tokens[1].start, tokens[1].length);
+            Shard& shard = shardFor(key);
+            std::lock_guard<std::mutex> _(shard.mutex);
+            auto it = shard.items.find(key);
+            uint64_t value;
+            if (it == shard.items.end() || expired(it->second.expiry)) {
+                out += "NOT_FOUND\r\n";
+            } else if (!toUint64({it->second.value.data(),
+                                  it->second.value.size()}, &value)) {
+                out += "CLIENT_ERROR cannot increment or decrement "
+                       "non-numeric value\r\n";
+            } else {
+                if (command.is("incr"))
+                    value += delta;
+                else
+                    value = value > delta ? value - delta : 0;
+                it->second.value = std::to_string(value);
+                it->second.cas = nextCas++;
+                out += it->second.value;
+                out += "\r\n";
+            }
+        }
+    } else if (command.is("touch") && nArgs == 3) {
+        int64_t exptime;
+        if (!toInt64(tokens[2], &exptime)) {
+            out += "CLIENT_ERROR invalid exptime argument\r\n";
+        } else if (nullMode) {
+            out += "TOUCHED\r\n";
+        } else {
+            key.assign(tokens[1].start, tokens[1].length);
+            Shard& shard = shardFor(key);
+            std::lock_guard<std::mutex> _(shard.mutex);
+            auto it = shard.items.find(key);
+            if (it == shard.items.end() || expired(it->second.expiry)) {
+                out += "NOT_FOUND\r\n";
+            } else {
+                it->second.expiry = toExpiry(exptime);
+                out += "TOUCHED\r\n";
+            }
+        }
+    } else if (command.is("stats") && nArgs == 1) {
+        uint64_t items = 0, bytes = 0;
+        for (Shard& shard : shards) {
+            std::lock_guard<std::mutex> _(shard.mutex);
+            items += shard.items.size();
+            for (auto& entry : shard.items)
+                bytes += entry.first.size() + entry.second.value.size();
+        }
+        rusage usage;
+        getrusage(RUSAGE_SELF, &usage);
+        char buf[512];
+        snprintf(buf, sizeof(buf),
+                 "STAT pid %d\r\n"
+                 "STAT rusage_user %ld.%06ld\r\n"
+                 "STAT rusage_system %ld.%06ld\r\n"
+                 "STAT curr_connections %lu\r\n"
+                 "STAT cmd_get %lu\r\n"
+                 "STAT cmd_set %lu\r\n"
+                 "STAT get_hits %lu\r\n"
+                 "STAT get_misses %lu\r\n"
+                 "STAT curr_items %lu\r\n"
+                 "STAT bytes %lu\r\n"
+                 "STAT evictions 0\r\n"
+                 "STAT threads %lu\r\n"
+                 "END\r\n",
+                 int(getpid()),
+                 usage.ru_utime.tv_sec, long(usage.ru_utime.tv_usec),
+                 usage.ru_stime.tv_sec, long(usage.ru_stime.tv_usec),
+                 stats.connections.load(), stats.gets.load(),
+                 stats.sets.load(), stats.hits.load(),
+                 stats.gets - stats.hits, items, bytes, epollFds.size());
+        out += buf;
+    } else if (command.is("flush_all")) {
+        for (Shard& shard : shards) {
+            std::lock_guard<std::mutex> _(shard.mutex);
+            shard.items.clear();
+        }
+        out += "OK\r\n";
+    } else if (command.is("version")) {
+        out += "VERSION 1.6.0-loopback\r\n";
+    } else if (command.is("verbosity")) {
+        out += "OK\r\n";
+    } else if (command.is("quit")) {
+        return CLOSE;
+    } else {
+        out += "ERROR\r\n";
+    }
+
+    if (noreply)
+        out.resize(replyStart);
+    return consumed;
+}
+
+/**
+ * Apply storage command #command ("set", "add", ...) to #key.
+ * \return
+ *      The reply line.
+ */
+const char*
+LoopbackServer::store(const std::string& command, const std::string& key,
+                      uint32_t flags, int64_t expiry, uint64_t casUnique,
+                      const char* data, size_t length)
+{
+    if (nullMode)
+        return "STORED\r\n";
+
+    Shard& shard = shardFor(key);
+    std::lock_guard<std::mutex> _(shard.mutex);
+    auto it = shard.items.find(key);
+    if (it != shard.items.end() && expired(it->second.expiry)) {
+        shard.items.erase(it);
+        it = shard.items.end();
+    }
+    const bool present = it != shard.items.end();
+
+    if (command == "set" || (command == "add" && !present) ||
+        (command == "replace" && present) ||
+        (command == "cas" && present && it->second.cas == casUnique)) {
+        Item& item = shard.items[key];
+        item.value.assign(data, length);
+        item.flags = flags;
+        item.expiry = expiry;
+        item.cas = nextCas++;
+        return "STORED\r\n";
+    }
+    if ((command == "append" || command == "prepend") && present) {
+        std::string& value = it->second.value;
+        if (command == "append")
+            value.append(data, length);
+        else
+            value.insert(0, data, length);
+        it->second.cas = nextCas++;
+        return "STORED\r\n";
+    }
+    if (command == "cas")
+        return present ? "EXISTS\r\n" : "NOT_FOUND\r\n";
+    return "NOT_STORED\r\n";
+}
@@ -0,0 +1,103 @@
+#ifndef LOOPBACKSERVER_H_
+#define LOOPBACKSERVER_H_
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+/**
+ * A small memcached stand-in that runs inside the client process, so the
+ * player and bench can find their own throughput ceilings and run without
+ * an external server. It speaks the text protocol (get, gets, set, add,
+ * replace, append, prepend, cas, delete, incr, decr, touch, stats,
+ * flush_all, version, quit) on a TCP port or a Unix socket.
+ *
+ * Each worker thread runs its own epoll loop and accepts connections from
+ * the shared listening socket. Items live in a hash map split into
+ * independently locked shards; there is no memory limit and no eviction.
+ *
+ * In null mode nothing is stored: every update is acknowledged and every
+ * read misses, which measures the cost of the client and the transport
+ * alone.
+ */
+class LoopbackServer {
+  public:
+    /// Counters for the "stats" command.
+    struct Stats {
+        std::atomic<uint64_t> connections;
+        std::atomic<uint64_t> gets;
+        std::atomic<uint64_t> hits;
+        std::atomic<uint64_t> sets;
+    };
+
+    LoopbackServer(const std::string& address, size_t nThreads,
+                   bool nullMode = false);
+    ~LoopbackServer();
+
+    /// TCP port being served (useful when the address asked for port 0),
+    /// or 0 for a Unix socket.
+    int getPort() const { return port; }
+
+    /// Path of the Unix socket being served, or empty for TCP.
+    const std::string& getSocketPath() const { return socketPath; }
+
+  private:
+    struct Item {
+        std::string value;
+        uint32_t flags;
+        uint64_t cas;
+
+        /// Unix time after which the item is gone, or 0 for never.
+        int64_t expiry;
+    };
+
+    struct Shard {
+        std::mutex mutex;
+        std::unordered_map<std::string, Item> items;
+    };
+
+    class Connection;
+
+    void workerThread(int epollFd);
+    void acceptConnections();
+    void closeConnection(int epollFd, Connection* conn);
+    bool serve(int epollFd, Connection* conn);
+    bool flush(int epollFd, Connection* conn);
+    size_t execute(Connection* conn, const char* line, const char* end,
+                   const char* data, size_t available);
+    const char* store(const std::string& command, const std::string& key,
+                      uint32_t flags, int64_t expiry, uint64_t casUnique,
+                      const char* data, size_t length);
+    Shard& shardFor(const std::string& key);
+
+    static const size_t N_SHARDS = 64;
+
+    const bool nullMode;
+    int port;
+    std::string socketPath;
+    int listenFd;
+    int wakeFd;
+    std::atomic<bool> quit;
+    std::atomic<uint64_t> nextCas;
+    Stats stats;
+
+    std::vector<Shard> shards;
+    std::vector<int> epollFds;
+    std::atomic<size_t> nextEpoll;
+    std::vector<std::thread> threads;
+
+    /// Open connections, so any still open at shutdown can be freed.
+    std::mutex connectionsMutex;
+    std::unordered_set<Connection*> connections;
+
+    LoopbackServer(const LoopbackServer&) = delete;
+    LoopbackServer& operator=(const LoopbackServer&) = delete;
+};
+
+#endif /* !LOOPBACKSERVER_H_ */
@@ -0,0 +1,400 @@
+#include "KVBackend.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <algorithm>
+
+#include <libmemcached/memcached.h>
+
+namespace {
+
+/**
+ * A KVBackend on a libmemcached client connected to every configured
+ * server. Options: "binary=1" switches to the binary protocol.
+ *
+ * In a submit() batch each run of consecutive GETs goes out as one
+ * memcached_mget(); other requests are issued one at a time between the
+ * runs. With "noreply=1" each run of consecutive SETs is instead buffered
+ * and sent with noreply in one flush, so a SET the server refuses is not
+ * seen as a failure.
+ */
+class MemcachedBackend : public KVBackend {
+  public:
+    explicit MemcachedBackend(const BackendConfig& config)
+        : memc(memcached_create(NULL))
+        , lastError(MEMCACHED_SUCCESS)
+        , quietSets(config.getOption("noreply", 0) != 0)
+        , keyPtrs()
+        , keyLengths()
+    {
+        memcached_return rc;
+        if (config.getOption("binary", 0)) {
+            rc = memcached_behavior_set(memc,
+                                        MEMCACHED_BEHAVIOR_BINARY_PROTOCOL, 1);
+            if (rc != MEMCACHED_SUCCESS) {
+                fprintf(stderr, "failed to set binary protocol\n");
+                exit(1);
+            }
+        }
+
+        rc = memcached_behavior_set(memc, MEMCACHED_BEHAVIOR_NO_BLOCK, 1);
+        if (rc != MEMCACHED_SUCCESS) {
+            fprintf(stderr, "failed to set non-blocking IO\n");
+            exit(1);
+        }
+
+        memcached_server_st* servers = NULL;
+        for (auto& server : config.servers) {
+            if (server.first[0] == '/')
+                continue;
+            servers = memcached_server_list_append(servers,
+                                                   server.first.c_str(),
+                                                   server.second, &rc);
+            if (servers == NULL) {
+                fprintf(stderr, "memcached_server_list_append failed: %d\n",
+                        (int)rc);
+                exit(1);
+            }
+        }
+        if (servers != NULL) {
+            rc = memcached_server_push(memc, servers);
+            if (rc != MEMCACHED_SUCCESS) {
+                fprintf(stderr, "memcached_server_push failed: %d (%s)\n",
+                        (int)rc, memcached_strerror(memc, rc));
+                exit(1);
+            }
+            memcached_server_list_free(servers);
+        }
+
+        for (auto& server : config.servers) {
+            if (server.first[0] != '/')
+                continue;
+            rc = memcached_server_add_unix_socket(memc, server.first.c_str());
+            if (rc != MEMCACHED_SUCCESS) {
+                fprintf(stderr, "memcached_server_add_unix_socket failed: "
+                        "%d (%s)\n", (int)rc, memcached_strerror(memc, rc));
+                exit(1);
+            }
+        }
+    }
+
+    ~MemcachedBackend()
+    {
+        memcached_free(memc);
+    }
+
+    Status
+    get(const char* key, size_t keyLength, size_t* valueLength,
+        std::string* value)
+    {
+        uint32_t flags;
+        memcached_return rc;
+        char* ret = memcached_get(memc, key, keyLength, valueLength, &flags,
+                                  &rc);
+        if (ret == NULL)
+            return toStatus(rc);
+        if (value != NULL)
+            value->assign(ret, *valueLength);
+        free(ret);
+        return OK;
+    }
+
+    Status
+    set(const char* key, size_t keyLength, const char* value,
+        size_t valueLength, uint32_t ttl)
+    {
+        return toStatus(memcached_set(memc, key, keyLength, value,
+                                      valueLength, (time_t)ttl, (uint32_t)0));
+    }
+
+    Status
+    remove(const char* key, size_t keyLength)
+    {
+        return toStatus(memcached_delete(memc, key, keyLength, (time_t)0));
+    }
+
+    Status
+    touch(const char* key, size_t keyLength, uint32_t ttl)
+    {
+        return toStatus(memcached_touch(memc, key, keyLength, (time_t)ttl));
+    }
+
+    /**
+     * memcached_get() never asks for CAS tokens, so fetch the key with
+     * memcached_mget() with CAS support switched on just for this call; left
+     * on, every GET of the replay would go out as "gets".
+     */
+    Status
+    gets(const char* key, size_t keyLength, size_t* valueLength,
+         uint64_t* cas)
+    {
+        memcached_behavior_set(memc, MEMCACHED_BEHAVIOR_SUPPORT_CAS, 1);
+        memcached_return rc = memcached_mget(memc, &key, &keyLength, 1);
+        Status status = MISS;
+        if (rc != MEMCACHED_SUCCESS) {
+            status = toStatus(rc);
+        } else {
+            memcached_result_st* result;
+            while ((result = memcached_fetch_result(memc, NULL, &rc)) !=
+                   NULL) {
+                *valueLength = memcached_result_length(result);
+                *cas = memcached_result_cas(result);
+                status = OK;
+                memcached_result_free(result);
+            }
+            if (status == MISS && !fetchedAll(rc))
+                status = ERROR;
+        }
+        memcached_behavior_set(memc, MEMCACHED_BEHAVIOR_SUPPORT_CAS, 0);
+        return status;
+    }
+
+    Status
+    cas(const char* key, size_t keyLength, const char* value,
+        size_t valueLength, uint32_t ttl, uint64_t cas)
+    {
+        memcached_return rc = memcached_cas(memc, key, keyLength, value,
+                                            valueLength, (time_t)ttl,
+                                            (uint32_t)0, cas);
+        return rc == MEMCACHED_DATA_EXISTS ? EXISTS : toStatus(rc);
+    }
+
+    Status
+    append(const char* key, size_t keyLength, const char* value,
+           size_t valueLength, bool prepend)
+    {
+        memcached_return rc =
+            prepend ? memcached_prepend(memc, key, keyLength, value,
+                                        valueLength, (time_t)0, (uint32_t)0)
+                    : memcached_append(memc, key, keyLength, value,
+                                       valueLength, (time_t)0, (uint32_t)0);
+        return rc == MEMCACHED_NOTSTORED ? MISS : toStatus(rc);
+    }
+
+    /**
+     * memcached takes 32-bit amounts; anything larger is clamped. The text
+     * protocol's CLIENT_ERROR is what a non-numeric value gets back.
+     */
+    Status
+    incr(const char* key, size_t keyLength, uint64_t amount, bool decrement,
+         uint64_t* counter)
+    {
+        uint32_t offset = uint32_t(std::min<uint64_t>(amount, UINT32_MAX));
+        memcached_return rc =
+            decrement ? memcached_decrement(memc, key, keyLength, offset,
+                                            counter)
+                      : memcached_increment(memc, key, keyLength, offset,
+                                            counter);
+        return rc == MEMCACHED_CLIENT_ERROR ? NON_NUMERIC : toStatus(rc);
+    }
+
+    /**
+     * Fetch all the GETs with one memcached_mget(); results come back in
+     * whatever order the servers answer, so match them up by key.
+     */
+    void
+    multiGet(Request* requests, size_t count)
+    {
+        keyPtrs.clear();
+        keyLengths.clear();
+        for (size_t i = 0; i < count; i++) {
+            if (requests[i].type != Request::GET)
+                continue;
+            requests[i].status = MISS;
+            keyPtrs.push_back(requests[i].key);
+            keyLengths.push_back(requests[i].keyLength);
+        }
+        if (keyPtrs.empty())
+            return;
+
+        memcached_return rc = memcached_mget(memc, keyPtrs.data(),
+                                             keyLengths.data(),
+                                             keyPtrs.size());
+        if (rc != MEMCACHED_SUCCESS) {
+            lastError = rc;
+            for (size_t i = 0; i < count; i++) {
+                if (requests[i].type == Request::GET)
+                    requests[i].status = ERROR;
+            }
+            return;
+        }
+
+        memcached_result_st* result;
+        while ((result = memcached_fetch_result(memc, NULL, &rc)) != NULL) {
+            const char* key = memcached_result_key_value(result);
+            const size_t keyLength = memcached_result_key_length(result);
+            for (size_t i = 0; i < count; i++) {
+                Request& r = requests[i];
+                if (r.type == Request::GET && r.status == MISS &&
+                    r.keyLength == keyLength &&
+                    memcmp(r.key, key, keyLength) == 0) {
+                    r.status = OK;
+                    r.valueLength = memcached_result_length(result);
+                    if (r.data != NULL) {
+                        r.data->assign(memcached_result_value(result),
+                                       r.valueLength);
+                    }
+                    break;
+                }
+            }
+            memcached_result_free(result);
+        }
+
+        // A GET the servers never answered didn't miss.
+        if (!fetchedAll(rc)) {
+            for (size_t i = 0; i < count; i++) {
+                if (requests[i].type == Request::GET &&
+                    requests[i].status == MISS) {
+                    requests[i].status = ERROR;
+                }
+            }
+        }
+    }
+
+    void
+    submit(Request* requests, size_t count)
+    {
+        size_t start = 0;
+        while (start < count) {
+            Request::Type type = requests[start].type;
+            size_t end = start + 1;
+            while (end < count && requests[end].type == type)
+                end++;
+            if (end - start > 1 && type == Request::GET)
+                multiGet(requests + start, end - start);
+            else if (end - start > 1 && type == Request::SET && quietSets)
+                setQuietly(requests + start, end - start);
+            else
+                KVBackend::submit(requests + start, end - start);
+            start = end;
+        }
+    }
+
+    bool
+    serverStats(ServerStats* sum)
+    {
+        memcached_return rc;
+        memcached_stat_st* stats = memcached_stat(memc, NULL, &rc);
+        if (stats == NULL)
+            return false;
+
+        *sum = ServerStats{};
+        uint32_t nServers = memcached_server_count(memc);
+        for (uint32_t i = 0; i < nServers; i++) {
+            sum->evictions += stats[i].evictions;
+            sum->getHits += stats[i].get_hits;
+            sum->cmdGet += stats[i].cmd_get;
+            sum->bytes += stats[i].bytes;
+            sum->currItems += stats[i].curr_items;
+            sum->cpuSeconds += (double)(stats[i].rusage_user_seconds +
+                                        stats[i].rusage_system_seconds) +
+                               (double)(stats[i].rusage_user_microseconds +
+                                        stats[i].rusage_system_microseconds)
+                               / 1e6;
+        }
+        memcached_stat_free(memc, stats);
+
+        // A server that didn't answer left its counters zeroed; summing
+        // them anyway would make the next interval's deltas go backwards.
+        return rc == MEMCACHED_SUCCESS;
+    }
+
+    const char*
+    errorString()
+    {
+        return memcached_strerror(memc, lastError);
+    }
+
+  private:
+    /**
+     * Return true if #rc, as memcached_fetch_result() left it after the
+     * last result, means every server finished answering; otherwise note
+     * it as the last error.
+     */
+    bool
+    fetchedAll(memcached_return rc)
+    {
+        if (rc == MEMCACHED_END || rc == MEMCACHED_SUCCESS ||
+            rc == MEMCACHED_NOTFOUND) {
+            return true;
+        }
+        lastError = rc;
+        return false;
+    }
+
+    /**
+     * Buffer #requests, all SETs, with noreply and send them in one
+     * flush. Each one is OK unless it couldn't be queued or the flush failed.
+     */
+    void
+    setQuietly(Request* requests, size_t count)
+    {
+        memcached_behavior_set(memc, MEMCACHED_BEHAVIOR_BUFFER_REQUESTS, 1);
+        memcached_behavior_set(memc, MEMCACHED_BEHAVIOR_NOREPLY, 1);
+        for (size_t i = 0; i < count; i++) {
+            Request& r = requests[i];
+            memcached_return rc = memcached_set(memc, r.key, r.keyLength,
+                                                r.value, r.valueLength,
+                                                (time_t)r.ttl, (uint32_t)0);
+            r.status = rc == MEMCACHED_BUFFERED ? OK : toStatus(rc);
+        }
+        memcached_return rc = memcached_flush_buffers(memc);
+        memcached_behavior_set(memc, MEMCACHED_BEHAVIOR_NOREPLY, 0);
+        memcached_behavior_set(memc, MEMCACHED_BEHAVIOR_BUFFER_REQUESTS, 0);
+        if (rc != MEMCACHED_SUCCESS) {
+            lastError = rc;
+            for (size_t i = 0; i < count; i++)
+                requests[i].status = ERROR;
+        }
+    }
+
+    Status
+    toStatus(memcached_return rc)
+    {
+        if (rc == MEMCACHED_SUCCESS)
+            return OK;
+        if (rc == MEMCACHED_NOTFOUND)
+            return MISS;
+        lastError = rc;
+        return ERROR;
+    }
+
+    memcached_st* memc;
+    memcached_return lastError;
+
+    /// Whether runs of SETs in a batch go out buffered with noreply.
+    const bool quietSets;
+
+    std::vector<const char*> keyPtrs;
+    std::vector<size_t> keyLengths;
+};
+
+class MemcachedFactory : public KVBackendFactory {
+  public:
+    explicit MemcachedFactory(const BackendConfig& config)
+        : config(config)
+    {
+    }
+
+    std::unique_ptr<KVBackend>
+    connect()
+    {
+        return std::unique_ptr<KVBackend>(new MemcachedBackend(config));
+    }
+
+  private:
+    const BackendConfig config;
+};
+
+KVBackendRegistry::Registration memcachedBackend{
+    "memcached",
+    "libmemcached client over the memcached protocol (-o binary=1 for the "
+    "binary protocol); with -B, runs of GETs go out as one mget (-o "
+    "noreply=1 to send runs of SETs buffered, without replies)",
+    [](const BackendConfig& config) {
+        return std::unique_ptr<KVBackendFactory>(new MemcachedFactory(config));
+    }};
+
+} // anonymous namespace
@@ -0,0 +1,223 @@
+#include <stdlib.h>
+
+#include <algorithm>
+#include <mutex>
+
+#include "Cycles.h"
+#include "NearCache.h"
+
+/**
+ * Parse #spec, ENTRIES or ENTRIES:TTL with the TTL in seconds, and size
+ * the shards to match. Exits if it is malformed.
+ */
+NearCache::NearCache(const char* spec)
+    : entries(0)
+    , ttlSeconds(0)
+    , windowSize(0)
+    , mainSize(0)
+    , protectedSize(0)
+    , sketchMask(0)
+    , sketchPeriod(0)
+    , shards()
+{
+    char* end;
+    entries = strtoull(spec, &end, 10);
+    if (*end == ':')
+        ttlSeconds = strtod(end + 1, &end);
+    if (end == spec || *end != '\0' || entries == 0 || ttlSeconds < 0) {
+        fprintf(stderr, "bad near cache %s (ENTRIES or ENTRIES:TTL)\n",
+                spec);
+        exit(1);
+    }
+
+    size_t perShard = std::max<uint64_t>((entries + N_SHARDS - 1) / N_SHARDS,
+                                         2);
+    windowSize = std::max<size_t>(perShard / 100, 1);
+    mainSize = perShard - windowSize;
+    protectedSize = mainSize * 4 / 5;
+    uint64_t width = 16;
+    while (width < perShard)
+        width *= 2;
+    sketchMask = width - 1;
+    sketchPeriod = 10 * perShard;
+    for (Shard& shard : shards) {
+        shard.lock.v_ = 0;
+        shard.sketch.resize(SKETCH_ROWS * width);
+    }
+}
+
+/**
+ * Look up a GET of #keyHash. Returns true if the cache holds the value,
+ * which becomes the most recently used in its segment.
+ */
+bool
+NearCache::get(uint64_t keyHash)
+{
+    Shard& shard = shardFor(keyHash);
+    std::lock_guard<SpinLock> _(shard.lock);
+    countRead(shard, keyHash);
+    auto found = shard.index.find(keyHash);
+    if (found == shard.index.end()) {
+        shard.misses++;
+        return false;
+    }
+    Lru::iterator it = found->second;
+    if (it->deadline != 0 && RAMCloud::Cycles::rdtsc() >= it->deadline) {
+        remove(shard, it);
+        shard.expired++;
+        shard.misses++;
+        return false;
+    }
+
+    // A second read of a key on probation makes it protected; if that
+    // crowds the protected segment, its least recent key goes back.
+    Region region = it->region == PROBATION ? PROTECTED : it->region;
+    move(shard, it, region);
+    if (shard.regions[PROTECTED].size() > protectedSize) {
+        move(shard, std::prev(shard.regions[PROTECTED].end()), PROBATION);
+    }
+    shard.hits++;
+    return true;
+}
+
+/**
+ * Keep the value of #keyHash the application just read, which the store
+ * holds for #ttl seconds (0 for never), if it wins admission.
+ */
+void
+NearCache::fill(uint64_t keyHash, uint32_t ttl)
+{
+    double seconds = ttlSeconds;
+    if (ttl != 0 && (seconds == 0 || ttl < seconds))
+        seconds = ttl;
+    uint64_t deadline = seconds == 0 ? 0
+        : RAMCloud::Cycles::rdtsc() + RAMCloud::Cycles::fromSeconds(seconds);
+
+    Shard& shard = shardFor(keyHash);
+    std::lock_guard<SpinLock> _(shard.lock);
+    auto found = shard.index.find(keyHash);
+    if (found != shard.index.end()) {
+        found->second->deadline = deadline;
+        return;
+    }
+    Lru& window = shard.regions[WINDOW];
+    window.push_front({keyHash, deadline, WINDOW});
+    shard.index[keyHash] = window.begin();
+    if (window.size() <= windowSize)
+        return;
+
+    // The window's least recent key is a candidate for the main segments.
+    Lru::iterator candidate = std::prev(window.end());
+    Lru& probation = shard.regions[PROBATION];
+    Lru& protect = shard.regions[PROTECTED];
+    if (probation.size() + protect.size() < mainSize) {
+        move(shard, candidate, PROBATION);
+        shard.admitted++;
+        return;
+    }
+    Lru::iterator victim = probation.empty() ? std::prev(protect.end())
+                                             : std::prev(probation.end());
+    if (frequency(shard, candidate->keyHash) >
+            frequency(shard, victim->keyHash)) {
+        remove(shard, victim);
+        move(shard, candidate, PROBATION);
+        shard.admitted++;
+        shard.evicted++;
+    } else {
+        remove(shard, candidate);
+        shard.rejected++;
+    }
+}
+
+/// Drop any copy of #keyHash, because this process just wrote the key.
+void
+NearCache::invalidate(uint64_t keyHash)
+{
+    Shard& shard = shardFor(keyHash);
+    std::lock_guard<SpinLock> _(shard.lock);
+    auto found = shard.index.find(keyHash);
+    if (found == shard.index.end())
+        return;
+    remove(shard, found->second);
+    shard.invalidated++;
+}
+
+/**
+ * Print how the cache did, and the share of the #ops the replay issued
+ * that still went to the store.
+ */
+void
+NearCache::print(FILE* out, uint64_t ops) const
+{
+    Shard total{};
+    for (const Shard& shard : shards) {
+        total.hits += shard.hits;
+        total.misses += shard.misses;
+        total.admitted += shard.admitted;
+        total.rejected += shard.rejected;
+        total.evicted += shard.evicted;
+        total.invalidated += shard.invalidated;
+        total.expired += shard.expired;
+    }
+    uint64_t gets = total.hits + total.misses;
+    fprintf(out, "# near cache: %lu entries, W-TinyLFU, TTL %g s: %lu hits "
+            "of %lu gets (%.3f%%)   %lu admitted   %lu rejected   "
+            "%lu evicted   %lu invalidated   %lu expired\n", entries,
+            ttlSeconds, total.hits, gets,
+            gets > 0 ? (double)total.hits / (double)gets * 100 : 0.0,
+            total.admitted, total.rejected, total.evicted,
+            total.invalidated, total.expired);
+    uint64_t served = std::min(total.hits, ops);
+    fprintf(out, "# near cache: the store saw %lu of %lu operations "
+            "(%.3f%%)\n", ops - served, ops,
+            ops > 0 ? (double)(ops - served) / (double)ops * 100 : 0.0);
+}
+
+/// Count a read of #keyHash in the frequency sketch.
+void
+NearCache::countRead(Shard& shard, uint64_t keyHash)
+{
+    uint64_t h = keyHash;
+    for (int row = 0; row < SKETCH_ROWS; row++) {
+        h = h * 0x9e3779b97f4a7c15UL + row;
+        uint8_t& counter =
+            shard.sketch[row * (sketchMask + 1) + ((h >> 32) & sketchMask)];
+        if (counter < 15)
+            counter++;
+    }
+    if (++shard.sketchReads >= sketchPeriod) {
+        for (uint8_t& counter : shard.sketch)
+            counter >>= 1;
+        shard.sketchReads /= 2;
+    }
+}
+
+/// Estimated reads of #keyHash: the least of its counters.
+uint32_t
+NearCache::frequency(const Shard& shard, uint64_t keyHash) const
+{
+    uint32_t least = 15;
+    uint64_t h = keyHash;
+    for (int row = 0; row < SKETCH_ROWS; row++) {
+        h = h * 0x9e3779b97f4a7c15UL + row;
+        least = std::min<uint32_t>(least,
+            shard.sketch[row * (sketchMask + 1) + ((h >> 32) & sketchMask)]);
+    }
+    return least;
+}
+
+void
+NearCache::remove(Shard& shard, Lru::iterator it)
+{
+    shard.index.erase(it->keyHash);
+    shard.regions[it->region].erase(it);
+}
+
+/// Make #it the most recently used entry of region #to.
+void
+NearCache::move(Shard& shard, Lru::iterator it, Region to)
+{
+    shard.regions[to].splice(shard.regions[to].begin(),
+                             shard.regions[it->region], it);
+    it->region = to;
+}
@@ -0,0 +1,109 @@
+#ifndef NEARCACHE_H_
+#define NEARCACHE_H_
+
+#include <cstdint>
+#include <cstdio>
+#include <list>
+#include <unordered_map>
+#include <vector>
+
+#include <boost/smart_ptr/detail/spinlock.hpp>
+
+/**
+ * A small cache in the client process, in front of the store (-n), as an
+ * application tier would keep: a GET it holds never reaches the store.
+ * Values are remembered by key hash alone, since the replay never looks at
+ * their contents.
+ *
+ * Admission and eviction follow W-TinyLFU (Einziger et al., "TinyLFU: A
+ * Highly Efficient Cache Admission Policy"): new keys enter a small LRU
+ * window (1% of the entries); a key the window evicts joins the main
+ * segmented LRU only if TinyLFU's frequency sketch says it is read more
+ * often than the key it would displace there. The sketch is a count-min
+ * sketch of 4-bit counters, halved every 10 reads per entry so old
+ * popularity fades.
+ *
+ * An entry lives at most the cache's TTL (0 for no limit) and no longer
+ * than the value it copies; a write by this process to the key removes
+ * it. Writes by other processes are not seen, as in a real near cache.
+ * The cache is split into independently locked shards that any worker
+ * may use.
+ */
+class NearCache {
+  public:
+    explicit NearCache(const char* spec);
+
+    bool get(uint64_t keyHash);
+    void fill(uint64_t keyHash, uint32_t ttl);
+    void invalidate(uint64_t keyHash);
+    void print(FILE* out, uint64_t ops) const;
+
+  private:
+    typedef boost::detail::spinlock SpinLock;
+
+    static const int N_SHARDS = 16;
+    static const int SKETCH_ROWS = 4;
+
+    enum Region {
+        WINDOW,
+        PROBATION,
+        PROTECTED
+    };
+
+    struct Entry {
+        uint64_t keyHash;
+
+        /// Cycles::rdtsc() at which the entry expires, or 0 for never.
+        uint64_t deadline;
+        Region region;
+    };
+
+    /// Most recently used first.
+    typedef std::list<Entry> Lru;
+
+    struct Shard {
+        SpinLock lock;
+        std::unordered_map<uint64_t, Lru::iterator> index;
+        Lru regions[3];
+
+        /// SKETCH_ROWS rows of counters, each sketchMask + 1 wide.
+        std::vector<uint8_t> sketch;
+
+        /// Reads counted in the sketch since it was last halved.
+        uint64_t sketchReads;
+
+        uint64_t hits;
+        uint64_t misses;
+        uint64_t admitted;
+        uint64_t rejected;
+        uint64_t evicted;
+        uint64_t invalidated;
+        uint64_t expired;
+    };
+
+    Shard&
+    shardFor(uint64_t keyHash)
+    {
+        return shards[keyHash >> 60];
+    }
+
+    void countRead(Shard& shard, uint64_t keyHash);
+    uint32_t frequency(const Shard& shard, uint64_t keyHash) const;
+    void remove(Shard& shard, Lru::iterator it);
+    void move(Shard& shard, Lru::iterator it, Region to);
+
+    uint64_t entries;
+    double ttlSeconds;
+
+    /// Per shard: entries in the window, in the main segments together,
+    /// and in the protected segment.
+    size_t windowSize;
+    size_t mainSize;
+    size_t protectedSize;
+    uint64_t sketchMask;
+    uint64_t sketchPeriod;
+
+    Shard shards[N_SHARDS];
+};
+
+#endif /* !NEARCACHE_H_ */
@@ -0,0 +1,209 @@
+#include "ProcessGroup.h"
+
+#include <errno.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <new>
+
+/**
+ * Map the shared segment, with #slotBytes of zeroed memory per process.
+ */
+ProcessGroup::ProcessGroup(int nProcesses, size_t slotBytes)
+    : nProcesses(nProcesses)
+    , slotBytes((slotBytes + 63) & ~size_t(63))
+    , segmentBytes(0)
+    , header(NULL)
+    , slots(NULL)
+    , children()
+    , coordinator(0)
+{
+    segmentBytes = 64 + this->slotBytes * nProcesses;
+    void* segment = mmap(NULL, segmentBytes, PROT_READ | PROT_WRITE,
+                         MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (segment == MAP_FAILED) {
+        fprintf(stderr, "couldn't map %lu bytes of shared memory: %s\n",
+                segmentBytes, strerror(errno));
+        exit(1);
+    }
+    header = new(segment) Header();
+    header->arrived = 0;
+    header->announced = false;
+    header->announcedValue = 0;
+    slots = static_cast<char*>(segment) + 64;
+}
+
+ProcessGroup::~ProcessGroup()
+{
+    munmap(header, segmentBytes);
+}
+
+/**
+ * Fork the children, each pinned to its share of the CPUs.
+ *
+ * \return
+ *      In a child, its index in [0, size()); in the coordinator, -1.
+ */
+int
+ProcessGroup::start()
+{
+    // Anything still buffered would otherwise be printed once per child.
+    fflush(stdout);
+    fflush(stderr);
+
+    coordinator = getpid();
+    for (int i = 0; i < nProcesses; i++) {
+        pid_t pid = fork();
+        if (pid < 0) {
+            fprintf(stderr, "couldn't fork: %s\n", strerror(errno));
+            for (pid_t child : children)
+                kill(child, SIGTERM);
+            exit(1);
+        }
+        if (pid == 0) {
+            children.clear();
+            pin(i);
+            return i;
+        }
+        children.push_back(pid);
+    }
+    return -1;
+}
+
+/**
+ * Restrict the calling process to the #index'th of size() equal, contiguous
+ * shares of the CPUs it is allowed to run on, so processes stay apart and
+ * neighbouring CPUs (usually on the same node) go to the same process. With
+ * fewer CPUs than processes, processes share them round robin.
+ */
+void
+ProcessGroup::pin(int index)
+{
+    cpu_set_t allowed;
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0)
+        return;
+    std::vector<int> cpus;
+    for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+        if (CPU_ISSET(cpu, &allowed))
+            cpus.push_back(cpu);
+    }
+    if (cpus.empty())
+        return;
+
+    cpu_set_t mine;
+    CPU_ZERO(&mine);
+    size_t n = cpus.size();
+    if (n < size_t(nProcesses)) {
+        CPU_SET(cpus[index % n], &mine);
+    } else {
+        for (size_t i = index * n / nProcesses;
+             i < (index + 1) * n / nProcesses; i++) {
+            CPU_SET(cpus[i], &mine);
+        }
+    }
+    if (sched_setaffinity(0, sizeof(mine), &mine) != 0) {
+        fprintf(stderr, "couldn't pin process %d: %s\n", index,
+                strerror(errno));
+    }
+}
+
+/**
+ * Called once by each child; returns when every child has called it.
+ */
+void
+ProcessGroup::barrier()
+{
+    header->arrived.fetch_add(1);
+    while (header->arrived.load() < nProcesses) {
+        checkCoordinator();
+        usleep(50);
+    }
+}
+
+/**
+ * Called by the coordinator to hand every child #value, which they pick up
+ * with announcement().
+ */
+void
+ProcessGroup::announce(int64_t value)
+{
+    header->announcedValue.store(value);
+    header->announced.store(true);
+}
+
+/**
+ * Called by a child; waits for the coordinator's announce() and returns the
+ * value it gave.
+ */
+int64_t
+ProcessGroup::announcement()
+{
+    while (!header->announced.load()) {
+        checkCoordinator();
+        usleep(50);
+    }
+    return header->announcedValue.load();
+}
+
+/**
+ * Exit from a child whose coordinator has gone, rather than wait forever
+ * for something it will now never do.
+ */
+void
+ProcessGroup::checkCoordinator()
+{
+    if (getppid() != coordinator) {
+        fprintf(stderr, "coordinator %d exited; stopping\n", coordinator);
+        exit(1);
+    }
+}
+
+/**
+ * Called by the coordinator to wait for every child to exit. If one fails,
+ * the others are killed (they may be waiting for it in barrier()) and the
+ * coordinator exits too.
+ */
+void
+ProcessGroup::wait()
+{
+    size_t remaining = children.size();
+    bool failed = false;
+    while (remaining > 0) {
+        int status;
+        pid_t pid = waitpid(-1, &status, 0);
+        if (pid < 0) {
+            if (errno == EINTR)
+                continue;
+            fprintf(stderr, "waitpid failed: %s\n", strerror(errno));
+            exit(1);
+        }
+        bool known = false;
+        for (pid_t& child : children) {
+            if (child == pid) {
+                child = 0;
+                known = true;
+            }
+        }
+        if (!known)
+            continue;
+        remaining--;
+        if (WIFEXITED(status) && WEXITSTATUS(status) == 0)
+            continue;
+        if (!failed) {
+            fprintf(stderr, "process %d failed; stopping the others\n", pid);
+            for (pid_t child : children) {
+                if (child != 0)
+                    kill(child, SIGTERM);
+            }
+        }
+        failed = true;
+    }
+    if (failed)
+        exit(1);
+}
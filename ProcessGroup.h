@@ -0,0 +1,80 @@
+#ifndef PROCESSGROUP_H_
+#define PROCESSGROUP_H_
+
+#include <sys/types.h>
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+/**
+ * Forks a group of worker processes that each drive part of the load and
+ * report back through shared memory, for going past the point where one
+ * client process is limited by its own locks, allocator or NUMA placement.
+ *
+ * The coordinator creates the group, which maps a shared segment with one
+ * fixed-size slot per process, then calls start(). Each child gets its own
+ * share of the CPUs the coordinator may run on, prepares whatever it needs,
+ * waits in barrier() so that they all begin together, and writes its results
+ * into its slot before exiting. The coordinator waits for them all in
+ * wait() and then reads the slots; if any child fails, the rest are killed.
+ *
+ * Threads do not survive fork(), so start() must be called before anything
+ * the children need starts threads of its own. Something the coordinator
+ * starts afterwards for the children to use (such as a server) can hand
+ * them a number, say its port, with announce(); they wait for it in
+ * announcement().
+ */
+class ProcessGroup {
+  public:
+    ProcessGroup(int nProcesses, size_t slotBytes);
+    ~ProcessGroup();
+
+    int start();
+    void barrier();
+    void wait();
+    void announce(int64_t value);
+    int64_t announcement();
+
+    /// Shared memory for process #index's results.
+    void*
+    slot(int index)
+    {
+        return slots + index * slotBytes;
+    }
+
+    int
+    size() const
+    {
+        return nProcesses;
+    }
+
+  private:
+    /// Start of the shared segment; slots follow it.
+    struct Header {
+        std::atomic<int> arrived;
+
+        /// Set once the coordinator has called announce().
+        std::atomic<bool> announced;
+        std::atomic<int64_t> announcedValue;
+    };
+
+    void pin(int index);
+    void checkCoordinator();
+
+    const int nProcesses;
+    const size_t slotBytes;
+    size_t segmentBytes;
+    Header* header;
+    char* slots;
+    std::vector<pid_t> children;
+
+    /// The process that called start().
+    pid_t coordinator;
+
+    ProcessGroup(const ProcessGroup&) = delete;
+    ProcessGroup& operator=(const ProcessGroup&) = delete;
+};
+
+#endif /* !PROCESSGROUP_H_ */
@@ -0,0 +1,628 @@
+#include "KVBackend.h"
+#include "TraceParser.h"
+
+#include <algorithm>
+
+#include <errno.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+namespace {
+
+/**
+ * One blocking connection to a Redis server: commands are appended to an
+ * output buffer and sent together by flush(), then their replies are read
+ * back one at a time, which is all pipelining needs.
+ */
+class RespConnection {
+  public:
+    /// One reply. Strings point into the connection's buffer and are only
+    /// valid until the next readReply().
+    struct Reply {
+        /// '+', '-', ':', '$' or '*', as on the wire.
+        char type;
+        bool nil;
+        int64_t integer;
+        const char* str;
+        size_t length;
+    };
+
+    RespConnection(const std::string& host, int port)
+        : fd(-1)
+        , out()
+        , in()
+        , inPos(0)
+    {
+        if (port == 0) {
+            sockaddr_un addr = {};
+            addr.sun_family = AF_UNIX;
+            strncpy(addr.sun_path, host.c_str(), sizeof(addr.sun_path) - 1);
+            fd = socket(AF_UNIX, SOCK_STREAM, 0);
+            if (fd < 0 || ::connect(fd, reinterpret_cast<sockaddr*>(&addr),
+                                    sizeof(addr)) != 0) {
+                fprintf(stderr, "couldn't connect to redis at %s: %s\n",
+                        host.c_str(), strerror(errno));
+                exit(1);
+            }
+            return;
+        }
+
+        addrinfo hints = {};
+        hints.ai_family = AF_UNSPEC;
+        hints.ai_socktype = SOCK_STREAM;
+        addrinfo* result;
+        std::string service = std::to_string(port);
+        int rc = getaddrinfo(host.c_str(), service.c_str(), &hints, &result);
+        if (rc != 0) {
+            fprintf(stderr, "couldn't resolve %s: %s\n", host.c_str(),
+                    gai_strerror(rc));
+            exit(1);
+        }
+        for (addrinfo* ai = result; ai != NULL && fd < 0; ai = ai->ai_next) {
+            fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+            if (fd >= 0 && ::connect(fd, ai->ai_addr, ai->ai_addrlen) != 0) {
+                close(fd);
+                fd = -1;
+            }
+        }
+        freeaddrinfo(result);
+        if (fd < 0) {
+            fprintf(stderr, "couldn't connect to redis at %s:%d: %s\n",
+                    host.c_str(), port, strerror(errno));
+            exit(1);
+        }
+        int one = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    }
+
+    ~RespConnection()
+    {
+        close(fd);
+    }
+
+    /// Queue a command made of #count bulk strings.
+    void
+    append(const char* const* args, const size_t* lengths, int count)
+    {
+        out += '*';
+        out += std::to_string(count);
+        out += "\r\n";
+        for (int i = 0; i < count; i++) {
+            out += '$';
+            out += std::to_string(lengths[i]);
+            out += "\r\n";
+            out.append(args[i], lengths[i]);
+            out += "\r\n";
+        }
+    }
+
+    /// Send everything queued by append().
+    void
+    flush()
+    {
+        size_t sent = 0;
+        while (sent < out.size()) {
+            ssize_t n = write(fd, out.data() + sent, out.size() - sent);
+            if (n < 0 && errno == EINTR)
+                continue;
+            if (n < 0) {
+                fprintf(stderr, "redis write failed: %s\n", strerror(errno));
+                exit(1);
+            }
+            sent += n;
+        }
+        out.clear();
+    }
+
+    Reply
+    readReply()
+    {
+        // Drop the replies the caller has finished with.
+        if (inPos == in.size()) {
+            in.clear();
+            inPos = 0;
+        } else if (inPos > 1024 * 1024) {
+            in.erase(0, inPos);
+            inPos = 0;
+        }
+        return parse();
+    }
+
+  private:
+    /// Make sure at least #length unread bytes are buffered.
+    void
+    need(size_t length)
+    {
+        while (in.size() - inPos < length) {
+            char buf[64 * 1024];
+            ssize_t n = read(fd, buf, sizeof(buf));
+            if (n < 0 && errno == EINTR)
+                continue;
+            if (n <= 0) {
+                fprintf(stderr, "redis connection lost: %s\n",
+                        n == 0 ? "closed by server" : strerror(errno));
+                exit(1);
+            }
+            in.append(buf, n);
+        }
+    }
+
+    /// Return the offset of the next "\r\n"-terminated line's end.
+    size_t
+    lineEnd()
+    {
+        size_t searched = inPos;
+        while (true) {
+            size_t crlf = in.find("\r\n", searched);
+            if (crlf != std::string::npos)
+                return crlf;
+            searched = in.size() > 0 ? in.size() - 1 : 0;
+            need(in.size() - inPos + 1);
+        }
+    }
+
+    Reply
+    parse()
+    {
+        Reply reply = {};
+        size_t end = lineEnd();
+        reply.type = in[inPos];
+        const size_t start = inPos + 1;
+        inPos = end + 2;
+
+        switch (reply.type) {
+        case '+':
+        case '-':
+            reply.str = in.data() + start;
+            reply.length = end - start;
+            break;
+        case ':':
+            reply.integer = strtoll(in.data() + start, NULL, 10);
+            break;
+        case '$': {
+            int64_t length = strtoll(in.data() + start, NULL, 10);
+            if (length < 0) {
+                reply.nil = true;
+                break;
+            }
+            size_t bodyStart = inPos;
+            need(length + 2);
+            inPos += length + 2;
+            reply.str = in.data() + bodyStart;
+            reply.length = length;
+            break;
+        }
+        case '*': {
+            // Nothing we send expects an array back; read past it.
+            int64_t count = strtoll(in.data() + start, NULL, 10);
+            for (int64_t i = 0; i < count; i++)
+                parse();
+            reply.nil = count < 0;
+            break;
+        }
+        default:
+            fprintf(stderr, "bad redis reply type '%c'\n", reply.type);
+            exit(1);
+        }
+        return reply;
+    }
+
+    int fd;
+    std::string out;
+    std::string in;
+    size_t inPos;
+};
+
+/// The Redis Cluster key slot: CRC16 (XMODEM) of the key, or of the part
+/// in the first non-empty {hash tag}, modulo 16384.
+uint16_t
+keySlot(const char* key, size_t length)
+{
+    const char* open = static_cast<const char*>(memchr(key, '{', length));
+    if (open != NULL) {
+        const char* close = static_cast<const char*>(
+            memchr(open + 1, '}', key + length - (open + 1)));
+        if (close != NULL && close > open + 1) {
+            key = open + 1;
+            length = close - key;
+        }
+    }
+
+    uint16_t crc = 0;
+    for (size_t i = 0; i < length; i++) {
+        crc ^= uint16_t((unsigned char)key[i]) << 8;
+        for (int bit = 0; bit < 8; bit++)
+            crc = (crc & 0x8000) ? uint16_t((crc << 1) ^ 0x1021)
+                                 : uint16_t(crc << 1);
+    }
+    return crc & 16383;
+}
+
+const size_t N_SLOTS = 16384;
+
+/**
+ * A KVBackend speaking RESP to one or more Redis servers. READs become GET,
+ * writes SET and touches EXPIRE; batches from submit() are pipelined, up to
+ * "pipeline" commands per connection at a time. Redis has no CAS, and its
+ * APPEND and INCRBY create missing keys where memcached's fail, so those
+ * are left to KVBackend's emulations, one at a time between the pipelined
+ * runs. With several servers keys are spread by hash, or with "cluster=1"
+ * by Redis Cluster slot: the slots are split into equal contiguous ranges
+ * over the servers in the order given (the layout redis-cli gives a new
+ * cluster) and MOVED redirections update the map.
+ */
+class RedisBackend : public KVBackend {
+  public:
+    explicit RedisBackend(const BackendConfig& config)
+        : servers(config.servers)
+        , connections()
+        , cluster(config.getOption("cluster", 0) != 0)
+        , pipeline(std::max<uint64_t>(config.getOption("pipeline", 32), 1))
+        , slotOwner()
+        , lastError()
+        , runDepth()
+        , byConnection()
+        , moved()
+    {
+        for (auto& server : servers) {
+            connections.emplace_back(
+                new RespConnection(server.first, server.second));
+        }
+        if (cluster) {
+            slotOwner.resize(N_SLOTS);
+            for (size_t slot = 0; slot < N_SLOTS; slot++)
+                slotOwner[slot] = slot * servers.size() / N_SLOTS;
+        }
+        runDepth.resize(servers.size());
+        byConnection.resize(servers.size());
+    }
+
+    Status
+    get(const char* key, size_t keyLength, size_t* valueLength,
+        std::string* value)
+    {
+        Request request{Request::GET, key, keyLength, NULL, 0, OK};
+        execute(&request, 1, value);
+        *valueLength = request.valueLength;
+        return request.status;
+    }
+
+    Status
+    set(const char* key, size_t keyLength, const char* value,
+        size_t valueLength, uint32_t ttl)
+    {
+        Request request{Request::SET, key, keyLength, value, valueLength, OK,
+                        ttl};
+        execute(&request, 1, NULL);
+        return request.status;
+    }
+
+    Status
+    remove(const char* key, size_t keyLength)
+    {
+        Request request{Request::DELETE, key, keyLength, NULL, 0, OK};
+        execute(&request, 1, NULL);
+        return request.status;
+    }
+
+    void
+    multiGet(Request* requests, size_t count)
+    {
+        executeRuns(requests, count, true);
+    }
+
+    void
+    submit(Request* requests, size_t count)
+    {
+        executeRuns(requests, count, false);
+    }
+
+    bool
+    serverStats(ServerStats* sum)
+    {
+        *sum = ServerStats{};
+        static const char* info[] = {"INFO"};
+        static const size_t infoLength[] = {4};
+        for (auto& conn : connections) {
+            conn->append(info, infoLength, 1);
+            conn->flush();
+            RespConnection::Reply reply = conn->readReply();
+            if (reply.type != '$' || reply.nil)
+                return false;
+            std::string text(reply.str, reply.length);
+            addInfo(text, sum);
+        }
+        return true;
+    }
+
+    const char*
+    errorString()
+    {
+        return lastError.c_str();
+    }
+
+  private:
+    /// True if #request has a Redis command of its own (see appendCommand()).
+    /// PERSIST can't tell a missing key from one without a TTL, so touches
+    /// to TTL 0 are emulated too.
+    static bool
+    pipelined(const Request& request)
+    {
+        return request.type == Request::GET || request.type == Request::SET ||
+               request.type == Request::DELETE ||
+               (request.type == Request::TOUCH && request.ttl != 0);
+    }
+
+    /**
+     * Execute #requests in order as pipelined runs, each with at most
+     * #pipeline commands for any one connection. Requests without a Redis
+     * command are emulated one at a time between the runs; with #getsOnly
+     * (for multiGet()) everything but GETs is skipped instead.
+     */
+    void
+    executeRuns(Request* requests, size_t count, bool getsOnly)
+    {
+        size_t start = 0;
+        while (start < count) {
+            if (getsOnly && requests[start].type != Request::GET) {
+                start++;
+                continue;
+            }
+            if (!pipelined(requests[start])) {
+                KVBackend::submit(&requests[start++], 1);
+                continue;
+            }
+            std::fill(runDepth.begin(), runDepth.end(), 0);
+            size_t end = start;
+            while (end < count && pipelined(requests[end]) &&
+                   (!getsOnly || requests[end].type == Request::GET)) {
+                size_t c = connectionFor(requests[end].key,
+                                         requests[end].keyLength);
+                if (runDepth[c] == pipeline)
+                    break;
+                runDepth[c]++;
+                end++;
+            }
+            execute(requests + start, end - start, NULL);
+            start = end;
+        }
+    }
+
+    size_t
+    connectionFor(const char* key, size_t keyLength)
+    {
+        if (connections.size() == 1)
+            return 0;
+        if (cluster)
+            return slotOwner[keySlot(key, keyLength)];
+        return hashTraceKey(key, keyLength) % connections.size();
+    }
+
+    /**
+     * Send #requests (at most #pipeline per connection) and collect their
+     * replies; for a single GET, copy the value into #value if non-NULL
+     * (otherwise into each GET's data, if it asks).
+     */
+    void
+    execute(Request* requests, size_t count, std::string* value)
+    {
+        for (auto& indices : byConnection)
+            indices.clear();
+        for (size_t i = 0; i < count; i++) {
+            size_t c = connectionFor(requests[i].key, requests[i].keyLength);
+            appendCommand(*connections[c], requests[i]);
+            byConnection[c].push_back(i);
+        }
+
+        moved.clear();
+        for (size_t c = 0; c < connections.size(); c++) {
+            if (byConnection[c].empty())
+                continue;
+            connections[c]->flush();
+            for (size_t i : byConnection[c]) {
+                RespConnection::Reply reply = connections[c]->readReply();
+                if (!complete(requests[i], reply, value))
+                    moved.push_back(i);
+            }
+        }
+
+        // Retry redirected requests one at a time against their new owner.
+        for (size_t i : std::vector<size_t>(moved))
+            execute(&requests[i], 1, value);
+    }
+
+    void
+    appendCommand(RespConnection& conn, const Request& request)
+    {
+        static const char* names[] = {"GET", "SET", "DEL", "EXPIRE"};
+        char ttl[16];
+        const char* args[5] = {names[request.type], request.key,
+                               request.value, "EX", ttl};
+        size_t lengths[5] = {strlen(args[0]), request.keyLength,
+                             request.valueLength, 2, 0};
+        int nArgs = 2;
+        if (request.type == Request::SET) {
+            nArgs = 3;
+            if (request.ttl != 0) {
+                lengths[4] = snprintf(ttl, sizeof(ttl), "%u", request.ttl);
+                nArgs = 5;
+            }
+        } else if (request.type == Request::TOUCH) {
+            args[2] = ttl;
+            lengths[2] = snprintf(ttl, sizeof(ttl), "%u", request.ttl);
+            nArgs = 3;
+        }
+        conn.append(args, lengths, nArgs);
+    }
+
+    /**
+     * Fill in #request from #reply.
+     * \return
+     *      False if the server redirected the request elsewhere (the slot
+     *      map has been updated and the request should be sent again).
+     */
+    bool
+    complete(Request& request, const RespConnection::Reply& reply,
+             std::string* value)
+    {
+        if (reply.type == '-') {
+            std::string error(reply.str, reply.length);
+            if (cluster && error.compare(0, 6, "MOVED ") == 0 &&
+                redirect(error)) {
+                return false;
+            }
+            lastError = error;
+            request.status = ERROR;
+            return true;
+        }
+
+        switch (request.type) {
+        case Request::GET:
+            if (reply.type != '$') {
+                request.status = unexpected(reply);
+            } else if (reply.nil) {
+                request.status = MISS;
+            } else {
+                request.status = OK;
+                request.valueLength = reply.length;
+                std::string* copy = value != NULL ? value : request.data;
+                if (copy != NULL)
+                    copy->assign(reply.str, reply.length);
+            }
+            break;
+        case Request::SET:
+            request.status = reply.type == '+' ? OK : unexpected(reply);
+            break;
+        case Request::DELETE:
+        case Request::TOUCH:
+            if (reply.type != ':')
+                request.status = unexpected(reply);
+            else
+                request.status = reply.integer > 0 ? OK : MISS;
+            break;
+        default:
+            request.status = unexpected(reply);
+            break;
+        }
+        return true;
+    }
+
+    Status
+    unexpected(const RespConnection::Reply& reply)
+    {
+        lastError = std::string("unexpected reply type ") + reply.type;
+        return ERROR;
+    }
+
+    /// Handle "MOVED <slot> <host>:<port>"; false if the target is not one
+    /// of our servers.
+    bool
+    redirect(const std::string& error)
+    {
+        size_t slot = strtoul(error.c_str() + 6, NULL, 10);
+        size_t space = error.find(' ', 6);
+        size_t colon = error.rfind(':');
+        if (slot >= N_SLOTS || space == std::string::npos ||
+            colon == std::string::npos || colon < space) {
+            return false;
+        }
+        std::string host = error.substr(space + 1, colon - space - 1);
+        int port = atoi(error.c_str() + colon + 1);
+        for (size_t c = 0; c < servers.size(); c++) {
+            if (servers[c].second == port &&
+                (servers[c].first == host ||
+                 (host == "127.0.0.1" && servers[c].first == "localhost"))) {
+                slotOwner[slot] = c;
+                return true;
+            }
+        }
+        return false;
+    }
+
+    /// Add one server's INFO output to #sum.
+    static void
+    addInfo(const std::string& text, ServerStats* sum)
+    {
+        uint64_t hits = 0, misses = 0;
+        double cpu = 0;
+        size_t pos = 0;
+        while (pos < text.size()) {
+            size_t end = text.find("\r\n", pos);
+            if (end == std::string::npos)
+                end = text.size();
+            std::string line = text.substr(pos, end - pos);
+            pos = end + 2;
+
+            size_t colon = line.find(':');
+            if (colon == std::string::npos)
+                continue;
+            std::string name = line.substr(0, colon);
+            const char* value = line.c_str() + colon + 1;
+            if (name == "evicted_keys")
+                sum->evictions += strtoull(value, NULL, 10);
+            else if (name == "keyspace_hits")
+                hits = strtoull(value, NULL, 10);
+            else if (name == "keyspace_misses")
+                misses = strtoull(value, NULL, 10);
+            else if (name == "used_memory")
+                sum->bytes += strtoull(value, NULL, 10);
+            else if (name == "used_cpu_sys" || name == "used_cpu_user")
+                cpu += strtod(value, NULL);
+            else if (name.compare(0, 2, "db") == 0 &&
+                     strncmp(value, "keys=", 5) == 0)
+                sum->currItems += strtoull(value + 5, NULL, 10);
+        }
+        sum->getHits += hits;
+        sum->cmdGet += hits + misses;
+        sum->cpuSeconds += cpu;
+    }
+
+    const std::vector<std::pair<std::string, int>> servers;
+    std::vector<std::unique_ptr<RespConnection>> connections;
+    const bool cluster;
+    const size_t pipeline;
+
+    /// Cluster mode: index of the server holding each slot.
+    std::vector<size_t> slotOwner;
+    std::string lastError;
+
+    /// Scratch space for executeRuns() and execute().
+    std::vector<size_t> runDepth;
+    std::vector<std::vector<size_t>> byConnection;
+    std::vector<size_t> moved;
+};
+
+class RedisFactory : public KVBackendFactory {
+  public:
+    explicit RedisFactory(const BackendConfig& config)
+        : config(config)
+    {
+    }
+
+    std::unique_ptr<KVBackend>
+    connect()
+    {
+        return std::unique_ptr<KVBackend>(new RedisBackend(config));
+    }
+
+  private:
+    const BackendConfig config;
+};
+
+KVBackendRegistry::Registration redisBackend{
+    "redis",
+    "RESP client; GET/SET/DEL/EXPIRE pipelined up to -o pipeline=N "
+    "(default 32) per connection, -o cluster=1 for Redis Cluster slot "
+    "hashing",
+    [](const BackendConfig& config) {
+        return std::unique_ptr<KVBackendFactory>(new RedisFactory(config));
+    }};
+
+} // anonymous namespace
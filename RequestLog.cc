@@ -0,0 +1,184 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <chrono>
+
+#include "Cycles.h"
+#include "RequestLog.h"
+
+/**
+ * Create the log at #path and start its flusher.
+ *
+ * \param nWorkers
+ *      Workers will be numbered [0, nWorkers).
+ * \param sampleRate
+ *      Fraction of requests to log, in [0, 1].
+ * \param slowNs
+ *      Requests taking at least this long are always logged; 0 for no
+ *      threshold.
+ * \param ringRecords
+ *      Records each worker can have waiting for the flusher; rounded up to
+ *      a power of two.
+ */
+RequestLog::RequestLog(const char* path, int nWorkers, double sampleRate,
+                       uint64_t slowNs, size_t ringRecords)
+    : fd(-1)
+    , ringSize([ringRecords] {
+        size_t size = 1;
+        while (size < ringRecords)
+            size *= 2;
+        return size;
+    }())
+    , slowNs(slowNs == 0 ? UINT64_MAX : slowNs)
+    , sampleAll(sampleRate >= 1.0)
+    , sampleThreshold(sampleRate <= 0.0 || sampleRate >= 1.0
+                      ? 0 : uint64_t(sampleRate * 0x1p64))
+    , rings()
+    , buffer(WRITE_RECORDS)
+    , buffered(0)
+    , written(0)
+    , slowWritten(0)
+    , mutex()
+    , cond()
+    , quit(false)
+    , flusher()
+{
+    fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        fprintf(stderr, "couldn't create request log %s: %s\n", path,
+                strerror(errno));
+        exit(1);
+    }
+
+    FileHeader header{};
+    memcpy(header.magic, magic(), sizeof(header.magic));
+    header.version = VERSION;
+    header.recordSize = sizeof(Record);
+    header.cyclesPerSecond = RAMCloud::Cycles::perSecond();
+    header.startCycles = RAMCloud::Cycles::rdtsc();
+    header.sampleRate = sampleRate;
+    header.slowNs = slowNs;
+    if (write(fd, &header, sizeof(header)) != sizeof(header)) {
+        fprintf(stderr, "couldn't write request log %s: %s\n", path,
+                strerror(errno));
+        exit(1);
+    }
+
+    for (int i = 0; i < nWorkers; i++)
+        rings.emplace_back(new Ring(ringSize, header.startCycles + i));
+    flusher = std::thread(&RequestLog::flushThread, this);
+}
+
+RequestLog::~RequestLog()
+{
+    stop();
+    close(fd);
+}
+
+/**
+ * Write out everything the workers logged and stop the flusher. The workers
+ * must have stopped first.
+ */
+void
+RequestLog::stop()
+{
+    if (!flusher.joinable())
+        return;
+    {
+        std::lock_guard<std::mutex> _(mutex);
+        quit = true;
+    }
+    cond.notify_all();
+    flusher.join();
+}
+
+void
+RequestLog::printStats(FILE* out)
+{
+    uint64_t dropped = 0;
+    for (auto& ring : rings)
+        dropped += ring->dropped;
+    fprintf(out, "# request log: %lu records (%lu slow), %lu dropped with "
+            "full rings\n", written, slowWritten, dropped);
+}
+
+void
+RequestLog::flushThread()
+{
+    std::unique_lock<std::mutex> lock(mutex);
+    while (true) {
+        bool stopping = quit;
+        lock.unlock();
+
+        // Keep draining while the rings are busy; otherwise nap briefly.
+        while (drain() > 0) {
+        }
+        if (stopping) {
+            writeBuffer();
+            return;
+        }
+
+        lock.lock();
+        cond.wait_for(lock, std::chrono::milliseconds(10));
+    }
+}
+
+/**
+ * Move whatever the workers have logged into the write buffer, writing it
+ * out each time it fills.
+ *
+ * \return
+ *      The number of records moved.
+ */
+size_t
+RequestLog::drain()
+{
+    size_t moved = 0;
+    for (auto& ring : rings) {
+        uint64_t tail = ring->tail.load(std::memory_order_relaxed);
+        uint64_t head = ring->head.load(std::memory_order_acquire);
+        while (tail != head) {
+            if (buffered == buffer.size())
+                writeBuffer();
+            size_t n = std::min<uint64_t>(head - tail,
+                                          buffer.size() - buffered);
+            n = std::min<uint64_t>(n, ringSize - (tail & (ringSize - 1)));
+            memcpy(&buffer[buffered], &ring->records[tail & (ringSize - 1)],
+                   n * sizeof(Record));
+            for (size_t i = 0; i < n; i++) {
+                if (buffer[buffered + i].flags & SLOW)
+                    slowWritten++;
+            }
+            buffered += n;
+            tail += n;
+            moved += n;
+            ring->tail.store(tail, std::memory_order_release);
+        }
+    }
+    return moved;
+}
+
+void
+RequestLog::writeBuffer()
+{
+    const char* p = reinterpret_cast<const char*>(buffer.data());
+    size_t left = buffered * sizeof(Record);
+    while (left > 0) {
+        ssize_t n = write(fd, p, left);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0) {
+            fprintf(stderr, "couldn't write request log: %s\n",
+                    strerror(errno));
+            exit(1);
+        }
+        p += n;
+        left -= n;
+    }
+    written += buffered;
+    buffered = 0;
+}
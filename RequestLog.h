@@ -0,0 +1,215 @@
+#ifndef REQUESTLOG_H_
+#define REQUESTLOG_H_
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/**
+ * An optional binary log of individual requests, for finding out which
+ * keys, operations and workers were behind a latency spike.
+ *
+ * Each worker appends fixed-size records to its own single-producer ring
+ * without taking a lock; a background thread drains the rings into a large
+ * buffer and writes it out in big sequential writes. A worker never waits
+ * for the disk: if its ring is full the record is dropped and counted.
+ * Requests are logged at a sampling rate, and any request at least as slow
+ * as a threshold is logged regardless. ycsb_logdump turns the file into
+ * CSV.
+ *
+ * The file is a FileHeader followed by Records, in the machine's byte
+ * order; records from different workers are interleaved roughly in time.
+ */
+class RequestLog {
+  public:
+    /// First bytes of every request log, without a terminator.
+    static const char*
+    magic()
+    {
+        return "YCSBRLOG";
+    }
+    static const uint32_t VERSION = 1;
+
+    struct FileHeader {
+        char magic[8];
+        uint32_t version;
+        uint32_t recordSize;
+
+        /// For converting Record::start to time; start of the log.
+        double cyclesPerSecond;
+        uint64_t startCycles;
+
+        double sampleRate;
+
+        /// Slow-request threshold, or 0 if there was none.
+        uint64_t slowNs;
+    };
+
+    enum Op : uint8_t {
+        GET = 1,
+        SET = 2,
+        DELETE = 3,
+        TOUCH = 4,
+        CAS = 5,
+        APPEND = 6,
+        PREPEND = 7,
+        INCR = 8,
+        DECR = 9,
+        READMODIFYWRITE = 10
+    };
+
+    enum Result : uint8_t {
+        OK = 0,
+
+        /// A GET that missed and was refilled, or any other operation
+        /// that found no value.
+        MISS = 1,
+
+        /// A GET that found a value of the wrong length, or an INCR or DECR
+        /// one that was not a number, and replaced it.
+        REPLACED = 2,
+
+        /// A SET, or the refill after a GET, that the store refused; or any
+        /// other operation that failed.
+        FAILED = 3,
+
+        /// A CAS that found the value changed since it was read.
+        CONFLICT = 4
+    };
+    static const int N_RESULTS = 5;
+
+    enum Flags : uint8_t {
+        SAMPLED = 1,
+        SLOW = 2
+    };
+
+    struct Record {
+        /// Cycles::rdtsc() when the request was issued.
+        uint64_t start;
+
+        /// hashTraceKey() of the key.
+        uint64_t keyId;
+
+        uint32_t latencyNs;
+        uint32_t valueLength;
+        uint16_t worker;
+        uint8_t op;
+        uint8_t result;
+        uint8_t flags;
+        uint8_t unused[3];
+    };
+    static_assert(sizeof(Record) == 32, "Record must stay 32 bytes");
+
+    RequestLog(const char* path, int nWorkers, double sampleRate,
+               uint64_t slowNs, size_t ringRecords = 64 * 1024);
+    ~RequestLog();
+
+    void stop();
+
+    /**
+     * Log a request by worker #worker, if it is sampled or slow. Only that
+     * worker may call this for its ring.
+     */
+    void
+    record(int worker, Op op, Result result, uint64_t keyId,
+           size_t valueLength, uint64_t startCycles, uint64_t latencyNs)
+    {
+        Ring& ring = *rings[worker];
+        uint8_t flags = 0;
+        if (latencyNs >= slowNs)
+            flags |= SLOW;
+        if (sampleAll || (sampleThreshold != 0 &&
+                          ring.nextRandom() < sampleThreshold))
+            flags |= SAMPLED;
+        if (flags == 0)
+            return;
+
+        uint64_t head = ring.head.load(std::memory_order_relaxed);
+        if (head - ring.tail.load(std::memory_order_acquire) == ringSize) {
+            ring.dropped++;
+            return;
+        }
+        Record& r = ring.records[head & (ringSize - 1)];
+        r.start = startCycles;
+        r.keyId = keyId;
+        r.latencyNs = latencyNs > UINT32_MAX ? UINT32_MAX
+                                             : uint32_t(latencyNs);
+        r.valueLength = uint32_t(valueLength);
+        r.worker = uint16_t(worker);
+        r.op = op;
+        r.result = result;
+        r.flags = flags;
+        r.unused[0] = r.unused[1] = r.unused[2] = 0;
+        ring.head.store(head + 1, std::memory_order_release);
+    }
+
+    void printStats(FILE* out);
+
+  private:
+    /**
+     * One worker's records between the worker (which advances head) and the
+     * flusher (which advances tail).
+     */
+    struct Ring {
+        explicit Ring(size_t size, uint64_t seed)
+            : head(0)
+            , random(seed | 1)
+            , dropped(0)
+            , tail(0)
+            , records(size)
+        {
+        }
+
+        uint64_t
+        nextRandom()
+        {
+            random ^= random << 13;
+            random ^= random >> 7;
+            random ^= random << 17;
+            return random;
+        }
+
+        std::atomic<uint64_t> head;
+        uint64_t random;
+        uint64_t dropped;
+        char pad[64 - 3 * sizeof(uint64_t)];
+
+        std::atomic<uint64_t> tail;
+        std::vector<Record> records;
+    };
+
+    void flushThread();
+    size_t drain();
+    void writeBuffer();
+
+    /// Records gathered from the rings before each write.
+    static const size_t WRITE_RECORDS = 32 * 1024;
+
+    int fd;
+    const size_t ringSize;
+    const uint64_t slowNs;
+    const bool sampleAll;
+    const uint64_t sampleThreshold;
+    std::vector<std::unique_ptr<Ring>> rings;
+
+    std::vector<Record> buffer;
+    size_t buffered;
+    uint64_t written;
+    uint64_t slowWritten;
+
+    std::mutex mutex;
+    std::condition_variable cond;
+    bool quit;
+    std::thread flusher;
+
+    RequestLog(const RequestLog&) = delete;
+    RequestLog& operator=(const RequestLog&) = delete;
+};
+
+#endif /* !REQUESTLOG_H_ */
@@ -0,0 +1,157 @@
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "Cycles.h"
+#include "SingleFlight.h"
+
+/**
+ * Parse #spec as described for the class: wait, skip, lease or lease:US.
+ * Exits if it is none of those.
+ */
+SingleFlight::SingleFlight(const char* spec)
+    : mode(WAIT)
+    , leaseWaitUs(100)
+    , stripes()
+    , nextToken(1)
+    , refills(0)
+    , coalesced(0)
+    , staleDropped(0)
+    , leaseRetries(0)
+    , waitCycles(0)
+{
+    if (strcmp(spec, "wait") == 0) {
+        mode = WAIT;
+    } else if (strcmp(spec, "skip") == 0) {
+        mode = SKIP;
+    } else if (strcmp(spec, "lease") == 0) {
+        mode = LEASE;
+    } else if (strncmp(spec, "lease:", 6) == 0) {
+        mode = LEASE;
+        char* end;
+        leaseWaitUs = strtoul(spec + 6, &end, 10);
+        if (end == spec + 6 || *end != '\0') {
+            fprintf(stderr, "bad lease wait in %s (lease:US)\n", spec);
+            exit(1);
+        }
+    } else {
+        fprintf(stderr, "unknown single-flight mode %s "
+                "(wait, skip, lease or lease:US)\n", spec);
+        exit(1);
+    }
+}
+
+/**
+ * Note that a GET of #keyHash just missed. Returns OWNER, with a new
+ * #token, if no refill of the key is in flight, so the caller must refill
+ * it and then release(); otherwise FOLLOWER, with the owner's #token.
+ */
+SingleFlight::Role
+SingleFlight::miss(uint64_t keyHash, uint64_t* token)
+{
+    Stripe& stripe = stripeFor(keyHash);
+    std::lock_guard<std::mutex> _(stripe.lock);
+    auto it = stripe.flights.find(keyHash);
+    if (it != stripe.flights.end()) {
+        *token = it->second.token;
+        return FOLLOWER;
+    }
+    *token = nextToken++;
+    stripe.flights[keyHash] = Flight{*token, false};
+    refills++;
+    return OWNER;
+}
+
+/**
+ * True if the owner of #token should still send its refill: false only
+ * if a write or DELETE has invalidated its lease.
+ */
+bool
+SingleFlight::mayRefill(uint64_t keyHash, uint64_t token)
+{
+    if (mode != LEASE)
+        return true;
+    Stripe& stripe = stripeFor(keyHash);
+    std::lock_guard<std::mutex> _(stripe.lock);
+    auto it = stripe.flights.find(keyHash);
+    if (it != stripe.flights.end() && it->second.token == token &&
+        !it->second.invalidated) {
+        return true;
+    }
+    staleDropped++;
+    return false;
+}
+
+/// End the flight #token, whether or not its refill was stored.
+void
+SingleFlight::release(uint64_t keyHash, uint64_t token)
+{
+    Stripe& stripe = stripeFor(keyHash);
+    {
+        std::lock_guard<std::mutex> _(stripe.lock);
+        auto it = stripe.flights.find(keyHash);
+        if (it != stripe.flights.end() && it->second.token == token)
+            stripe.flights.erase(it);
+    }
+    stripe.landed.notify_all();
+}
+
+/**
+ * Follow the flight #token instead of refilling: with WAIT, block until it
+ * has ended. LEASE followers back off and read again instead (backOff()).
+ */
+void
+SingleFlight::follow(uint64_t keyHash, uint64_t token)
+{
+    coalesced++;
+    if (mode != WAIT)
+        return;
+    uint64_t start = RAMCloud::Cycles::rdtsc();
+    Stripe& stripe = stripeFor(keyHash);
+    std::unique_lock<std::mutex> lock(stripe.lock);
+    stripe.landed.wait(lock, [&] {
+        auto it = stripe.flights.find(keyHash);
+        return it == stripe.flights.end() || it->second.token != token;
+    });
+    waitCycles += RAMCloud::Cycles::rdtsc() - start;
+}
+
+/// Sleep for the lease wait before a lease follower reads the key again.
+void
+SingleFlight::backOff()
+{
+    uint64_t start = RAMCloud::Cycles::rdtsc();
+    usleep(leaseWaitUs);
+    leaseRetries++;
+    waitCycles += RAMCloud::Cycles::rdtsc() - start;
+}
+
+/// Note a write or DELETE of #keyHash, which invalidates any lease on it.
+void
+SingleFlight::invalidate(uint64_t keyHash)
+{
+    if (mode != LEASE)
+        return;
+    Stripe& stripe = stripeFor(keyHash);
+    std::lock_guard<std::mutex> _(stripe.lock);
+    auto it = stripe.flights.find(keyHash);
+    if (it != stripe.flights.end())
+        it->second.invalidated = true;
+}
+
+void
+SingleFlight::print(FILE* out) const
+{
+    static const char* const modes[] = {"wait", "skip", "lease"};
+    uint64_t saved = coalesced;
+    double waitUs = RAMCloud::Cycles::toSeconds(waitCycles) * 1e6;
+    fprintf(out, "# single-flight (%s): %lu refills   %lu coalesced "
+            "(refills saved)   %.1f us waited per refill saved",
+            modes[mode], refills.load(), saved,
+            saved > 0 ? waitUs / saved : 0.0);
+    if (mode == LEASE) {
+        fprintf(out, "   %lu lease retries   %lu stale refills dropped",
+                leaseRetries.load(), staleDropped.load());
+    }
+    fprintf(out, "\n");
+}
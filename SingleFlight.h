@@ -0,0 +1,111 @@
+#ifndef SINGLEFLIGHT_H_
+#define SINGLEFLIGHT_H_
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <mutex>
+#include <unordered_map>
+
+/**
+ * Lets only one worker at a time refill a key that missed (-F), as a client
+ * that coalesces misses would. The first GET to miss a key owns its refill;
+ * GETs that miss it while the refill is in flight follow it instead of
+ * writing the same value again. How a follower gets its value is the mode:
+ *
+ *   wait    block until the owner's refill lands and take its value;
+ *   skip    read the value from the database and go on without storing it;
+ *   lease   emulate memcached leases: back off for the lease wait (in
+ *           microseconds, lease:US; 100 by default) and read the key again,
+ *           taking over the refill if the lease has gone without one. A
+ *           write or DELETE of the key while a lease is out invalidates it,
+ *           and the refill it was for, which would now be stale, is
+ *           dropped.
+ *
+ * Flights are kept by key hash, in striped maps that any worker may use.
+ * The lease check comes just before the refill is sent rather than in the
+ * store, so a write that lands in between is missed.
+ */
+class SingleFlight {
+  public:
+    enum Mode {
+        WAIT,
+        SKIP,
+        LEASE
+    };
+
+    enum Role {
+        OWNER,
+        FOLLOWER
+    };
+
+    explicit SingleFlight(const char* spec);
+
+    Mode
+    getMode() const
+    {
+        return mode;
+    }
+
+    Role miss(uint64_t keyHash, uint64_t* token);
+    bool mayRefill(uint64_t keyHash, uint64_t token);
+    void release(uint64_t keyHash, uint64_t token);
+    void follow(uint64_t keyHash, uint64_t token);
+    void backOff();
+    void invalidate(uint64_t keyHash);
+
+    /// Count a lease follower that found the owner's value on a later read.
+    void
+    coalesce()
+    {
+        coalesced++;
+    }
+
+    void print(FILE* out) const;
+
+  private:
+    static const int N_STRIPES = 64;
+
+    struct Flight {
+        /// Told apart from later flights for the same key.
+        uint64_t token;
+
+        /// A write or DELETE of the key came while the lease was out.
+        bool invalidated;
+    };
+
+    struct Stripe {
+        std::mutex lock;
+        std::condition_variable landed;
+        std::unordered_map<uint64_t, Flight> flights;
+    };
+
+    Stripe&
+    stripeFor(uint64_t keyHash)
+    {
+        return stripes[keyHash >> 58];
+    }
+
+    Mode mode;
+    uint64_t leaseWaitUs;
+    Stripe stripes[N_STRIPES];
+    std::atomic<uint64_t> nextToken;
+
+    /// Refills started by owners.
+    std::atomic<uint64_t> refills;
+
+    /// Followers that did not refill: the refills saved.
+    std::atomic<uint64_t> coalesced;
+
+    /// Refills dropped because their lease was invalidated.
+    std::atomic<uint64_t> staleDropped;
+
+    /// Lease followers' back-offs, each followed by another read.
+    std::atomic<uint64_t> leaseRetries;
+
+    /// Time followers spent waiting for refills or backing off.
+    std::atomic<uint64_t> waitCycles;
+};
+
+#endif /* !SINGLEFLIGHT_H_ */
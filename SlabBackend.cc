@@ -0,0 +1,529 @@
+#include "KVBackend.h"
+#include "HashIndex.h"
+#include "TraceParser.h"
+
+#include <algorithm>
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+namespace {
+
+/**
+ * The start of every chunk: the item stored in it and its place in the
+ * slab class's LRU list.
+ */
+struct Chunk {
+    uint64_t hash;
+    uint32_t valueLength;
+    uint16_t keyLength;
+    uint8_t slabClass;
+
+    // Guarded by the slab class's lock.
+    Chunk* prev;
+    Chunk* next;
+
+    /// Bumped whenever the chunk is freed or reused, so a writer that
+    /// found it in the index can tell whether it still holds that item.
+    uint32_t generation;
+
+    /// KVBackend::clockSeconds() when the item expires, or 0.
+    uint32_t expiry;
+
+    const char* key() const { return reinterpret_cast<const char*>(this + 1); }
+    const char* value() const { return key() + keyLength; }
+};
+
+/**
+ * Chunks of one size, carved out of pages as the class needs them, with the
+ * items in them in LRU order.
+ */
+struct SlabClass {
+    std::mutex lock;
+    size_t chunkSize;
+    size_t pages;
+    Chunk* freeList;
+
+    /// Most recently used at #head.
+    Chunk* head;
+    Chunk* tail;
+
+    uint64_t items;
+    uint64_t evictions;
+
+    /// Items removed by the first read after they expired.
+    uint64_t expirations;
+
+    /// Sets that found no free chunk, no page left and nothing to evict.
+    uint64_t failures;
+
+    void
+    pushFront(Chunk* chunk)
+    {
+        chunk->prev = NULL;
+        chunk->next = head;
+        if (head != NULL)
+            head->prev = chunk;
+        head = chunk;
+        if (tail == NULL)
+            tail = chunk;
+    }
+
+    void
+    unlink(Chunk* chunk)
+    {
+        if (chunk->prev != NULL)
+            chunk->prev->next = chunk->next;
+        else
+            head = chunk->next;
+        if (chunk->next != NULL)
+            chunk->next->prev = chunk->prev;
+        else
+            tail = chunk->prev;
+    }
+};
+
+/**
+ * A memcached-style slab allocator for comparison with the log store:
+ * memory is split into 1 MB pages, each page is given for good to the
+ * first slab class that needs one, and items live in the smallest chunk
+ * that fits them, with chunk sizes growing by a constant factor. Each
+ * class evicts in LRU order among its own items only, so memory assigned
+ * to sizes the workload has moved away from stays stranded there.
+ */
+class SlabStore : public KVBackendFactory {
+  public:
+    explicit SlabStore(const BackendConfig& config)
+        : pageSize(config.getOption("page", 1 << 20))
+        , maxPages(std::max<size_t>(
+              (config.getOption("memory_mb", 256) << 20) / pageSize, 1))
+        , pagesUsed(0)
+        , classes()
+        , index()
+        , countersLock()
+        , counters()
+        , liveData(0)
+        , liveItems(0)
+    {
+        // Chunk sizes as memcached picks them: from a small minimum, up by
+        // the growth factor (-o growth=percent) rounded to 8 bytes, with a
+        // last class holding a whole page.
+        const double factor = double(config.getOption("growth", 125)) / 100;
+        std::vector<size_t> sizes;
+        for (double size = sizeof(Chunk) + 48; size <= pageSize / 2;
+             size *= factor) {
+            size_t rounded = (size_t(size) + 7) & ~size_t(7);
+            if (sizes.empty() || rounded > sizes.back())
+                sizes.push_back(rounded);
+            if (factor <= 1)
+                break;
+        }
+        sizes.push_back(pageSize);
+        if (sizes.size() > 255) {
+            fprintf(stderr, "slab growth factor too small\n");
+            exit(1);
+        }
+        classes.reset(new SlabClass[sizes.size()]);
+        nClasses = sizes.size();
+        for (size_t i = 0; i < nClasses; i++) {
+            SlabClass& c = classes[i];
+            c.chunkSize = sizes[i];
+            c.pages = 0;
+            c.freeList = c.head = c.tail = NULL;
+            c.items = c.evictions = c.expirations = c.failures = 0;
+        }
+        index.reset(new HashIndex(config.getOption(
+            "items", (config.getOption("memory_mb", 256) << 20) / 128)));
+        pageMemory.reserve(maxPages);
+        printf("# slab store: %lu pages of %lu bytes, %lu classes from %lu "
+               "to %lu bytes\n", maxPages, pageSize, nClasses,
+               classes[0].chunkSize, classes[nClasses - 1].chunkSize);
+    }
+
+    ~SlabStore()
+    {
+        for (char* page : pageMemory)
+            free(page);
+    }
+
+    std::unique_ptr<KVBackend> connect();
+
+    void
+    report(FILE* out)
+    {
+        uint64_t gets = 0, hits = 0;
+        sumCounters(&gets, &hits);
+        uint64_t evictions = 0, expirations = 0, failures = 0;
+        for (size_t i = 0; i < nClasses; i++) {
+            std::lock_guard<std::mutex> _(classes[i].lock);
+            evictions += classes[i].evictions;
+            expirations += classes[i].expirations;
+            failures += classes[i].failures;
+        }
+        const double footprint = double(pagesUsed) * double(pageSize);
+        const double indexBytes = double(index->memoryUsed());
+        fprintf(out, "# slab store: %.1f MB live in %lu pages (%.1f MB), "
+                "%.1f%% efficiency (%.1f%% counting the %.1f MB index)   "
+                "%.3f%% hits   %lu evictions   %lu expired   %lu sets "
+                "without room\n",
+                double(liveData) / 1e6, uint64_t(pagesUsed), footprint / 1e6,
+                footprint > 0 ? double(liveData) / footprint * 100 : 0.0,
+                double(liveData) / (footprint + indexBytes) * 100,
+                indexBytes / 1e6,
+                gets ? double(hits) / double(gets) * 100 : 0.0,
+                evictions, expirations, failures);
+        for (size_t i = 0; i < nClasses; i++) {
+            SlabClass& c = classes[i];
+            std::lock_guard<std::mutex> _(c.lock);
+            if (c.pages == 0)
+                continue;
+            fprintf(out, "#   class %2lu: %7lu-byte chunks   %4lu pages   "
+                    "%8lu items   %8lu evictions\n",
+                    i, c.chunkSize, c.pages, c.items, c.evictions);
+        }
+    }
+
+    /// Per-thread operation counts, summed for serverStats().
+    struct Counters {
+        std::atomic<uint64_t> gets;
+        std::atomic<uint64_t> hits;
+        char pad[64 - 2 * sizeof(std::atomic<uint64_t>)];
+    };
+
+    Counters*
+    addCounters()
+    {
+        std::lock_guard<std::mutex> _(countersLock);
+        counters.emplace_back(new Counters());
+        counters.back()->gets = 0;
+        counters.back()->hits = 0;
+        return counters.back().get();
+    }
+
+    void
+    stats(KVBackend::ServerStats* stats)
+    {
+        *stats = KVBackend::ServerStats{};
+        sumCounters(&stats->cmdGet, &stats->getHits);
+        for (size_t i = 0; i < nClasses; i++) {
+            std::lock_guard<std::mutex> _(classes[i].lock);
+            stats->evictions += classes[i].evictions;
+        }
+        stats->bytes = liveData;
+        stats->currItems = liveItems;
+    }
+
+    bool
+    read(uint64_t hash, const char* key, size_t keyLength,
+         size_t* valueLength, std::string* value)
+    {
+        std::unique_lock<HashIndex::Lock> lock(index->lockFor(hash));
+        Chunk* chunk = find(hash, key, keyLength);
+        if (chunk == NULL)
+            return false;
+        if (KVBackend::expired(chunk->expiry)) {
+            index->remove(hash, reinterpret_cast<uint64_t>(chunk));
+            uint32_t generation = chunk->generation;
+            SlabClass& c = classes[chunk->slabClass];
+            liveData -= chunk->keyLength + chunk->valueLength;
+            liveItems--;
+            lock.unlock();
+            if (release(chunk, generation)) {
+                std::lock_guard<std::mutex> _(c.lock);
+                c.expirations++;
+            }
+            return false;
+        }
+        *valueLength = chunk->valueLength;
+        if (value != NULL)
+            value->assign(chunk->value(), chunk->valueLength);
+
+        // The index lock keeps the chunk from being evicted meanwhile;
+        // skip the bump rather than wait for the class lock.
+        SlabClass& c = classes[chunk->slabClass];
+        if (c.lock.try_lock()) {
+            if (c.head != chunk) {
+                c.unlink(chunk);
+                c.pushFront(chunk);
+            }
+            c.lock.unlock();
+        }
+        return true;
+    }
+
+    bool
+    write(uint64_t hash, const char* key, size_t keyLength,
+          const char* value, size_t valueLength, uint32_t expiry)
+    {
+        const size_t size = sizeof(Chunk) + keyLength + valueLength;
+        if (size > pageSize || keyLength > UINT16_MAX)
+            return false;
+        size_t classId = 0;
+        while (classes[classId].chunkSize < size)
+            classId++;
+        SlabClass& c = classes[classId];
+
+        Chunk* chunk;
+        {
+            std::lock_guard<std::mutex> _(c.lock);
+            chunk = allocate(c);
+            if (chunk == NULL) {
+                c.failures++;
+                return false;
+            }
+            chunk->hash = hash;
+            chunk->keyLength = uint16_t(keyLength);
+            chunk->valueLength = uint32_t(valueLength);
+            chunk->slabClass = uint8_t(classId);
+            chunk->expiry = expiry;
+            char* data = reinterpret_cast<char*>(chunk + 1);
+            memcpy(data, key, keyLength);
+            memcpy(data + keyLength, value, valueLength);
+            c.pushFront(chunk);
+            c.items++;
+        }
+
+        Chunk* old;
+        uint32_t oldGeneration = 0;
+        {
+            std::lock_guard<HashIndex::Lock> _(index->lockFor(hash));
+            old = reinterpret_cast<Chunk*>(
+                index->insert(hash, reinterpret_cast<uint64_t>(chunk)));
+            if (old != reinterpret_cast<Chunk*>(HashIndex::NONE)) {
+                oldGeneration = old->generation;
+                liveData -= old->keyLength + old->valueLength;
+            } else {
+                old = NULL;
+                liveItems++;
+            }
+            liveData += keyLength + valueLength;
+        }
+        if (old != NULL)
+            release(old, oldGeneration);
+        return true;
+    }
+
+    bool
+    erase(uint64_t hash, const char* key, size_t keyLength)
+    {
+        Chunk* chunk;
+        uint32_t generation;
+        {
+            std::lock_guard<HashIndex::Lock> _(index->lockFor(hash));
+            chunk = find(hash, key, keyLength);
+            if (chunk == NULL)
+                return false;
+            index->remove(hash, reinterpret_cast<uint64_t>(chunk));
+            generation = chunk->generation;
+            liveData -= chunk->keyLength + chunk->valueLength;
+            liveItems--;
+        }
+        release(chunk, generation);
+        return true;
+    }
+
+  private:
+    /// The chunk holding #key; the caller holds its index lock.
+    Chunk*
+    find(uint64_t hash, const char* key, size_t keyLength)
+    {
+        uint64_t ref = index->lookup(hash);
+        if (ref == HashIndex::NONE)
+            return NULL;
+        Chunk* chunk = reinterpret_cast<Chunk*>(ref);
+        if (chunk->keyLength != keyLength ||
+            memcmp(chunk->key(), key, keyLength) != 0) {
+            return NULL;
+        }
+        return chunk;
+    }
+
+    /**
+     * Find a chunk in #c: a free one, one from a new page, or else the
+     * class's least recently used item. The caller holds the class lock.
+     */
+    Chunk*
+    allocate(SlabClass& c)
+    {
+        if (c.freeList == NULL)
+            addPage(c);
+        if (c.freeList != NULL) {
+            Chunk* chunk = c.freeList;
+            c.freeList = chunk->next;
+            return chunk;
+        }
+
+        Chunk* victim = c.tail;
+        if (victim == NULL)
+            return NULL;
+        {
+            std::lock_guard<HashIndex::Lock> _(index->lockFor(victim->hash));
+            if (index->remove(victim->hash,
+                              reinterpret_cast<uint64_t>(victim))) {
+                liveData -= victim->keyLength + victim->valueLength;
+                liveItems--;
+                c.evictions++;
+            }
+        }
+        c.unlink(victim);
+        c.items--;
+        victim->generation++;
+        return victim;
+    }
+
+    /// Give #c another page, if any are left; the caller holds its lock.
+    bool
+    addPage(SlabClass& c)
+    {
+        char* page;
+        {
+            std::lock_guard<std::mutex> _(pagesLock);
+            if (pagesUsed == maxPages)
+                return false;
+            page = static_cast<char*>(malloc(pageSize));
+            if (page == NULL) {
+                fprintf(stderr, "out of memory allocating a slab page\n");
+                exit(1);
+            }
+            pageMemory.push_back(page);
+            pagesUsed++;
+        }
+        c.pages++;
+        for (size_t offset = 0; offset + c.chunkSize <= pageSize;
+             offset += c.chunkSize) {
+            Chunk* chunk = new(page + offset) Chunk();
+            chunk->generation = 0;
+            chunk->next = c.freeList;
+            c.freeList = chunk;
+        }
+        return true;
+    }
+
+    /// Free #chunk unless it was evicted and reused since the caller
+    /// removed it from the index at #generation.
+    bool
+    release(Chunk* chunk, uint32_t generation)
+    {
+        SlabClass& c = classes[chunk->slabClass];
+        std::lock_guard<std::mutex> _(c.lock);
+        if (chunk->generation != generation)
+            return false;
+        c.unlink(chunk);
+        c.items--;
+        chunk->generation++;
+        chunk->next = c.freeList;
+        c.freeList = chunk;
+        return true;
+    }
+
+    void
+    sumCounters(uint64_t* gets, uint64_t* hits)
+    {
+        std::lock_guard<std::mutex> _(countersLock);
+        *gets = *hits = 0;
+        for (auto& c : counters) {
+            *gets += c->gets.load(std::memory_order_relaxed);
+            *hits += c->hits.load(std::memory_order_relaxed);
+        }
+    }
+
+    const size_t pageSize;
+    const size_t maxPages;
+
+    std::mutex pagesLock;
+    std::vector<char*> pageMemory;
+    std::atomic<size_t> pagesUsed;
+
+    std::unique_ptr<SlabClass[]> classes;
+    size_t nClasses;
+    std::unique_ptr<HashIndex> index;
+
+    std::mutex countersLock;
+    std::vector<std::unique_ptr<Counters>> counters;
+
+    /// Key and value bytes of the items the index points to.
+    std::atomic<int64_t> liveData;
+    std::atomic<int64_t> liveItems;
+};
+
+/// One thread's handle on a SlabStore.
+class SlabBackend : public KVBackend {
+  public:
+    explicit SlabBackend(SlabStore& store)
+        : store(store)
+        , counters(store.addCounters())
+    {
+    }
+
+    Status
+    get(const char* key, size_t keyLength, size_t* valueLength,
+        std::string* value)
+    {
+        counters->gets.store(counters->gets.load(std::memory_order_relaxed) + 1,
+                             std::memory_order_relaxed);
+        if (!store.read(hashTraceKey(key, keyLength), key, keyLength,
+                        valueLength, value)) {
+            return MISS;
+        }
+        counters->hits.store(counters->hits.load(std::memory_order_relaxed) + 1,
+                             std::memory_order_relaxed);
+        return OK;
+    }
+
+    Status
+    set(const char* key, size_t keyLength, const char* value,
+        size_t valueLength, uint32_t ttl)
+    {
+        if (!store.write(hashTraceKey(key, keyLength), key, keyLength, value,
+                         valueLength, expiryFor(ttl))) {
+            return ERROR;
+        }
+        return OK;
+    }
+
+    Status
+    remove(const char* key, size_t keyLength)
+    {
+        return store.erase(hashTraceKey(key, keyLength), key, keyLength)
+                   ? OK : MISS;
+    }
+
+    bool
+    serverStats(ServerStats* stats)
+    {
+        store.stats(stats);
+        return true;
+    }
+
+    const char*
+    errorString()
+    {
+        return "no memory for an item of this size";
+    }
+
+  private:
+    SlabStore& store;
+    SlabStore::Counters* counters;
+};
+
+std::unique_ptr<KVBackend>
+SlabStore::connect()
+{
+    return std::unique_ptr<KVBackend>(new SlabBackend(*this));
+}
+
+KVBackendRegistry::Registration slabBackend{
+    "slab",
+    "in-process memcached-style slab store with per-class LRU; "
+    "-o memory_mb=N (default 256), -o page=bytes, -o growth=percent "
+    "(default 125)",
+    [](const BackendConfig& config) {
+        return std::unique_ptr<KVBackendFactory>(new SlabStore(config));
+    }};
+
+} // anonymous namespace
@@ -0,0 +1,207 @@
+#include "TraceIndex.h"
+#include "TraceParser.h"
+#include "TraceReader.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+
+namespace {
+const char MAGIC[8] = {'Y', 'C', 'S', 'B', 'T', 'I', 'D', 'X'};
+}
+
+TraceIndex::TraceIndex(uint64_t stride)
+    : stride(std::max<uint64_t>(stride, 1))
+    , entries()
+    , end{0, 0, NO_TIME}
+    , complete(false)
+{
+}
+
+std::string
+TraceIndex::pathFor(const char* trace)
+{
+    return std::string(trace) + ".idx";
+}
+
+/**
+ * Replace this index with the one saved for #trace, taking on its stride.
+ *
+ * \return
+ *      False, leaving the index as it was, if there is none or it was
+ *      saved for a different version of the trace.
+ */
+bool
+TraceIndex::load(const char* trace)
+{
+    uint64_t size, mtimeNs;
+    if (!traceIdentity(trace, &size, &mtimeNs))
+        return false;
+    std::string path = pathFor(trace);
+    FILE* in = fopen(path.c_str(), "rb");
+    if (in == NULL)
+        return false;
+
+    FileHeader header;
+    bool ok = fread(&header, sizeof(header), 1, in) == 1 &&
+              memcmp(header.magic, MAGIC, sizeof(MAGIC)) == 0 &&
+              header.version == VERSION &&
+              header.traceSize == size &&
+              header.traceMtimeNs == mtimeNs &&
+              header.stride > 0;
+    std::vector<Entry> loaded;
+    if (ok) {
+        loaded.resize(header.nEntries);
+        ok = fread(loaded.data(), sizeof(Entry), loaded.size(), in) ==
+             loaded.size();
+    }
+    fclose(in);
+    if (!ok)
+        return false;
+
+    stride = header.stride;
+    entries.swap(loaded);
+    end = header.end;
+    complete = header.complete != 0;
+    return true;
+}
+
+/**
+ * Write the index to TRACE.idx, replacing any there. A failure is reported
+ * but not fatal: the index only saves time.
+ *
+ * \param complete
+ *      True if the index now covers the whole trace, ending at setEnd().
+ */
+void
+TraceIndex::save(const char* trace, bool complete)
+{
+    this->complete = complete;
+    FileHeader header{};
+    memcpy(header.magic, MAGIC, sizeof(MAGIC));
+    header.version = VERSION;
+    header.complete = complete;
+    header.stride = stride;
+    if (!traceIdentity(trace, &header.traceSize, &header.traceMtimeNs))
+        return;
+    header.nEntries = entries.size();
+    header.end = end;
+
+    // Write a new file and rename it so readers never see a partial one.
+    std::string path = pathFor(trace);
+    std::string temp = path + ".tmp";
+    FILE* out = fopen(temp.c_str(), "wb");
+    bool ok = out != NULL &&
+              fwrite(&header, sizeof(header), 1, out) == 1 &&
+              fwrite(entries.data(), sizeof(Entry), entries.size(), out) ==
+                  entries.size();
+    if (out != NULL && fclose(out) != 0)
+        ok = false;
+    if (!ok || rename(temp.c_str(), path.c_str()) != 0) {
+        fprintf(stderr, "couldn't save trace index %s: %s\n", path.c_str(),
+                strerror(errno));
+        unlink(temp.c_str());
+    }
+}
+
+/**
+ * Index all of #trace in one pass, with an entry exactly every stride
+ * operations.
+ */
+void
+TraceIndex::build(const char* trace)
+{
+    entries.clear();
+    uint64_t ops = 0;
+    uint64_t offset = 0;
+    TraceReader reader(trace);
+    while (TraceReader::Block* block = reader.next()) {
+        const char* data = block->data;
+        const char* blockEnd = data + block->length;
+        const char* line = data;
+        TraceOp op;
+        while (line < blockEnd) {
+            const char* newline = static_cast<const char*>(
+                memchr(line, '\n', blockEnd - line));
+            const char* lineEnd = newline == NULL ? blockEnd : newline + 1;
+            if (parseTraceLine(line, lineEnd, &op)) {
+                if (ops % stride == 0)
+                    add(block->offset + (line - data), ops, NO_TIME);
+                ops++;
+            }
+            line = lineEnd;
+        }
+        offset = block->offset + block->length;
+        reader.release(block);
+    }
+    setEnd(offset, ops);
+    complete = true;
+}
+
+/**
+ * Return the last entry at or before operation #op, or NULL if the index
+ * has none.
+ */
+const TraceIndex::Entry*
+TraceIndex::findOp(uint64_t op) const
+{
+    auto it = std::upper_bound(entries.begin(), entries.end(), op,
+        [](uint64_t op, const Entry& e) { return op < e.ops; });
+    return it == entries.begin() ? NULL : &*(it - 1);
+}
+
+/**
+ * Return the last entry a replay reached at or before #timeNs, or NULL if
+ * the index has no times that early.
+ */
+const TraceIndex::Entry*
+TraceIndex::findTime(uint64_t timeNs) const
+{
+    const Entry* found = NULL;
+    for (const Entry& e : entries) {
+        if (e.timeNs == NO_TIME || e.timeNs > timeNs)
+            break;
+        found = &e;
+    }
+    return found;
+}
+
+/**
+ * Divide a complete index's trace into #n consecutive ranges holding about
+ * the same number of operations (to within a stride).
+ */
+std::vector<TraceIndex::Range>
+TraceIndex::split(int n) const
+{
+    std::vector<Entry> bounds;
+    for (int i = 0; i < n; i++) {
+        const Entry* e = findOp(end.ops * i / n);
+        bounds.push_back(e != NULL ? *e : Entry{0, 0, NO_TIME});
+    }
+    bounds.push_back(end);
+
+    std::vector<Range> ranges;
+    for (int i = 0; i < n; i++)
+        ranges.push_back({bounds[i], bounds[i + 1]});
+    return ranges;
+}
+
+/**
+ * Get the size and modification time that tie an index to its trace.
+ */
+bool
+TraceIndex::traceIdentity(const char* trace, uint64_t* size,
+                          uint64_t* mtimeNs)
+{
+    struct stat st;
+    if (stat(trace, &st) != 0)
+        return false;
+    *size = st.st_size;
+    *mtimeNs = st.st_mtim.tv_sec * 1000000000UL + st.st_mtim.tv_nsec;
+    return true;
+}
@@ -0,0 +1,131 @@
+#ifndef TRACEINDEX_H_
+#define TRACEINDEX_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+/**
+ * A sparse index of a trace file: the decoded byte offset of roughly every
+ * #stride'th operation, so a replay can start partway through a large trace,
+ * resume where an earlier one stopped, or be split into ranges of about
+ * equal numbers of operations for parallel readers, without parsing
+ * everything before that point.
+ *
+ * An index is kept next to its trace as TRACE.idx. It can be built in one
+ * scan with build(), or grown by a replay as it reads the trace from
+ * wherever it starts (see add()); a partial index is saved as such and
+ * later replays extend it. Traces carry no timestamps, so an entry
+ * built during a replay records how far into that replay it was reached,
+ * which lets a later replay start at a time instead of an operation.
+ *
+ * Offsets are into the decoded trace and always start a line. The index
+ * remembers the size and modification time of its trace and is ignored if
+ * either changes.
+ */
+class TraceIndex {
+  public:
+    static const uint32_t VERSION = 2;
+
+    /// A time that was not recorded.
+    static const uint64_t NO_TIME = ~0ul;
+
+    struct Entry {
+        /// Decoded offset of the line holding operation #ops.
+        uint64_t offset;
+
+        /// Operations in the trace before #offset.
+        uint64_t ops;
+
+        /// Nanoseconds into the replay that reached #offset, or NO_TIME.
+        uint64_t timeNs;
+    };
+
+    /// Operations [begin.ops, end.ops) at decoded bytes [begin, end).
+    struct Range {
+        Entry begin;
+        Entry end;
+    };
+
+    explicit TraceIndex(uint64_t stride);
+
+    static std::string pathFor(const char* trace);
+
+    bool load(const char* trace);
+    void save(const char* trace, bool complete);
+    void build(const char* trace);
+
+    /**
+     * Note that operation #ops starts at decoded #offset, reached #timeNs
+     * into the replay; it becomes an entry if it is at least a stride past
+     * the last one. Entries must be added in trace order.
+     */
+    void
+    add(uint64_t offset, uint64_t ops, uint64_t timeNs)
+    {
+        if (entries.empty() || ops >= entries.back().ops + stride)
+            entries.push_back({offset, ops, timeNs});
+    }
+
+    const Entry* findOp(uint64_t op) const;
+    const Entry* findTime(uint64_t timeNs) const;
+    std::vector<Range> split(int n) const;
+
+    /// True if the index covers the whole trace.
+    bool
+    isComplete() const
+    {
+        return complete;
+    }
+
+    uint64_t
+    getStride() const
+    {
+        return stride;
+    }
+
+    size_t
+    size() const
+    {
+        return entries.size();
+    }
+
+    /// Operations in the trace; only once isComplete().
+    uint64_t
+    totalOps() const
+    {
+        return complete ? end.ops : 0;
+    }
+
+    void
+    setEnd(uint64_t offset, uint64_t ops)
+    {
+        end = {offset, ops, NO_TIME};
+    }
+
+  private:
+    /// Start of an index file; entries follow it.
+    struct FileHeader {
+        char magic[8];
+        uint32_t version;
+        uint32_t complete;
+        uint64_t stride;
+        uint64_t traceSize;
+        uint64_t traceMtimeNs;
+        uint64_t nEntries;
+
+        /// The end of the trace, if complete.
+        Entry end;
+    };
+
+    static bool traceIdentity(const char* trace, uint64_t* size,
+                              uint64_t* mtimeNs);
+
+    uint64_t stride;
+    std::vector<Entry> entries;
+    Entry end;
+    bool complete;
+};
+
+#endif /* !TRACEINDEX_H_ */
@@ -0,0 +1,309 @@
+#ifndef TRACEPARSER_H_
+#define TRACEPARSER_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+
+/**
+ * A single operation parsed out of one line of YCSB basic-DB text output:
+ *
+ *   READ usertable user6622674881006267921 [ <all fields>]
+ *   INSERT usertable user8183854946431771896 [ field0=8#?(;?4%4*'4#0$"= ]
+ *
+ * or of a trace run through ycsb_munge.py, where the field list has been
+ * replaced by the value's length in bytes:
+ *
+ *   UPDATE usertable user8183854946431771896 1000
+ *
+ * Either form of a write may end with a TTL in seconds:
+ *
+ *   UPDATE usertable user8183854946431771896 1000 3600
+ *
+ * Besides YCSB's READ, INSERT, UPDATE, DELETE and READMODIFYWRITE, traces
+ * taken from a memcached client may hold the rest of its commands. CAS,
+ * APPEND and PREPEND carry a value like UPDATE (for APPEND and PREPEND, the
+ * bytes added); INCR and DECR are followed by the amount, 1 if there is
+ * none, and TOUCH by the new TTL:
+ *
+ *   DELETE usertable user8183854946431771896
+ *   CAS usertable user8183854946431771896 1000 3600
+ *   INCR usertable user8183854946431771896 5
+ *   TOUCH usertable user8183854946431771896 3600
+ *
+ * The key is not copied; it points into the line that was parsed.
+ */
+struct TraceOp {
+    enum Type {
+        INVALID,
+        READ,
+        INSERT,
+        UPDATE,
+        DELETE,
+        READMODIFYWRITE,
+        CAS,
+        APPEND,
+        PREPEND,
+        INCR,
+        DECR,
+        TOUCH
+    };
+    static const int N_TYPES = TOUCH + 1;
+
+    /// The name of #type in a trace, e.g. "READ".
+    static const char*
+    name(Type type)
+    {
+        static const char* const names[N_TYPES] = {
+            "INVALID", "READ", "INSERT", "UPDATE", "DELETE",
+            "READMODIFYWRITE", "CAS", "APPEND", "PREPEND", "INCR", "DECR",
+            "TOUCH"};
+        return names[type];
+    }
+
+    /// True if operations of #type store a value of #valueLength bytes.
+    static bool
+    writesValue(Type type)
+    {
+        return type == INSERT || type == UPDATE || type == READMODIFYWRITE ||
+               type == CAS || type == APPEND || type == PREPEND;
+    }
+
+    Type type;
+    const char* key;
+    size_t keyLength;
+
+    /// Length of the value written (see writesValue()), or the amount of an
+    /// INCR or DECR; 0 otherwise.
+    int valueLength;
+
+    /// TTL of the value written, or the new TTL of a TOUCH, from the trace;
+    /// 0 if it has none.
+    int ttl;
+};
+
+/// True if the #length bytes at #line start with #name and a space.
+static inline bool
+traceNameIs(const char* line, size_t length, const char* name)
+{
+    size_t n = strlen(name);
+    return length > n && memcmp(line, name, n) == 0 && line[n] == ' ';
+}
+
+/**
+ * Return the type of operation named by the first word of the line at
+ * #line, or TraceOp::INVALID for anything else (YCSB's status output, for
+ * instance). Names must be followed by a space, so that lines such as
+ * "DBWrapper: ..." and "Command line: ..." are not taken for operations.
+ */
+static inline TraceOp::Type
+parseTraceType(const char* line, const char* end)
+{
+    const size_t length = end - line;
+    if (length == 0)
+        return TraceOp::INVALID;
+    switch (line[0]) {
+    case 'R':
+        if (traceNameIs(line, length, "READ"))
+            return TraceOp::READ;
+        if (traceNameIs(line, length, "READMODIFYWRITE"))
+            return TraceOp::READMODIFYWRITE;
+        break;
+    case 'I':
+        if (traceNameIs(line, length, "INSERT"))
+            return TraceOp::INSERT;
+        if (traceNameIs(line, length, "INCR"))
+            return TraceOp::INCR;
+        break;
+    case 'U':
+        if (traceNameIs(line, length, "UPDATE"))
+            return TraceOp::UPDATE;
+        break;
+    case 'D':
+        if (traceNameIs(line, length, "DELETE"))
+            return TraceOp::DELETE;
+        if (traceNameIs(line, length, "DECR"))
+            return TraceOp::DECR;
+        break;
+    case 'C':
+        if (traceNameIs(line, length, "CAS"))
+            return TraceOp::CAS;
+        break;
+    case 'A':
+        if (traceNameIs(line, length, "APPEND"))
+            return TraceOp::APPEND;
+        break;
+    case 'P':
+        if (traceNameIs(line, length, "PREPEND"))
+            return TraceOp::PREPEND;
+        break;
+    case 'T':
+        if (traceNameIs(line, length, "TOUCH"))
+            return TraceOp::TOUCH;
+        break;
+    }
+    return TraceOp::INVALID;
+}
+
+/**
+ * Return the value length recorded in a line. With a field list this is the
+ * span between the brackets less the " field0=" and " ]" framing (it only
+ * works if a single field is given); otherwise it is the fourth
+ * whitespace-separated token.
+ */
+static inline int
+parseTraceValueLength(const char* line, const char* end)
+{
+    const char* open =
+        static_cast<const char*>(memchr(line, '[', end - line));
+    if (open != NULL) {
+        const char* close =
+            static_cast<const char*>(memchr(open, ']', end - open));
+        if (close == NULL)
+            close = end;
+        return (int)(close - open) - 10;
+    }
+
+    const char* p = line;
+    for (int field = 0; field < 3; field++) {
+        while (p < end && *p != ' ')
+            p++;
+        while (p < end && *p == ' ')
+            p++;
+    }
+    int length = 0;
+    while (p < end && *p >= '0' && *p <= '9')
+        length = length * 10 + (*p++ - '0');
+    return length;
+}
+
+/**
+ * Return the TTL recorded after the value in a line: the number following
+ * the closing bracket or the value length, if there is one.
+ */
+static inline int
+parseTraceTtl(const char* line, const char* end)
+{
+    const char* p;
+    const char* open =
+        static_cast<const char*>(memchr(line, '[', end - line));
+    if (open != NULL) {
+        p = static_cast<const char*>(memchr(open, ']', end - open));
+        if (p == NULL)
+            return 0;
+        p++;
+    } else {
+        p = line;
+        for (int field = 0; field < 4; field++) {
+            while (p < end && *p != ' ')
+                p++;
+            while (p < end && *p == ' ')
+                p++;
+        }
+    }
+    while (p < end && *p == ' ')
+        p++;
+    int ttl = 0;
+    while (p < end && *p >= '0' && *p <= '9')
+        ttl = ttl * 10 + (*p++ - '0');
+    return ttl;
+}
+
+/**
+ * Return the number in the fourth whitespace-separated token of a line (the
+ * amount of an INCR or DECR, or the TTL of a TOUCH), or #missing if there
+ * is none.
+ */
+static inline int
+parseTraceNumber(const char* line, const char* end, int missing)
+{
+    const char* p = line;
+    for (int field = 0; field < 3; field++) {
+        while (p < end && *p != ' ')
+            p++;
+        while (p < end && *p == ' ')
+            p++;
+    }
+    if (p == end || *p < '0' || *p > '9')
+        return missing;
+    uint64_t number = 0;
+    while (p < end && *p >= '0' && *p <= '9' && number <= INT32_MAX)
+        number = number * 10 + (*p++ - '0');
+    return number > INT32_MAX ? INT32_MAX : (int)number;
+}
+
+/**
+ * Parse the line [line, end) into #op. Lines that are not operations
+ * (YCSB's status output, for instance) yield TraceOp::INVALID.
+ *
+ * \return
+ *      True if #op holds an operation to replay.
+ */
+static inline bool
+parseTraceLine(const char* line, const char* end, TraceOp* op)
+{
+    op->type = TraceOp::INVALID;
+    op->key = NULL;
+    op->keyLength = 0;
+    op->valueLength = 0;
+    op->ttl = 0;
+
+    op->type = parseTraceType(line, end);
+    if (op->type == TraceOp::INVALID)
+        return false;
+
+    // Skip the operation and table names; the key is the third token.
+    const char* p = line;
+    for (int field = 0; field < 2; field++) {
+        while (p < end && *p != ' ')
+            p++;
+        while (p < end && *p == ' ')
+            p++;
+    }
+    const char* key = p;
+    while (p < end && *p != ' ' && *p != '\n' && *p != '\r')
+        p++;
+    op->key = key;
+    op->keyLength = p - key;
+
+    switch (op->type) {
+    case TraceOp::READ:
+    case TraceOp::DELETE:
+        break;
+    case TraceOp::INCR:
+    case TraceOp::DECR:
+        op->valueLength = parseTraceNumber(line, end, 1);
+        break;
+    case TraceOp::TOUCH:
+        op->ttl = parseTraceNumber(line, end, 0);
+        break;
+    default:
+        op->valueLength = parseTraceValueLength(line, end);
+        op->ttl = parseTraceTtl(line, end);
+        break;
+    }
+    return true;
+}
+
+/**
+ * A 64-bit hash of a key with well-mixed low and high bits, suitable for
+ * sketches and sampling (FNV-1a followed by a murmur3 finalizer).
+ */
+static inline uint64_t
+hashTraceKey(const char* key, size_t length)
+{
+    uint64_t h = 14695981039346656037UL;
+    for (size_t i = 0; i < length; i++) {
+        h ^= (unsigned char)key[i];
+        h *= 1099511628211UL;
+    }
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdUL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53UL;
+    h ^= h >> 33;
+    return h;
+}
+
+#endif /* !TRACEPARSER_H_ */
@@ -0,0 +1,477 @@
+#include "TraceReader.h"
+#include "Cycles.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <algorithm>
+
+#if HAVE_ZSTD
+#include <zstd.h>
+#endif
+#if HAVE_LZ4
+#include <lz4frame.h>
+#endif
+
+/**
+ * Produces the decoded bytes of a trace file.
+ */
+class TraceReader::Source {
+  public:
+    virtual ~Source() {}
+
+    /**
+     * Decode up to #length bytes of the trace into #buf.
+     * \return
+     *      The number of bytes written, or 0 at the end of the trace.
+     */
+    virtual size_t read(char* buf, size_t length) = 0;
+
+    /**
+     * Move past the next #length bytes of the trace without returning them;
+     * by default they are decoded and dropped.
+     */
+    virtual void
+    skip(uint64_t length)
+    {
+        std::vector<char> scratch(std::min<uint64_t>(length, 1 << 20));
+        while (length > 0) {
+            size_t n = read(scratch.data(),
+                            std::min<uint64_t>(length, scratch.size()));
+            if (n == 0)
+                break;
+            length -= n;
+        }
+    }
+};
+
+namespace {
+
+/// read() that retries on EINTR and short reads; exits on error.
+size_t
+readFully(int fd, char* buf, size_t length)
+{
+    size_t total = 0;
+    while (total < length) {
+        ssize_t n = ::read(fd, buf + total, length - total);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0) {
+            fprintf(stderr, "trace read failed: %s\n", strerror(errno));
+            exit(1);
+        }
+        if (n == 0)
+            break;
+        total += n;
+    }
+    return total;
+}
+
+class PlainSource : public TraceReader::Source {
+  public:
+    explicit PlainSource(int fd)
+        : fd(fd)
+        , offset(0)
+    {
+    }
+
+    ~PlainSource()
+    {
+        close(fd);
+    }
+
+    size_t
+    read(char* buf, size_t length)
+    {
+        // Keep the next read's worth of the file on its way into the page
+        // cache while this one is being parsed. (A no-op under O_DIRECT.)
+        posix_fadvise(fd, offset + length, length, POSIX_FADV_WILLNEED);
+        size_t n = readFully(fd, buf, length);
+        offset += n;
+        return n;
+    }
+
+    void
+    skip(uint64_t length)
+    {
+        offset += length;
+        if (lseek(fd, offset, SEEK_SET) < 0) {
+            fprintf(stderr, "trace seek failed: %s\n", strerror(errno));
+            exit(1);
+        }
+    }
+
+  private:
+    int fd;
+    off_t offset;
+};
+
+#if HAVE_ZSTD
+class ZstdSource : public TraceReader::Source {
+  public:
+    explicit ZstdSource(int fd)
+        : fd(fd)
+        , dctx(ZSTD_createDCtx())
+        , in(ZSTD_DStreamInSize())
+        , input{in.data(), 0, 0}
+        , inputEof(false)
+    {
+    }
+
+    ~ZstdSource()
+    {
+        ZSTD_freeDCtx(dctx);
+        close(fd);
+    }
+
+    size_t
+    read(char* buf, size_t length)
+    {
+        ZSTD_outBuffer output = {buf, length, 0};
+        while (output.pos < output.size) {
+            if (input.pos == input.size && !inputEof) {
+                input.size = readFully(fd, in.data(), in.size());
+                input.pos = 0;
+                inputEof = (input.size == 0);
+            }
+            size_t before = output.pos;
+            size_t rc = ZSTD_decompressStream(dctx, &output, &input);
+            if (ZSTD_isError(rc)) {
+                fprintf(stderr, "zstd decode failed: %s\n",
+                        ZSTD_getErrorName(rc));
+                exit(1);
+            }
+            if (inputEof && input.pos == input.size && output.pos == before)
+                break;
+        }
+        return output.pos;
+    }
+
+  private:
+    int fd;
+    ZSTD_DCtx* dctx;
+    std::vector<char> in;
+    ZSTD_inBuffer input;
+    bool inputEof;
+};
+#endif
+
+#if HAVE_LZ4
+class Lz4Source : public TraceReader::Source {
+  public:
+    explicit Lz4Source(int fd)
+        : fd(fd)
+        , dctx(NULL)
+        , in(256 * 1024)
+        , inPos(0)
+        , inLength(0)
+        , inputEof(false)
+    {
+        LZ4F_errorCode_t rc =
+            LZ4F_createDecompressionContext(&dctx, LZ4F_VERSION);
+        if (LZ4F_isError(rc)) {
+            fprintf(stderr, "lz4 init failed: %s\n", LZ4F_getErrorName(rc));
+            exit(1);
+        }
+    }
+
+    ~Lz4Source()
+    {
+        LZ4F_freeDecompressionContext(dctx);
+        close(fd);
+    }
+
+    size_t
+    read(char* buf, size_t length)
+    {
+        size_t produced = 0;
+        while (produced < length) {
+            if (inPos == inLength && !inputEof) {
+                inLength = readFully(fd, in.data(), in.size());
+                inPos = 0;
+                inputEof = (inLength == 0);
+            }
+            size_t dstSize = length - produced;
+            size_t srcSize = inLength - inPos;
+            size_t rc = LZ4F_decompress(dctx, buf + produced, &dstSize,
+                                        in.data() + inPos, &srcSize, NULL);
+            if (LZ4F_isError(rc)) {
+                fprintf(stderr, "lz4 decode failed: %s\n",
+                        LZ4F_getErrorName(rc));
+                exit(1);
+            }
+            inPos += srcSize;
+            produced += dstSize;
+            if (inputEof && inPos == inLength && dstSize == 0)
+                break;
+        }
+        return produced;
+    }
+
+  private:
+    int fd;
+    LZ4F_dctx* dctx;
+    std::vector<char> in;
+    size_t inPos;
+    size_t inLength;
+    bool inputEof;
+};
+#endif
+
+/**
+ * Open #path and pick a decoder for it from the file's magic number.
+ */
+TraceReader::Source*
+openSource(const char* path, bool directIo, uint64_t startOffset,
+           uint64_t endOffset)
+{
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        fprintf(stderr, "couldn't open %s: %s\n", path, strerror(errno));
+        exit(1);
+    }
+
+    uint8_t magic[4] = {};
+    if (pread(fd, magic, sizeof(magic), 0) < 0) {
+        fprintf(stderr, "couldn't read %s: %s\n", path, strerror(errno));
+        exit(1);
+    }
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+    static const uint8_t zstdMagic[] = { 0x28, 0xb5, 0x2f, 0xfd };
+    static const uint8_t lz4Magic[] = { 0x04, 0x22, 0x4d, 0x18 };
+    if (memcmp(magic, zstdMagic, sizeof(magic)) == 0) {
+#if HAVE_ZSTD
+        return new ZstdSource(fd);
+#else
+        fprintf(stderr, "%s is zstd-compressed, but this build lacks zstd\n",
+                path);
+        exit(1);
+#endif
+    }
+    if (memcmp(magic, lz4Magic, sizeof(magic)) == 0) {
+#if HAVE_LZ4
+        return new Lz4Source(fd);
+#else
+        fprintf(stderr, "%s is lz4-compressed, but this build lacks lz4\n",
+                path);
+        exit(1);
+#endif
+    }
+
+    // O_DIRECT reads must start and end on block boundaries.
+    if (directIo && (startOffset % 4096 != 0 || endOffset != ~0ul)) {
+        fprintf(stderr, "# %s: reading part of the trace; using the page "
+                "cache\n", path);
+        directIo = false;
+    }
+    if (directIo) {
+        int directFd = open(path, O_RDONLY | O_DIRECT);
+        if (directFd >= 0) {
+            close(fd);
+            fd = directFd;
+        } else {
+            fprintf(stderr, "# O_DIRECT unavailable for %s (%s); using the "
+                    "page cache\n", path, strerror(errno));
+        }
+    }
+    return new PlainSource(fd);
+}
+
+} // anonymous namespace
+
+/**
+ * Open a trace and start decoding it in the background.
+ * \param path
+ *      File to read; plain text, or a zstd or lz4 frame.
+ * \param blockSize
+ *      Bytes of decoded trace per block; must exceed MAX_LINE.
+ * \param nBlocks
+ *      Number of blocks in flight between the decoder and the callers.
+ * \param directIo
+ *      Read plain-text traces with O_DIRECT, bypassing the page cache.
+ *      blockSize must then be a multiple of the device's block size.
+ * \param startOffset
+ *      Decoded offset of the first line to return.
+ * \param endOffset
+ *      Decoded offset just past the last line to return.
+ */
+TraceReader::TraceReader(const char* path, size_t blockSize, size_t nBlocks,
+                         bool directIo, uint64_t startOffset,
+                         uint64_t endOffset)
+    : source(openSource(path, directIo, startOffset, endOffset))
+    , blockSize(blockSize)
+    , position(startOffset)
+    , endOffset(endOffset)
+    , blocks(nBlocks)
+    , mutex()
+    , cond()
+    , freeBlocks()
+    , fullBlocks()
+    , nextSequence(0)
+    , eof(false)
+    , quit(false)
+    , stats()
+    , decoder()
+{
+    assert(blockSize > MAX_LINE);
+    for (Block& block : blocks) {
+        void* buffer;
+        if (posix_memalign(&buffer, 4096, MAX_LINE + blockSize) != 0) {
+            fprintf(stderr, "couldn't allocate trace blocks\n");
+            exit(1);
+        }
+        block.buffer = static_cast<char*>(buffer);
+        block.data = block.buffer + MAX_LINE;
+        block.length = 0;
+        block.sequence = 0;
+        block.offset = 0;
+        freeBlocks.push(&block);
+    }
+    decoder = std::thread(&TraceReader::decodeThread, this);
+}
+
+TraceReader::~TraceReader()
+{
+    {
+        std::lock_guard<std::mutex> _(mutex);
+        quit = true;
+    }
+    cond.notify_all();
+    decoder.join();
+
+    for (Block& block : blocks)
+        free(block.buffer);
+    delete source;
+}
+
+/**
+ * Return the next block of the trace, waiting for the decoder if necessary.
+ * \return
+ *      A block of whole lines that the caller must hand back with
+ *      release(), or NULL once the whole trace has been returned.
+ */
+TraceReader::Block*
+TraceReader::next()
+{
+    std::unique_lock<std::mutex> lock(mutex);
+    cond.wait(lock, [this] { return !fullBlocks.empty() || eof; });
+    if (fullBlocks.empty())
+        return NULL;
+    return fullBlocks.pop();
+}
+
+/**
+ * Return a block obtained from next() so the decoder can refill it.
+ */
+void
+TraceReader::release(Block* block)
+{
+    {
+        std::lock_guard<std::mutex> _(mutex);
+        freeBlocks.push(block);
+    }
+    cond.notify_all();
+}
+
+/**
+ * Return a snapshot of the decode thread's counters.
+ */
+TraceReader::Stats
+TraceReader::getStats()
+{
+    std::lock_guard<std::mutex> _(mutex);
+    return stats;
+}
+
+/**
+ * Fill free blocks from the source, moving the partial line at the end of
+ * each block to the front of the next one.
+ */
+void
+TraceReader::decodeThread()
+{
+    std::vector<char> carry;
+    carry.reserve(MAX_LINE);
+    if (position > 0)
+        source->skip(position);
+
+    while (true) {
+        Block* block;
+        uint64_t waitStart = RAMCloud::Cycles::rdtsc();
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            cond.wait(lock, [this] { return quit || !freeBlocks.empty(); });
+            if (quit)
+                return;
+            block = freeBlocks.pop();
+        }
+        uint64_t decodeStart = RAMCloud::Cycles::rdtsc();
+
+        // Decode into the aligned part of the buffer and put the carried
+        // line in the headroom just ahead of it.
+        char* region = block->buffer + MAX_LINE;
+        block->data = region - carry.size();
+        block->offset = position - carry.size();
+        memcpy(block->data, carry.data(), carry.size());
+        size_t length = carry.size();
+        carry.clear();
+
+        bool end = false;
+        size_t filled = 0;
+        while (filled < blockSize) {
+            size_t n = 0;
+            if (position + filled < endOffset) {
+                n = source->read(region + filled,
+                                 std::min<uint64_t>(blockSize - filled,
+                                                    endOffset - position -
+                                                    filled));
+            }
+            if (n == 0) {
+                end = true;
+                break;
+            }
+            filled += n;
+        }
+        length += filled;
+        position += filled;
+
+        if (!end) {
+            const char* lastNewline = static_cast<const char*>(
+                memrchr(block->data, '\n', length));
+            size_t tail = (lastNewline == NULL)
+                ? 0 : block->data + length - (lastNewline + 1);
+            if (tail <= MAX_LINE) {
+                carry.assign(block->data + length - tail,
+                             block->data + length);
+                length -= tail;
+            }
+        }
+        block->length = length;
+
+        uint64_t decodeEnd = RAMCloud::Cycles::rdtsc();
+        {
+            std::lock_guard<std::mutex> _(mutex);
+            if (length > 0) {
+                block->sequence = nextSequence++;
+                fullBlocks.push(block);
+            } else {
+                freeBlocks.push(block);
+            }
+            eof = end;
+            stats.bytes += filled;
+            stats.blocks++;
+            stats.decodeCycles += decodeEnd - decodeStart;
+            stats.stallCycles += decodeStart - waitStart;
+        }
+        cond.notify_all();
+
+        if (end)
+            return;
+    }
+}
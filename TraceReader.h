@@ -0,0 +1,113 @@
+#ifndef TRACEREADER_H_
+#define TRACEREADER_H_
+
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "FifoQueue.h"
+
+/**
+ * Reads a trace file ahead of the replay on a dedicated thread and hands it
+ * out as large blocks that each hold only whole lines. Plain text and
+ * zstd- or lz4-framed files (recognized by their magic numbers) are
+ * supported; compressed input is decoded straight into the blocks, so the
+ * only copying is of the partial line left at the end of each block, which
+ * is placed in headroom just ahead of the next block's data.
+ *
+ * Blocks are page aligned so plain files can optionally be read with
+ * O_DIRECT; otherwise the kernel is asked to read ahead of the decoder.
+ * A reader can be limited to a range of the decoded trace, which must start
+ * and end on line boundaries (see TraceIndex); plain files seek straight to
+ * the start, while compressed ones are decoded up to it.
+ * Several threads may call next() and release() concurrently; each block
+ * carries its position in the file so their results can be put back in
+ * order.
+ *
+ * Typical use:
+ *
+ *   TraceReader reader(path);
+ *   while (TraceReader::Block* block = reader.next()) {
+ *       ... parse block->data[0 .. block->length) ...
+ *       reader.release(block);
+ *   }
+ */
+class TraceReader {
+  public:
+    struct Block {
+        /// First byte of the first line in the block.
+        char* data;
+        size_t length;
+
+        /// Position of this block in the trace, counting from 0.
+        uint64_t sequence;
+
+        /// Offset of #data in the decoded trace.
+        uint64_t offset;
+
+        /// Start of the allocation: MAX_LINE bytes of headroom for the line
+        /// carried over from the previous block, then blockSize bytes.
+        char* buffer;
+    };
+
+    /// Totals describing how hard the decode thread has been working.
+    struct Stats {
+        uint64_t bytes;
+        uint64_t blocks;
+
+        /// Cycles spent reading and decoding.
+        uint64_t decodeCycles;
+
+        /// Cycles spent waiting for a free block: time in which the
+        /// consumers, not the trace source, were the bottleneck.
+        uint64_t stallCycles;
+    };
+
+    class Source;
+
+    explicit TraceReader(const char* path,
+                         size_t blockSize = 4 * 1024 * 1024,
+                         size_t nBlocks = 4,
+                         bool directIo = false,
+                         uint64_t startOffset = 0,
+                         uint64_t endOffset = ~0ul);
+    ~TraceReader();
+
+    Block* next();
+    void release(Block* block);
+    Stats getStats();
+
+  private:
+    void decodeThread();
+
+    /// Upper bound on the length of a line carried from one block to the
+    /// next; longer lines are split, as fgets() into a fixed buffer would.
+    static const size_t MAX_LINE = 64 * 1024;
+
+    Source* source;
+    const size_t blockSize;
+
+    /// Decoded offset of the next byte from #source, and where to stop.
+    uint64_t position;
+    const uint64_t endOffset;
+    std::vector<Block> blocks;
+
+    std::mutex mutex;
+    std::condition_variable cond;
+    FifoQueue<Block*> freeBlocks;
+    FifoQueue<Block*> fullBlocks;
+    uint64_t nextSequence;
+    bool eof;
+    bool quit;
+    Stats stats;
+
+    std::thread decoder;
+
+    TraceReader(const TraceReader&) = delete;
+    TraceReader& operator=(const TraceReader&) = delete;
+};
+
+#endif /* !TRACEREADER_H_ */
@@ -0,0 +1,384 @@
+#ifndef TRACETOKENIZER_H_
+#define TRACETOKENIZER_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
+#include "TraceParser.h"
+
+/**
+ * Parses whole buffers of YCSB text output into TraceOps, with the same
+ * results as calling parseTraceLine() on each line, but without walking the
+ * lines a byte at a time.
+ *
+ * The 64 bytes at the start of each line are classified into bitmasks of
+ * newlines, spaces, brackets and carriage returns with AVX2 or SSE2; other
+ * machines just run parseTraceLine() line by line. For a well-formed line
+ * those masks give the key, the brackets and the end of the line with a
+ * handful of bit operations, and the field data of longer writes is skipped
+ * 64 bytes at a time looking only for ']' and '\n'.
+ * Anything unusual (runs of spaces, carriage returns in the key, a key that
+ * runs out of the window) is handed to parseTraceLine().
+ */
+class TraceTokenizer {
+  public:
+    enum Isa {
+        SCALAR,
+        SSE2,
+        AVX2
+    };
+
+    explicit TraceTokenizer(Isa isa = bestIsa())
+        : isa(isa)
+    {
+    }
+
+    /// The fastest classifier this machine supports.
+    static Isa
+    bestIsa()
+    {
+#if defined(__x86_64__)
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx2"))
+            return AVX2;
+        return SSE2;
+#else
+        return SCALAR;
+#endif
+    }
+
+    static bool
+    supported(Isa isa)
+    {
+        return isa <= bestIsa();
+    }
+
+    static const char*
+    isaName(Isa isa)
+    {
+        switch (isa) {
+        case AVX2:
+            return "avx2";
+        case SSE2:
+            return "sse2";
+        default:
+            return "scalar";
+        }
+    }
+
+    Isa
+    getIsa() const
+    {
+        return isa;
+    }
+
+    /**
+     * Parse the lines in [begin, end) into #ops, skipping lines that are not
+     * operations, until the buffer ends or #maxOps operations have been
+     * parsed. #begin must be the start of a line; a last line without a
+     * newline ends at #end.
+     *
+     * \param[out] nOps
+     *      Set to the number of operations stored in #ops.
+     * \return
+     *      The start of the first line not parsed; #end once the whole
+     *      buffer has been.
+     */
+    const char*
+    tokenize(const char* begin, const char* end, TraceOp* ops, size_t maxOps,
+             size_t* nOps)
+    {
+        switch (isa) {
+#if defined(__x86_64__)
+        case AVX2:
+            return scanAvx2(begin, end, ops, maxOps, nOps);
+        case SSE2:
+            return scan<Sse2>(begin, end, ops, maxOps, nOps);
+#endif
+        default:
+            return scanLines(begin, end, ops, maxOps, nOps);
+        }
+    }
+
+  private:
+    /// Bitmasks over 64 bytes; bit i describes byte i.
+    struct Masks {
+        uint64_t newlines;
+        uint64_t spaces;
+        uint64_t opens;
+        uint64_t closes;
+        uint64_t returns;
+    };
+
+#if defined(__x86_64__)
+    struct Sse2 {
+        __attribute__((always_inline)) static inline uint64_t
+        matches(__m128i a, __m128i b, __m128i c, __m128i d, char ch)
+        {
+            __m128i pattern = _mm_set1_epi8(ch);
+            uint64_t mask =
+                (uint16_t)_mm_movemask_epi8(_mm_cmpeq_epi8(a, pattern));
+            mask |= (uint64_t)(uint16_t)_mm_movemask_epi8(
+                        _mm_cmpeq_epi8(b, pattern)) << 16;
+            mask |= (uint64_t)(uint16_t)_mm_movemask_epi8(
+                        _mm_cmpeq_epi8(c, pattern)) << 32;
+            mask |= (uint64_t)(uint16_t)_mm_movemask_epi8(
+                        _mm_cmpeq_epi8(d, pattern)) << 48;
+            return mask;
+        }
+
+        __attribute__((always_inline)) static inline Masks
+        classify(const char* p)
+        {
+            const __m128i* v = reinterpret_cast<const __m128i*>(p);
+            __m128i a = _mm_loadu_si128(v);
+            __m128i b = _mm_loadu_si128(v + 1);
+            __m128i c = _mm_loadu_si128(v + 2);
+            __m128i d = _mm_loadu_si128(v + 3);
+            Masks m;
+            m.newlines = matches(a, b, c, d, '\n');
+            m.spaces = matches(a, b, c, d, ' ');
+            m.opens = matches(a, b, c, d, '[');
+            m.closes = matches(a, b, c, d, ']');
+            m.returns = matches(a, b, c, d, '\r');
+            return m;
+        }
+    };
+
+    struct Avx2 {
+        __attribute__((target("avx2"))) static uint64_t
+        matches(__m256i lo, __m256i hi, char c)
+        {
+            __m256i pattern = _mm256_set1_epi8(c);
+            uint32_t low =
+                _mm256_movemask_epi8(_mm256_cmpeq_epi8(lo, pattern));
+            uint32_t high =
+                _mm256_movemask_epi8(_mm256_cmpeq_epi8(hi, pattern));
+            return (uint64_t)high << 32 | low;
+        }
+
+        __attribute__((target("avx2"))) static Masks
+        classify(const char* p)
+        {
+            __m256i lo =
+                _mm256_loadu_si256(reinterpret_cast<const __m256i*>(p));
+            __m256i hi =
+                _mm256_loadu_si256(reinterpret_cast<const __m256i*>(p + 32));
+            Masks m;
+            m.newlines = matches(lo, hi, '\n');
+            m.spaces = matches(lo, hi, ' ');
+            m.opens = matches(lo, hi, '[');
+            m.closes = matches(lo, hi, ']');
+            m.returns = matches(lo, hi, '\r');
+            return m;
+        }
+    };
+
+    // scan() compiled for AVX2, so that the classifier is inlined into it.
+    __attribute__((target("avx2"))) static const char*
+    scanAvx2(const char* begin, const char* end, TraceOp* ops, size_t maxOps,
+             size_t* nOps)
+    {
+        return scan<Avx2>(begin, end, ops, maxOps, nOps);
+    }
+#endif
+
+    /// Bits for bytes [0, n) of a window; n may be 64.
+    static uint64_t
+    below(int n)
+    {
+        return (n >= 64) ? ~0ul : (1ul << n) - 1;
+    }
+
+    /// Classify the 64 bytes at #p; bytes past #end match nothing.
+    template <typename Classifier>
+    __attribute__((always_inline)) static inline Masks
+    window(const char* p, const char* end)
+    {
+        if (end - p >= 64)
+            return Classifier::classify(p);
+        char padded[64] = {0};
+        memcpy(padded, p, end - p);
+        return Classifier::classify(padded);
+    }
+
+    /// The first '\n' (or, with #orClose, ']') at or after #p; else #end.
+    template <typename Classifier>
+    __attribute__((always_inline)) static inline const char*
+    find(const char* p, const char* end, bool orClose)
+    {
+        for (; p < end; p += 64) {
+            Masks m = window<Classifier>(p, end);
+            uint64_t hits = m.newlines | (orClose ? m.closes : 0);
+            if (hits != 0)
+                return p + __builtin_ctzll(hits);
+        }
+        return end;
+    }
+
+    /**
+     * Parse the line at #line, which holds an operation of type #type, into
+     * #op given the masks #m of its first 64 bytes.
+     *
+     * \return
+     *      The end of the line: its newline, or #end.
+     */
+    template <typename Classifier>
+    __attribute__((always_inline)) static inline const char*
+    parseLine(const char* line, const char* end, const Masks& m,
+              TraceOp::Type type, TraceOp* op)
+    {
+        // Bits of the window that belong to this line, and its end if the
+        // window reaches it.
+        const char* lineEnd = NULL;
+        uint64_t inLine = ~0ul;
+        if (m.newlines != 0) {
+            int length = __builtin_ctzll(m.newlines);
+            lineEnd = line + length;
+            inLine = below(length);
+        } else if (end - line <= 64) {
+            lineEnd = end;
+        }
+
+        // Counters and TOUCH are rare enough not to need a fast path.
+        if (type == TraceOp::INCR || type == TraceOp::DECR ||
+            type == TraceOp::TOUCH) {
+            return slowLine<Classifier>(line, end, lineEnd, op);
+        }
+
+        // The common case: the operation and table names are each followed
+        // by a single space, and the key ends in the window at a space or
+        // at the end of the line.
+        uint64_t spaces = m.spaces & inLine;
+        if (__builtin_popcountll(spaces) < 2)
+            return slowLine<Classifier>(line, end, lineEnd, op);
+        int first = __builtin_ctzll(spaces);
+        spaces &= spaces - 1;
+        int second = __builtin_ctzll(spaces);
+        if (second == first + 1 || second == 63 ||
+            (m.spaces >> (second + 1) & 1) != 0) {
+            return slowLine<Classifier>(line, end, lineEnd, op);
+        }
+        uint64_t keyStops = (m.spaces | m.returns) & inLine & ~below(second + 1);
+        int keyEnd;
+        if (keyStops != 0)
+            keyEnd = __builtin_ctzll(keyStops);
+        else if (lineEnd != NULL)
+            keyEnd = (int)(lineEnd - line);
+        else
+            return slowLine<Classifier>(line, end, lineEnd, op);
+
+        op->type = type;
+        op->key = line + second + 1;
+        op->keyLength = keyEnd - (second + 1);
+        op->valueLength = 0;
+        op->ttl = 0;
+        if (type == TraceOp::READ || type == TraceOp::DELETE)
+            return (lineEnd != NULL) ? lineEnd
+                                     : find<Classifier>(line + 64, end, false);
+
+        // The value length runs from the first '[' to the first ']' after it.
+        uint64_t opens = m.opens & inLine;
+        if (opens != 0) {
+            int open = __builtin_ctzll(opens);
+            uint64_t closes = m.closes & inLine & ~below(open + 1);
+            const char* close;
+            if (closes != 0) {
+                close = line + __builtin_ctzll(closes);
+            } else if (lineEnd != NULL) {
+                close = lineEnd;
+            } else {
+                close = find<Classifier>(line + 64, end, true);
+                lineEnd = (close < end && *close == ']')
+                        ? find<Classifier>(close, end, false) : close;
+            }
+            op->valueLength = (int)(close - (line + open)) - 10;
+            if (lineEnd == NULL)
+                lineEnd = find<Classifier>(line + 64, end, false);
+            if (close + 1 < lineEnd && close[1] == ' ')
+                op->ttl = parseTraceTtl(line, lineEnd);
+            return lineEnd;
+        }
+
+        // No brackets: the length is the next token, if the window holds
+        // the whole line and the key was followed by a single space.
+        if (lineEnd == NULL || line + keyEnd >= lineEnd || keyEnd >= 63 ||
+            line[keyEnd] != ' ' ||
+            (m.spaces >> (keyEnd + 1) & 1) != 0) {
+            return slowLine<Classifier>(line, end, lineEnd, op);
+        }
+        int length = 0;
+        const char* p = line + keyEnd + 1;
+        for (; p < lineEnd && *p >= '0' && *p <= '9'; p++)
+            length = length * 10 + (*p - '0');
+        op->valueLength = length;
+        if (p < lineEnd && *p == ' ')
+            op->ttl = parseTraceTtl(line, lineEnd);
+        return lineEnd;
+    }
+
+    /// Parse a line the fast path can't with parseTraceLine().
+    template <typename Classifier>
+    __attribute__((always_inline)) static inline const char*
+    slowLine(const char* line, const char* end, const char* lineEnd,
+             TraceOp* op)
+    {
+        if (lineEnd == NULL)
+            lineEnd = find<Classifier>(line + 64, end, false);
+        parseTraceLine(line, lineEnd, op);
+        return lineEnd;
+    }
+
+    /// The scalar fallback: one parseTraceLine() per line.
+    static const char*
+    scanLines(const char* begin, const char* end, TraceOp* ops, size_t maxOps,
+              size_t* nOps)
+    {
+        size_t n = 0;
+        const char* line = begin;
+        while (line < end && n < maxOps) {
+            const char* newline =
+                static_cast<const char*>(memchr(line, '\n', end - line));
+            const char* lineEnd = (newline == NULL) ? end : newline;
+            if (parseTraceLine(line, lineEnd, &ops[n]))
+                n++;
+            line = lineEnd + 1;
+        }
+        *nOps = n;
+        return (line < end) ? line : end;
+    }
+
+    template <typename Classifier>
+    __attribute__((always_inline)) static inline const char*
+    scan(const char* begin, const char* end, TraceOp* ops, size_t maxOps,
+         size_t* nOps)
+    {
+        size_t n = 0;
+        const char* line = begin;
+        while (line < end && n < maxOps) {
+            TraceOp::Type type = parseTraceType(line, end);
+            Masks m = window<Classifier>(line, end);
+            const char* lineEnd;
+            if (type == TraceOp::INVALID) {
+                lineEnd = (m.newlines != 0)
+                        ? line + __builtin_ctzll(m.newlines)
+                        : find<Classifier>(line + 64, end, false);
+            } else {
+                lineEnd = parseLine<Classifier>(line, end, m, type, &ops[n]);
+                n++;
+            }
+            line = lineEnd + 1;
+        }
+        *nOps = n;
+        return (line < end) ? line : end;
+    }
+
+    Isa isa;
+};
+
+#endif /* !TRACETOKENIZER_H_ */
@@ -0,0 +1,292 @@
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <algorithm>
+#include <mutex>
+
+#include "Cycles.h"
+#include "TtlModel.h"
+
+namespace {
+
+/// memcached takes larger exptimes as absolute Unix times.
+const double MAX_TTL = 60 * 60 * 24 * 30;
+
+/// Parse all of #text as a number of seconds, or exit.
+double
+parseSeconds(const char* text, const char* spec)
+{
+    char* end;
+    double value = strtod(text, &end);
+    if (end == text || (*end != '\0' && *end != ':') || value < 0) {
+        fprintf(stderr, "bad TTL rule %s\n", spec);
+        exit(1);
+    }
+    return value;
+}
+
+} // anonymous namespace
+
+TtlModel::TtlModel()
+    : rules()
+    , useTrace(false)
+    , compression(1.0)
+{
+}
+
+/**
+ * Add a rule, tried after those already added: "trace" to take TTLs from
+ * the trace, or MATCH=DISTRIBUTION as described for the class. Exits if
+ * #spec is malformed.
+ */
+void
+TtlModel::addRule(const char* spec)
+{
+    if (strcmp(spec, "trace") == 0) {
+        useTrace = true;
+        return;
+    }
+    const char* equals = strchr(spec, '=');
+    if (equals == NULL) {
+        fprintf(stderr, "bad TTL rule %s (trace or MATCH=DISTRIBUTION)\n",
+                spec);
+        exit(1);
+    }
+
+    Rule rule{};
+    rule.spec = spec;
+    std::string match(spec, equals - spec);
+    if (match == "*") {
+        rule.match = Rule::ANY;
+    } else if (match == "insert" || match == "update" || match == "refill") {
+        rule.match = Rule::WRITE;
+        rule.write = match == "insert" ? INSERT
+                   : match == "update" ? UPDATE : REFILL;
+    } else {
+        rule.match = Rule::PREFIX;
+        rule.prefix = match;
+    }
+
+    const char* dist = equals + 1;
+    if (strcmp(dist, "never") == 0) {
+        rule.shape = Rule::NEVER;
+    } else if (strncmp(dist, "uniform:", 8) == 0) {
+        rule.shape = Rule::UNIFORM;
+        rule.a = parseSeconds(dist + 8, spec);
+        const char* colon = strchr(dist + 8, ':');
+        if (colon == NULL) {
+            fprintf(stderr, "bad TTL rule %s (uniform:LOW:HIGH)\n", spec);
+            exit(1);
+        }
+        rule.b = parseSeconds(colon + 1, spec);
+        if (rule.b < rule.a)
+            std::swap(rule.a, rule.b);
+    } else if (strncmp(dist, "exp:", 4) == 0) {
+        rule.shape = Rule::EXPONENTIAL;
+        rule.a = parseSeconds(dist + 4, spec);
+    } else {
+        rule.shape = Rule::FIXED;
+        rule.a = parseSeconds(dist, spec);
+        if (rule.a == 0)
+            rule.shape = Rule::NEVER;
+    }
+    rules.push_back(rule);
+}
+
+/// Run TTLs #factor times faster than the trace (-E).
+void
+TtlModel::setCompression(double factor)
+{
+    if (factor <= 0) {
+        fprintf(stderr, "TTL compression factor must be positive\n");
+        exit(1);
+    }
+    compression = factor;
+}
+
+/**
+ * Return the TTL to give the store for a write of #key, already compressed;
+ * 0 if it should never expire.
+ *
+ * \param keyHash
+ *      hashTraceKey() of the key.
+ * \param traceTtl
+ *      The TTL the trace gives the write, or 0.
+ */
+uint32_t
+TtlModel::ttlFor(Write write, const char* key, size_t keyLength,
+                 uint64_t keyHash, int traceTtl) const
+{
+    if (useTrace && traceTtl > 0)
+        return compress(traceTtl);
+
+    for (size_t i = 0; i < rules.size(); i++) {
+        const Rule& rule = rules[i];
+        if (rule.match == Rule::WRITE && rule.write != write)
+            continue;
+        if (rule.match == Rule::PREFIX &&
+            (keyLength < rule.prefix.size() ||
+             memcmp(key, rule.prefix.data(), rule.prefix.size()) != 0)) {
+            continue;
+        }
+
+        // A uniform draw in [0, 1) from the key, different for each rule.
+        uint64_t h = keyHash ^ (0x9e3779b97f4a7c15UL * (i + 1));
+        h ^= h >> 31;
+        h *= 0xbf58476d1ce4e5b9UL;
+        h ^= h >> 29;
+        double u = double(h >> 11) * (1.0 / 9007199254740992.0);
+
+        switch (rule.shape) {
+        case Rule::NEVER:
+            return 0;
+        case Rule::FIXED:
+            return compress(rule.a);
+        case Rule::UNIFORM:
+            return compress(rule.a + (rule.b - rule.a) * u);
+        case Rule::EXPONENTIAL:
+            return compress(-rule.a * log1p(-u));
+        }
+    }
+    return 0;
+}
+
+void
+TtlModel::print(FILE* out) const
+{
+    fprintf(out, "# TTLs:");
+    if (useTrace)
+        fprintf(out, " from the trace,");
+    for (const Rule& rule : rules)
+        fprintf(out, " %s,", rule.spec.c_str());
+    fprintf(out, " otherwise never; %gx compression\n", compression);
+}
+
+/// Scale #seconds of trace time to a whole number of replay seconds.
+uint32_t
+TtlModel::compress(double seconds) const
+{
+    double scaled = ceil(seconds / compression);
+    return uint32_t(std::min(std::max(scaled, 1.0), MAX_TTL));
+}
+
+/**
+ * Make room for about #capacity keys, rounded up to whole sets in each
+ * stripe.
+ */
+MissClassifier::MissClassifier(size_t capacity)
+    : stripes()
+    , slackCycles(RAMCloud::Cycles::fromSeconds(1.0))
+{
+    size_t sets = 1;
+    while (sets * WAYS * N_STRIPES < capacity)
+        sets *= 2;
+    for (Stripe& stripe : stripes) {
+        stripe.lock.v_ = 0;
+        stripe.entries.resize(sets * WAYS);
+        stripe.forgotten = 0;
+    }
+}
+
+/// Note that #keyHash was just stored with #ttl (0 for never).
+void
+MissClassifier::written(uint64_t keyHash, uint32_t ttl)
+{
+    uint64_t deadline = 0;
+    if (ttl != 0) {
+        deadline = RAMCloud::Cycles::rdtsc() +
+                   RAMCloud::Cycles::fromSeconds(ttl);
+    }
+    setDeadline(keyHash, deadline);
+}
+
+/// Note that #keyHash was just deleted.
+void
+MissClassifier::removed(uint64_t keyHash)
+{
+    setDeadline(keyHash, REMOVED);
+}
+
+/// Say why a GET of #keyHash just missed.
+MissClassifier::Kind
+MissClassifier::classify(uint64_t keyHash)
+{
+    Stripe& stripe = stripes[keyHash >> 58];
+    uint64_t deadline;
+    {
+        std::lock_guard<SpinLock> _(stripe.lock);
+        Entry* entry = find(stripe, keyHash, false);
+        if (entry == NULL)
+            return COLD;
+        deadline = entry->deadline;
+    }
+    if (deadline == REMOVED)
+        return DELETED;
+    if (deadline != 0 && RAMCloud::Cycles::rdtsc() + slackCycles >= deadline)
+        return EXPIRED;
+    return EVICTED;
+}
+
+/// Return how many keys have been displaced to make room for others.
+uint64_t
+MissClassifier::forgotten()
+{
+    uint64_t total = 0;
+    for (Stripe& stripe : stripes) {
+        std::lock_guard<SpinLock> _(stripe.lock);
+        total += stripe.forgotten;
+    }
+    return total;
+}
+
+/**
+ * Return #keyHash's entry in #stripe, whose lock the caller holds, or NULL
+ * if it has none. With #add, give it one if need be, in an empty entry of
+ * its set or else in place of the key that expires first; one that never
+ * does, or was deleted, goes last.
+ */
+MissClassifier::Entry*
+MissClassifier::find(Stripe& stripe, uint64_t keyHash, bool add)
+{
+    uint64_t tag = keyHash | 1;
+    size_t sets = stripe.entries.size() / WAYS;
+    Entry* set = &stripe.entries[((keyHash >> 1) & (sets - 1)) * WAYS];
+    Entry* victim = NULL;
+    for (int i = 0; i < WAYS; i++) {
+        Entry& entry = set[i];
+        if (entry.tag == tag)
+            return &entry;
+        // Less one, never (0) and REMOVED sort after every real deadline.
+        if (victim == NULL ||
+                (victim->tag != 0 &&
+                 (entry.tag == 0 ||
+                  entry.deadline - 1 < victim->deadline - 1))) {
+            victim = &entry;
+        }
+    }
+    if (!add)
+        return NULL;
+    if (victim->tag != 0)
+        stripe.forgotten++;
+    victim->tag = tag;
+    return victim;
+}
+
+/// Record #deadline for #keyHash, as written() and removed() describe.
+void
+MissClassifier::setDeadline(uint64_t keyHash, uint64_t deadline)
+{
+    Stripe& stripe = stripes[keyHash >> 58];
+    std::lock_guard<SpinLock> _(stripe.lock);
+    find(stripe, keyHash, true)->deadline = deadline;
+}
+
+const char*
+MissClassifier::kindName(Kind kind)
+{
+    static const char* const names[] = {"cold", "expired", "evicted",
+                                        "deleted"};
+    return names[kind];
+}
@@ -0,0 +1,158 @@
+#ifndef TTLMODEL_H_
+#define TTLMODEL_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <string>
+#include <vector>
+
+#include <boost/smart_ptr/detail/spinlock.hpp>
+
+/**
+ * Decides how long each value a replay writes should live (-e), and how
+ * fast TTLs run during the replay compared with the trace (-E).
+ *
+ * A write takes the TTL recorded in the trace, if rules include "trace" and
+ * the line has one, and otherwise the first rule that matches it. A rule
+ * matches a kind of write (insert, update, or refill, the write-back after
+ * a GET misses), a key prefix, or everything (*), and gives a distribution
+ * of TTLs in seconds: a fixed number, uniform:LOW:HIGH, exp:MEAN, or never.
+ * Draws come from a hash of the key, so a key gets the same TTL each time a
+ * rule applies to it and replays are repeatable. A write nothing matches
+ * never expires.
+ *
+ * TTLs are in trace time. With a compression factor F the store is asked
+ * to keep each value for 1/F of its TTL, rounded up to the whole second
+ * that memcached counts in, so hour-long TTLs play out in a short replay.
+ */
+class TtlModel {
+  public:
+    enum Write {
+        INSERT,
+        UPDATE,
+        REFILL
+    };
+
+    TtlModel();
+
+    void addRule(const char* spec);
+    void setCompression(double factor);
+
+    /// True if any write can be given a TTL.
+    bool
+    isEnabled() const
+    {
+        return useTrace || !rules.empty();
+    }
+
+    uint32_t ttlFor(Write write, const char* key, size_t keyLength,
+                    uint64_t keyHash, int traceTtl) const;
+    void print(FILE* out) const;
+
+  private:
+    struct Rule {
+        enum Match {
+            ANY,
+            WRITE,
+            PREFIX
+        };
+        enum Shape {
+            NEVER,
+            FIXED,
+            UNIFORM,
+            EXPONENTIAL
+        };
+
+        std::string spec;
+        Match match;
+        Write write;
+        std::string prefix;
+        Shape shape;
+        double a;
+        double b;
+    };
+
+    uint32_t compress(double seconds) const;
+
+    std::vector<Rule> rules;
+    bool useTrace;
+    double compression;
+};
+
+/**
+ * Tells the reasons for GET misses apart by remembering when the store was
+ * told each key written during the replay would expire: a miss on a key
+ * never written is cold, one after its TTL ran out is an expiry, one after
+ * the replay deleted the key is a deletion, and any other is taken to be an
+ * eviction. Keys are remembered by hash, in striped tables that any worker
+ * may update.
+ *
+ * The tables hold a fixed number of keys, in sets of four that share a
+ * cache line. A key written when its set is full takes the place of the
+ * one that expires first, and a later miss on the key it displaced is
+ * taken for a cold one; forgotten() says how often that happened.
+ */
+class MissClassifier {
+  public:
+    enum Kind {
+        COLD,
+        EXPIRED,
+        EVICTED,
+        DELETED
+    };
+    static const int N_KINDS = 4;
+
+    /// Keys remembered unless the constructor is told otherwise: 32 MB.
+    static const size_t DEFAULT_CAPACITY = 1 << 21;
+
+    explicit MissClassifier(size_t capacity = DEFAULT_CAPACITY);
+
+    void written(uint64_t keyHash, uint32_t ttl);
+    void removed(uint64_t keyHash);
+    Kind classify(uint64_t keyHash);
+    uint64_t forgotten();
+
+    static const char* kindName(Kind kind);
+
+  private:
+    typedef boost::detail::spinlock SpinLock;
+
+    static const int N_STRIPES = 64;
+    static const int WAYS = 4;
+
+    /// A deadline meaning the key was deleted.
+    static const uint64_t REMOVED = ~0ul;
+
+    struct Entry {
+        /// The key's hash with the low bit set, or 0 for an empty entry.
+        uint64_t tag;
+
+        /// Cycles::rdtsc() at which the key expires, 0 for never, or
+        /// REMOVED.
+        uint64_t deadline;
+    };
+
+    struct Stripe {
+        SpinLock lock;
+
+        /// Sets of WAYS entries, a power of two of them.
+        std::vector<Entry> entries;
+
+        /// Keys displaced to make room for others.
+        uint64_t forgotten;
+        char pad[64 - (sizeof(SpinLock) + sizeof(std::vector<Entry>) +
+                       sizeof(uint64_t)) % 64];
+    };
+
+    Entry* find(Stripe& stripe, uint64_t keyHash, bool add);
+    void setDeadline(uint64_t keyHash, uint64_t deadline);
+
+    Stripe stripes[N_STRIPES];
+
+    /// Stores count time in whole seconds, so an item may expire up to a
+    /// second before its exact deadline.
+    const uint64_t slackCycles;
+};
+
+#endif /* !TTLMODEL_H_ */
@@ -0,0 +1,468 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include <string>
+#include <vector>
+
+#if HAVE_ZSTD
+#include <zstd.h>
+#endif
+#if HAVE_LZ4
+#include <lz4.h>
+#endif
+
+#include "Cycles.h"
+#include "ValueCompression.h"
+
+namespace {
+
+/// Marks a compressed value; the low bits name the codec.
+const uint8_t COMPRESSED = 0x80;
+
+/// The marker byte and the original length, little-endian.
+const size_t HEADER_LENGTH = 5;
+
+/// Longer original lengths mean the header is not one of ours.
+const uint32_t MAX_VALUE_LENGTH = 64 << 20;
+
+const char* const codecNames[] = {"none", "lz4", "zstd"};
+
+} // anonymous namespace
+
+/**
+ * A KVBackend that compresses values on their way to another and
+ * decompresses them on their way back (see ValueCompression). One per
+ * worker, like the backend it wraps, so its counts are its own until it
+ * adds them to the totals at the end.
+ */
+class CompressingBackend : public KVBackend {
+  public:
+    CompressingBackend(std::unique_ptr<KVBackend> backend,
+                       ValueCompression& settings)
+        : backend(std::move(backend))
+        , settings(settings)
+        , counts()
+        , fetched()
+        , decoded()
+        , single()
+        , encoded()
+        , copies()
+        , saved()
+#if HAVE_ZSTD
+        , cctx(ZSTD_createCCtx())
+        , dctx(ZSTD_createDCtx())
+#endif
+    {
+    }
+
+    ~CompressingBackend()
+    {
+        {
+            std::lock_guard<std::mutex> _(settings.totalsMutex);
+            settings.totals.add(counts);
+        }
+#if HAVE_ZSTD
+        ZSTD_freeCCtx(cctx);
+        ZSTD_freeDCtx(dctx);
+#endif
+    }
+
+    Status
+    get(const char* key, size_t keyLength, size_t* valueLength,
+        std::string* value)
+    {
+        Status status = backend->get(key, keyLength, valueLength, &fetched);
+        if (status == OK)
+            decode(fetched, valueLength, value);
+        return status;
+    }
+
+    Status
+    set(const char* key, size_t keyLength, const char* value,
+        size_t valueLength, uint32_t ttl)
+    {
+        encode(&value, &valueLength, &single);
+        return backend->set(key, keyLength, value, valueLength, ttl);
+    }
+
+    Status
+    remove(const char* key, size_t keyLength)
+    {
+        return backend->remove(key, keyLength);
+    }
+
+    Status
+    touch(const char* key, size_t keyLength, uint32_t ttl)
+    {
+        return backend->touch(key, keyLength, ttl);
+    }
+
+    Status
+    gets(const char* key, size_t keyLength, size_t* valueLength,
+         uint64_t* cas)
+    {
+        return backend->gets(key, keyLength, valueLength, cas);
+    }
+
+    Status
+    cas(const char* key, size_t keyLength, const char* value,
+        size_t valueLength, uint32_t ttl, uint64_t cas)
+    {
+        encode(&value, &valueLength, &single);
+        return backend->cas(key, keyLength, value, valueLength, ttl, cas);
+    }
+
+    Status
+    append(const char* key, size_t keyLength, const char* value,
+           size_t valueLength, bool prepend)
+    {
+        return backend->append(key, keyLength, value, valueLength, prepend);
+    }
+
+    Status
+    incr(const char* key, size_t keyLength, uint64_t amount, bool decrement,
+         uint64_t* counter)
+    {
+        return backend->incr(key, keyLength, amount, decrement, counter);
+    }
+
+    void
+    multiGet(Request* requests, size_t count)
+    {
+        fetchAll(requests, count, true);
+    }
+
+    /**
+     * Pass the batch on whole, with each write's value encoded and each
+     * GET's value fetched so it can be decoded; #requests are left as they
+     * were given, apart from the results.
+     */
+    void
+    submit(Request* requests, size_t count)
+    {
+        fetchAll(requests, count, false);
+    }
+
+    bool
+    serverStats(ServerStats* stats)
+    {
+        return backend->serverStats(stats);
+    }
+
+    const char*
+    errorString()
+    {
+        return backend->errorString();
+    }
+
+  private:
+    void
+    fetchAll(Request* requests, size_t count, bool getsOnly)
+    {
+        if (encoded.size() < count)
+            encoded.resize(count);
+        if (copies.size() < count)
+            copies.resize(count);
+        saved.assign(requests, requests + count);
+        for (size_t i = 0; i < count; i++) {
+            Request& r = requests[i];
+            if (r.type == Request::GET)
+                r.data = &copies[i];
+            else if (r.type == Request::SET || r.type == Request::CAS)
+                encode(&r.value, &r.valueLength, &encoded[i]);
+        }
+        if (getsOnly)
+            backend->multiGet(requests, count);
+        else
+            backend->submit(requests, count);
+        for (size_t i = 0; i < count; i++) {
+            Request& r = requests[i];
+            r.value = saved[i].value;
+            r.data = saved[i].data;
+            if (r.type == Request::SET || r.type == Request::CAS)
+                r.valueLength = saved[i].valueLength;
+            else if (r.type == Request::GET && r.status == OK)
+                decode(copies[i], &r.valueLength, r.data);
+        }
+    }
+
+    /**
+     * Compress the value at *#value if it is long enough and shrinks,
+     * pointing *#value and *#length at the result in #buffer.
+     */
+    void
+    encode(const char** value, size_t* length, std::string* buffer)
+    {
+        counts.valuesWritten++;
+        counts.rawBytesWritten += *length;
+        if (settings.codec == ValueCompression::NONE ||
+            *length < settings.threshold || *length > UINT32_MAX) {
+            counts.bytesSent += *length;
+            return;
+        }
+
+        uint64_t start = RAMCloud::Cycles::rdtsc();
+        buffer->resize(HEADER_LENGTH + *length);
+        size_t packed = compress(*value, *length, &(*buffer)[HEADER_LENGTH],
+                                 *length);
+        counts.compressCycles += RAMCloud::Cycles::rdtsc() - start;
+
+        // Give up unless the header and all fit in less than the original.
+        if (packed == 0 || HEADER_LENGTH + packed >= *length) {
+            counts.bytesSent += *length;
+            return;
+        }
+        uint32_t original = uint32_t(*length);
+        (*buffer)[0] = char(COMPRESSED | settings.codec);
+        memcpy(&(*buffer)[1], &original, sizeof(original));
+        *value = buffer->data();
+        *length = HEADER_LENGTH + packed;
+        counts.bytesSent += *length;
+        counts.compressed++;
+    }
+
+    /**
+     * Decode a value a GET found, #found, setting *#length to its
+     * decoded length and copying it to #value if that isn't NULL.
+     */
+    void
+    decode(const std::string& found, size_t* length, std::string* value)
+    {
+        counts.valuesRead++;
+        counts.bytesReceived += found.size();
+        if (found.size() < HEADER_LENGTH ||
+            !(uint8_t(found[0]) & COMPRESSED)) {
+            counts.rawBytesRead += found.size();
+            *length = found.size();
+            if (value != NULL)
+                *value = found;
+            return;
+        }
+
+        uint32_t original;
+        memcpy(&original, &found[1], sizeof(original));
+        uint64_t start = RAMCloud::Cycles::rdtsc();
+        bool ok = original <= MAX_VALUE_LENGTH &&
+            decompress(uint8_t(found[0]) & ~COMPRESSED,
+                       found.data() + HEADER_LENGTH,
+                       found.size() - HEADER_LENGTH, original);
+        counts.decompressCycles += RAMCloud::Cycles::rdtsc() - start;
+
+        if (!ok) {
+            counts.undecodable++;
+            counts.rawBytesRead += found.size();
+            *length = found.size();
+            if (value != NULL)
+                *value = found;
+            return;
+        }
+        counts.decompressed++;
+        counts.rawBytesRead += original;
+        *length = original;
+        if (value != NULL)
+            value->swap(decoded);
+    }
+
+    /**
+     * Compress #length bytes at #in into the #capacity bytes at #out.
+     * Returns the compressed length, or 0 if it didn't fit.
+     */
+    size_t
+    compress(const char* in, size_t length, char* out, size_t capacity)
+    {
+        switch (settings.codec) {
+        case ValueCompression::LZ4:
+#if HAVE_LZ4
+            return size_t(LZ4_compress_fast(in, out, int(length),
+                                            int(capacity), settings.level));
+#endif
+            break;
+        case ValueCompression::ZSTD:
+#if HAVE_ZSTD
+        {
+            size_t packed = ZSTD_compressCCtx(cctx, out, capacity, in, length,
+                                              settings.level);
+            return ZSTD_isError(packed) ? 0 : packed;
+        }
+#endif
+            break;
+        case ValueCompression::NONE:
+            break;
+        }
+        return 0;
+    }
+
+    /**
+     * Decompress the #length bytes at #in, compressed by #codec, into
+     * #decoded. Returns false unless they decode to exactly #original bytes.
+     */
+    bool
+    decompress(int codec, const char* in, size_t length, uint32_t original)
+    {
+        decoded.resize(original);
+        switch (codec) {
+        case ValueCompression::LZ4:
+#if HAVE_LZ4
+            return LZ4_decompress_safe(in, &decoded[0], int(length),
+                                       int(original)) == int(original);
+#endif
+            break;
+        case ValueCompression::ZSTD:
+#if HAVE_ZSTD
+            return ZSTD_decompressDCtx(dctx, &decoded[0], original, in,
+                                       length) == original;
+#endif
+            break;
+        }
+        return false;
+    }
+
+    std::unique_ptr<KVBackend> backend;
+    ValueCompression& settings;
+    ValueCompression::Counters counts;
+
+    /// A value as a GET found it, and once decompressed.
+    std::string fetched;
+    std::string decoded;
+
+    /// A compressed value, for a single SET or CAS.
+    std::string single;
+
+    /// Compressed values, one per request of a batch.
+    std::vector<std::string> encoded;
+
+    /// Values fetched by the GETs of a batch.
+    std::vector<std::string> copies;
+
+    /// The caller's requests, to put back what submit() changed.
+    std::vector<Request> saved;
+
+#if HAVE_ZSTD
+    ZSTD_CCtx* cctx;
+    ZSTD_DCtx* dctx;
+#endif
+};
+
+/**
+ * Parse #spec as described for the class. Exits if it is malformed or
+ * names a codec this build lacks.
+ */
+ValueCompression::ValueCompression(const char* spec)
+    : codec(NONE)
+    , level(0)
+    , threshold(256)
+    , totals()
+    , totalsMutex()
+{
+    const char* colon = strchr(spec, ':');
+    std::string name(spec, colon != NULL ? colon - spec : strlen(spec));
+    if (name == "lz4") {
+        codec = LZ4;
+        level = 1;
+    } else if (name == "zstd") {
+        codec = ZSTD;
+        level = 3;
+    } else if (name != "none") {
+        fprintf(stderr, "unknown codec %s (lz4, zstd or none)\n",
+                name.c_str());
+        exit(1);
+    }
+
+    if (colon != NULL) {
+        char* end;
+        level = int(strtol(colon + 1, &end, 10));
+        if (*end == ':')
+            threshold = strtoul(end + 1, &end, 10);
+        if (end == colon + 1 || *end != '\0') {
+            fprintf(stderr, "bad compression setting %s "
+                    "(CODEC[:LEVEL[:THRESHOLD]])\n", spec);
+            exit(1);
+        }
+    }
+
+#if !HAVE_LZ4
+    if (codec == LZ4) {
+        fprintf(stderr, "this build lacks lz4\n");
+        exit(1);
+    }
+#endif
+#if !HAVE_ZSTD
+    if (codec == ZSTD) {
+        fprintf(stderr, "this build lacks zstd\n");
+        exit(1);
+    }
+#endif
+}
+
+/// Return a backend that goes through #backend, compressing as set.
+std::unique_ptr<KVBackend>
+ValueCompression::wrap(std::unique_ptr<KVBackend> backend)
+{
+    return std::unique_ptr<KVBackend>(
+        new CompressingBackend(std::move(backend), *this));
+}
+
+void
+ValueCompression::Counters::add(const Counters& other)
+{
+    valuesWritten += other.valuesWritten;
+    rawBytesWritten += other.rawBytesWritten;
+    bytesSent += other.bytesSent;
+    compressed += other.compressed;
+    compressCycles += other.compressCycles;
+    valuesRead += other.valuesRead;
+    bytesReceived += other.bytesReceived;
+    rawBytesRead += other.rawBytesRead;
+    decompressed += other.decompressed;
+    decompressCycles += other.decompressCycles;
+    undecodable += other.undecodable;
+}
+
+void
+ValueCompression::printSettings(FILE* out) const
+{
+    if (codec == NONE) {
+        fprintf(out, "# values: compressible, not compressed\n");
+        return;
+    }
+    fprintf(out, "# values: compressible, %s level %d from %lu bytes\n",
+            codecNames[codec], level, threshold);
+}
+
+/**
+ * Print the value bytes that went to and came from the store, against
+ * what they would have been uncompressed, and the time (de)compression
+ * took over the #ops the replay issued. Only the backends destroyed by now
+ * are counted, so call this once the workers are done.
+ */
+void
+ValueCompression::print(FILE* out, uint64_t ops) const
+{
+    const Counters& c = totals;
+    double cycleNs = RAMCloud::Cycles::toSeconds(1000000) * 1e3;
+    fprintf(out, "# compression (%s): %lu of %lu values written "
+            "compressed   %lu bytes sent for %lu (%.2fx)   "
+            "%.0f ns compressing per value\n", codecNames[codec],
+            c.compressed, c.valuesWritten, c.bytesSent, c.rawBytesWritten,
+            c.bytesSent > 0
+                ? (double)c.rawBytesWritten / (double)c.bytesSent : 0.0,
+            c.valuesWritten > 0
+                ? (double)c.compressCycles * cycleNs / (double)c.valuesWritten
+                : 0.0);
+    fprintf(out, "# compression (%s): %lu of %lu values read "
+            "compressed   %lu bytes received for %lu (%.2fx)   "
+            "%.0f ns per decompression   %lu undecodable\n",
+            codecNames[codec], c.decompressed, c.valuesRead,
+            c.bytesReceived, c.rawBytesRead,
+            c.bytesReceived > 0
+                ? (double)c.rawBytesRead / (double)c.bytesReceived : 0.0,
+            c.decompressed > 0
+                ? (double)c.decompressCycles * cycleNs / (double)c.decompressed
+                : 0.0,
+            c.undecodable);
+    fprintf(out, "# compression (%s): %.0f ns of CPU per operation\n",
+            codecNames[codec],
+            ops > 0 ? (double)(c.compressCycles + c.decompressCycles) *
+                          cycleNs / (double)ops
+                    : 0.0);
+}
@@ -0,0 +1,93 @@
+#ifndef VALUECOMPRESSION_H_
+#define VALUECOMPRESSION_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <memory>
+#include <mutex>
+
+#include "KVBackend.h"
+
+/**
+ * Compresses the values a replay writes (-Z), as a client library would
+ * before handing them to the store, and decompresses them when GETs read
+ * them back; it also counts what that costs and saves.
+ *
+ * The setting is CODEC[:LEVEL[:THRESHOLD]]: lz4 (LEVEL is the
+ * acceleration, 1 by default), zstd (LEVEL is the compression level, 3 by
+ * default) or none, which changes nothing but the payloads (see the
+ * player). Only values of at least THRESHOLD bytes (256 by default) are
+ * compressed, and only if that makes them smaller.
+ *
+ * KVBackend has no item flags, and Redis has none to offer, so a
+ * compressed value is marked the way a client without flags would mark
+ * it: with a five-byte header whose first byte has its high bit set (which
+ * the printable payloads never have) and names the codec, followed by the
+ * original length. APPEND and PREPEND data goes out as it is, so a
+ * compressed value appended to can no longer be decoded; it is read as it
+ * stands and counted as undecodable.
+ */
+class ValueCompression {
+  public:
+    enum Codec {
+        NONE,
+        LZ4,
+        ZSTD
+    };
+
+    explicit ValueCompression(const char* spec);
+
+    Codec
+    getCodec() const
+    {
+        return codec;
+    }
+
+    std::unique_ptr<KVBackend> wrap(std::unique_ptr<KVBackend> backend);
+    void printSettings(FILE* out) const;
+    void print(FILE* out, uint64_t ops) const;
+
+  private:
+    friend class CompressingBackend;
+
+    Codec codec;
+    int level;
+    size_t threshold;
+
+    /// What the replay's values came to. Each CompressingBackend counts
+    /// on its own, with no shared writes on the way, and adds its counts to
+    /// #totals when it is destroyed.
+    struct Counters {
+        /// Values the replay wrote, their bytes, and the bytes sent for
+        /// them.
+        uint64_t valuesWritten;
+        uint64_t rawBytesWritten;
+        uint64_t bytesSent;
+
+        /// Values sent compressed, and the time spent compressing,
+        /// including attempts that didn't pay off.
+        uint64_t compressed;
+        uint64_t compressCycles;
+
+        /// Values GETs found, their bytes as received and once decoded.
+        uint64_t valuesRead;
+        uint64_t bytesReceived;
+        uint64_t rawBytesRead;
+
+        /// Values found compressed, and the time spent decompressing them.
+        uint64_t decompressed;
+        uint64_t decompressCycles;
+
+        /// Values marked compressed that failed to decode.
+        uint64_t undecodable;
+
+        void add(const Counters& other);
+    };
+
+    /// The counts of every backend destroyed so far.
+    Counters totals;
+    std::mutex totalsMutex;
+};
+
+#endif /* !VALUECOMPRESSION_H_ */
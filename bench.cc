@@ -2,14 +2,22 @@
 #include <iostream>
 #include <vector>
 #include <atomic>
+#include <algorithm>
+#include <chrono>
+#include <cmath>
 #include <cassert>
 #include <string>
+#include <memory>
+#include <tuple>
 #include <stdio.h>
+#include <string.h>
 #include <unistd.h>
 
-#include <libmemcached/memcached.h>
-
 #include "Benchmark.h"
+#include "Cycles.h"
+#include "LoopbackServer.h"
+
+using RAMCloud::Cycles;
 
 // If true, when we do a get() and it isn't the expected length, do a new
 // set with the new length. This simulates updating the cache when software
@@ -21,6 +29,7 @@ static thread_local PRNG prng{};
 class SmallFillThenRead : public Benchmark {
   const size_t valueLen;
   const size_t nKeys;
+  const size_t batchSize;
 
   std::atomic<uint64_t> getAttempts;
   std::atomic<uint64_t> getFailures;
@@ -30,9 +39,15 @@ class SmallFillThenRead : public Benchmark {
   uint64_t lastGetAttempts;
   uint64_t lastGetFailures;
 
+  // Counter values when the current phase began.
+  uint64_t phaseGetAttempts;
+  uint64_t phaseGetFailures;
+  uint64_t phaseSetAttempts;
+  uint64_t phaseSetFailures;
+
   char randomChars[100000];
 
-  void issueSet(memcached_st* memc,
+  void issueSet(KVBackend* kv,
                 const char* key,
                 size_t valueLen)
   {
@@ -40,38 +55,59 @@ class SmallFillThenRead : public Benchmark {
     const char* value =
       &randomChars[prng()  % (sizeof(randomChars) - valueLen)];
     setAttempts++;
-    memcached_return rc =
-      memcached_set(memc, key, strlen(key), value, valueLen,
-                    (time_t)0, (uint32_t)0);
-    if (rc != MEMCACHED_SUCCESS)
+    if (kv->set(key, strlen(key), value, valueLen) != KVBackend::OK)
       setFailures++;
   }
 
-  void issueGet(memcached_st* memc, const char* key, size_t reinsertValueLen) {
-    memcached_return rc;
-    uint32_t flags;
-    size_t valueLength;
-
+  void issueGet(KVBackend* kv, const char* key, size_t reinsertValueLen) {
     getAttempts++;
 
-    char* ret = memcached_get(memc, key, strlen(key), &valueLength, &flags, &rc);
-    if (ret == NULL) {
+    // should just be a cache miss. handle by adding it to the cache.
+    assert(reinsertValueLen <= sizeof(randomChars));
+    const char* value =
+      &randomChars[prng()  % (sizeof(randomChars) - reinsertValueLen)];
+    KVBackend::Status setStatus = KVBackend::OK;
+    KVBackend::ReadResult result =
+      kv->getOrRefill(key, strlen(key), value, reinsertValueLen,
+                      UPDATE_CHANGED_VALUE_LENGTH, &setStatus);
+    if (result == KVBackend::FAILED) {
+      std::cerr << "unexpected get error: " << kv->errorString() << std::endl;
+      exit(1);
+    }
+    if (result != KVBackend::HIT) {
       getFailures++;
+      setAttempts++;
+      if (setStatus != KVBackend::OK)
+        setFailures++;
+    }
+  }
+
+  // Fetch #keys with one multi-get, refilling those that miss
+  // just as issueGet() does.
+  void issueMultiGet(KVBackend* kv, const std::vector<std::string>& keys,
+                     size_t reinsertValueLen)
+  {
+    static thread_local std::vector<KVBackend::Request> requests;
+    requests.clear();
+    for (const std::string& key : keys) {
+      requests.push_back({KVBackend::Request::GET, key.c_str(), key.size(),
+                          nullptr, 0, KVBackend::OK});
+    }
+
+    getAttempts += keys.size();
+    kv->multiGet(requests.data(), requests.size());
 
-      // should just be a cache miss. handle by adding it to the cache.
-      if (rc == MEMCACHED_NOTFOUND) { 
-        issueSet(memc, key, reinsertValueLen);
-      } else {
-        std::cerr << "unexpected get error: " <<  memcached_strerror(memc, rc)
+    for (const KVBackend::Request& r : requests) {
+      if (r.status == KVBackend::ERROR) {
+        std::cerr << "unexpected multi-get error: " << kv->errorString()
                   << std::endl;
         exit(1);
       }
-    } else {
-      if (UPDATE_CHANGED_VALUE_LENGTH && valueLength != reinsertValueLen) {
+      if (r.status == KVBackend::MISS ||
+          (UPDATE_CHANGED_VALUE_LENGTH && r.valueLength != reinsertValueLen)) {
         getFailures++;
-        issueSet(memc, key, reinsertValueLen);
+        issueSet(kv, r.key, reinsertValueLen);
       }
-      free(ret);
     }
   }
 
@@ -79,20 +115,60 @@ class SmallFillThenRead : public Benchmark {
     prng.reseed(threadId);
   }
 
-  // Just do round-robin gets until time is up.
+  // Insert every key once, split across the phase's threads.
+  void fill(size_t threadId) {
+    for (uint64_t key = threadId; key < nKeys;
+         key += getPhase().nThreads) {
+      const std::string keyStr = "user" + std::to_string(key);
+      uint64_t start = Cycles::rdtscStart();
+      issueSet(getClient(threadId), keyStr.c_str(), valueLen);
+      recordOp(threadId,
+               Cycles::toNanosecondsFast(Cycles::rdtscStop() - start));
+    }
+  }
+
+  // Just do round-robin gets (batchSize keys at a time) until time is up,
+  // spreading requests over the thread's connections. Each latency sample
+  // covers one request, so with batching it is the time for the batch.
   void run(size_t threadId) {
+    std::vector<std::string> batch;
     size_t key = 0;
+    size_t connection = 0;
     while (!getStop()) {
-      const std::string keyStr = "user" + std::to_string(key);
-      issueGet(getClient(threadId), keyStr.c_str(), valueLen);
-      ++key;
-      if (key > nKeys)
-        key = 0;
+      KVBackend* kv = getClient(threadId, connection);
+      if (++connection == getNConnections())
+        connection = 0;
+
+      if (batchSize <= 1) {
+        const std::string keyStr = "user" + std::to_string(key);
+        uint64_t start = Cycles::rdtscStart();
+        issueGet(kv, keyStr.c_str(), valueLen);
+        recordOp(threadId,
+                 Cycles::toNanosecondsFast(Cycles::rdtscStop() - start));
+        ++key;
+        if (key > nKeys)
+          key = 0;
+        continue;
+      }
+
+      batch.clear();
+      while (batch.size() < batchSize) {
+        batch.emplace_back("user" + std::to_string(key));
+        ++key;
+        if (key > nKeys)
+          key = 0;
+      }
+      uint64_t start = Cycles::rdtscStart();
+      issueMultiGet(kv, batch, valueLen);
+      recordOp(threadId,
+               Cycles::toNanosecondsFast(Cycles::rdtscStop() - start),
+               batch.size());
     }
   }
 
   void dumpHeader() {
-    std::cout << "time" << " "
+    std::cout << "phase" << " "
+              << "time" << " "
               << "getAttempts" << " "
               << "getFailures" << " "
               << "setAttempts" << " "
@@ -104,7 +180,8 @@ class SmallFillThenRead : public Benchmark {
   void dump(double time, double interval) {
     const uint64_t intervalGetAttempts = getAttempts - lastGetAttempts;
     const uint64_t intervalGetFailures = getFailures - lastGetFailures;
-    std::cout << time << " "
+    std::cout << getPhase().name << " "
+              << time << " "
               << getAttempts << " "
               << getFailures << " "
               << setAttempts << " "
@@ -115,72 +192,987 @@ class SmallFillThenRead : public Benchmark {
     lastGetFailures = getFailures;
   }
 
+  void phaseStart(const Phase& phase) {
+    phaseGetAttempts = getAttempts;
+    phaseGetFailures = getFailures;
+    phaseSetAttempts = setAttempts;
+    phaseSetFailures = setFailures;
+    lastGetAttempts = getAttempts;
+    lastGetFailures = getFailures;
+  }
+
+  void phaseDone(const Phase& phase, double seconds) {
+    if (isQuiet())
+      return;
+    const uint64_t gets = getAttempts - phaseGetAttempts;
+    const uint64_t misses = getFailures - phaseGetFailures;
+    std::cout << "# phase " << phase.name
+              << " threads " << phase.nThreads
+              << " seconds " << seconds
+              << " getAttempts " << gets
+              << " getFailures " << misses
+              << " setAttempts " << setAttempts - phaseSetAttempts
+              << " setFailures " << setFailures - phaseSetFailures
+              << " okGetsPerSec " << (gets - misses) / seconds
+              << " setsPerSec " << (setAttempts - phaseSetAttempts) / seconds
+              << std::endl;
+  }
+
  public:
-  SmallFillThenRead(size_t port, size_t nThreads, double seconds,
-                    size_t valueLen, size_t nKeys)
-    : Benchmark{port, nThreads, seconds}
-    , valueLen{valueLen}
-    , nKeys{nKeys}
+  // Fill the keys (unless options.skipFill), optionally warm up with
+  // reads, measure, and optionally cool down with a single reader.
+  SmallFillThenRead(const BenchmarkOptions& o,
+                    double warmSeconds = 0, double coolSeconds = 0)
+    : Benchmark{o.pool ? o.pool : std::make_shared<ConnectionPool>(o.port),
+                o.nThreads, o.seconds, std::max<size_t>(o.nConnections, 1)}
+    , valueLen{o.valueLen}
+    , nKeys{o.nKeys}
+    , batchSize{o.batchSize}
     , getAttempts{}
     , getFailures{}
     , setAttempts{}
     , setFailures{}
     , lastGetAttempts{}
     , lastGetFailures{}
+    , phaseGetAttempts{}
+    , phaseGetFailures{}
+    , phaseSetAttempts{}
+    , phaseSetFailures{}
   {
     for (size_t i = 0; i < sizeof(randomChars); ++i)
       randomChars[i] = '!' + (random() % ('~' - '!' + 1));
+
+    auto reads = [this](size_t threadId) { run(threadId); };
+    if (!o.skipFill)
+      addPhase({"fill", 0, o.nThreads,
+                [this](size_t threadId) { fill(threadId); }});
+    if (warmSeconds > 0)
+      addPhase({"warm", warmSeconds, o.nThreads, reads});
+    addPhase({"measure", o.seconds, o.nThreads, reads});
+    if (coolSeconds > 0)
+      addPhase({"cool", coolSeconds, 1, reads});
+  }
+};
+
+static BenchmarkRegistry::Registration smallFillThenRead{
+  "small-fill-then-read",
+  "fill nKeys values, then round-robin gets on every thread",
+  [](const BenchmarkOptions& o) {
+    return std::unique_ptr<Benchmark>{
+      new SmallFillThenRead{o}};
+  }};
+
+static BenchmarkRegistry::Registration fillWarmMeasureCool{
+  "fill-warm-measure-cool",
+  "small-fill-then-read with a warm-up phase of a fifth of the measured "
+  "time before it and a one-thread cool-down of the same length after",
+  [](const BenchmarkOptions& o) {
+    return std::unique_ptr<Benchmark>{
+      new SmallFillThenRead{o, o.seconds / 5, o.seconds / 5}};
+  }};
+
+/**
+ * Reads of a fixed key set while the value size the application wants
+ * shifts over time, as when a new field is added to cached objects: each
+ * read that finds a value of another size re-sets it at the new size. The
+ * schedule (-S) is a comma-separated list of stages "sizes@seconds", each
+ * run as its own phase, where sizes is
+ *
+ *   N          every value is N bytes (successive stages give step changes),
+ *   A..B       drifting linearly from A to B over the stage, or
+ *   A+B:P      a mix: P percent of reads want B bytes, the rest A.
+ *
+ * The default is the -s size for -t seconds, then four times it for as
+ * long. Keys are loaded at the first stage's size by every thread in
+ * parallel, so stores that partition memory by size (slab classes) start
+ * out tuned to the old size, and calcification shows within seconds.
+ */
+class SizeShift : public Benchmark {
+  struct Stage {
+    std::string spec;
+    size_t from;
+    size_t to;
+
+    /// Percent of reads wanting #to in a mix; -1 for a drift.
+    int mixPercent;
+    double seconds;
+  };
+
+  static std::string phaseName(size_t i) {
+    return "shift" + std::to_string(i + 1);
+  }
+
+  /// What one thread saw in the current phase.
+  struct ThreadCounters {
+    uint64_t gets;
+    uint64_t misses;
+    uint64_t resets;
+    uint64_t setFailures;
+  };
+
+  const size_t nKeys;
+  std::vector<Stage> stages;
+  std::vector<std::unique_ptr<ThreadCounters>> counters;
+  uint64_t phaseStartTs;
+  const Stage* stage;
+  ThreadCounters last;
+
+  char randomChars[100000];
+
+  static Stage parseStage(const std::string& item) {
+    Stage stage{item, 0, 0, -1, 0};
+    const size_t at = item.find('@');
+    if (at == std::string::npos)
+      throw std::invalid_argument{"no @seconds"};
+    stage.seconds = std::stod(item.substr(at + 1));
+    const std::string sizes = item.substr(0, at);
+    const size_t dots = sizes.find("..");
+    const size_t plus = sizes.find('+');
+    if (dots != std::string::npos) {
+      stage.from = std::stoul(sizes.substr(0, dots));
+      stage.to = std::stoul(sizes.substr(dots + 2));
+    } else if (plus != std::string::npos) {
+      const size_t colon = sizes.find(':', plus);
+      if (colon == std::string::npos)
+        throw std::invalid_argument{"no :percent"};
+      stage.from = std::stoul(sizes.substr(0, plus));
+      stage.to = std::stoul(sizes.substr(plus + 1, colon - plus - 1));
+      stage.mixPercent = std::stoi(sizes.substr(colon + 1));
+    } else {
+      stage.from = stage.to = std::stoul(sizes);
+    }
+    if (stage.seconds <= 0 || stage.mixPercent > 100)
+      throw std::invalid_argument{"out of range"};
+    return stage;
+  }
+
+  /// The size a read issued now wants under the current stage.
+  size_t wantedSize() {
+    if (stage->mixPercent >= 0)
+      return int(prng() % 100) < stage->mixPercent ? stage->to : stage->from;
+    if (stage->from == stage->to)
+      return stage->from;
+    const double progress = std::min(1.0,
+      Cycles::toSeconds(Cycles::rdtsc() - phaseStartTs) / stage->seconds);
+    return size_t(double(stage->from) +
+                  (double(stage->to) - double(stage->from)) * progress);
+  }
+
+  const char* payload(size_t length) {
+    return &randomChars[prng() % (sizeof(randomChars) - length)];
   }
 
-  // Do normal benchmark start stuff, but then also prefill with some data.
-  // This happens on the main thread, so it happens just once in the order
-  // specified.
-  void start() {
-    for (uint64_t key = 0; key < nKeys; ++key) {
+  void warmup(size_t threadId) {
+    prng.reseed(threadId);
+  }
+
+  void fill(size_t threadId) {
+    ThreadCounters& c = *counters[threadId];
+    KVBackend* kv = getClient(threadId);
+    const size_t length = stages.front().from;
+    for (uint64_t key = threadId; key < nKeys; key += getPhase().nThreads) {
       const std::string keyStr = "user" + std::to_string(key);
-      issueSet(getClient(0), keyStr.c_str(), valueLen);
+      uint64_t start = Cycles::rdtscStart();
+      if (kv->set(keyStr.c_str(), keyStr.size(), payload(length), length) !=
+          KVBackend::OK)
+        c.setFailures++;
+      recordOp(threadId,
+               Cycles::toNanosecondsFast(Cycles::rdtscStop() - start));
+    }
+  }
+
+  void run(size_t threadId) {
+    ThreadCounters& c = *counters[threadId];
+    KVBackend* kv = getClient(threadId);
+    char key[32];
+    while (!getStop()) {
+      const int keyLength =
+        snprintf(key, sizeof(key), "user%lu", prng() % nKeys);
+      const size_t length = wantedSize();
+      KVBackend::Status setStatus = KVBackend::OK;
+      uint64_t start = Cycles::rdtscStart();
+      KVBackend::ReadResult result = kv->getOrRefill(
+        key, keyLength, payload(length), length, true, &setStatus);
+      recordOp(threadId,
+               Cycles::toNanosecondsFast(Cycles::rdtscStop() - start));
+      c.gets++;
+      switch (result) {
+        case KVBackend::HIT:
+          continue;
+        case KVBackend::REFILLED:
+          c.misses++;
+          break;
+        case KVBackend::REPLACED:
+          c.resets++;
+          break;
+        case KVBackend::FAILED:
+          std::cerr << "unexpected get error: " << kv->errorString()
+                    << std::endl;
+          exit(1);
+      }
+      if (setStatus != KVBackend::OK)
+        c.setFailures++;
+    }
+  }
+
+  ThreadCounters sum() {
+    ThreadCounters total{};
+    for (auto& c : counters) {
+      total.gets += c->gets;
+      total.misses += c->misses;
+      total.resets += c->resets;
+      total.setFailures += c->setFailures;
+    }
+    return total;
+  }
+
+  void dumpHeader() {
+    std::cout << "phase time gets hitRate resetRate setFailures getsPerSec"
+              << std::endl;
+  }
+
+  void dump(double time, double interval) {
+    if (stage == nullptr)
+      return;
+    const ThreadCounters now = sum();
+    const uint64_t gets = now.gets - last.gets;
+    const uint64_t misses = now.misses - last.misses;
+    const uint64_t resets = now.resets - last.resets;
+    std::cout << getPhase().name << " " << time << " " << now.gets << " "
+              << (gets ? double(gets - misses - resets) / gets : 0) << " "
+              << (gets ? double(resets) / gets : 0) << " "
+              << now.setFailures << " " << gets / interval << std::endl;
+    last = now;
+  }
+
+  void phaseStart(const Phase& phase) {
+    for (auto& c : counters)
+      *c = ThreadCounters{};
+    last = ThreadCounters{};
+    stage = nullptr;
+    for (size_t i = 0; i < stages.size(); ++i) {
+      if (phase.name == phaseName(i))
+        stage = &stages[i];
+    }
+    phaseStartTs = Cycles::rdtsc();
+  }
+
+  void phaseDone(const Phase& phase, double seconds) {
+    if (isQuiet())
+      return;
+    const ThreadCounters total = sum();
+    const PhaseResult& r = getResults().back();
+    KVBackend::ServerStats server{};
+    const bool haveStats = getClient(0)->serverStats(&server);
+    const uint64_t hits = total.gets - total.misses - total.resets;
+    std::cout << "# phase " << phase.name;
+    if (stage != nullptr)
+      std::cout << " sizes " << stage->spec;
+    std::cout << " threads " << phase.nThreads
+              << " seconds " << seconds
+              << " opsPerSec " << r.ops / seconds
+              << " hitRate " << (total.gets ? double(hits) / total.gets : 0)
+              << " missRate "
+              << (total.gets ? double(total.misses) / total.gets : 0)
+              << " resetRate "
+              << (total.gets ? double(total.resets) / total.gets : 0)
+              << " setFailures " << total.setFailures
+              << " p50us " << r.latency.percentile(0.5) / 1e3
+              << " p99us " << r.latency.percentile(0.99) / 1e3;
+    if (haveStats)
+      std::cout << " serverBytes " << server.bytes
+                << " serverItems " << server.currItems
+                << " serverEvictions " << server.evictions;
+    std::cout << std::endl;
+  }
+
+ public:
+  SizeShift(const BenchmarkOptions& o)
+    : Benchmark{o.pool ? o.pool : std::make_shared<ConnectionPool>(o.port),
+                o.nThreads, o.seconds}
+    , nKeys{o.nKeys}
+    , stages{}
+    , counters{}
+    , phaseStartTs{}
+    , stage{}
+    , last{}
+  {
+    const std::string schedule = !o.schedule.empty() ? o.schedule :
+      std::to_string(o.valueLen) + "@" + std::to_string(o.seconds) + "," +
+      std::to_string(4 * o.valueLen) + "@" + std::to_string(o.seconds);
+    size_t pos = 0;
+    while (pos <= schedule.size()) {
+      size_t comma = schedule.find(',', pos);
+      if (comma == std::string::npos)
+        comma = schedule.size();
+      const std::string item = schedule.substr(pos, comma - pos);
+      pos = comma + 1;
+      try {
+        stages.push_back(parseStage(item));
+      } catch (const std::exception&) {
+        std::cerr << "bad size-shift stage: " << item << std::endl;
+        exit(-1);
+      }
+      if (std::max(stages.back().from, stages.back().to) >=
+          sizeof(randomChars)) {
+        std::cerr << "value sizes must be below " << sizeof(randomChars)
+                  << std::endl;
+        exit(-1);
+      }
     }
 
-    Benchmark::start();
+    for (size_t i = 0; i < sizeof(randomChars); ++i)
+      randomChars[i] = '!' + (random() % ('~' - '!' + 1));
+    for (size_t i = 0; i < o.nThreads; ++i)
+      counters.emplace_back(new ThreadCounters{});
+
+    auto reads = [this](size_t threadId) { run(threadId); };
+    if (!o.skipFill)
+      addPhase({"fill", 0, o.nThreads,
+                [this](size_t threadId) { fill(threadId); }});
+    for (size_t i = 0; i < stages.size(); ++i)
+      addPhase({phaseName(i), stages[i].seconds, o.nThreads, reads});
   }
+
+  // Gets re-set values at later stages' sizes.
+  bool keepsDataSet() { return false; }
 };
 
+static BenchmarkRegistry::Registration sizeShift{
+  "size-shift",
+  "fill nKeys values in parallel, then random gets that re-set values "
+  "whose size no longer matches a schedule of sizes over time (-S)",
+  [](const BenchmarkOptions& o) {
+    return std::unique_ptr<Benchmark>{new SizeShift{o}};
+  }};
+
+/**
+ * Finds the highest request rate a store sustains within a latency and
+ * error-rate SLO. After the fill, each probe phase (-t seconds) offers
+ * open-loop Poisson load at a fixed rate split over the threads: requests go
+ * out at their scheduled times whether or not earlier ones have finished,
+ * and latency is measured from the scheduled time, so queueing behind a
+ * saturated store counts against it. The rate doubles from the starting
+ * rate until a probe misses the SLO, then a binary search closes in on the
+ * boundary; the best passing rate is then run once more as "measure". The
+ * SLO (-Q) is a comma-separated list of
+ *
+ *   p99=US        99th percentile latency target, in microseconds,
+ *   p999=US       99.9th percentile target (0, the default, ignores it),
+ *   errors=F      largest tolerated fraction of failed reads and refills,
+ *   start=OPS     rate of the first probe, in requests per second,
+ *   precision=F   stop once the lowest failing rate is within this
+ *                 fraction of the highest passing one,
+ *   probes=N      stop after this many probes regardless.
+ *
+ * Each probe is printed as it finishes, and the latency-throughput curve of
+ * all of them at the end.
+ */
+class CapacitySearch : public Benchmark {
+  struct Slo {
+    double p99us;
+    double p999us;
+    double errorRate;
+    double startRate;
+    double precision;
+    size_t maxProbes;
+  };
+
+  /// What one probe measured at one offered rate.
+  struct Probe {
+    double offered;
+    double achieved;
+    uint64_t p50;
+    uint64_t p99;
+    uint64_t p999;
+    uint64_t max;
+    double errorRate;
+    bool pass;
+  };
+
+  struct ThreadCounters {
+    uint64_t requests;
+    uint64_t errors;
+  };
+
+  const size_t valueLen;
+  const size_t nKeys;
+  Slo slo;
+  std::vector<std::unique_ptr<ThreadCounters>> counters;
+  std::vector<Probe> probes;
+
+  /// Offered rate of the current probe, in requests per second.
+  double rate;
+
+  /// Highest rate that met the SLO and lowest that missed it; 0 if none.
+  double passRate;
+  double failRate;
+
+  ThreadCounters last;
+
+  char randomChars[100000];
+
+  static Slo parseSlo(const std::string& spec) {
+    Slo slo{1000, 0, 0.001, 1000, 0.05, 30};
+    size_t pos = 0;
+    while (pos < spec.size()) {
+      size_t comma = spec.find(',', pos);
+      if (comma == std::string::npos)
+        comma = spec.size();
+      const std::string item = spec.substr(pos, comma - pos);
+      pos = comma + 1;
+      const size_t equals = item.find('=');
+      if (equals == std::string::npos)
+        throw std::invalid_argument{item};
+      const std::string name = item.substr(0, equals);
+      const double value = std::stod(item.substr(equals + 1));
+      if (name == "p99")
+        slo.p99us = value;
+      else if (name == "p999")
+        slo.p999us = value;
+      else if (name == "errors")
+        slo.errorRate = value;
+      else if (name == "start")
+        slo.startRate = value;
+      else if (name == "precision")
+        slo.precision = value;
+      else if (name == "probes")
+        slo.maxProbes = size_t(value);
+      else
+        throw std::invalid_argument{item};
+    }
+    if (slo.p99us <= 0 || slo.startRate <= 0 || slo.precision <= 0 ||
+        slo.maxProbes == 0)
+      throw std::invalid_argument{spec};
+    return slo;
+  }
+
+  void warmup(size_t threadId) {
+    prng.reseed(threadId);
+  }
+
+  void fill(size_t threadId) {
+    KVBackend* kv = getClient(threadId);
+    for (uint64_t key = threadId; key < nKeys; key += getPhase().nThreads) {
+      const std::string keyStr = "user" + std::to_string(key);
+      const char* value =
+        &randomChars[prng() % (sizeof(randomChars) - valueLen)];
+      uint64_t start = Cycles::rdtscStart();
+      kv->set(keyStr.c_str(), keyStr.size(), value, valueLen);
+      recordOp(threadId,
+               Cycles::toNanosecondsFast(Cycles::rdtscStop() - start));
+    }
+  }
+
+  /// Wait until the TSC reaches #when; false if the phase ends first.
+  /// Sleeps wake a couple of milliseconds early, since oversleeping would
+  /// be charged to the store as latency.
+  bool waitUntil(uint64_t when) {
+    const uint64_t margin = Cycles::fromSeconds(2e-3);
+    while (true) {
+      const uint64_t now = Cycles::rdtsc();
+      if (now >= when)
+        return true;
+      if (getStop())
+        return false;
+      if (when - now > 2 * margin)
+        std::this_thread::sleep_for(std::chrono::nanoseconds(
+          Cycles::toNanoseconds(std::min(when - now - margin, 5 * margin))));
+      else
+        std::this_thread::yield();
+    }
+  }
+
+  // Random gets, refilling misses, at exponentially distributed intervals
+  // averaging nThreads / rate.
+  void run(size_t threadId) {
+    ThreadCounters& c = *counters[threadId];
+    KVBackend* kv = getClient(threadId);
+    const double meanGap =
+      Cycles::perSecond() * double(getPhase().nThreads) / rate;
+    uint64_t next = Cycles::rdtsc();
+    char key[32];
+    while (true) {
+      const double uniform = double(prng() >> 11) / double(1ul << 53);
+      next += uint64_t(-meanGap * std::log(1.0 - uniform));
+      if (!waitUntil(next))
+        break;
+      const int keyLength =
+        snprintf(key, sizeof(key), "user%lu", prng() % nKeys);
+      const char* value =
+        &randomChars[prng() % (sizeof(randomChars) - valueLen)];
+      KVBackend::Status setStatus = KVBackend::OK;
+      KVBackend::ReadResult result = kv->getOrRefill(
+        key, keyLength, value, valueLen, UPDATE_CHANGED_VALUE_LENGTH,
+        &setStatus);
+      recordOp(threadId, Cycles::toNanosecondsFast(Cycles::rdtsc() - next));
+      c.requests++;
+      if (result == KVBackend::FAILED || setStatus != KVBackend::OK)
+        c.errors++;
+      if (getStop())
+        break;
+    }
+  }
+
+  ThreadCounters sum() {
+    ThreadCounters total{};
+    for (auto& c : counters) {
+      total.requests += c->requests;
+      total.errors += c->errors;
+    }
+    return total;
+  }
+
+  bool meets(const Probe& p) {
+    return p.errorRate <= slo.errorRate &&
+           double(p.p99) <= slo.p99us * 1e3 &&
+           (slo.p999us <= 0 || double(p.p999) <= slo.p999us * 1e3);
+  }
+
+  void addProbe(double offered) {
+    rate = offered;
+    addPhase({"probe" + std::to_string(probes.size() + 1),
+              getPhase().seconds, getPhase().nThreads,
+              [this](size_t threadId) { run(threadId); }});
+  }
+
+  void dumpHeader() {
+    std::cout << "phase time offered requests errors requestsPerSec"
+              << std::endl;
+  }
+
+  void dump(double time, double interval) {
+    if (getPhase().name == "fill")
+      return;
+    const ThreadCounters now = sum();
+    std::cout << getPhase().name << " " << time << " " << rate << " "
+              << now.requests << " " << now.errors << " "
+              << (now.requests - last.requests) / interval << std::endl;
+    last = now;
+  }
+
+  void phaseStart(const Phase& phase) {
+    for (auto& c : counters)
+      *c = ThreadCounters{};
+    last = ThreadCounters{};
+  }
+
+  void phaseDone(const Phase& phase, double seconds) {
+    if (phase.name == "fill")
+      return;
+    const PhaseResult& r = getResults().back();
+    const ThreadCounters total = sum();
+    Probe p{rate, r.ops / seconds,
+            r.latency.percentile(0.5), r.latency.percentile(0.99),
+            r.latency.percentile(0.999), r.latency.getMax(),
+            total.requests ? double(total.errors) / total.requests : 0,
+            false};
+    p.pass = meets(p);
+    if (!isQuiet())
+      std::cout << "# phase " << phase.name
+                << " threads " << phase.nThreads
+                << " seconds " << seconds
+                << " offered " << p.offered
+                << " achieved " << p.achieved
+                << " p50us " << p.p50 / 1e3
+                << " p99us " << p.p99 / 1e3
+                << " p999us " << p.p999 / 1e3
+                << " errorRate " << p.errorRate
+                << (p.pass ? " pass" : " fail") << std::endl;
+    if (phase.name == "measure") {
+      printCurve();
+      return;
+    }
+    probes.push_back(p);
+
+    if (p.pass)
+      passRate = std::max(passRate, rate);
+    else if (failRate == 0 || rate < failRate)
+      failRate = rate;
+
+    double next = 0;
+    if (probes.size() >= slo.maxProbes)
+      next = 0;
+    else if (failRate == 0)
+      next = 2 * rate;
+    else if (passRate == 0)
+      next = rate >= 2 ? rate / 2 : 0;
+    else if (failRate > passRate * (1 + slo.precision))
+      next = (passRate + failRate) / 2;
+
+    if (next > 0)
+      addProbe(next);
+    else if (passRate > 0) {
+      rate = passRate;
+      addPhase({"measure", phase.seconds, phase.nThreads,
+                [this](size_t threadId) { run(threadId); }});
+    } else {
+      printCurve();
+    }
+  }
+
+  void printCurve() {
+    if (isQuiet())
+      return;
+    std::vector<Probe> curve = probes;
+    std::sort(curve.begin(), curve.end(),
+      [](const Probe& a, const Probe& b) { return a.offered < b.offered; });
+    printf("%12s %12s %9s %9s %9s %9s %10s %4s\n", "offered", "achieved",
+           "p50us", "p99us", "p999us", "maxus", "errorRate", "slo");
+    for (const Probe& p : curve)
+      printf("%12.0f %12.0f %9.1f %9.1f %9.1f %9.1f %10.6f %4s\n",
+             p.offered, p.achieved, p.p50 / 1e3, p.p99 / 1e3, p.p999 / 1e3,
+             p.max / 1e3, p.errorRate, p.pass ? "ok" : "miss");
+    if (passRate > 0)
+      printf("# capacity: %.0f requests/s with p99 <= %.0fus", passRate,
+             slo.p99us);
+    else
+      printf("# capacity: none; %.0f requests/s already misses p99 <= %.0fus",
+             curve.front().offered, slo.p99us);
+    if (slo.p999us > 0)
+      printf(", p999 <= %.0fus", slo.p999us);
+    printf(", errors <= %g\n", slo.errorRate);
+    fflush(stdout);
+  }
+
+ public:
+  CapacitySearch(const BenchmarkOptions& o)
+    : Benchmark{o.pool ? o.pool : std::make_shared<ConnectionPool>(o.port),
+                o.nThreads, o.seconds}
+    , valueLen{o.valueLen}
+    , nKeys{o.nKeys}
+    , slo{}
+    , counters{}
+    , probes{}
+    , rate{}
+    , passRate{}
+    , failRate{}
+    , last{}
+  {
+    try {
+      slo = parseSlo(o.slo);
+    } catch (const std::exception&) {
+      std::cerr << "bad capacity SLO: " << o.slo << std::endl;
+      exit(-1);
+    }
+    if (valueLen >= sizeof(randomChars)) {
+      std::cerr << "value sizes must be below " << sizeof(randomChars)
+                << std::endl;
+      exit(-1);
+    }
+
+    for (size_t i = 0; i < sizeof(randomChars); ++i)
+      randomChars[i] = '!' + (random() % ('~' - '!' + 1));
+    for (size_t i = 0; i < o.nThreads; ++i)
+      counters.emplace_back(new ThreadCounters{});
+
+    if (!o.skipFill)
+      addPhase({"fill", 0, o.nThreads,
+                [this](size_t threadId) { fill(threadId); }});
+    rate = slo.startRate;
+    addPhase({"probe1", o.seconds, o.nThreads,
+              [this](size_t threadId) { run(threadId); }});
+  }
+};
+
+static BenchmarkRegistry::Registration capacitySearch{
+  "capacity",
+  "fill nKeys values, then search for the highest open-loop rate of "
+  "random gets that meets a latency and error-rate SLO (-Q)",
+  [](const BenchmarkOptions& o) {
+    return std::unique_ptr<Benchmark>{new CapacitySearch{o}};
+  }};
+
+/**
+ * Parse one sweep axis: a single value, a list "1,2,8", a doubling range
+ * "1..64", or a stepped range "1000..5000:1000" (forms may be combined,
+ * "1..8,12"). Exits on malformed input.
+ */
+static std::vector<size_t> parseAxis(const char* flag, const std::string& arg)
+{
+  std::vector<size_t> values;
+  size_t pos = 0;
+  while (pos <= arg.size()) {
+    size_t comma = arg.find(',', pos);
+    if (comma == std::string::npos)
+      comma = arg.size();
+    const std::string item = arg.substr(pos, comma - pos);
+    pos = comma + 1;
+
+    try {
+      size_t dots = item.find("..");
+      if (dots == std::string::npos) {
+        values.push_back(std::stoul(item));
+        continue;
+      }
+      size_t colon = item.find(':', dots);
+      const size_t lo = std::stoul(item.substr(0, dots));
+      const size_t hi = std::stoul(item.substr(dots + 2, colon - dots - 2));
+      const size_t step =
+        colon == std::string::npos ? 0 : std::stoul(item.substr(colon + 1));
+      if (lo == 0 && step == 0)
+        throw std::invalid_argument{"doubling range from 0"};
+      for (size_t v = lo; v <= hi; v = step ? v + step : v * 2)
+        values.push_back(v);
+    } catch (const std::exception&) {
+      std::cerr << "bad value for -" << flag << ": " << arg << std::endl;
+      exit(-1);
+    }
+  }
+  return values;
+}
+
+/// One configuration in a sweep and what it measured.
+struct SweepPoint {
+  size_t nThreads;
+  size_t valueLen;
+  size_t nKeys;
+  size_t batchSize;
+  size_t nConnections;
+
+  double opsPerSec;
+  uint64_t p50;
+  uint64_t p99;
+  uint64_t p999;
+
+  // Everything but the thread count: points that share this form one
+  // scaling curve.
+  std::tuple<size_t, size_t, size_t, size_t> curve() const {
+    return std::make_tuple(valueLen, nKeys, batchSize, nConnections);
+  }
+};
+
+/**
+ * Run benchmark #name at every point, reusing one set of connections and
+ * loading each (nKeys, valueLen) data set only once (unless the benchmark
+ * changes it, see Benchmark::keepsDataSet()), then print a single
+ * table. Efficiency is per-thread throughput relative to the fewest-thread
+ * point on the same curve, so perfect scaling reads 1.00 throughout.
+ */
+static void sweep(const std::string& name, size_t port,
+                  std::shared_ptr<ConnectionPool> pool, double seconds,
+                  const std::string& schedule, const std::string& slo,
+                  std::vector<SweepPoint> points)
+{
+  std::stable_sort(points.begin(), points.end(),
+    [](const SweepPoint& a, const SweepPoint& b) {
+      return std::make_pair(a.nKeys, a.valueLen) <
+             std::make_pair(b.nKeys, b.valueLen);
+    });
+
+  // The last point's data set, if it is still as its fill left it.
+  const SweepPoint* loaded = nullptr;
+  for (SweepPoint& p : points) {
+    const bool skipFill = loaded != nullptr &&
+                          loaded->nKeys == p.nKeys &&
+                          loaded->valueLen == p.valueLen;
+    std::unique_ptr<Benchmark> bench = BenchmarkRegistry::create(
+        name, BenchmarkOptions{port, p.nThreads, seconds, p.valueLen, p.nKeys,
+                               p.batchSize, p.nConnections, pool, skipFill,
+                               schedule, slo});
+    if (!bench) {
+      std::cerr << "Unknown benchmark " << name << std::endl;
+      exit(-1);
+    }
+    bench->setQuiet(true);
+    bench->start();
+    loaded = bench->keepsDataSet() ? &p : nullptr;
+
+    // Report the "measure" phase, or the last one if there isn't one.
+    const auto& results = bench->getResults();
+    auto measured = std::find_if(results.rbegin(), results.rend(),
+        [](const Benchmark::PhaseResult& r) { return r.name == "measure"; });
+    const Benchmark::PhaseResult& r =
+      measured != results.rend() ? *measured : results.back();
+    p.opsPerSec = r.seconds > 0 ? r.ops / r.seconds : 0;
+    p.p50 = r.latency.percentile(0.5);
+    p.p99 = r.latency.percentile(0.99);
+    p.p999 = r.latency.percentile(0.999);
+
+    std::cerr << "# done threads " << p.nThreads << " valueLen " << p.valueLen
+              << " keys " << p.nKeys << " batch " << p.batchSize
+              << " conns " << p.nConnections << std::endl;
+  }
+
+  printf("%7s %8s %9s %5s %5s %12s %9s %9s %9s %10s\n",
+         "threads", "valueLen", "keys", "batch", "conns", "opsPerSec",
+         "p50us", "p99us", "p999us", "efficiency");
+  for (const SweepPoint& p : points) {
+    const SweepPoint* base = &p;
+    for (const SweepPoint& q : points) {
+      if (q.curve() == p.curve() && q.nThreads < base->nThreads)
+        base = &q;
+    }
+    const double efficiency = base->opsPerSec > 0
+      ? (p.opsPerSec / p.nThreads) / (base->opsPerSec / base->nThreads)
+      : 0;
+    printf("%7lu %8lu %9lu %5lu %5lu %12.0f %9.1f %9.1f %9.1f %10.2f\n",
+           p.nThreads, p.valueLen, p.nKeys, p.batchSize, p.nConnections,
+           p.opsPerSec, p.p50 / 1e3, p.p99 / 1e3, p.p999 / 1e3, efficiency);
+  }
+}
+
 int main(int argc, char* argv[]) {
-  size_t nThreads = 1;
+  std::vector<size_t> nThreads{1};
   double seconds = 10.0;
-  size_t valueLen = 1024;
-  size_t nKeys = 10000;
+  std::vector<size_t> valueLen{1024};
+  std::vector<size_t> nKeys{10000};
+  std::vector<size_t> batchSize{1};
+  std::vector<size_t> nConnections{1};
   size_t port = 12000;
+  bool oneAxisAtATime = false;
+  size_t loopbackThreads = 0;
+  bool loopbackNull = false;
+  std::string socketPath;
+  std::string backend = "memcached";
+  BackendConfig backendConfig;
+  std::string name = "small-fill-then-read";
+  std::string schedule;
+  std::string slo;
 
   int c;
-  while ((c = getopt(argc, argv, "t:s:k:T:p:")) != -1) {
+  while ((c = getopt(argc, argv, "b:B:c:K:lL:No:Q:t:s:S:k:T:p:U:x")) != -1) {
     switch (c)
     {
+      case 'b':
+        name = optarg;
+        break;
+      case 'B':
+        batchSize = parseAxis("B", optarg);
+        break;
+      case 'c':
+        nConnections = parseAxis("c", optarg);
+        break;
+      case 'K':
+        backend = optarg;
+        break;
+      case 'l':
+        std::cout << "benchmarks:" << std::endl;
+        BenchmarkRegistry::list(std::cout);
+        std::cout << "backends:" << std::endl;
+        KVBackendRegistry::list(stdout);
+        return 0;
+      case 'L':
+        loopbackThreads = std::stoul(optarg);
+        break;
+      case 'N':
+        loopbackNull = true;
+        break;
       case 't':
         seconds = std::stod(optarg);
         break;
       case 's':
-        valueLen = std::stoul(optarg);
+        valueLen = parseAxis("s", optarg);
+        break;
+      case 'S':
+        schedule = optarg;
+        break;
+      case 'Q':
+        slo = optarg;
         break;
       case 'k':
-        nKeys = std::stoul(optarg);
+        nKeys = parseAxis("k", optarg);
         break;
       case 'T':
-        nThreads = std::stoul(optarg);
+        nThreads = parseAxis("T", optarg);
+        break;
+      case 'o': {
+        const std::string option = optarg;
+        const size_t equals = option.find('=');
+        if (equals == std::string::npos)
+          backendConfig.options[option] = "1";
+        else
+          backendConfig.options[option.substr(0, equals)] =
+            option.substr(equals + 1);
         break;
+      }
       case 'p':
         port = std::stoul(optarg);
         break;
+      case 'U':
+        socketPath = optarg;
+        break;
+      case 'x':
+        oneAxisAtATime = true;
+        break;
       default:
         std::cerr << "Unknown argument" << std::endl;
         exit(-1);
     }
   }
 
-  SmallFillThenRead bench{port, nThreads, seconds, valueLen, nKeys};
-  fprintf(stdout, "nthreads: %lu seconds: %f valuelen: %lu nkeys: %lu",
-      nThreads, seconds, valueLen, nKeys);
-  bench.start();
+  // -L serves the benchmark from inside this process, on a free port or
+  // on the Unix socket given by -U; -N makes that server store nothing.
+  std::unique_ptr<LoopbackServer> loopback;
+  if (loopbackThreads > 0) {
+    loopback.reset(new LoopbackServer{
+        socketPath.empty() ? "127.0.0.1:0" : socketPath, loopbackThreads,
+        loopbackNull});
+    port = loopback->getPort();
+    fprintf(stdout, "# loopback server: %lu threads on %s%s\n",
+            loopbackThreads,
+            socketPath.empty() ? ("port " + std::to_string(port)).c_str()
+                               : socketPath.c_str(),
+            loopbackNull ? " (null)" : "");
+  }
+
+  // -K picks what to benchmark: memcached by default, or any registered
+  // backend, configured with -o name=value.
+  if (socketPath.empty())
+    backendConfig.servers.emplace_back("127.0.0.1", port);
+  else
+    backendConfig.servers.emplace_back(socketPath, 0);
+  auto pool = std::make_shared<ConnectionPool>(backend, backendConfig);
+
+  // Any axis given more than one value turns the run into a sweep over the
+  // Cartesian product of the axes or, with -x, over each axis in turn with
+  // the others held at their first value.
+  const std::vector<size_t>* axes[] =
+    {&nThreads, &valueLen, &nKeys, &batchSize, &nConnections};
+  if (std::any_of(std::begin(axes), std::end(axes),
+                  [](const std::vector<size_t>* a) { return a->size() > 1; })) {
+    std::vector<SweepPoint> points;
+    const SweepPoint first{nThreads[0], valueLen[0], nKeys[0], batchSize[0],
+                           nConnections[0], 0, 0, 0, 0};
+    for (size_t k : nKeys)
+      for (size_t s : valueLen)
+        for (size_t t : nThreads)
+          for (size_t b : batchSize)
+            for (size_t n : nConnections) {
+              SweepPoint p{t, s, k, b, n, 0, 0, 0, 0};
+              const int nChanged = (t != first.nThreads) +
+                                   (s != first.valueLen) +
+                                   (k != first.nKeys) +
+                                   (b != first.batchSize) +
+                                   (n != first.nConnections);
+              if (!oneAxisAtATime || nChanged <= 1)
+                points.push_back(p);
+            }
+    fprintf(stdout, "benchmark: %s sweep of %lu points seconds: %f\n",
+            name.c_str(), points.size(), seconds);
+    fflush(stdout);
+    sweep(name, port, pool, seconds, schedule, slo, points);
+    pool->report(stdout);
+    return 0;
+  }
+
+  std::unique_ptr<Benchmark> bench = BenchmarkRegistry::create(
+      name, BenchmarkOptions{port, nThreads[0], seconds, valueLen[0],
+                             nKeys[0], batchSize[0], nConnections[0],
+                             pool, false, schedule, slo});
+  if (!bench) {
+    std::cerr << "Unknown benchmark " << name << "; known benchmarks:"
+              << std::endl;
+    BenchmarkRegistry::list(std::cerr);
+    exit(-1);
+  }
+  fprintf(stdout, "benchmark: %s backend: %s nthreads: %lu seconds: %f "
+      "valuelen: %lu nkeys: %lu batch: %lu conns: %lu\n", name.c_str(),
+      backend.c_str(), nThreads[0], seconds, valueLen[0], nKeys[0],
+      batchSize[0], nConnections[0]);
+  fflush(stdout);
+  bench->start();
+  pool->report(stdout);
 
   return 0;
 }
@@ -0,0 +1,806 @@
+#include <thread>
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <math.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <algorithm>
+#include <chrono>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "TraceParser.h"
+#include "TraceTokenizer.h"
+
+// Characterizes a YCSB trace with little memory beyond the sampled
+// accesses: the operation mix, value sizes, distinct keys, the hottest keys
+// and how popularity falls off with rank, working-set size over time and a
+// sampled reuse-distance distribution (i.e. an LRU miss-ratio curve). The
+// file is memory-mapped and split into one contiguous chunk per thread.
+// A first pass counts each chunk's operations; in the second each thread
+// keeps its own sketches, which are merged at the end. Working-set windows
+// are cut at the same operations whatever the chunks, and the sampled
+// accesses of every chunk are run through one LRU stack in file order, so
+// the results don't depend on the number of threads.
+//
+// With -b it instead times the trace parsers on each file, one thread each:
+// the line-at-a-time parseTraceLine() and TraceTokenizer with each SIMD
+// classifier the machine supports, checking that they all agree.
+
+static int nThreads = (int)std::thread::hardware_concurrency();
+static size_t topK = 20;
+static uint64_t windowOps = 1000000;
+static double sampleRate = 0.01;
+static int sketchWidthLog2 = 18;
+
+static const int SKETCH_DEPTH = 4;
+static const int HLL_BITS = 14;
+static const int WINDOW_HLL_BITS = 10;
+static const int HISTOGRAM_BUCKETS = 64;
+
+static int
+log2Bucket(uint64_t v)
+{
+    return v == 0 ? 0 : 64 - __builtin_clzl(v);
+}
+
+/**
+ * Estimates per-key access counts in fixed space; estimates are never low.
+ */
+class CountMinSketch {
+  public:
+    explicit CountMinSketch(int widthLog2)
+        : mask((1UL << widthLog2) - 1)
+        , counts(SKETCH_DEPTH << widthLog2)
+    {
+    }
+
+    uint32_t
+    add(uint64_t hash)
+    {
+        uint32_t estimate = UINT32_MAX;
+        for (int row = 0; row < SKETCH_DEPTH; row++) {
+            uint32_t& c = counts[(row * (mask + 1)) + slot(hash, row)];
+            if (c != UINT32_MAX)
+                c++;
+            estimate = std::min(estimate, c);
+        }
+        return estimate;
+    }
+
+    uint32_t
+    estimate(uint64_t hash) const
+    {
+        uint32_t estimate = UINT32_MAX;
+        for (int row = 0; row < SKETCH_DEPTH; row++)
+            estimate = std::min(estimate,
+                                counts[(row * (mask + 1)) + slot(hash, row)]);
+        return estimate;
+    }
+
+    void
+    merge(const CountMinSketch& other)
+    {
+        for (size_t i = 0; i < counts.size(); i++) {
+            uint64_t sum = (uint64_t)counts[i] + other.counts[i];
+            counts[i] = (uint32_t)std::min<uint64_t>(sum, UINT32_MAX);
+        }
+    }
+
+  private:
+    uint64_t
+    slot(uint64_t hash, int row) const
+    {
+        // Derive the row hashes from two halves of one 64-bit hash.
+        uint32_t h1 = (uint32_t)hash;
+        uint32_t h2 = (uint32_t)(hash >> 32);
+        return (h1 + (uint64_t)row * h2) & mask;
+    }
+
+    const uint64_t mask;
+    std::vector<uint32_t> counts;
+};
+
+/**
+ * Estimates the number of distinct keys seen in 2^bits bytes.
+ */
+class HyperLogLog {
+  public:
+    explicit HyperLogLog(int bits)
+        : bits(bits)
+        , registers(1UL << bits)
+    {
+    }
+
+    void
+    add(uint64_t hash)
+    {
+        uint64_t index = hash >> (64 - bits);
+        uint64_t rest = (hash << bits) | (1UL << (bits - 1));
+        uint8_t rank = (uint8_t)(__builtin_clzl(rest) + 1);
+        if (registers[index] < rank)
+            registers[index] = rank;
+    }
+
+    void
+    clear()
+    {
+        std::fill(registers.begin(), registers.end(), 0);
+    }
+
+    void
+    merge(const HyperLogLog& other)
+    {
+        for (size_t i = 0; i < registers.size(); i++)
+            registers[i] = std::max(registers[i], other.registers[i]);
+    }
+
+    double
+    estimate() const
+    {
+        double m = (double)registers.size();
+        double sum = 0;
+        size_t zeros = 0;
+        for (uint8_t r : registers) {
+            sum += ldexp(1.0, -r);
+            if (r == 0)
+                zeros++;
+        }
+        double e = (0.7213 / (1 + 1.079 / m)) * m * m / sum;
+        if (e <= 2.5 * m && zeros != 0)
+            e = m * log(m / (double)zeros);
+        return e;
+    }
+
+  private:
+    const int bits;
+    std::vector<uint8_t> registers;
+};
+
+/**
+ * A Fenwick tree over sampled-access timestamps, marking the most recent
+ * access of each sampled key. The number of marks after a key's previous
+ * access is the number of distinct sampled keys touched since, i.e. its
+ * (sampled) LRU stack distance.
+ */
+class StackDistance {
+  public:
+    StackDistance()
+        : tree((1 << 16) + 1)
+        , marks(1 << 16)
+        , nMarks(0)
+    {
+    }
+
+    void
+    mark(uint64_t time)
+    {
+        if (time >= marks.size())
+            grow();
+        marks[time] = 1;
+        nMarks++;
+        for (uint64_t i = time + 1; i < tree.size(); i += i & -i)
+            tree[i]++;
+    }
+
+    void
+    unmark(uint64_t time)
+    {
+        marks[time] = 0;
+        nMarks--;
+        for (uint64_t i = time + 1; i < tree.size(); i += i & -i)
+            tree[i]--;
+    }
+
+    /// Number of marks at timestamps greater than #time.
+    uint64_t
+    marksAfter(uint64_t time) const
+    {
+        uint64_t upTo = 0;
+        for (uint64_t i = time + 1; i > 0; i -= i & -i)
+            upTo += tree[i];
+        return nMarks - upTo;
+    }
+
+  private:
+    void
+    grow()
+    {
+        marks.resize(marks.size() * 2);
+        tree.assign(marks.size() + 1, 0);
+        for (uint64_t i = 1; i < tree.size(); i++) {
+            tree[i] += marks[i - 1];
+            uint64_t parent = i + (i & -i);
+            if (parent < tree.size())
+                tree[parent] += tree[i];
+        }
+    }
+
+    std::vector<uint32_t> tree;
+    std::vector<uint8_t> marks;
+    uint64_t nMarks;
+};
+
+/// The unique keys of the operations from #first to #first + #ops.
+struct Window {
+    explicit Window(uint64_t first)
+        : first(first)
+        , ops(0)
+        , keys(WINDOW_HLL_BITS)
+    {
+    }
+
+    uint64_t first;
+    uint64_t ops;
+    HyperLogLog keys;
+};
+
+/**
+ * Everything one thread learns about its chunk of the trace.
+ */
+struct ChunkStats {
+    /// #firstOp is the number of operations in the trace before the chunk.
+    explicit ChunkStats(uint64_t firstOp)
+        : byType()
+        , other(0)
+        , valueBytes(0)
+        , valueSizes()
+        , sketch(sketchWidthLog2)
+        , distinct(HLL_BITS)
+        , candidates()
+        , candidateFloor(0)
+        , nextOp(firstOp)
+        , workingSet()
+        , sampled()
+    {
+        memset(valueSizes, 0, sizeof(valueSizes));
+    }
+
+    /// Operations of each TraceOp::Type.
+    uint64_t byType[TraceOp::N_TYPES];
+    uint64_t other;
+    uint64_t valueBytes;
+    uint64_t valueSizes[HISTOGRAM_BUCKETS];
+
+    CountMinSketch sketch;
+    HyperLogLog distinct;
+
+    /// Keys whose sketch estimate made them hot at some point; pruned back to
+    /// a few times topK whenever it grows too large.
+    std::unordered_map<std::string, uint32_t> candidates;
+    uint32_t candidateFloor;
+
+    /// The trace-wide number of the chunk's next operation.
+    uint64_t nextOp;
+
+    /// The windows the chunk's operations fall in, of windowOps operations
+    /// each counted from the start of the trace; the first and last may be
+    /// shared with the neighbouring chunks.
+    std::vector<Window> workingSet;
+
+    /// Hashes of the chunk's sampled accesses, in order.
+    std::vector<uint64_t> sampled;
+};
+
+static void
+pruneCandidates(ChunkStats& stats)
+{
+    size_t keep = topK * 4;
+    std::vector<uint32_t> counts;
+    counts.reserve(stats.candidates.size());
+    for (auto& c : stats.candidates)
+        counts.push_back(c.second);
+    std::nth_element(counts.begin(), counts.begin() + keep, counts.end(),
+                     std::greater<uint32_t>());
+    stats.candidateFloor = counts[keep];
+    for (auto it = stats.candidates.begin(); it != stats.candidates.end(); ) {
+        if (it->second <= stats.candidateFloor)
+            it = stats.candidates.erase(it);
+        else
+            ++it;
+    }
+}
+
+static void
+analyzeOp(ChunkStats& stats, const TraceOp& op)
+{
+    if (op.type == TraceOp::INVALID) {
+        stats.other++;
+        return;
+    }
+    stats.byType[op.type]++;
+    if (TraceOp::writesValue(op.type) && op.valueLength >= 0) {
+        stats.valueBytes += op.valueLength;
+        stats.valueSizes[log2Bucket(op.valueLength)]++;
+    }
+
+    uint64_t hash = hashTraceKey(op.key, op.keyLength);
+    stats.distinct.add(hash);
+
+    uint32_t count = stats.sketch.add(hash);
+    if (count > stats.candidateFloor) {
+        stats.candidates[std::string(op.key, op.keyLength)] = count;
+        if (stats.candidates.size() > topK * 16)
+            pruneCandidates(stats);
+    }
+
+    if (stats.workingSet.empty() || stats.nextOp % windowOps == 0)
+        stats.workingSet.emplace_back(stats.nextOp / windowOps * windowOps);
+    stats.workingSet.back().keys.add(hash);
+    stats.workingSet.back().ops++;
+    stats.nextOp++;
+
+    // Spatially hashed sampling (as in SHARDS): a key is either always or
+    // never sampled, so distances among sampled keys scale by 1/sampleRate.
+    if ((double)(hash & 0xffffff) < sampleRate * (double)(1 << 24))
+        stats.sampled.push_back(hash);
+}
+
+/// Return the number of operations in the part of a trace from #begin to
+/// #end.
+static uint64_t
+countOps(const char* begin, const char* end)
+{
+    static const size_t MAX_OPS = 1024;
+    TraceTokenizer tokenizer;
+    TraceOp ops[MAX_OPS];
+    uint64_t count = 0;
+    const char* next = begin;
+    while (next < end) {
+        size_t nOps;
+        next = tokenizer.tokenize(next, end, ops, MAX_OPS, &nOps);
+        for (size_t i = 0; i < nOps; i++) {
+            if (ops[i].type != TraceOp::INVALID)
+                count++;
+        }
+    }
+    return count;
+}
+
+/**
+ * Run the sampled accesses of every chunk, in file order, through one LRU
+ * stack, counting first accesses in *#cold and the rest in #reuse by
+ * log2 of their (scaled) distance.
+ */
+static void
+reuseDistances(const std::vector<ChunkStats*>& chunks, uint64_t* cold,
+               uint64_t reuse[HISTOGRAM_BUCKETS])
+{
+    std::unordered_map<uint64_t, uint64_t> lastAccess;
+    StackDistance stack;
+    uint64_t now = 0;
+    *cold = 0;
+    for (ChunkStats* c : chunks) {
+        for (uint64_t hash : c->sampled) {
+            auto it = lastAccess.find(hash);
+            if (it == lastAccess.end()) {
+                (*cold)++;
+                lastAccess.emplace(hash, now);
+            } else {
+                uint64_t distance = stack.marksAfter(it->second);
+                reuse[log2Bucket((uint64_t)((double)distance /
+                                            sampleRate))]++;
+                stack.unmark(it->second);
+                it->second = now;
+            }
+            stack.mark(now++);
+        }
+        std::vector<uint64_t>().swap(c->sampled);
+    }
+}
+
+static void
+analyzeChunk(const char* begin, const char* end, ChunkStats* stats)
+{
+    static const size_t MAX_OPS = 1024;
+    TraceTokenizer tokenizer;
+    TraceOp ops[MAX_OPS];
+    const char* next = begin;
+    while (next < end) {
+        size_t nOps;
+        next = tokenizer.tokenize(next, end, ops, MAX_OPS, &nOps);
+        for (size_t i = 0; i < nOps; i++)
+            analyzeOp(*stats, ops[i]);
+    }
+}
+
+static void
+report(const char* path, std::vector<ChunkStats*>& chunks)
+{
+    ChunkStats& total = *chunks[0];
+    for (size_t i = 1; i < chunks.size(); i++) {
+        ChunkStats& c = *chunks[i];
+        for (int t = 0; t < TraceOp::N_TYPES; t++)
+            total.byType[t] += c.byType[t];
+        total.other += c.other;
+        total.valueBytes += c.valueBytes;
+        for (int b = 0; b < HISTOGRAM_BUCKETS; b++)
+            total.valueSizes[b] += c.valueSizes[b];
+        total.sketch.merge(c.sketch);
+        total.distinct.merge(c.distinct);
+        for (auto& candidate : c.candidates)
+            total.candidates.emplace(candidate.first, 0);
+    }
+
+    static const char* const labels[TraceOp::N_TYPES] = {
+        "", "reads", "inserts", "updates", "deletes", "read-modify-writes",
+        "cas", "appends", "prepends", "incrs", "decrs", "touches"};
+    uint64_t ops = 0;
+    uint64_t writes = 0;
+    for (int t = TraceOp::READ; t < TraceOp::N_TYPES; t++) {
+        ops += total.byType[t];
+        if (TraceOp::writesValue(TraceOp::Type(t)))
+            writes += total.byType[t];
+    }
+    printf("# %s\n", path);
+    printf("ops               %lu\n", ops);
+    for (int t = TraceOp::READ; t < TraceOp::N_TYPES; t++) {
+        // YCSB's own three are always listed; the rest only if present.
+        if (t > TraceOp::UPDATE && total.byType[t] == 0)
+            continue;
+        printf("%-17s %lu  (%.2f%%)\n", labels[t], total.byType[t],
+               ops ? (double)total.byType[t] / (double)ops * 100 : 0.0);
+    }
+    printf("other lines       %lu\n", total.other);
+    printf("unique keys       %.0f  (estimated)\n", total.distinct.estimate());
+    printf("mean value bytes  %.1f\n",
+           writes ? (double)total.valueBytes / (double)writes : 0.0);
+
+    printf("\nvalue size histogram (bytes)\n");
+    for (int b = 0; b < HISTOGRAM_BUCKETS; b++) {
+        if (total.valueSizes[b] == 0)
+            continue;
+        printf("  %10lu - %-10lu %12lu  (%.2f%%)\n",
+               b == 0 ? 0 : 1UL << (b - 1), (1UL << b) - 1,
+               total.valueSizes[b],
+               (double)total.valueSizes[b] / (double)writes * 100);
+    }
+
+    std::vector<std::pair<uint32_t, std::string>> hot;
+    for (auto& candidate : total.candidates) {
+        uint32_t count = total.sketch.estimate(
+            hashTraceKey(candidate.first.data(), candidate.first.size()));
+        hot.emplace_back(count, candidate.first);
+    }
+    std::sort(hot.begin(), hot.end(),
+              std::greater<std::pair<uint32_t, std::string>>());
+    if (hot.size() > topK)
+        hot.resize(topK);
+
+    printf("\ntop %zu keys (estimated accesses)\n", hot.size());
+    for (size_t i = 0; i < hot.size(); i++) {
+        printf("  %3zu  %-32s %12u  (%.3f%%)\n", i + 1, hot[i].second.c_str(),
+               hot[i].first, (double)hot[i].first / (double)ops * 100);
+    }
+
+    // Least-squares fit of log(frequency) against log(rank) over the hot
+    // keys; for a zipfian workload the slope is -alpha.
+    if (hot.size() >= 2) {
+        double sx = 0, sy = 0, sxx = 0, sxy = 0;
+        double n = (double)hot.size();
+        for (size_t i = 0; i < hot.size(); i++) {
+            double x = log((double)(i + 1));
+            double y = log((double)std::max<uint32_t>(hot[i].first, 1));
+            sx += x;
+            sy += y;
+            sxx += x * x;
+            sxy += x * y;
+        }
+        double slope = (n * sxy - sx * sy) / (n * sxx - sx * sx);
+        printf("zipf alpha        %.3f  (fit over top %zu ranks)\n",
+               -slope, hot.size());
+    }
+
+    printf("\nworking set (estimated unique keys per %lu ops)\n", windowOps);
+    printf("  %12s  %12s  %12s\n", "first op", "ops", "unique keys");
+    // A window split between chunks is the union of its pieces.
+    Window* open = NULL;
+    for (ChunkStats* c : chunks) {
+        for (Window& window : c->workingSet) {
+            if (open != NULL && open->first == window.first) {
+                open->ops += window.ops;
+                open->keys.merge(window.keys);
+                continue;
+            }
+            if (open != NULL) {
+                printf("  %12lu  %12lu  %12.0f\n", open->first, open->ops,
+                       open->keys.estimate());
+            }
+            open = &window;
+        }
+    }
+    if (open != NULL) {
+        printf("  %12lu  %12lu  %12.0f\n", open->first, open->ops,
+               open->keys.estimate());
+    }
+
+    uint64_t cold;
+    uint64_t reuse[HISTOGRAM_BUCKETS] = {};
+    reuseDistances(chunks, &cold, reuse);
+    uint64_t reused = 0;
+    for (int b = 0; b < HISTOGRAM_BUCKETS; b++)
+        reused += reuse[b];
+    uint64_t sampled = reused + cold;
+    printf("\nreuse distance (unique keys between accesses, %.2f%% of keys "
+           "sampled, %lu accesses)\n", sampleRate * 100, sampled);
+    printf("  %-23s %12lu\n", "cold", cold);
+    for (int b = 0; b < HISTOGRAM_BUCKETS; b++) {
+        if (reuse[b] == 0)
+            continue;
+        printf("  %10lu - %-10lu %12lu\n",
+               b == 0 ? 0 : 1UL << (b - 1), (1UL << b) - 1, reuse[b]);
+    }
+
+    // An LRU cache of 2^b keys hits every access whose distance is below
+    // its size.
+    printf("\nLRU miss ratio by cache size (keys)\n");
+    uint64_t misses = sampled;
+    for (int b = 0; b < HISTOGRAM_BUCKETS && misses > cold; b++) {
+        misses -= reuse[b];
+        printf("  %12lu  %.4f\n", 1UL << b,
+               sampled ? (double)misses / (double)sampled : 0.0);
+    }
+    printf("\n");
+}
+
+/**
+ * Map the file at #path into memory for reading front to back.
+ *
+ * \return
+ *      The contents of the file, or NULL if it is empty.
+ */
+static char*
+mapTrace(const char* path, size_t* size)
+{
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        fprintf(stderr, "couldn't open %s: %s\n", path, strerror(errno));
+        exit(1);
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        fprintf(stderr, "couldn't stat %s: %s\n", path, strerror(errno));
+        exit(1);
+    }
+    *size = st.st_size;
+    if (*size == 0) {
+        close(fd);
+        return NULL;
+    }
+    char* data = static_cast<char*>(
+        mmap(NULL, *size, PROT_READ, MAP_PRIVATE, fd, 0));
+    if (data == MAP_FAILED) {
+        fprintf(stderr, "couldn't mmap %s: %s\n", path, strerror(errno));
+        exit(1);
+    }
+    close(fd);
+    madvise(data, *size, MADV_SEQUENTIAL);
+    return data;
+}
+
+static void
+analyzeFile(const char* path)
+{
+    size_t size;
+    char* data = mapTrace(path, &size);
+    if (data == NULL)
+        return;
+
+    // Cut the file into one chunk per thread, ending each on a line.
+    std::vector<const char*> bounds{data};
+    for (int i = 1; i < nThreads; i++) {
+        const char* p = std::max<const char*>(bounds.back(), data + size * i / nThreads);
+        const char* newline =
+            static_cast<const char*>(memchr(p, '\n', data + size - p));
+        bounds.push_back(newline == NULL ? data + size : newline + 1);
+    }
+    bounds.push_back(data + size);
+
+    // Count each chunk's operations first, so each knows where in the
+    // trace it starts.
+    std::vector<uint64_t> counts(nThreads);
+    std::vector<std::thread> threads;
+    for (int i = 0; i < nThreads; i++) {
+        threads.emplace_back([&bounds, &counts, i] {
+            counts[i] = countOps(bounds[i], bounds[i + 1]);
+        });
+    }
+    for (auto& thread : threads)
+        thread.join();
+    threads.clear();
+
+    std::vector<ChunkStats*> chunks;
+    uint64_t firstOp = 0;
+    for (int i = 0; i < nThreads; i++) {
+        chunks.push_back(new ChunkStats(firstOp));
+        firstOp += counts[i];
+        threads.emplace_back(analyzeChunk, bounds[i], bounds[i + 1], chunks[i]);
+    }
+    for (auto& thread : threads)
+        thread.join();
+
+    report(path, chunks);
+
+    for (ChunkStats* c : chunks)
+        delete c;
+    munmap(data, size);
+}
+
+static const int BENCHMARK_PASSES = 5;
+
+/**
+ * Fold one parsed operation into a digest of everything a parser produced.
+ * Keys point into the mapped trace, so their offsets identify them without
+ * the cost of hashing them.
+ */
+static uint64_t
+digestOp(uint64_t digest, const char* data, const TraceOp& op)
+{
+    uint64_t h = (uint64_t)(op.key - data) ^ ((uint64_t)op.keyLength << 40) ^
+                 ((uint64_t)op.type << 56) ^ ((uint64_t)op.valueLength << 20) ^
+                 ((uint64_t)op.ttl * 0x9e3779b97f4a7c15UL);
+    return (digest ^ h) * 1099511628211UL;
+}
+
+/**
+ * Run #parse, which returns the digest of the operations it parsed, over
+ * the whole trace BENCHMARK_PASSES times and return the fastest pass in
+ * seconds.
+ */
+template <typename Parse>
+static double
+timeParser(Parse parse, uint64_t* digest, uint64_t* nOps)
+{
+    double best = 0;
+    for (int pass = 0; pass < BENCHMARK_PASSES; pass++) {
+        auto start = std::chrono::steady_clock::now();
+        *nOps = 0;
+        *digest = parse(nOps);
+        std::chrono::duration<double> secs =
+            std::chrono::steady_clock::now() - start;
+        if (pass == 0 || secs.count() < best)
+            best = secs.count();
+    }
+    return best;
+}
+
+static void
+benchmarkParsers(const char* path)
+{
+    size_t size;
+    char* data = mapTrace(path, &size);
+    if (data == NULL)
+        return;
+    const char* end = data + size;
+
+    uint64_t lines = 0;
+    for (const char* line = data; line < end; lines++) {
+        const char* newline =
+            static_cast<const char*>(memchr(line, '\n', end - line));
+        line = (newline == NULL) ? end : newline + 1;
+    }
+    printf("# parsers: %s: %lu lines, %.1f MB, best of %d passes\n",
+           path, lines, (double)size / 1e6, BENCHMARK_PASSES);
+
+    uint64_t expected;
+    uint64_t nOps;
+    double baseline = timeParser([data, end](uint64_t* nOps) {
+        uint64_t digest = 0;
+        TraceOp op;
+        const char* line = data;
+        while (line < end) {
+            const char* newline =
+                static_cast<const char*>(memchr(line, '\n', end - line));
+            const char* lineEnd = (newline == NULL) ? end : newline;
+            if (parseTraceLine(line, lineEnd, &op)) {
+                digest = digestOp(digest, data, op);
+                (*nOps)++;
+            }
+            line = lineEnd + 1;
+        }
+        return digest;
+    }, &expected, &nOps);
+    printf("  %-8s %10lu ops  %7.3f s  %7.1f M lines/s  %7.0f MB/s  %5.1fx  "
+           "digest %016lx\n", "line", nOps, baseline,
+           (double)lines / baseline / 1e6, (double)size / baseline / 1e6,
+           1.0, expected);
+
+    bool agree = true;
+    for (int i = TraceTokenizer::SSE2; i <= TraceTokenizer::AVX2; i++) {
+        TraceTokenizer::Isa isa = static_cast<TraceTokenizer::Isa>(i);
+        if (!TraceTokenizer::supported(isa))
+            continue;
+        TraceTokenizer tokenizer(isa);
+        uint64_t digest;
+        double secs = timeParser([&tokenizer, data, end](uint64_t* nOps) {
+            static const size_t MAX_OPS = 1024;
+            TraceOp ops[MAX_OPS];
+            uint64_t digest = 0;
+            const char* next = data;
+            while (next < end) {
+                size_t n;
+                next = tokenizer.tokenize(next, end, ops, MAX_OPS, &n);
+                for (size_t j = 0; j < n; j++)
+                    digest = digestOp(digest, data, ops[j]);
+                *nOps += n;
+            }
+            return digest;
+        }, &digest, &nOps);
+        printf("  %-8s %10lu ops  %7.3f s  %7.1f M lines/s  %7.0f MB/s  "
+               "%5.1fx  digest %016lx%s\n", TraceTokenizer::isaName(isa),
+               nOps, secs, (double)lines / secs / 1e6,
+               (double)size / secs / 1e6, baseline / secs, digest,
+               digest == expected ? "" : "  MISMATCH");
+        agree = agree && digest == expected;
+    }
+    printf("\n");
+
+    munmap(data, size);
+    if (!agree) {
+        fprintf(stderr, "%s: tokenizer disagrees with parseTraceLine\n", path);
+        exit(1);
+    }
+}
+
+int
+main(int argc, char** argv)
+{
+    int opt;
+    char* progname = argv[0];
+    bool benchmark = false;
+
+    while ((opt = getopt(argc, argv, "bk:r:t:W:w:")) != -1) {
+        switch (opt) {
+        case 'b':
+            benchmark = true;
+            break;
+        case 'k':
+            topK = atoi(optarg);
+            break;
+        case 'r':
+            sampleRate = atof(optarg);
+            break;
+        case 't':
+            nThreads = atoi(optarg);
+            break;
+        case 'W':
+            windowOps = strtoull(optarg, NULL, 0);
+            break;
+        case 'w':
+            sketchWidthLog2 = atoi(optarg);
+            break;
+        default:
+            fprintf(stderr, "usage: %s [-b] [-t threads] [-k top-keys] "
+                    "[-r reuse-sample-rate] [-W window-ops] "
+                    "[-w log2-sketch-width] ycsb-dump [...]\n", progname);
+            exit(1);
+        }
+    }
+    argc -= optind;
+    argv += optind;
+
+    if (argc < 1) {
+        fprintf(stderr, "usage: %s [-b] [-t threads] [-k top-keys] "
+                "[-r reuse-sample-rate] [-W window-ops] "
+                "[-w log2-sketch-width] ycsb-dump [...]\n", progname);
+        exit(1);
+    }
+    if (nThreads < 1)
+        nThreads = 1;
+    if (topK < 1)
+        topK = 1;
+
+    for (int i = 0; i < argc; i++)
+        if (benchmark)
+            benchmarkParsers(argv[i]);
+        else
+            analyzeFile(argv[i]);
+
+    return 0;
+}
@@ -0,0 +1,137 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <vector>
+
+#include "RequestLog.h"
+
+// Converts a request log written by ycsb_player -R to CSV on stdout, one row
+// per request: when it was issued (microseconds since the log was opened),
+// the worker, the operation, the key's hash, the value length, the outcome,
+// the latency and whether it was logged for being slow. Rows are in the order
+// the log was flushed, which is only roughly time order across workers.
+//
+// With -s only the requests logged for being slow are printed.
+
+static const char*
+opName(uint8_t op)
+{
+    switch (op) {
+    case RequestLog::GET:
+        return "GET";
+    case RequestLog::SET:
+        return "SET";
+    case RequestLog::DELETE:
+        return "DELETE";
+    case RequestLog::TOUCH:
+        return "TOUCH";
+    case RequestLog::CAS:
+        return "CAS";
+    case RequestLog::APPEND:
+        return "APPEND";
+    case RequestLog::PREPEND:
+        return "PREPEND";
+    case RequestLog::INCR:
+        return "INCR";
+    case RequestLog::DECR:
+        return "DECR";
+    case RequestLog::READMODIFYWRITE:
+        return "READMODIFYWRITE";
+    }
+    return "?";
+}
+
+static const char*
+resultName(uint8_t result)
+{
+    switch (result) {
+    case RequestLog::OK:
+        return "ok";
+    case RequestLog::MISS:
+        return "miss";
+    case RequestLog::REPLACED:
+        return "replaced";
+    case RequestLog::FAILED:
+        return "failed";
+    case RequestLog::CONFLICT:
+        return "conflict";
+    }
+    return "?";
+}
+
+static void
+dump(const char* path, bool slowOnly)
+{
+    FILE* in = fopen(path, "rb");
+    if (in == NULL) {
+        perror(path);
+        exit(1);
+    }
+
+    RequestLog::FileHeader header;
+    if (fread(&header, sizeof(header), 1, in) != 1 ||
+        memcmp(header.magic, RequestLog::magic(),
+               sizeof(header.magic)) != 0) {
+        fprintf(stderr, "%s is not a request log\n", path);
+        exit(1);
+    }
+    if (header.version != RequestLog::VERSION ||
+        header.recordSize != sizeof(RequestLog::Record)) {
+        fprintf(stderr, "%s: unsupported request log version %u\n", path,
+                header.version);
+        exit(1);
+    }
+
+    printf("time_us,worker,op,key,value_length,result,latency_ns,slow\n");
+    std::vector<RequestLog::Record> records(64 * 1024);
+    size_t n;
+    while ((n = fread(records.data(), sizeof(records[0]), records.size(),
+                      in)) > 0) {
+        for (size_t i = 0; i < n; i++) {
+            const RequestLog::Record& r = records[i];
+            bool slow = (r.flags & RequestLog::SLOW) != 0;
+            if (slowOnly && !slow)
+                continue;
+            double us = (double)(int64_t)(r.start - header.startCycles) /
+                        header.cyclesPerSecond * 1e6;
+            printf("%.3f,%u,%s,%016lx,%u,%s,%u,%d\n", us, r.worker,
+                   opName(r.op), r.keyId, r.valueLength, resultName(r.result),
+                   r.latencyNs, slow);
+        }
+    }
+    if (ferror(in)) {
+        perror(path);
+        exit(1);
+    }
+    fclose(in);
+}
+
+int
+main(int argc, char** argv)
+{
+    int opt;
+    char* progname = argv[0];
+    bool slowOnly = false;
+
+    while ((opt = getopt(argc, argv, "s")) != -1) {
+        switch (opt) {
+        case 's':
+            slowOnly = true;
+            break;
+        default:
+            fprintf(stderr, "usage: %s [-s] request-log [...]\n", progname);
+            exit(1);
+        }
+    }
+    argc -= optind;
+    argv += optind;
+
+    if (argc < 1) {
+        fprintf(stderr, "usage: %s [-s] request-log [...]\n", progname);
+        exit(1);
+    }
+    for (int i = 0; i < argc; i++)
+        dump(argv[i], slowOnly);
+    return 0;
+}
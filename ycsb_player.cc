@@ -8,10 +8,30 @@
 #include <boost/smart_ptr/detail/spinlock.hpp>
 #include "FifoQueue.h"
 #include <vector>
+#include <string>
+#include <array>
+#include <algorithm>
+#include <condition_variable>
+#include <map>
+#include <mutex>
 
-#include <libmemcached/memcached.h>
 #define PRIVATE private
 #include "Cycles.h"
+#include "Benchmark.h"
+#include "Histogram.h"
+#include "TraceParser.h"
+#include "TraceTokenizer.h"
+#include "TraceIndex.h"
+#include "TraceReader.h"
+#include "LoopbackServer.h"
+#include "KVBackend.h"
+#include "LiveStats.h"
+#include "ProcessGroup.h"
+#include "NearCache.h"
+#include "RequestLog.h"
+#include "SingleFlight.h"
+#include "TtlModel.h"
+#include "ValueCompression.h"
 
 static const bool takeLatencySamples = false;
 static const size_t maxSamples = 1 * 1000 * 1000;
@@ -29,164 +49,1041 @@ bool USE_LENGTH_FROM_FILE = true;
 static char randomChars[100000];
 
 #define MEMCACHED_THREADS 16
+#define MAX_WORKER_THREADS 256
+
+// Worker threads replaying the trace (-w), for measuring how a store scales
+// with the number of cores driving it.
+int nWorkers = MEMCACHED_THREADS;
+
+// If true (-l), every worker times each operation and the merged latency
+// histograms are printed at exit.
+bool RECORD_LATENCY = false;
+
+// If set (-R), workers also log a sample of individual requests (-r) and
+// every request slower than a threshold (-T) to a file for ycsb_logdump.
+RequestLog* requestLog = NULL;
+
+// Operations a worker takes from its queue at once and hands to the backend
+// as one batch (-B), so backends that pipeline can keep several in flight.
+// A batch ends early rather than take a key it already has (see
+// issueBatch()).
+size_t BATCH_SIZE = 1;
+
+// If true (-S), the replay is reproducible: payloads and set offsets come
+// from PRNGs seeded from REPLAY_SEED and each key is always dispatched to
+// the same worker, so operations on a key are issued in trace order.
+bool DETERMINISTIC = false;
+uint64_t REPLAY_SEED = 0;
+
+// With -X, the coordinator forks this many player processes, each replaying
+// the share of the trace picked out by SHARDING (-x): the keys hashing to
+// it, every nProcesses'th operation, or one of nProcesses contiguous ranges
+// found through the trace index.
+enum ShardMode {
+    SHARD_KEYS,
+    SHARD_OPS,
+    SHARD_RANGES
+};
+int nProcesses = 1;
+int processIndex = 0;
+ShardMode SHARDING = SHARD_KEYS;
+static const char* const shardNames[] = {"key", "trace", "range"};
+
+// Per-worker generator for payload offsets; libc random() takes a global
+// lock on every call.
+static thread_local PRNG prng{};
 
 std::atomic<uint64_t> getAttempts(0);
 std::atomic<uint64_t> getFailures(0);
 std::atomic<uint64_t> setAttempts(0);
 std::atomic<uint64_t> setFailures(0);
+
+// Operations other than GETs and SETs. A READMODIFYWRITE counts as a GET
+// and a SET instead, and the SET an operation makes to store a value it
+// found missing counts as a SET, like the refill after a GET.
+std::atomic<uint64_t> otherAttempts(0);
 uint32_t linesProcessed = 0;
 
+// Order-independent sum of per-operation (key, outcome) hashes; reported at
+// exit so two runs can be compared with more than just aggregate counts.
+std::atomic<uint64_t> resultDigest(0);
+
+// TTLs for the values written (-e, -E) and, if the store honours them, the
+// reasons GETs missed, counted by MissClassifier::Kind.
+TtlModel ttlModel;
+std::unique_ptr<MissClassifier> missClassifier;
+std::atomic<uint64_t> missesByKind[MissClassifier::N_KINDS];
+
+// Coalesces concurrent refills of the same key (-F).
+std::unique_ptr<SingleFlight> singleFlight;
+
+// The application's own cache in front of the store (-n).
+std::unique_ptr<NearCache> nearCache;
+
+// Compresses values on their way to the store (-Z).
+std::unique_ptr<ValueCompression> valueCompression;
+
 // Set to true to cause memcached worker threads to quit
 static volatile bool threadsQuit = false;
 
+// Threads that have connected to the backend; the replay's clock starts
+// once all of them have.
+static std::atomic<int> threadsConnected(0);
+
 class Operation {
   public:
+    // Numbered as RequestLog::Op.
     enum OperationType {
         INVALID,
         GET, 
-        SET
+        SET,
+        DELETE,
+        TOUCH,
+        CAS,
+        APPEND,
+        PREPEND,
+        INCR,
+        DECR,
+        READMODIFYWRITE
     };
+    static const int N_TYPES = READMODIFYWRITE + 1;
+
+    static const char*
+    name(OperationType type)
+    {
+        static const char* const names[N_TYPES] = {
+            "invalid", "get", "set", "delete", "touch", "cas", "append",
+            "prepend", "incr", "decr", "rmw"};
+        return names[type];
+    }
 
     Operation()
         : type(INVALID)
         , key()
         , valueLength(0)
+        , ttl(0)
     {
     }
 
     enum OperationType type;
     char key[100];
+
+    /// Length of the value written, or of the one stored if a GET (or a
+    /// CAS, APPEND or PREPEND) finds none; for INCR and DECR, the amount.
     size_t valueLength;
+
+    /// TTL of the value written, or of the one stored if the key is found
+    /// missing; for TOUCH, the new TTL.
+    uint32_t ttl;
+};
+
+// memcached instances to replay against (-H, default 127.0.0.1 on
+// DEFAULT_PORT, which is also the port of a host given without one).
+// Unix sockets are listed by path, with port 0.
+static const int DEFAULT_PORT = 12000;
+std::vector<std::pair<std::string, int>> serverList;
+
+// Server-side counters summed over serverList; written by statsThread (-M)
+// and read when printing the periodic line.
+struct ServerStats {
+    uint64_t evictions;
+    uint64_t getHits;
+    uint64_t cmdGet;
+    uint64_t bytes;
+    uint64_t currItems;
+    double cpuSeconds;
+    uint64_t sampledAt;
+    bool valid;
 };
+ServerStats latestServerStats{};
+boost::detail::spinlock statsLock = BOOST_DETAIL_SPINLOCK_INIT;
 
 #define MAX_QUEUE_LENGTH 1000
-FifoQueue<Operation> queue;
-boost::detail::spinlock queueLock;
 
-void
-issueSet(memcached_st* memc, char* key, int valueLen)
+// In deterministic mode each worker drains its own queue; otherwise every
+// worker shares queues[0].
+struct WorkQueue {
+    FifoQueue<Operation> ops;
+    boost::detail::spinlock lock;
+};
+WorkQueue queues[MAX_WORKER_THREADS];
+
+static uint64_t
+hashKey(const char* key, uint64_t h = 14695981039346656037UL)
+{
+    while (*key != '\0') {
+        h ^= (unsigned char)*key++;
+        h *= 1099511628211UL;
+    }
+    return h;
+}
+
+// What became of an operation, as the result digest counts it.
+enum Outcome {
+    HIT,
+    MISS,
+    REPLACED,   // found with the wrong length, so refilled
+    WRITTEN,
+    OTHER       // any other type; the detail holds the type and result
+};
+
+static inline uint64_t
+mix64(uint64_t h)
+{
+    h = (h ^ (h >> 30)) * 0xbf58476d1ce4e5b9UL;
+    h = (h ^ (h >> 27)) * 0x94d049bb133111ebUL;
+    return h ^ (h >> 31);
+}
+
+/**
+ * The digest term for an operation on #key that came to #outcome, with
+ * #detail (a write's value length) folded in. Each outcome keys its own
+ * mix of the key's hash, so that the terms of different outcomes don't
+ * line up in the digest's sum the way reseeded key hashes could.
+ */
+static uint64_t
+outcomeHash(const char* key, Outcome outcome, uint64_t detail = 0)
+{
+    return mix64(hashKey(key) ^ mix64((detail << 8 | outcome) + 1));
+}
+
+// Makes each worker's connection to the store under test (-K, -o).
+std::unique_ptr<KVBackendFactory> backendFactory;
+
+// Per-operation latencies in ns (-l), by Operation::OperationType, merged
+// from every worker as it exits. With -B the unit timed is a whole batch.
+struct LatencyHistograms {
+    static const int N_HISTOGRAMS = Operation::N_TYPES + 1;
+
+    /// Histogram #i of N_HISTOGRAMS: those in #ops, then #batch.
+    Histogram&
+    at(int i)
+    {
+        return i < Operation::N_TYPES ? ops[i] : batch;
+    }
+
+    const Histogram&
+    at(int i) const
+    {
+        return i < Operation::N_TYPES ? ops[i] : batch;
+    }
+
+    Histogram ops[Operation::N_TYPES];
+    Histogram batch;
+};
+LatencyHistograms latency{};
+
+// What every operation came to, by Operation::OperationType and
+// RequestLog::Result, merged from every worker as it exits.
+uint64_t opResults[Operation::N_TYPES][RequestLog::N_RESULTS];
+
+// Guards latency and opResults.
+std::mutex totalsMutex;
+
+// A worker's own tally of what it has issued: its GETs and SETs for the live
+// stats (-m), and the outcome of everything for opResults.
+struct WorkerCounts {
+    void
+    count(Operation::OperationType type, RequestLog::Result result)
+    {
+        results[type][result]++;
+        if (type == Operation::GET) {
+            gets++;
+            if (result != RequestLog::OK)
+                getMisses++;
+            if (result == RequestLog::FAILED)
+                setFailures++;
+        } else if (type == Operation::SET) {
+            sets++;
+            if (result == RequestLog::FAILED)
+                setFailures++;
+        }
+    }
+
+    uint64_t gets;
+    uint64_t getMisses;
+    uint64_t sets;
+    uint64_t setFailures;
+    uint64_t results[Operation::N_TYPES][RequestLog::N_RESULTS];
+};
+
+// What a worker hands the live-stats publisher when asked: its counts and a
+// copy of its latency histograms. The worker writes only while #wanted is
+// set and clears it when done, so the publisher never reads a half-written
+// report and the replay never waits for the publisher.
+struct WorkerReport {
+    std::atomic<bool> wanted;
+    WorkerCounts counts;
+    LatencyHistograms latency;
+};
+std::unique_ptr<WorkerReport[]> workerReports;
+
+// What each process of a -X run leaves in its ProcessGroup slot.
+struct ProcessResults {
+    // As in the digest line.
+    uint64_t counters[6];
+
+    // missesByKind.
+    uint64_t misses[MissClassifier::N_KINDS];
+
+    uint64_t results[Operation::N_TYPES][RequestLog::N_RESULTS];
+
+    // latency, by LatencyHistograms::at().
+    uint64_t latencySum[LatencyHistograms::N_HISTOGRAMS];
+    uint64_t latencyMax[LatencyHistograms::N_HISTOGRAMS];
+    uint64_t latencyCounts[LatencyHistograms::N_HISTOGRAMS]
+                          [Histogram::N_BUCKETS];
+};
+
+/// Tell the miss classifier (-e) that #key was stored with #ttl.
+static inline void
+noteWrite(const char* key, uint32_t ttl)
+{
+    if (missClassifier != NULL)
+        missClassifier->written(hashTraceKey(key, strlen(key)), ttl);
+}
+
+/// Tell the miss classifier (-e) that #key was deleted.
+static inline void
+noteRemove(const char* key)
+{
+    if (missClassifier != NULL)
+        missClassifier->removed(hashTraceKey(key, strlen(key)));
+}
+
+/// Count a GET of #key that found nothing by why it missed (-e).
+static inline void
+classifyMiss(const char* key)
+{
+    if (missClassifier == NULL)
+        return;
+    uint64_t keyHash = hashTraceKey(key, strlen(key));
+    missesByKind[missClassifier->classify(keyHash)]++;
+}
+
+/**
+ * Fill randomChars with text that compresses about as well as real cached
+ * values (-Z): JSON-like records of words from a small vocabulary and
+ * random numbers, rather than random characters, which would not compress
+ * at all. Like those, it is all printable ASCII.
+ */
+static void
+fillCompressible(PRNG& fillPrng)
+{
+    static const char* const words[] = {
+        "user", "session", "profile", "item", "cart", "order", "price",
+        "count", "status", "active", "pending", "shipped", "name", "email",
+        "created", "updated", "region", "us-east", "eu-west", "true",
+        "false", "null", "tags", "score", "views", "likes", "title", "body",
+    };
+    const size_t nWords = sizeof(words) / sizeof(words[0]);
+
+    size_t filled = 0;
+    char record[256];
+    while (filled < sizeof(randomChars)) {
+        int length = snprintf(record, sizeof(record),
+            "{\"id\":%lu,\"%s\":\"%s %s\",\"%s\":%lu,\"%s\":[\"%s\",\"%s\"],"
+            "\"%s\":\"%s\"},",
+            fillPrng() % 10000000, words[fillPrng() % nWords],
+            words[fillPrng() % nWords], words[fillPrng() % nWords],
+            words[fillPrng() % nWords], fillPrng() % 100000,
+            words[fillPrng() % nWords], words[fillPrng() % nWords],
+            words[fillPrng() % nWords], words[fillPrng() % nWords],
+            words[fillPrng() % nWords]);
+        size_t n = std::min(size_t(length), sizeof(randomChars) - filled);
+        memcpy(&randomChars[filled], record, n);
+        filled += n;
+    }
+}
+
+/// A value of #length bytes to write.
+static inline const char*
+payload(size_t length)
+{
+    assert(length <= sizeof(randomChars));
+    return &randomChars[prng() % (sizeof(randomChars) - length)];
+}
+
+/**
+ * Note that this process is about to write or delete #key: that ends any
+ * lease on it (-F lease) and drops the near cache's copy (-n).
+ */
+static inline void
+noteOverwrite(const char* key)
+{
+    if (singleFlight == NULL && nearCache == NULL)
+        return;
+    uint64_t keyHash = hashTraceKey(key, strlen(key));
+    if (singleFlight != NULL)
+        singleFlight->invalidate(keyHash);
+    if (nearCache != NULL)
+        nearCache->invalidate(keyHash);
+}
+
+/**
+ * Serve a GET of #key from the near cache (-n) if it holds the value.
+ */
+static inline bool
+nearCacheGet(const char* key, uint64_t& digest)
+{
+    if (nearCache->get(hashTraceKey(key, strlen(key)))) {
+        digest += outcomeHash(key, HIT);
+        return true;
+    }
+    return false;
+}
+
+/**
+ * Have the near cache (-n) keep the value a GET of #key got from the store,
+ * or refilled it with, which the store keeps for #ttl. Only for a GET that
+ * came to something other than RequestLog::FAILED: a value the application
+ * failed to get or to store isn't one it would hold on to.
+ */
+static inline void
+nearCacheFill(const char* key, uint32_t ttl)
+{
+    nearCache->fill(hashTraceKey(key, strlen(key)), ttl);
+}
+
+/**
+ * Refill #key as the owner of flight #token (-F), unless its lease has
+ * been invalidated, then end the flight. Returns what the GET that came to
+ * #missed ends up as.
+ */
+static RequestLog::Result
+refillAsOwner(KVBackend& kv, const char* key, uint64_t keyHash,
+              uint64_t token, size_t valueLength, uint32_t ttl,
+              RequestLog::Result missed)
+{
+    RequestLog::Result result = missed;
+    if (singleFlight->mayRefill(keyHash, token)) {
+        setAttempts++;
+        if (kv.set(key, strlen(key), payload(valueLength), valueLength,
+                   ttl) != KVBackend::OK) {
+            setFailures++;
+            result = RequestLog::FAILED;
+        } else {
+            noteWrite(key, ttl);
+        }
+    }
+    singleFlight->release(keyHash, token);
+    return result;
+}
+
+/**
+ * Let flight #token's refill of #key stand for this GET's (-F). A lease
+ * follower instead backs off and reads the key again until it finds a
+ * value, or finds the flight ended without one and takes over the refill.
+ */
+static RequestLog::Result
+followRefill(KVBackend& kv, const char* key, uint64_t keyHash,
+             uint64_t token, size_t valueLength, uint32_t ttl,
+             RequestLog::Result missed)
+{
+    if (singleFlight->getMode() != SingleFlight::LEASE) {
+        singleFlight->follow(keyHash, token);
+        return missed;
+    }
+    while (true) {
+        singleFlight->backOff();
+        size_t foundLength;
+        KVBackend::Status status = kv.get(key, strlen(key), &foundLength);
+        if (status == KVBackend::ERROR) {
+            fprintf(stderr, "unexpected get error: %s\n", kv.errorString());
+            exit(1);
+        }
+        if (status == KVBackend::OK) {
+            singleFlight->coalesce();
+            return missed;
+        }
+        if (singleFlight->miss(keyHash, &token) == SingleFlight::OWNER) {
+            return refillAsOwner(kv, key, keyHash, token, valueLength, ttl,
+                                 missed);
+        }
+    }
+}
+
+/**
+ * issueGet() with single-flight refills (-F): of the GETs that miss a key
+ * at the same time, only the first refills it.
+ */
+static RequestLog::Result
+issueCoalescedGet(KVBackend& kv, const char* key, size_t valueLength,
+                  uint32_t ttl, uint64_t& digest)
+{
+    size_t keyLength = strlen(key);
+    size_t foundLength = 0;
+    KVBackend::Status status = kv.get(key, keyLength, &foundLength);
+    if (status == KVBackend::ERROR) {
+        fprintf(stderr, "unexpected get error: %s\n", kv.errorString());
+        exit(1);
+    }
+    if (status == KVBackend::OK &&
+        (!UPDATE_CHANGED_VALUE_LENGTH || foundLength == valueLength)) {
+        digest += outcomeHash(key, HIT);
+        return RequestLog::OK;
+    }
+    digest += outcomeHash(key, status == KVBackend::MISS ? MISS : REPLACED);
+    if (status == KVBackend::MISS)
+        classifyMiss(key);
+    getFailures++;
+    RequestLog::Result missed = status == KVBackend::MISS
+        ? RequestLog::MISS : RequestLog::REPLACED;
+
+    uint64_t keyHash = hashTraceKey(key, keyLength);
+    uint64_t token;
+    if (singleFlight->miss(keyHash, &token) == SingleFlight::OWNER) {
+        return refillAsOwner(kv, key, keyHash, token, valueLength, ttl,
+                             missed);
+    }
+    return followRefill(kv, key, keyHash, token, valueLength, ttl, missed);
+}
+
+RequestLog::Result
+issueSet(KVBackend& kv, const char* key, int valueLen, uint32_t ttl)
 {
     assert(valueLen <= (int)sizeof(randomChars));
-    char* value = &randomChars[random() % (sizeof(randomChars) - valueLen)];
+    char* value = &randomChars[prng() % (sizeof(randomChars) - valueLen)];
 
+    noteOverwrite(key);
     setAttempts++;
-    memcached_return rc = memcached_set(memc, key, strlen(key), value, valueLen, (time_t)0, (uint32_t)0);
-    if (rc != MEMCACHED_SUCCESS) {
-        //fprintf(stderr, "set rc == %d (%s)\n", (int)rc, memcached_strerror(memc, rc));
+    if (kv.set(key, strlen(key), value, valueLen, ttl) != KVBackend::OK) {
+        //fprintf(stderr, "set failed (%s)\n", kv.errorString());
         setFailures++;
+        return RequestLog::FAILED;
     }
+    noteWrite(key, ttl);
+    return RequestLog::OK;
 }
 
-void
-issueGet(memcached_st* memc, char* key, std::vector<uint64_t>& getSamples)
+RequestLog::Result
+issueGet(KVBackend& kv, char* key, int valueLen, uint32_t ttl,
+         std::vector<uint64_t>& getSamples, uint64_t& digest)
 {
-    memcached_return rc;
-    uint32_t flags;
-    size_t valueLength;
-
     getAttempts++;
+    if (nearCache != NULL && nearCacheGet(key, digest))
+        return RequestLog::OK;
+    if (singleFlight != NULL) {
+        RequestLog::Result result =
+            issueCoalescedGet(kv, key, valueLen, ttl, digest);
+        if (nearCache != NULL && result != RequestLog::FAILED)
+            nearCacheFill(key, ttl);
+        return result;
+    }
 
     uint64_t start;
     if (takeLatencySamples)
-      start = RAMCloud::Cycles::rdtsc();
+      start = RAMCloud::Cycles::rdtscStart();
 
-    char* ret = memcached_get(memc, key, strlen(key), &valueLength, &flags, &rc);
-    if (ret == NULL) {
-        //fprintf(stderr, "get rc == %d (%s)\n", (int)rc, memcached_strerror(memc, rc));
-        getFailures++;
-
-        // should just be a cache miss. handle by adding it to the cache.
-        if (rc == MEMCACHED_NOTFOUND) { 
-            issueSet(memc, key, VALUE_LENGTH);
-        } else {
-            fprintf(stderr, "unexpected get error: %s\n", memcached_strerror(memc, rc));
-            exit(1);
-        }
-    } else {
+    // On a miss, or a value of the wrong length, refill the key just as the
+    // application would after reading from the database.
+    assert(valueLen <= (int)sizeof(randomChars));
+    char* value = &randomChars[prng() % (sizeof(randomChars) - valueLen)];
+    KVBackend::Status setStatus = KVBackend::OK;
+    KVBackend::ReadResult result =
+        kv.getOrRefill(key, strlen(key), value, valueLen,
+                       UPDATE_CHANGED_VALUE_LENGTH, &setStatus, ttl);
+    switch (result) {
+    case KVBackend::HIT:
         if (takeLatencySamples &&
             (start & 0xfff) == 0x010 &&
             getSamples.size() != maxSamples)
         {
-            getSamples.emplace_back(RAMCloud::Cycles::rdtsc() - start);
+            getSamples.emplace_back(RAMCloud::Cycles::rdtscStop() - start);
         }
-        if (UPDATE_CHANGED_VALUE_LENGTH && (int)valueLength != VALUE_LENGTH) {
+        digest += outcomeHash(key, HIT);
+        if (nearCache != NULL)
+            nearCacheFill(key, ttl);
+        return RequestLog::OK;
+    case KVBackend::REFILLED:
+        digest += outcomeHash(key, MISS);
+        classifyMiss(key);
+        break;
+    case KVBackend::REPLACED:
+        digest += outcomeHash(key, REPLACED);
+        break;
+    case KVBackend::FAILED:
+        fprintf(stderr, "unexpected get error: %s\n", kv.errorString());
+        exit(1);
+    }
+
+    getFailures++;
+    setAttempts++;
+    if (setStatus != KVBackend::OK) {
+        setFailures++;
+        return RequestLog::FAILED;
+    }
+    noteWrite(key, ttl);
+    if (nearCache != NULL)
+        nearCacheFill(key, ttl);
+    return result == KVBackend::REFILLED ? RequestLog::MISS
+                                         : RequestLog::REPLACED;
+}
+
+/// What an operation other than a GET came to, from the store's #status.
+static inline RequestLog::Result
+resultOf(KVBackend::Status status)
+{
+    switch (status) {
+    case KVBackend::OK:
+        return RequestLog::OK;
+    case KVBackend::MISS:
+        return RequestLog::MISS;
+    default:
+        return RequestLog::FAILED;
+    }
+}
+
+/// A GET in a batch that missed with -F, and the refill flight it joined.
+struct RefillFlight {
+    size_t op;
+    uint64_t keyHash;
+    uint64_t token;
+};
+
+/**
+ * Issue #ops as one KVBackend::submit() batch, then a second batch with the
+ * writes that depend on what the first found: the refill of each GET that
+ * missed, the write half of each READMODIFYWRITE, the cas of each CAS whose
+ * gets hit, and a SET for each CAS, APPEND, PREPEND, INCR or DECR that found
+ * nothing to change (or, for a counter, no number), storing the value afresh
+ * as the application would. With -F, a GET's refill joins the second batch
+ * only if the GET was the first to miss its key; the others follow that
+ * refill once the batch is done. With -n, GETs the near cache holds are not
+ * sent at all, and those that are fill it once they're done. Counters and
+ * digest are updated exactly as issueGet() and issueSet() would for the same
+ * GETs and SETs. If #results is given, it is filled with what each operation
+ * came to.
+ *
+ * No key may appear twice in #ops: the second round would then go out after
+ * later operations on the same key, so a refill could overwrite a SET that
+ * followed it in the trace, and a key read twice would miss twice.
+ */
+void
+issueBatch(KVBackend& kv, const std::vector<Operation>& ops, uint64_t& digest,
+           std::vector<RequestLog::Result>* results = NULL)
+{
+    static thread_local std::vector<KVBackend::Request> requests;
+    // The operation each request is for.
+    static thread_local std::vector<size_t> issued;
+    static thread_local std::vector<KVBackend::Request> followUps;
+    static thread_local std::vector<size_t> followed;
+    static thread_local std::vector<RequestLog::Result> ownResults;
+    // Counters stored afresh, one slot per operation so none moves while the
+    // second batch is outstanding.
+    static thread_local std::vector<std::array<char, 24>> counters;
+    // GETs that missed with -F, then the flights they own and follow.
+    static thread_local std::vector<size_t> coalescing;
+    static thread_local std::vector<RefillFlight> owned;
+    static thread_local std::vector<RefillFlight> following;
+    requests.clear();
+    issued.clear();
+    followUps.clear();
+    followed.clear();
+    coalescing.clear();
+    owned.clear();
+    following.clear();
+    std::vector<RequestLog::Result>& result =
+        results != NULL ? *results : ownResults;
+    result.assign(ops.size(), RequestLog::OK);
+    if (counters.size() < ops.size())
+        counters.resize(ops.size());
+
+    for (size_t i = 0; i < ops.size(); i++) {
+        const Operation& op = ops[i];
+        KVBackend::Request r{KVBackend::Request::GET, op.key, strlen(op.key),
+                             NULL, 0, KVBackend::OK, 0, 0, 0};
+        switch (op.type) {
+        case Operation::GET:
+            getAttempts++;
+            if (nearCache != NULL && nearCacheGet(op.key, digest))
+                continue;
+            break;
+        case Operation::READMODIFYWRITE:
+            getAttempts++;
+            noteOverwrite(op.key);
+            break;
+        case Operation::SET:
+            r.type = KVBackend::Request::SET;
+            r.ttl = op.ttl;
+            r.valueLength = op.valueLength;
+            r.value = payload(op.valueLength);
+            digest += outcomeHash(op.key, WRITTEN, op.valueLength);
+            noteOverwrite(op.key);
+            setAttempts++;
+            break;
+        case Operation::DELETE:
+            r.type = KVBackend::Request::DELETE;
+            noteOverwrite(op.key);
+            otherAttempts++;
+            break;
+        case Operation::TOUCH:
+            r.type = KVBackend::Request::TOUCH;
+            r.ttl = op.ttl;
+            otherAttempts++;
+            break;
+        case Operation::CAS:
+            r.type = KVBackend::Request::GETS;
+            noteOverwrite(op.key);
+            otherAttempts++;
+            break;
+        case Operation::APPEND:
+        case Operation::PREPEND:
+            r.type = op.type == Operation::APPEND ? KVBackend::Request::APPEND
+                                                  : KVBackend::Request::PREPEND;
+            r.valueLength = op.valueLength;
+            r.value = payload(op.valueLength);
+            noteOverwrite(op.key);
+            otherAttempts++;
+            break;
+        case Operation::INCR:
+        case Operation::DECR:
+            r.type = op.type == Operation::INCR ? KVBackend::Request::INCR
+                                                : KVBackend::Request::DECR;
+            r.amount = op.valueLength;
+            noteOverwrite(op.key);
+            otherAttempts++;
+            break;
+        default:
+            fprintf(stderr, "invalid operation!\n");
+            exit(1);
+        }
+        issued.push_back(i);
+        requests.push_back(r);
+    }
+
+    kv.submit(requests.data(), requests.size());
+
+    for (size_t j = 0; j < requests.size(); j++) {
+        size_t i = issued[j];
+        const Operation& op = ops[i];
+        KVBackend::Request& r = requests[j];
+        KVBackend::Request followUp{KVBackend::Request::SET, r.key,
+                                    r.keyLength, NULL, op.valueLength,
+                                    KVBackend::OK, op.ttl, 0, 0};
+        switch (op.type) {
+        case Operation::SET:
+            if (r.status != KVBackend::OK) {
+                setFailures++;
+                result[i] = RequestLog::FAILED;
+            } else {
+                noteWrite(r.key, r.ttl);
+            }
+            continue;
+        case Operation::GET:
+            if (r.status == KVBackend::ERROR) {
+                fprintf(stderr, "unexpected get error: %s\n",
+                        kv.errorString());
+                exit(1);
+            }
+            if (r.status == KVBackend::OK &&
+                (!UPDATE_CHANGED_VALUE_LENGTH ||
+                 r.valueLength == op.valueLength)) {
+                digest += outcomeHash(r.key, HIT);
+                continue;
+            }
+            digest += outcomeHash(r.key, r.status == KVBackend::MISS
+                                             ? MISS : REPLACED);
+            if (r.status == KVBackend::MISS)
+                classifyMiss(r.key);
             getFailures++;
-            issueSet(memc, key, VALUE_LENGTH);
+            result[i] = r.status == KVBackend::MISS ? RequestLog::MISS
+                                                    : RequestLog::REPLACED;
+            if (singleFlight != NULL) {
+                coalescing.push_back(i);
+                continue;
+            }
+            setAttempts++;
+            break;
+        case Operation::READMODIFYWRITE:
+            if (r.status == KVBackend::ERROR) {
+                fprintf(stderr, "unexpected get error: %s\n",
+                        kv.errorString());
+                exit(1);
+            }
+            if (r.status == KVBackend::MISS) {
+                classifyMiss(r.key);
+                getFailures++;
+                result[i] = RequestLog::MISS;
+            }
+            setAttempts++;
+            break;
+        case Operation::DELETE:
+            result[i] = resultOf(r.status);
+            if (r.status == KVBackend::OK)
+                noteRemove(r.key);
+            continue;
+        case Operation::TOUCH:
+            result[i] = resultOf(r.status);
+            if (r.status == KVBackend::OK)
+                noteWrite(r.key, r.ttl);
+            continue;
+        case Operation::CAS:
+            result[i] = resultOf(r.status);
+            if (r.status == KVBackend::OK) {
+                followUp.type = KVBackend::Request::CAS;
+                followUp.cas = r.cas;
+            } else if (r.status == KVBackend::MISS) {
+                setAttempts++;
+            } else {
+                continue;
+            }
+            break;
+        case Operation::APPEND:
+        case Operation::PREPEND:
+            result[i] = resultOf(r.status);
+            if (r.status != KVBackend::MISS)
+                continue;
+            setAttempts++;
+            break;
+        case Operation::INCR:
+        case Operation::DECR:
+            if (r.status == KVBackend::NON_NUMERIC) {
+                result[i] = RequestLog::REPLACED;
+            } else {
+                result[i] = resultOf(r.status);
+                if (r.status != KVBackend::MISS)
+                    continue;
+            }
+            // Start the counter where the operation would have taken it.
+            followUp.valueLength = snprintf(
+                counters[i].data(), counters[i].size(), "%lu",
+                op.type == Operation::INCR ? op.valueLength : 0UL);
+            followUp.value = counters[i].data();
+            setAttempts++;
+            break;
+        default:
+            break;
         }
-        free(ret);
+        if (followUp.value == NULL)
+            followUp.value = payload(followUp.valueLength);
+        followed.push_back(i);
+        followUps.push_back(followUp);
+    }
+
+    for (size_t i : coalescing) {
+        const Operation& op = ops[i];
+        size_t keyLength = strlen(op.key);
+        RefillFlight flight{i, hashTraceKey(op.key, keyLength), 0};
+        if (singleFlight->miss(flight.keyHash, &flight.token) ==
+                SingleFlight::FOLLOWER) {
+            following.push_back(flight);
+            continue;
+        }
+        owned.push_back(flight);
+        if (!singleFlight->mayRefill(flight.keyHash, flight.token))
+            continue;
+        setAttempts++;
+        followed.push_back(i);
+        followUps.push_back({KVBackend::Request::SET, op.key, keyLength,
+                             payload(op.valueLength), op.valueLength,
+                             KVBackend::OK, op.ttl, 0, 0});
+    }
+
+    // The write half of a READMODIFYWRITE, or the cas of a CAS, goes out
+    // after the rest of the first round; nothing there shares its key, so
+    // no DELETE or SET the trace has after it can be undone by it.
+    if (!followUps.empty())
+        kv.submit(followUps.data(), followUps.size());
+    for (size_t j = 0; j < followUps.size(); j++) {
+        const KVBackend::Request& f = followUps[j];
+        size_t i = followed[j];
+        if (f.type == KVBackend::Request::CAS) {
+            // The value changed or went away since the gets.
+            if (f.status == KVBackend::EXISTS)
+                result[i] = RequestLog::CONFLICT;
+            else if (f.status != KVBackend::OK)
+                result[i] = resultOf(f.status);
+            else
+                noteWrite(f.key, f.ttl);
+        } else if (f.status != KVBackend::OK) {
+            setFailures++;
+            result[i] = RequestLog::FAILED;
+        } else {
+            noteWrite(f.key, f.ttl);
+        }
+    }
+
+    // Only now, holding no flights, may this worker wait for others'.
+    for (const RefillFlight& flight : owned)
+        singleFlight->release(flight.keyHash, flight.token);
+    for (const RefillFlight& flight : following) {
+        const Operation& op = ops[flight.op];
+        result[flight.op] = followRefill(kv, op.key, flight.keyHash,
+                                         flight.token, op.valueLength, op.ttl,
+                                         result[flight.op]);
+    }
+
+    // No later write in #ops shares a GET's key, so nothing has overwritten
+    // what it found since; filling now is filling in trace order.
+    if (nearCache != NULL) {
+        for (size_t i : issued) {
+            if (ops[i].type == Operation::GET &&
+                result[i] != RequestLog::FAILED) {
+                nearCacheFill(ops[i].key, ops[i].ttl);
+            }
+        }
+    }
+
+    for (size_t i = 0; i < ops.size(); i++) {
+        if (ops[i].type != Operation::GET && ops[i].type != Operation::SET)
+            digest += outcomeHash(ops[i].key, OTHER,
+                                  uint64_t(ops[i].type) << 8 | result[i]);
     }
 }
 
+/// Hand one finished operation to the request log (-R).
+static void
+logRequest(int threadId, const Operation& op, RequestLog::Result result,
+           uint64_t start, uint64_t latencyNs)
+{
+    requestLog->record(threadId, RequestLog::Op(op.type), result,
+                       hashTraceKey(op.key, strlen(op.key)), op.valueLength,
+                       start, latencyNs);
+}
+
 void
-memcachedThread()
+memcachedThread(int threadId)
 {
+    if (DETERMINISTIC)
+        prng.reseed(REPLAY_SEED + threadId + 1);
+    else
+        prng.reseed(RAMCloud::Cycles::rdtsc() + threadId);
+    WorkQueue& queue = queues[DETERMINISTIC ? threadId : 0];
+    uint64_t digest = 0;
+
     std::vector<uint64_t> getSamples{};
     std::vector<uint64_t> setSamples{};
     if (takeLatencySamples) {
       getSamples.reserve(maxSamples);
       setSamples.reserve(maxSamples);
     }
-    memcached_st* memc = memcached_create(NULL);
-    memcached_return rc;
-#if 0
-    rc = memcached_behavior_set(memc, MEMCACHED_BEHAVIOR_BINARY_PROTOCOL, 1);
-    if (rc != MEMCACHED_SUCCESS) {
-        fprintf(stderr, "failed to set binary protocol\n");
-        exit(1);
-    }
+    std::unique_ptr<KVBackend> kv = backendFactory->connect();
+    if (valueCompression != NULL)
+        kv = valueCompression->wrap(std::move(kv));
+    threadsConnected++;
+    std::vector<Operation> batch;
+    std::vector<uint64_t> batchKeys;
+    LatencyHistograms local{};
+    uint64_t opStart = 0;
+    const bool timeOps = RECORD_LATENCY || requestLog != NULL;
+    std::vector<RequestLog::Result> batchResults;
+    WorkerReport* report =
+        workerReports != NULL ? &workerReports[threadId] : NULL;
+    WorkerCounts counts{};
 
-    rc = memcached_behavior_set(memc, MEMCACHED_BEHAVIOR_USE_UDP, 1);
-    if (rc != MEMCACHED_SUCCESS) {
-        fprintf(stderr, "failed to set udp protocol\n");
-        exit(1);
-    }
-#endif
-    rc = memcached_behavior_set(memc, MEMCACHED_BEHAVIOR_NO_BLOCK, 1);
-    if (rc != MEMCACHED_SUCCESS) {
-        fprintf(stderr, "failed to set non-blocking IO\n");
-        exit(1);
-    }
+    while (!threadsQuit) {
+        if (report != NULL &&
+            report->wanted.load(std::memory_order_acquire)) {
+            report->counts = counts;
+            if (RECORD_LATENCY)
+                report->latency = local;
+            report->wanted.store(false, std::memory_order_release);
+        }
 
-    memcached_server_st* servers = memcached_server_list_append(NULL, "127.0.0.1", 12000, &rc);
-    if (servers == NULL) {
-        fprintf(stderr, "memcached_server_list_append failed: %d\n", (int)rc);
-        exit(1);
-    }
-    rc = memcached_server_push(memc, servers);
-    if (rc != MEMCACHED_SUCCESS) {
-        fprintf(stderr, "memcached_server_push failed: %d (%s)\n", (int)rc, memcached_strerror(memc, rc));
-        exit(1);
-    }
+        queue.lock.lock();
+        if (queue.ops.empty()) {
+            queue.lock.unlock();
+            // Without contention on a shared lock nothing else makes an idle
+            // worker back off, so let the dispatcher have the core.
+            if (DETERMINISTIC)
+                std::this_thread::yield();
+            continue;
+        }
 
-    while (!threadsQuit) {
-        queueLock.lock();
-        if (queue.empty()) {
-            queueLock.unlock();
+        if (BATCH_SIZE > 1) {
+            batch.clear();
+            batchKeys.clear();
+            while (batch.size() < BATCH_SIZE && !queue.ops.empty()) {
+                uint64_t keyHash = hashKey(queue.ops.front().key);
+                if (std::find(batchKeys.begin(), batchKeys.end(), keyHash) !=
+                        batchKeys.end()) {
+                    break;
+                }
+                batchKeys.push_back(keyHash);
+                batch.push_back(queue.ops.pop());
+            }
+            queue.lock.unlock();
+            if (timeOps)
+                opStart = RAMCloud::Cycles::rdtscStart();
+            issueBatch(*kv, batch, digest, &batchResults);
+            for (size_t i = 0; i < batch.size(); i++)
+                counts.count(batch[i].type, batchResults[i]);
+            if (!timeOps)
+                continue;
+            uint64_t ns = RAMCloud::Cycles::toNanosecondsFast(
+                RAMCloud::Cycles::rdtscStop() - opStart);
+            if (RECORD_LATENCY)
+                local.batch.record(ns);
+            // Each operation is logged with the latency of its whole batch.
+            if (requestLog != NULL) {
+                for (size_t i = 0; i < batch.size(); i++)
+                    logRequest(threadId, batch[i], batchResults[i], opStart,
+                               ns);
+            }
             continue;
         }
 
-        Operation op = queue.pop();
-        queueLock.unlock();
+        Operation op = queue.ops.pop();
+        queue.lock.unlock();
 
+        if (timeOps)
+            opStart = RAMCloud::Cycles::rdtscStart();
+        RequestLog::Result result;
         if (op.type == Operation::GET) {
-            issueGet(memc, op.key, getSamples);
+            result = issueGet(*kv, op.key, op.valueLength, op.ttl, getSamples,
+                              digest);
         } else if (op.type == Operation::SET) {
+            digest += outcomeHash(op.key, WRITTEN, op.valueLength);
             uint64_t start;
             if (takeLatencySamples)
-              start = RAMCloud::Cycles::rdtsc();
+              start = RAMCloud::Cycles::rdtscStart();
             if (takeLatencySamples &&
                 (start & 0xfff) == 0x010 &&
                 setSamples.size() != maxSamples)
             {
               setSamples.emplace_back(start);
-              issueSet(memc, op.key, op.valueLength);
-              setSamples.back() = RAMCloud::Cycles::rdtsc() - setSamples.back();
+              result = issueSet(*kv, op.key, op.valueLength, op.ttl);
+              setSamples.back() = RAMCloud::Cycles::rdtscStop() - setSamples.back();
             } else {
-              issueSet(memc, op.key, op.valueLength);
+              result = issueSet(*kv, op.key, op.valueLength, op.ttl);
             }
         } else {
-            fprintf(stderr, "invalid operation!\n");
-            exit(1);
+            // The rest play out exactly as they would in a batch of their own.
+            static thread_local std::vector<Operation> one(1);
+            one[0] = op;
+            issueBatch(*kv, one, digest, &batchResults);
+            result = batchResults[0];
+        }
+
+        counts.count(op.type, result);
+        if (!timeOps)
+            continue;
+        uint64_t ns = RAMCloud::Cycles::toNanosecondsFast(
+            RAMCloud::Cycles::rdtscStop() - opStart);
+        if (RECORD_LATENCY)
+            local.ops[op.type].record(ns);
+        if (requestLog != NULL)
+            logRequest(threadId, op, result, opStart, ns);
+    }
+
+    // The publisher has stopped by now; leave it the final tally.
+    if (report != NULL) {
+        report->counts = counts;
+        report->latency = local;
+        report->wanted.store(false, std::memory_order_release);
+    }
+
+    resultDigest += digest;
+    {
+        std::lock_guard<std::mutex> _(totalsMutex);
+        for (int t = 0; t < Operation::N_TYPES; t++) {
+            for (int r = 0; r < RequestLog::N_RESULTS; r++)
+                opResults[t][r] += counts.results[t][r];
+        }
+        if (RECORD_LATENCY) {
+            for (int i = 0; i < LatencyHistograms::N_HISTOGRAMS; i++)
+                latency.at(i).merge(local.at(i));
         }
     }
 
@@ -196,68 +1093,754 @@ memcachedThread()
     for (uint64_t s : setSamples)
       printf("SET %lu ns\n", RAMCloud::Cycles::toNanoseconds(s));
 
+    kv.reset();
     fprintf(stderr, "memcached worker thread exiting\n");
 }
 
-int
-getValueLength(char* line)
+/**
+ * Poll "stats" on every target server each #interval seconds and publish
+ * the sums in #latestServerStats for the periodic report line.
+ */
+void
+statsThread(double interval)
 {
-    if (USE_LENGTH_FROM_FILE) {
-        // XXX- this only works if a single field is given
-        if (strchr(line, '[') != NULL)
-            return (int)(strchr(line, ']') - strchr(line, '[')) - 10;
+    std::unique_ptr<KVBackend> kv = backendFactory->connect();
+    threadsConnected++;
+    uint64_t nextPoll = RAMCloud::Cycles::rdtsc();
 
-        // if there are no fields explicitly listed, then assume this has been run
-        // through ycsb_munge.py and the key was stripped in favour of its byte length
-        int length;
-        sscanf(line, "%*s %*s %*s %d\n", &length);
-        return length;
+    while (!threadsQuit) {
+        if (RAMCloud::Cycles::rdtsc() < nextPoll) {
+            usleep(1000);
+            continue;
+        }
+        nextPoll += RAMCloud::Cycles::fromSeconds(interval);
+
+        KVBackend::ServerStats stats{};
+        ServerStats sum{};
+        sum.valid = kv->serverStats(&stats);
+        sum.evictions = stats.evictions;
+        sum.getHits = stats.getHits;
+        sum.cmdGet = stats.cmdGet;
+        sum.bytes = stats.bytes;
+        sum.currItems = stats.currItems;
+        sum.cpuSeconds = stats.cpuSeconds;
+        sum.sampledAt = RAMCloud::Cycles::rdtsc();
+
+        statsLock.lock();
+        latestServerStats = sum;
+        statsLock.unlock();
     }
+}
 
-    return VALUE_LENGTH;
+/**
+ * Fill in #op from an operation parsed out of the trace:
+ *
+ *   READ usertable user6622674881006267921 [ <all fields>]
+ *   INSERT usertable user8183854946431771896 [ field0=8#?(;?4%4*'4#0$"=/$*9"/)-!?36?7#>8>"-0$&2(2"0+))  &'-;+7 ()7%->56.!;2<086;-!#.9067 01(=!%3<$;7$#7#,; ]
+ *
+ * READs become GETs and INSERTs and UPDATEs SETs; the other operations
+ * TraceParser knows are replayed as themselves.
+ */
+void
+makeOp(const TraceOp& traceOp, Operation* op)
+{
+    static const Operation::OperationType types[TraceOp::N_TYPES] = {
+        Operation::INVALID, Operation::GET, Operation::SET, Operation::SET,
+        Operation::DELETE, Operation::READMODIFYWRITE, Operation::CAS,
+        Operation::APPEND, Operation::PREPEND, Operation::INCR,
+        Operation::DECR, Operation::TOUCH};
+    op->type = types[traceOp.type];
+    size_t keyLength = std::min(traceOp.keyLength, sizeof(op->key) - 1);
+    memcpy(op->key, traceOp.key, keyLength);
+    op->key[keyLength] = '\0';
+    // A GET's length is that of the value to refill it with; fixing it
+    // here keeps a change to VALUE_LENGTH between files from reaching
+    // operations of the previous file still waiting in the queues.
+    op->valueLength = VALUE_LENGTH;
+    if (TraceOp::writesValue(traceOp.type) && USE_LENGTH_FROM_FILE)
+        op->valueLength = traceOp.valueLength;
+    if (op->type == Operation::INCR || op->type == Operation::DECR)
+        op->valueLength = traceOp.valueLength;
+    op->ttl = 0;
+    if (ttlModel.isEnabled()) {
+        // Whatever rewrites an existing value counts as an update; the
+        // values stored because a key was found missing are refills.
+        TtlModel::Write write = TtlModel::REFILL;
+        switch (traceOp.type) {
+        case TraceOp::INSERT:
+            write = TtlModel::INSERT;
+            break;
+        case TraceOp::UPDATE:
+        case TraceOp::READMODIFYWRITE:
+        case TraceOp::CAS:
+        case TraceOp::TOUCH:
+            write = TtlModel::UPDATE;
+            break;
+        default:
+            break;
+        }
+        op->ttl = ttlModel.ttlFor(write, op->key, keyLength,
+                                  hashTraceKey(op->key, keyLength),
+                                  traceOp.ttl);
+    }
 }
 
-// this method can parse through about 4M operations/sec from the ycsb
-// text output
+// Cycles the dispatcher has spent waiting for parsed operations and for
+// room in the worker queues, respectively, and when the wait under way
+// began (0 if none), so -m can charge each interval its share of a long one.
+uint64_t dispatchInputWaitCycles = 0;
+uint64_t dispatchQueueWaitCycles = 0;
+uint64_t dispatchInputWaitStart = 0;
+uint64_t dispatchQueueWaitStart = 0;
+
 void
-handleOp(char *line)
+dispatchOp(const Operation& op)
 {
-    /*
-     * READ usertable user6622674881006267921 [ <all fields>]
-     * INSERT usertable user8183854946431771896 [ field0=8#?(;?4%4*'4#0$"=/$*9"/)-!?36?7#>8>"-0$&2(2"0+))  &'-;+7 ()7%->56.!;2<086;-!#.9067 01(=!%3<$;7$#7#,; ]
-     */
+    WorkQueue& queue =
+        queues[DETERMINISTIC ? hashKey(op.key) % nWorkers : 0];
 
     bool queueFull = true;
+    uint64_t waitStart = 0;
     while (queueFull) {
-        queueLock.lock();
-        queueFull = (queue.size() == MAX_QUEUE_LENGTH);
-        queueLock.unlock();
-        if (queueFull)
-            usleep(100);
+        queue.lock.lock();
+        queueFull = (queue.ops.size() == MAX_QUEUE_LENGTH);
+        if (!queueFull)
+            break;
+        queue.lock.unlock();
+        if (waitStart == 0) {
+            waitStart = RAMCloud::Cycles::rdtsc();
+            __atomic_store_n(&dispatchQueueWaitStart, waitStart,
+                             __ATOMIC_RELAXED);
+        }
+        usleep(100);
+    }
+
+    queue.ops.push(op);
+    linesProcessed++;
+    queue.lock.unlock();
+
+    if (waitStart != 0) {
+        dispatchQueueWaitCycles += RAMCloud::Cycles::rdtsc() - waitStart;
+        __atomic_store_n(&dispatchQueueWaitStart, 0, __ATOMIC_RELAXED);
+    }
+}
+
+/**
+ * Publishes a LiveStats snapshot of the replay every interval (-m), from
+ * its own thread: it asks every worker for a report, gives them a moment to
+ * answer between operations, and fills in the rest from the global
+ * counters, the queues and the server stats thread. A worker that is slow
+ * to answer keeps its previous report.
+ */
+class LivePublisher {
+  public:
+    LivePublisher(const char* path, double interval, const char* backend)
+        : stats(path, interval, backend)
+        , interval(interval)
+        , snapshot(new LiveStats::Snapshot())
+        , current(nWorkers)
+        , previous(nWorkers)
+        , currentCounts(nWorkers)
+        , start(RAMCloud::Cycles::rdtsc())
+        , lastSample(start)
+        , lastOps(0)
+        , lastInputWait(0)
+        , lastQueueWait(0)
+        , quit(false)
+        , thread()
+    {
+        workerReports.reset(new WorkerReport[nWorkers]);
+        for (int i = 0; i < nWorkers; i++) {
+            workerReports[i].wanted = false;
+            workerReports[i].counts = WorkerCounts{};
+        }
+    }
+
+    void
+    run()
+    {
+        thread = std::thread([this] {
+            uint64_t next = start;
+            while (!quit) {
+                next += RAMCloud::Cycles::fromSeconds(interval);
+                while (!quit && RAMCloud::Cycles::rdtsc() < next)
+                    usleep(1000);
+                if (!quit)
+                    publish(false);
+            }
+        });
+    }
+
+    /// Stop publishing; call before the workers quit.
+    void
+    stop()
+    {
+        quit = true;
+        thread.join();
+    }
+
+    /**
+     * Gather and publish a snapshot. With #finished, the workers must have
+     * exited, leaving their final reports.
+     */
+    void
+    publish(bool finished)
+    {
+        if (!finished)
+            collectReports();
+        for (int i = 0; i < nWorkers; i++) {
+            if (workerReports[i].wanted.load(std::memory_order_acquire))
+                continue;
+            currentCounts[i] = workerReports[i].counts;
+            current[i] = workerReports[i].latency;
+        }
+
+        uint64_t now = RAMCloud::Cycles::rdtsc();
+        double periodSecs = RAMCloud::Cycles::toSeconds(now - lastSample);
+        LiveStats::Snapshot& s = *snapshot;
+        timespec wall;
+        clock_gettime(CLOCK_REALTIME, &wall);
+        s.sampledAtNs = wall.tv_sec * 1000000000UL + wall.tv_nsec;
+        s.elapsedSeconds = RAMCloud::Cycles::toSeconds(now - start);
+        s.finished = finished;
+
+        s.lines = __atomic_load_n(&linesProcessed, __ATOMIC_RELAXED);
+        s.gets = getAttempts;
+        s.getMisses = getFailures;
+        s.sets = setAttempts;
+        s.setFailures = setFailures;
+        uint64_t ops = s.gets + s.sets + otherAttempts;
+        s.opsPerSecond = s.elapsedSeconds > 0 ? ops / s.elapsedSeconds : 0;
+        s.recentOpsPerSecond = periodSecs > 0 ? (ops - lastOps) / periodSecs
+                                              : 0;
+        uint64_t inputWait = waited(dispatchInputWaitCycles,
+                                    dispatchInputWaitStart, now);
+        uint64_t queueWait = waited(dispatchQueueWaitCycles,
+                                    dispatchQueueWaitStart, now);
+        s.inputStarved = share(inputWait, lastInputWait, now);
+        s.queueBlocked = share(queueWait, lastQueueWait, now);
+
+        LatencyHistograms total{};
+        LatencyHistograms recent{};
+        Histogram delta;
+        s.queueDepth = 0;
+        s.nWorkers = std::min(nWorkers, LiveStats::MAX_WORKERS);
+        for (int i = 0; i < nWorkers; i++) {
+            uint64_t depth = 0;
+            if (DETERMINISTIC || i == 0) {
+                queues[i].lock.lock();
+                depth = queues[i].ops.size();
+                queues[i].lock.unlock();
+            }
+            s.queueDepth += depth;
+
+            const Histogram* now[] = {&current[i].ops[Operation::GET],
+                                      &current[i].ops[Operation::SET],
+                                      &current[i].batch};
+            const Histogram* before[] = {&previous[i].ops[Operation::GET],
+                                         &previous[i].ops[Operation::SET],
+                                         &previous[i].batch};
+            Histogram* totals[] = {&total.ops[Operation::GET],
+                                   &total.ops[Operation::SET], &total.batch};
+            Histogram* recents[] = {&recent.ops[Operation::GET],
+                                    &recent.ops[Operation::SET],
+                                    &recent.batch};
+            LiveStats::Latency summaries[3];
+            for (int k = 0; k < 3; k++) {
+                totals[k]->merge(*now[k]);
+                difference(*now[k], *before[k], &delta);
+                recents[k]->merge(delta);
+                summaries[k] = summarize(delta);
+            }
+            if (i >= LiveStats::MAX_WORKERS)
+                continue;
+            LiveStats::Worker& w = s.workers[i];
+            w.gets = currentCounts[i].gets;
+            w.getMisses = currentCounts[i].getMisses;
+            w.sets = currentCounts[i].sets;
+            w.setFailures = currentCounts[i].setFailures;
+            w.queueDepth = depth;
+            w.get = summaries[0];
+            w.set = summaries[1];
+            w.batch = summaries[2];
+        }
+        s.get = summarize(total.ops[Operation::GET]);
+        s.set = summarize(total.ops[Operation::SET]);
+        s.batch = summarize(total.batch);
+        s.recentGet = summarize(recent.ops[Operation::GET]);
+        s.recentSet = summarize(recent.ops[Operation::SET]);
+        s.recentBatch = summarize(recent.batch);
+
+        statsLock.lock();
+        ServerStats server = latestServerStats;
+        statsLock.unlock();
+        s.server.valid = server.valid;
+        s.server.evictions = server.evictions;
+        s.server.getHits = server.getHits;
+        s.server.cmdGet = server.cmdGet;
+        s.server.bytes = server.bytes;
+        s.server.items = server.currItems;
+        s.server.cpuSeconds = server.cpuSeconds;
+
+        stats.publish(s);
+        previous = current;
+        lastSample = now;
+        lastOps = ops;
+        lastInputWait = inputWait;
+        lastQueueWait = queueWait;
+    }
+
+  private:
+    /**
+     * The cycles the dispatcher has waited by #now: the #total of its
+     * finished waits and the part of any since #waitStart.
+     */
+    static uint64_t
+    waited(const uint64_t& total, const uint64_t& waitStart, uint64_t now)
+    {
+        uint64_t since = __atomic_load_n(&waitStart, __ATOMIC_RELAXED);
+        uint64_t cycles = __atomic_load_n(&total, __ATOMIC_RELAXED);
+        return cycles + (since != 0 && since < now ? now - since : 0);
+    }
+
+    /**
+     * The fraction of the interval ending at #now spent waiting, from
+     * waited() then and at the interval's start. A wait that ends between
+     * the two loads in waited() can be counted in the wrong interval, so
+     * the result is approximate and clamped to [0, 1].
+     */
+    double
+    share(uint64_t waitedNow, uint64_t waitedBefore, uint64_t now)
+    {
+        if (now <= lastSample || waitedNow <= waitedBefore)
+            return 0;
+        return std::min(1.0, double(waitedNow - waitedBefore) /
+                             double(now - lastSample));
+    }
+
+    /// Ask every worker for a report and wait up to 50 ms for them.
+    void
+    collectReports()
+    {
+        for (int i = 0; i < nWorkers; i++)
+            workerReports[i].wanted.store(true, std::memory_order_release);
+        uint64_t deadline = RAMCloud::Cycles::rdtsc() +
+                            RAMCloud::Cycles::fromSeconds(0.05);
+        for (int i = 0; i < nWorkers; i++) {
+            while (workerReports[i].wanted.load(std::memory_order_acquire) &&
+                   RAMCloud::Cycles::rdtsc() < deadline) {
+                usleep(100);
+            }
+        }
+    }
+
+    /// Set #out to the samples in #now that are not in #before.
+    static void
+    difference(const Histogram& now, const Histogram& before, Histogram* out)
+    {
+        static thread_local std::vector<uint64_t> counts(Histogram::N_BUCKETS);
+        uint64_t max = 0;
+        for (size_t i = 0; i < counts.size(); i++) {
+            counts[i] = now.getCounts()[i] - before.getCounts()[i];
+            if (counts[i] != 0)
+                max = Histogram::bucketUpperBound(i);
+        }
+        out->clear();
+        out->merge(counts.data(), now.getSum() - before.getSum(),
+                   std::min(max, now.getMax()));
+    }
+
+    static LiveStats::Latency
+    summarize(const Histogram& h)
+    {
+        return {h.count(), (uint64_t)h.mean(), h.percentile(0.5),
+                h.percentile(0.99), h.percentile(0.999), h.getMax()};
+    }
+
+    LiveStats stats;
+    const double interval;
+    std::unique_ptr<LiveStats::Snapshot> snapshot;
+
+    /// Each worker's latest report, and the one before it.
+    std::vector<LatencyHistograms> current;
+    std::vector<LatencyHistograms> previous;
+    std::vector<WorkerCounts> currentCounts;
+
+    uint64_t start;
+    uint64_t lastSample;
+    uint64_t lastOps;
+    uint64_t lastInputWait;
+    uint64_t lastQueueWait;
+    std::atomic<bool> quit;
+    std::thread thread;
+};
+
+/**
+ * The operations parsed out of one TraceReader block.
+ */
+struct OpBatch {
+    uint64_t sequence;
+
+    /// Decoded offset in the trace file just past the block.
+    uint64_t endOffset;
+
+    std::vector<Operation> ops;
+
+    /// Decoded offsets of the lines holding some of #ops, as (index in ops,
+    /// offset) pairs, for the trace index.
+    std::vector<std::pair<size_t, uint64_t>> marks;
+};
+
+/**
+ * A pool of threads that parse blocks from a TraceReader into OpBatches.
+ * Blocks are parsed in parallel, but next() hands the batches back in trace
+ * order.
+ */
+class ParseStage {
+  public:
+    ParseStage(TraceReader& reader, int nThreads)
+        : parseCycles(0)
+        , opsParsed(0)
+        , reader(reader)
+        , mutex()
+        , cond()
+        , ready()
+        , spare()
+        , nextSequence(0)
+        , running(nThreads)
+        , threads()
+    {
+        for (int i = 0; i < nThreads; i++)
+            threads.emplace_back(&ParseStage::parserThread, this);
+    }
+
+    ~ParseStage()
+    {
+        for (auto& thread : threads)
+            thread.join();
+        for (auto& batch : ready)
+            delete batch.second;
+        for (OpBatch* batch : spare)
+            delete batch;
+    }
+
+    /**
+     * Return the next batch in trace order, or NULL once the trace is
+     * exhausted. The batch must be handed back with release().
+     */
+    OpBatch*
+    next()
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        cond.wait(lock, [this] {
+            return ready.count(nextSequence) != 0 ||
+                   (running == 0 && ready.empty());
+        });
+        auto it = ready.find(nextSequence);
+        if (it == ready.end())
+            return NULL;
+        OpBatch* batch = it->second;
+        ready.erase(it);
+        nextSequence++;
+        cond.notify_all();
+        return batch;
+    }
+
+    void
+    release(OpBatch* batch)
+    {
+        std::lock_guard<std::mutex> _(mutex);
+        spare.push_back(batch);
+    }
+
+    /// Cycles spent parsing, summed over the parser threads.
+    std::atomic<uint64_t> parseCycles;
+    std::atomic<uint64_t> opsParsed;
+
+  private:
+    void
+    parserThread()
+    {
+        TraceTokenizer tokenizer;
+        TraceOp traceOps[TOKENIZE_OPS];
+        while (TraceReader::Block* block = reader.next()) {
+            uint64_t start = RAMCloud::Cycles::rdtsc();
+            OpBatch* batch = NULL;
+            {
+                std::lock_guard<std::mutex> _(mutex);
+                if (!spare.empty()) {
+                    batch = spare.back();
+                    spare.pop_back();
+                }
+            }
+            if (batch == NULL)
+                batch = new OpBatch();
+            batch->sequence = block->sequence;
+            batch->endOffset = block->offset + block->length;
+            batch->ops.clear();
+            batch->marks.clear();
+
+            const char* end = block->data + block->length;
+            const char* next = block->data;
+            Operation op;
+            while (next < end) {
+                batch->marks.emplace_back(batch->ops.size(),
+                                          block->offset + (next - block->data));
+                size_t nOps;
+                next = tokenizer.tokenize(next, end, traceOps,
+                                          TOKENIZE_OPS, &nOps);
+                for (size_t i = 0; i < nOps; i++) {
+                    makeOp(traceOps[i], &op);
+                    batch->ops.push_back(op);
+                }
+            }
+            reader.release(block);
+            parseCycles += RAMCloud::Cycles::rdtsc() - start;
+            opsParsed += batch->ops.size();
+
+            // Don't run more than a few batches ahead of the dispatcher, but
+            // never hold back the one it is waiting for.
+            std::unique_lock<std::mutex> lock(mutex);
+            cond.wait(lock, [this, batch] {
+                return ready.size() < MAX_READY_BATCHES ||
+                       batch->sequence == nextSequence;
+            });
+            ready[batch->sequence] = batch;
+            cond.notify_all();
+        }
+
+        std::lock_guard<std::mutex> _(mutex);
+        running--;
+        cond.notify_all();
+    }
+
+    static const size_t MAX_READY_BATCHES = 4;
+
+    /// Operations tokenized at a time before being copied into the batch.
+    static const size_t TOKENIZE_OPS = 1024;
+
+    TraceReader& reader;
+    std::mutex mutex;
+    std::condition_variable cond;
+    std::map<uint64_t, OpBatch*> ready;
+    std::vector<OpBatch*> spare;
+    uint64_t nextSequence;
+    int running;
+
+    std::vector<std::thread> threads;
+};
+
+/**
+ * Print the digest line for #counters: lines, gets, get misses, sets, set
+ * failures and the result digest.
+ */
+static void
+printDigest(const uint64_t counters[6])
+{
+    uint64_t checksum = 14695981039346656037UL;
+    for (int c = 0; c < 6; c++) {
+        for (int i = 0; i < 8; i++) {
+            checksum ^= (counters[c] >> (i * 8)) & 0xff;
+            checksum *= 1099511628211UL;
+        }
+    }
+    printf("# digest: %lu lines   %lu gets   %lu get misses   %lu sets   "
+           "%lu set failures   results %016lx   checksum %016lx\n",
+           counters[0], counters[1], counters[2], counters[3], counters[4],
+           counters[5], checksum);
+}
+
+static void
+printLatency(const LatencyHistograms& latency)
+{
+    for (int i = 0; i < LatencyHistograms::N_HISTOGRAMS; i++) {
+        const Histogram& h = latency.at(i);
+        if (h.count() == 0)
+            continue;
+        const char* name = i < Operation::N_TYPES
+            ? Operation::name(Operation::OperationType(i)) : "batch";
+        printf("# latency: %-5s %lu ops   mean %.0f ns   p50 %lu ns   "
+               "p99 %lu ns   p99.9 %lu ns   max %lu ns\n",
+               name, h.count(), h.mean(), h.percentile(0.5),
+               h.percentile(0.99), h.percentile(0.999), h.getMax());
+    }
+}
+
+/**
+ * Print what the operations other than GETs and SETs came to, one line for
+ * each kind the trace held; GETs and SETs are in the digest.
+ */
+static void
+printOps(const uint64_t results[Operation::N_TYPES][RequestLog::N_RESULTS])
+{
+    for (int t = Operation::DELETE; t < Operation::N_TYPES; t++) {
+        const uint64_t* r = results[t];
+        uint64_t issued = 0;
+        for (int k = 0; k < RequestLog::N_RESULTS; k++)
+            issued += r[k];
+        if (issued == 0)
+            continue;
+        printf("# ops: %-7s %lu issued   %lu missed   %lu replaced   "
+               "%lu conflicts   %lu failed\n",
+               Operation::name(Operation::OperationType(t)), issued,
+               r[RequestLog::MISS], r[RequestLog::REPLACED],
+               r[RequestLog::CONFLICT], r[RequestLog::FAILED]);
+    }
+}
+
+/**
+ * Print how many GETs missed for each reason (-e); the rest of #getMisses
+ * found a value of the wrong length.
+ */
+static void
+printMisses(const uint64_t misses[MissClassifier::N_KINDS],
+            uint64_t getMisses)
+{
+    printf("# get misses:");
+    for (int k = 0; k < MissClassifier::N_KINDS; k++) {
+        printf("   %lu %s", misses[k],
+               MissClassifier::kindName(MissClassifier::Kind(k)));
+        getMisses -= misses[k];
     }
+    printf("   %lu replaced\n", getMisses);
+}
 
-    queueLock.lock();
+/**
+ * Sum what every process of a -X run left in its slot and print it as a
+ * single run would have.
+ */
+static void
+printTotals(ProcessGroup& group)
+{
+    uint64_t counters[6] = {};
+    uint64_t misses[MissClassifier::N_KINDS] = {};
+    uint64_t classified = 0;
+    uint64_t opTotals[Operation::N_TYPES][RequestLog::N_RESULTS] = {};
+    LatencyHistograms total{};
+    for (int p = 0; p < group.size(); p++) {
+        const ProcessResults* results =
+            static_cast<const ProcessResults*>(group.slot(p));
+        for (int c = 0; c < 6; c++)
+            counters[c] += results->counters[c];
+        for (int k = 0; k < MissClassifier::N_KINDS; k++) {
+            misses[k] += results->misses[k];
+            classified += results->misses[k];
+        }
+        for (int t = 0; t < Operation::N_TYPES; t++) {
+            for (int k = 0; k < RequestLog::N_RESULTS; k++)
+                opTotals[t][k] += results->results[t][k];
+        }
+        for (int i = 0; i < LatencyHistograms::N_HISTOGRAMS; i++) {
+            total.at(i).merge(results->latencyCounts[i],
+                              results->latencySum[i],
+                              results->latencyMax[i]);
+        }
+    }
+    printf("# totals over %d processes\n", group.size());
+    printDigest(counters);
+    if (classified > 0)
+        printMisses(misses, counters[2]);
+    printOps(opTotals);
+    if (RECORD_LATENCY)
+        printLatency(total);
+}
+
+/**
+ * Load #trace's index (-j), or start a new one with entries every #stride
+ * operations. With #complete, an index that doesn't cover the whole trace
+ * is rebuilt in one pass and saved.
+ */
+static std::unique_ptr<TraceIndex>
+loadIndex(const char* trace, uint64_t stride, bool complete)
+{
+    std::unique_ptr<TraceIndex> index(new TraceIndex(stride));
+    if (index->load(trace)) {
+        printf("# trace index for %s: %lu entries every %lu ops%s\n", trace,
+               index->size(), index->getStride(),
+               index->isComplete() ? "" : " (partial)");
+    }
+    if (complete && !index->isComplete()) {
+        printf("# indexing %s\n", trace);
+        fflush(stdout);
+        index.reset(new TraceIndex(stride));
+        index->build(trace);
+        index->save(trace, true);
+        printf("# trace index for %s: %lu ops, %lu entries\n", trace,
+               index->totalOps(), index->size());
+    }
+    return index;
+}
+
+static std::string
+checkpointPath(const char* trace)
+{
+    return std::string(trace) + ".ckpt";
+}
 
-    if (line[0] == 'R') {
-        queue.push(Operation());
-        queue.back().type = Operation::GET;
-        sscanf(line, "READ usertable %s [", queue.back().key);
-        linesProcessed++;
-    } else if (line[0] == 'I') {
-        queue.push(Operation());
-        queue.back().type = Operation::SET;
-        sscanf(line, "INSERT usertable %s [", queue.back().key);
-        queue.back().valueLength = getValueLength(line);
-        linesProcessed++;
-    } else if (line[0] == 'U') {
-        queue.push(Operation());
-        queue.back().type = Operation::SET;
-        sscanf(line, "UPDATE usertable %s [", queue.back().key);
-        queue.back().valueLength = getValueLength(line);
-        linesProcessed++;
+/**
+ * Record that a replay of #trace resumed (-C) from #entry would miss none of
+ * the operations issued so far (-c).
+ */
+static void
+writeCheckpoint(const char* trace, const TraceIndex::Entry& entry)
+{
+    std::string path = checkpointPath(trace);
+    std::string temp = path + ".tmp";
+    FILE* out = fopen(temp.c_str(), "w");
+    bool ok = out != NULL &&
+              fprintf(out, "%lu %lu %lu\n", entry.ops, entry.offset,
+                      entry.timeNs) > 0;
+    if (out != NULL && fclose(out) != 0)
+        ok = false;
+    if (!ok || rename(temp.c_str(), path.c_str()) != 0) {
+        fprintf(stderr, "couldn't write checkpoint %s: %s\n", path.c_str(),
+                strerror(errno));
+        unlink(temp.c_str());
     }
+}
+
+static bool
+readCheckpoint(const char* trace, TraceIndex::Entry* entry)
+{
+    FILE* in = fopen(checkpointPath(trace).c_str(), "r");
+    if (in == NULL)
+        return false;
+    bool ok = fscanf(in, "%lu %lu %lu", &entry->ops, &entry->offset,
+                     &entry->timeNs) == 3;
+    fclose(in);
+    return ok;
+}
 
-    queueLock.unlock();
+/**
+ * Point serverList at the -L server: at the Unix socket #socket, or if that
+ * is NULL at #port on localhost.
+ */
+static void
+useLoopback(const char* socket, int port)
+{
+    serverList.clear();
+    if (socket != NULL)
+        serverList.emplace_back(socket, 0);
+    else
+        serverList.emplace_back("127.0.0.1", port);
+}
+
+/**
+ * Start the -L server with #nThreads threads and replay against it; see
+ * useLoopback() for #socket.
+ */
+static LoopbackServer*
+startLoopback(int nThreads, const char* socket, bool null)
+{
+    LoopbackServer* loopback = new LoopbackServer(
+        socket != NULL ? socket : "127.0.0.1:0", nThreads, null);
+    useLoopback(socket, loopback->getPort());
+    printf("# loopback server: %d threads on %s%s%s\n",
+           nThreads, serverList[0].first.c_str(),
+           socket != NULL
+               ? "" : (":" + std::to_string(loopback->getPort())).c_str(),
+           null ? " (null)" : "");
+    return loopback;
 }
 
 int
@@ -266,12 +1849,148 @@ main(int argc, char** argv)
     int opt;
     char* progname = argv[0];
     uint32_t periodicity = 100000;
+    double statsInterval = 0;
+    int nParsers = 2;
+    bool directIo = false;
+    int loopbackThreads = 0;
+    bool loopbackNull = false;
+    const char* loopbackSocket = NULL;
+    std::string backendName = "memcached";
+    BackendConfig backendConfig;
+    const char* requestLogPath = NULL;
+    double requestLogRate = 0.01;
+    double requestLogSlowUs = 0;
+    const char* liveStatsPath = NULL;
+    double liveStatsInterval = 1.0;
+    uint64_t indexStride = 0;
+    uint64_t startOp = 0;
+    double startSeconds = -1;
+    double checkpointInterval = 0;
+    bool resume = false;
 
-    while ((opt = getopt(argc, argv, "fP:s:")) != -1) {
+    while ((opt = getopt(argc, argv, "B:c:CDe:E:fF:g:G:H:i:j:K:lL:m:M:n:No:p:P:r:R:s:S:T:U:w:x:X:Z:")) != -1) {
         switch (opt) {
+        case 'B':
+            BATCH_SIZE = std::max(1, atoi(optarg));
+            break;
+        case 'K':
+            backendName = optarg;
+            break;
+        case 'l':
+            RECORD_LATENCY = true;
+            break;
+        case 'R':
+            requestLogPath = optarg;
+            break;
+        case 'r':
+            requestLogRate = atof(optarg);
+            break;
+        case 'T':
+            requestLogSlowUs = atof(optarg);
+            break;
+        case 'X':
+            nProcesses = std::max(1, atoi(optarg));
+            break;
+        case 'x':
+            if (strcmp(optarg, "key") == 0) {
+                SHARDING = SHARD_KEYS;
+            } else if (strcmp(optarg, "trace") == 0) {
+                SHARDING = SHARD_OPS;
+            } else if (strcmp(optarg, "range") == 0) {
+                SHARDING = SHARD_RANGES;
+            } else {
+                fprintf(stderr, "unknown sharding %s (key, trace or "
+                        "range)\n", optarg);
+                exit(1);
+            }
+            break;
+        case 'e':
+            ttlModel.addRule(optarg);
+            break;
+        case 'E':
+            ttlModel.setCompression(atof(optarg));
+            break;
+        case 'F':
+            singleFlight.reset(new SingleFlight(optarg));
+            break;
+        case 'n':
+            nearCache.reset(new NearCache(optarg));
+            break;
+        case 'Z':
+            valueCompression.reset(new ValueCompression(optarg));
+            break;
+        case 'j':
+            indexStride = std::max(1ull, strtoull(optarg, NULL, 0));
+            break;
+        case 'g':
+            startOp = strtoull(optarg, NULL, 0);
+            break;
+        case 'G':
+            startSeconds = atof(optarg);
+            break;
+        case 'c':
+            checkpointInterval = atof(optarg);
+            break;
+        case 'C':
+            resume = true;
+            break;
+        case 'w':
+            nWorkers = std::min(std::max(1, atoi(optarg)),
+                                MAX_WORKER_THREADS);
+            break;
+        case 'o': {
+            char* equals = strchr(optarg, '=');
+            if (equals == NULL) {
+                backendConfig.options[optarg] = "1";
+            } else {
+                *equals = '\0';
+                backendConfig.options[optarg] = equals + 1;
+            }
+            break;
+        }
+        case 'H': {
+            char* colon = strrchr(optarg, ':');
+            int port = DEFAULT_PORT;
+            if (optarg[0] == '/') {
+                port = 0;
+            } else if (colon != NULL) {
+                *colon = '\0';
+                port = atoi(colon + 1);
+            }
+            serverList.emplace_back(optarg, port);
+            break;
+        }
+        case 'L':
+            loopbackThreads = atoi(optarg);
+            break;
+        case 'N':
+            loopbackNull = true;
+            break;
+        case 'U':
+            loopbackSocket = optarg;
+            break;
+        case 'M':
+            statsInterval = atof(optarg);
+            break;
+        case 'm':
+            liveStatsPath = optarg;
+            break;
+        case 'i':
+            liveStatsInterval = std::max(0.01, atof(optarg));
+            break;
+        case 'D':
+            directIo = true;
+            break;
+        case 'p':
+            nParsers = std::max(1, atoi(optarg));
+            break;
         case 'f':
             USE_LENGTH_FROM_FILE = false;
             break;
+        case 'S':
+            DETERMINISTIC = true;
+            REPLAY_SEED = strtoull(optarg, NULL, 0);
+            break;
         case 'P':
             periodicity = atoi(optarg);
             break;
@@ -288,36 +2007,301 @@ main(int argc, char** argv)
         exit(1);
     }
 
-    for (int i = 0; i < (int)sizeof(randomChars); i++)
-        randomChars[i] = '!' + (random() % ('~' - '!' + 1));
+    // With -L, replay against a server inside this process instead: on a
+    // free localhost port, or on the Unix socket given by -U. -N makes it
+    // acknowledge updates without storing them. With -X the coordinator
+    // starts it once the players are forked (see below).
+    LoopbackServer* loopback = NULL;
+    if (loopbackThreads > 0 && nProcesses == 1) {
+        loopback = startLoopback(loopbackThreads, loopbackSocket,
+                                 loopbackNull);
+    }
+
+    if (serverList.empty())
+        serverList.emplace_back("127.0.0.1", DEFAULT_PORT);
+
+    // Starting partway through (-g, -G, -C), checkpointing (-c) and
+    // splitting into ranges all go through a trace index (-j).
+    bool indexing = indexStride > 0 || startOp > 0 || startSeconds >= 0 ||
+                    checkpointInterval > 0 || resume ||
+                    (nProcesses > 1 && SHARDING == SHARD_RANGES);
+    if (indexing && indexStride == 0)
+        indexStride = 10000;
+    if (checkpointInterval > 0 && nProcesses > 1) {
+        fprintf(stderr, "# checkpoints (-c) need a single process; "
+                "ignoring them\n");
+        checkpointInterval = 0;
+    }
+    if (nProcesses > 1 && SHARDING == SHARD_RANGES) {
+        for (int i = 0; i < argc; i++)
+            loadIndex(argv[i], indexStride, true);
+    }
+
+    // With -X, fork the players now, before the backend or anything else
+    // starts threads; the coordinator only serves any loopback server,
+    // which it starts only now so the players don't inherit its threads or
+    // sockets, then waits and sums up their results. Each player parses the
+    // whole trace and replays its shard of it, except that with ranges each
+    // reads only its own part.
+    ProcessGroup* group = NULL;
+    std::string requestLogName;
+    std::string liveStatsName;
+    if (nProcesses > 1) {
+        group = new ProcessGroup(nProcesses, sizeof(ProcessResults));
+        printf("# %d processes, sharded by %s\n", nProcesses,
+               shardNames[SHARDING]);
+        processIndex = group->start();
+        if (processIndex < 0) {
+            if (loopbackThreads > 0) {
+                loopback = startLoopback(loopbackThreads, loopbackSocket,
+                                         loopbackNull);
+                fflush(stdout);
+                group->announce(loopback->getPort());
+            }
+            group->wait();
+            delete loopback;
+            printTotals(*group);
+            delete group;
+            return 0;
+        }
+        if (loopbackThreads > 0)
+            useLoopback(loopbackSocket, int(group->announcement()));
+        setvbuf(stdout, NULL, _IOLBF, 0);
+        printf("# process %d of %d, pid %d\n", processIndex, nProcesses,
+               getpid());
+        if (requestLogPath != NULL) {
+            requestLogName = std::string(requestLogPath) + "." +
+                             std::to_string(processIndex);
+            requestLogPath = requestLogName.c_str();
+        }
+        if (liveStatsPath != NULL) {
+            liveStatsName = std::string(liveStatsPath) + "." +
+                            std::to_string(processIndex);
+            liveStatsPath = liveStatsName.c_str();
+        }
+    }
+
+    backendConfig.servers = serverList;
+    backendFactory = KVBackendRegistry::create(backendName, backendConfig);
+    if (!backendFactory) {
+        fprintf(stderr, "unknown backend %s; known backends:\n",
+                backendName.c_str());
+        KVBackendRegistry::list(stderr);
+        exit(1);
+    }
+    printf("# backend: %s, batches of up to %lu operations\n",
+           backendName.c_str(), BATCH_SIZE);
+    if (ttlModel.isEnabled()) {
+        ttlModel.print(stdout);
+        // A player only knows the writes it made itself, which are all
+        // there are to its keys only if it has keys of its own.
+        if (!backendFactory->expiresItems()) {
+            printf("# %s ignores TTLs; misses are not classified\n",
+                   backendName.c_str());
+        } else if (group != NULL && SHARDING != SHARD_KEYS) {
+            printf("# players sharded by %s share keys; misses are not "
+                   "classified\n", shardNames[SHARDING]);
+        } else {
+            missClassifier.reset(new MissClassifier());
+            if (group != NULL) {
+                printf("# each player classifies the misses on its own "
+                       "shard of the keys\n");
+            }
+        }
+    }
+
+    PRNG fillPrng{DETERMINISTIC ? REPLAY_SEED : RAMCloud::Cycles::rdtsc()};
+    if (valueCompression != NULL) {
+        fillCompressible(fillPrng);
+        valueCompression->printSettings(stdout);
+    } else {
+        for (int i = 0; i < (int)sizeof(randomChars); i++)
+            randomChars[i] = '!' + (fillPrng() % ('~' - '!' + 1));
+    }
+
+    if (requestLogPath != NULL) {
+        requestLog = new RequestLog(requestLogPath, nWorkers, requestLogRate,
+                                    uint64_t(requestLogSlowUs * 1000));
+        printf("# request log: %s, sampling %g of requests", requestLogPath,
+               requestLogRate);
+        if (requestLogSlowUs > 0)
+            printf(" and every one over %g us", requestLogSlowUs);
+        printf("\n");
+    }
+
+    // The workers pick up their report slots as they start.
+    LivePublisher* publisher = NULL;
+    if (liveStatsPath != NULL) {
+        publisher = new LivePublisher(liveStatsPath, liveStatsInterval,
+                                      backendName.c_str());
+        printf("# live stats: %s every %.2f s\n", liveStatsPath,
+               liveStatsInterval);
+    }
+
+    printf("#spinning %d memcached worker threads\n", nWorkers);
+    std::thread* threads[MAX_WORKER_THREADS];
+    for (int i = 0; i < nWorkers; i++)
+        threads[i] = new std::thread(memcachedThread, i);
+    if (publisher != NULL)
+        publisher->run();
 
-    printf("#spinning %d memcached worker threads\n", MEMCACHED_THREADS);
-    std::thread* threads[MEMCACHED_THREADS];
-    for (int i = 0; i < MEMCACHED_THREADS; i++)
-        threads[i] = new std::thread(memcachedThread);
+    std::thread* collector = NULL;
+    if (statsInterval > 0) {
+        printf("# polling server stats every %.2f s\n", statsInterval);
+        collector = new std::thread(statsThread, statsInterval);
+    }
 
     printf("# UPDATE_CHANGED_VALUE_LENGTH = %s\n", (UPDATE_CHANGED_VALUE_LENGTH) ? "true" : "false");
     printf("# USE_LENGTH_FROM_FILE = %s\n", (USE_LENGTH_FROM_FILE) ? "true" : "false");
     printf("# VALUE_LENGTH = %d (ONLY APPLIES IF !USE_LENGTH_FROM_FILE)\n", VALUE_LENGTH);
+    if (DETERMINISTIC)
+        printf("# DETERMINISTIC, seed = %lu\n", REPLAY_SEED);
+
+    // Connecting can take a while (and with -X, every player is doing it
+    // at once), so it stays out of the first interval.
+    const int nConnecting = nWorkers + (collector != NULL ? 1 : 0);
+    while (threadsConnected.load() < nConnecting)
+        usleep(100);
+
+    uint64_t opsSeen = 0;
+    if (group != NULL)
+        group->barrier();
 
-    char buf[1000];
     uint64_t start = RAMCloud::Cycles::rdtsc();
     uint64_t lastGetAttempts = 0;
+    uint64_t lastOtherAttempts = 0;
     uint64_t lastGetFailures = 0;
     uint64_t lastSetAttempts = 0;
     //uint64_t lastSetFailures = 0;
     uint32_t lastLinesProcessed = 0;
     double lastElapsed = 0;
+    ServerStats lastServerStats{};
+    uint64_t lastInputWaitCycles = 0;
+
+    // Operations that may have been dispatched but not yet issued; a
+    // checkpoint stays at least this far behind the dispatcher.
+    const uint64_t inFlight = MAX_QUEUE_LENGTH * (DETERMINISTIC ? nWorkers : 1) +
+                              nWorkers * BATCH_SIZE;
+    bool firstFile = true;
 
     while (argc > 0) {
-        printf("# Using workload file [%s]\n", argv[0]);
-        FILE* fp = fopen(argv[0], "r");
-        assert(fp != NULL);
+        const char* trace = argv[0];
+        printf("# Using workload file [%s]\n", trace);
+
+        // Work out where in the file to start and stop: the index entry at
+        // or before the first operation to replay, and how many operations
+        // past it that is.
+        std::unique_ptr<TraceIndex> index;
+        TraceIndex::Entry from{0, 0, 0};
+        uint64_t endOffset = ~0ul;
+        uint64_t skipOps = 0;
+        if (indexing)
+            index = loadIndex(trace, indexStride, false);
+        if (indexing && firstFile) {
+            TraceIndex::Entry checkpoint;
+            if (resume && readCheckpoint(trace, &checkpoint)) {
+                from = checkpoint;
+            } else if (resume) {
+                printf("# no checkpoint for %s; starting at the beginning\n",
+                       trace);
+            } else if (startSeconds >= 0) {
+                const TraceIndex::Entry* e =
+                    index->findTime(uint64_t(startSeconds * 1e9));
+                if (e == NULL) {
+                    fprintf(stderr, "the index for %s records no replay "
+                            "times that early\n", trace);
+                    exit(1);
+                }
+                from = *e;
+            } else if (startOp > 0) {
+                const TraceIndex::Entry* e = index->findOp(startOp);
+                if (e != NULL)
+                    from = *e;
+                skipOps = startOp - from.ops;
+            }
+        }
+        if (nProcesses > 1 && SHARDING == SHARD_RANGES) {
+            TraceIndex::Range range = index->split(nProcesses)[processIndex];
+            from = range.begin;
+            endOffset = range.end.offset;
+            skipOps = 0;
+            printf("# replaying ops [%lu, %lu) of %s\n", range.begin.ops,
+                   range.end.ops, trace);
+        } else if (from.ops + skipOps > 0) {
+            printf("# starting at op %lu of %s (offset %lu)\n",
+                   from.ops + skipOps, trace, from.offset);
+        }
 
-        while (fgets(buf, sizeof(buf), fp) != NULL) {
-            handleOp(buf);
+        // Only a replay of the whole rest of the file can finish its index,
+        // and only a lone process saves it.
+        const bool growIndex = index != NULL && endOffset == ~0ul &&
+                               nProcesses == 1;
+        const bool recordTimes = from.ops == 0 ||
+                                 from.timeNs != TraceIndex::NO_TIME;
+        const uint64_t timeBase = from.ops == 0 ? 0 : from.timeNs;
+        uint64_t opNumber = from.ops;
+        uint64_t replayStart = 0;
+        uint64_t fileEndOffset = from.offset;
+        uint64_t nextCheckpoint = RAMCloud::Cycles::rdtsc() +
+            RAMCloud::Cycles::fromSeconds(checkpointInterval);
 
-            if ((linesProcessed - lastLinesProcessed) == periodicity) {
+        TraceReader reader(trace, 4 * 1024 * 1024, 4, directIo, from.offset,
+                           endOffset);
+        ParseStage parser(reader, nParsers);
+        uint64_t fileStart = RAMCloud::Cycles::rdtsc();
+        uint64_t fileStartLines = linesProcessed;
+        uint64_t fileStartInputWait = dispatchInputWaitCycles;
+        uint64_t fileStartQueueWait = dispatchQueueWaitCycles;
+
+        while (true) {
+            uint64_t waitStart = RAMCloud::Cycles::rdtsc();
+            __atomic_store_n(&dispatchInputWaitStart, waitStart,
+                             __ATOMIC_RELAXED);
+            OpBatch* batch = parser.next();
+            dispatchInputWaitCycles += RAMCloud::Cycles::rdtsc() - waitStart;
+            __atomic_store_n(&dispatchInputWaitStart, 0, __ATOMIC_RELAXED);
+            if (batch == NULL)
+                break;
+
+            if (growIndex) {
+                uint64_t now = RAMCloud::Cycles::rdtsc();
+                if (replayStart == 0)
+                    replayStart = now;
+                uint64_t timeNs = !recordTimes ? TraceIndex::NO_TIME
+                    : timeBase + RAMCloud::Cycles::toNanoseconds(
+                          now - replayStart);
+                for (const auto& mark : batch->marks)
+                    index->add(mark.second, opNumber + mark.first, timeNs);
+            }
+            fileEndOffset = batch->endOffset;
+            if (checkpointInterval > 0 &&
+                RAMCloud::Cycles::rdtsc() >= nextCheckpoint) {
+                nextCheckpoint += RAMCloud::Cycles::fromSeconds(
+                    checkpointInterval);
+                const TraceIndex::Entry* e = index->findOp(
+                    opNumber - std::min(opNumber, inFlight));
+                if (e != NULL) {
+                    index->save(trace, index->isComplete());
+                    writeCheckpoint(trace, *e);
+                }
+            }
+
+            for (const Operation& op : batch->ops) {
+                opNumber++;
+                if (skipOps > 0) {
+                    skipOps--;
+                    continue;
+                }
+                if (nProcesses > 1 && SHARDING != SHARD_RANGES) {
+                    uint64_t shard = SHARDING == SHARD_KEYS
+                        ? hashTraceKey(op.key, strlen(op.key))
+                        : opsSeen++;
+                    if ((int)(shard % nProcesses) != processIndex)
+                        continue;
+                }
+                dispatchOp(op);
+
+                if ((linesProcessed - lastLinesProcessed) == periodicity) {
                     lastLinesProcessed = linesProcessed;
 #if 0
                     printf("----------------------\n");
@@ -339,35 +2323,162 @@ main(int argc, char** argv)
 #endif
                     uint64_t newGets = getAttempts - lastGetAttempts;
                     uint64_t newSets = setAttempts - lastSetAttempts;
-                    uint64_t newAttempts = newGets + newSets;
+                    uint64_t newOthers = otherAttempts - lastOtherAttempts;
+                    uint64_t newAttempts = newGets + newSets + newOthers;
 
                     double elapsed = RAMCloud::Cycles::toSeconds(RAMCloud::Cycles::rdtsc() - start);
                     double periodSecs = elapsed - lastElapsed;
                     lastElapsed = elapsed;
-                    printf("%-10u lines   %.1f s   %e ops   %.5f%% misses   %.5f%% recently    %e set failures    %.2f op/s    %.2f current op/s\n",
+                    printf("%-10u lines   %.1f s   %e ops   %.5f%% misses   %.5f%% recently    %e set failures    %.2f op/s    %.2f current op/s    %.1f%% input-starved",
                         linesProcessed,
                         elapsed,
-                        (double)(getAttempts + setAttempts),
+                        (double)(getAttempts + setAttempts + otherAttempts),
                         (double)getFailures / (double)getAttempts * 100,
                         (double)(getFailures - lastGetFailures) / (double)(getAttempts - lastGetAttempts)* 100,
                         (double)setFailures,
-                        double(getAttempts + setAttempts) / elapsed,
-                        double(newAttempts) / periodSecs);
+                        double(getAttempts + setAttempts + otherAttempts) / elapsed,
+                        double(newAttempts) / periodSecs,
+                        RAMCloud::Cycles::toSeconds(dispatchInputWaitCycles - lastInputWaitCycles) / periodSecs * 100);
+                    lastInputWaitCycles = dispatchInputWaitCycles;
+                    if (collector != NULL) {
+                        statsLock.lock();
+                        ServerStats now = latestServerStats;
+                        statsLock.unlock();
+                        if (now.valid && lastServerStats.valid &&
+                            now.sampledAt != lastServerStats.sampledAt) {
+                            uint64_t gets = now.cmdGet - lastServerStats.cmdGet;
+                            uint64_t hits = now.getHits - lastServerStats.getHits;
+                            double secs = RAMCloud::Cycles::toSeconds(
+                                now.sampledAt - lastServerStats.sampledAt);
+                            printf("    server:   %lu evictions   %.5f%% hits   %lu bytes   %lu items   %.1f%% cpu",
+                                now.evictions - lastServerStats.evictions,
+                                gets ? (double)hits / (double)gets * 100 : 0.0,
+                                now.bytes,
+                                now.currItems,
+                                (now.cpuSeconds - lastServerStats.cpuSeconds) / secs * 100);
+                        }
+                        if (now.valid)
+                            lastServerStats = now;
+                    }
+                    printf("\n");
                     fflush(stdout);
                     lastGetAttempts = getAttempts;
                     lastGetFailures = getFailures;
                     lastSetAttempts = setAttempts;
+                    lastOtherAttempts = otherAttempts;
                     //lastSetFailures = setFailures;
+                }
             }
+            parser.release(batch);
         }
+
+        // The whole rest of the file went through, so the index now covers
+        // it and there's nothing left to resume.
+        if (growIndex) {
+            index->setEnd(fileEndOffset, opNumber);
+            index->save(trace, true);
+            if (checkpointInterval > 0 || resume)
+                unlink(checkpointPath(trace).c_str());
+        }
+
+        double fileSecs = RAMCloud::Cycles::toSeconds(
+            RAMCloud::Cycles::rdtsc() - fileStart);
+        TraceReader::Stats readStats = reader.getStats();
+        double decodeSecs = RAMCloud::Cycles::toSeconds(readStats.decodeCycles);
+        double parseSecs = RAMCloud::Cycles::toSeconds(parser.parseCycles);
+        printf("# pipeline: %.1f s   read %.1f MB in %.2f s busy (%.1f MB/s), %.2f s waiting for parsers   "
+               "parse %lu ops in %.2f s busy on %d %s threads (%.0f ops/s/thread)   "
+               "dispatch %lu ops (%.0f ops/s), %.2f s waiting for input, %.2f s waiting for workers\n",
+               fileSecs,
+               (double)readStats.bytes / 1e6, decodeSecs,
+               decodeSecs > 0 ? (double)readStats.bytes / 1e6 / decodeSecs : 0.0,
+               RAMCloud::Cycles::toSeconds(readStats.stallCycles),
+               (uint64_t)parser.opsParsed, parseSecs, nParsers,
+               TraceTokenizer::isaName(TraceTokenizer::bestIsa()),
+               parseSecs > 0 ? (double)parser.opsParsed / parseSecs : 0.0,
+               (uint64_t)(linesProcessed - fileStartLines),
+               (double)(linesProcessed - fileStartLines) / fileSecs,
+               RAMCloud::Cycles::toSeconds(dispatchInputWaitCycles - fileStartInputWait),
+               RAMCloud::Cycles::toSeconds(dispatchQueueWaitCycles - fileStartQueueWait));
+
         argc--;
         argv++;
         VALUE_LENGTH *= 2;
+        firstFile = false;
     }
 
+    // Let the workers drain what's left before telling them to quit, so the
+    // digest covers every operation in the trace.
+    for (int i = 0; i < nWorkers; i++) {
+        bool empty = false;
+        while (!empty) {
+            queues[i].lock.lock();
+            empty = queues[i].ops.empty();
+            queues[i].lock.unlock();
+            if (!empty)
+                usleep(100);
+        }
+    }
+
+    if (publisher != NULL)
+        publisher->stop();
     threadsQuit = true;
-    for (int i = 0; i < MEMCACHED_THREADS; i++)
+    for (int i = 0; i < nWorkers; i++)
         threads[i]->join();
+    if (collector != NULL)
+        collector->join();
+    delete loopback;
+    if (publisher != NULL) {
+        publisher->publish(true);
+        delete publisher;
+    }
+
+    uint64_t counters[] = { linesProcessed, getAttempts, getFailures,
+                            setAttempts, setFailures, resultDigest };
+    uint64_t misses[MissClassifier::N_KINDS];
+    for (int k = 0; k < MissClassifier::N_KINDS; k++)
+        misses[k] = missesByKind[k];
+    printDigest(counters);
+    if (missClassifier != NULL) {
+        printMisses(misses, counters[2]);
+        uint64_t forgotten = missClassifier->forgotten();
+        if (forgotten > 0) {
+            printf("# get misses: %lu keys forgotten to keep within %lu; "
+                   "misses on them count as cold\n", forgotten,
+                   (unsigned long)MissClassifier::DEFAULT_CAPACITY);
+        }
+    }
+    if (singleFlight != NULL)
+        singleFlight->print(stdout);
+    if (nearCache != NULL)
+        nearCache->print(stdout, getAttempts + setAttempts + otherAttempts);
+    if (valueCompression != NULL) {
+        valueCompression->print(stdout,
+                                getAttempts + setAttempts + otherAttempts);
+    }
+    printOps(opResults);
+    if (RECORD_LATENCY)
+        printLatency(latency);
+    if (group != NULL) {
+        ProcessResults* results =
+            static_cast<ProcessResults*>(group->slot(processIndex));
+        memcpy(results->counters, counters, sizeof(counters));
+        memcpy(results->misses, misses, sizeof(misses));
+        memcpy(results->results, opResults, sizeof(opResults));
+        for (int i = 0; i < LatencyHistograms::N_HISTOGRAMS; i++) {
+            const Histogram& h = latency.at(i);
+            results->latencySum[i] = h.getSum();
+            results->latencyMax[i] = h.getMax();
+            memcpy(results->latencyCounts[i], h.getCounts().data(),
+                   sizeof(results->latencyCounts[i]));
+        }
+    }
+    if (requestLog != NULL) {
+        requestLog->stop();
+        requestLog->printStats(stdout);
+        delete requestLog;
+    }
+    backendFactory->report(stdout);
 
     return 0;
 }
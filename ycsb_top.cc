@@ -0,0 +1,168 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <memory>
+
+#include "LiveStats.h"
+
+// Watches a running ycsb_player through the stats segment it publishes with
+// -m, redrawing the terminal every -d seconds: throughput, misses, how the
+// dispatcher is doing, latency percentiles over the last interval and since
+// the start, the server counters and one line per worker. With -1 it prints
+// a single snapshot and exits, for scripts. Reading the segment never slows
+// the player down.
+
+static const LiveStats::Segment*
+attach(const char* path)
+{
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        perror(path);
+        exit(1);
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size < (off_t)sizeof(LiveStats::Segment)) {
+        fprintf(stderr, "%s is not a stats segment\n", path);
+        exit(1);
+    }
+    void* p = mmap(NULL, sizeof(LiveStats::Segment), PROT_READ, MAP_SHARED,
+                   fd, 0);
+    close(fd);
+    if (p == MAP_FAILED) {
+        perror(path);
+        exit(1);
+    }
+
+    const LiveStats::Segment* segment =
+        static_cast<const LiveStats::Segment*>(p);
+    if (memcmp(segment->magic, LiveStats::magic(),
+               sizeof(segment->magic)) != 0) {
+        fprintf(stderr, "%s is not a stats segment\n", path);
+        exit(1);
+    }
+    if (segment->version != LiveStats::VERSION ||
+        segment->snapshotBytes != sizeof(LiveStats::Snapshot)) {
+        fprintf(stderr, "%s: unsupported stats segment version %u\n", path,
+                segment->version);
+        exit(1);
+    }
+    return segment;
+}
+
+static double
+percent(uint64_t part, uint64_t whole)
+{
+    return whole > 0 ? (double)part / (double)whole * 100 : 0;
+}
+
+static void
+printLatency(const char* name, const LiveStats::Latency& l)
+{
+    if (l.count == 0)
+        return;
+    printf("  %-14s %10lu %9lu %9lu %9lu %9lu %10lu\n", name, l.count,
+           l.mean, l.p50, l.p99, l.p999, l.max);
+}
+
+static void
+show(const LiveStats::Segment* segment, const LiveStats::Snapshot& s)
+{
+    const char* state = "running";
+    if (s.finished)
+        state = "finished";
+    else if (kill((pid_t)segment->pid, 0) != 0 && errno == ESRCH)
+        state = "exited";
+    printf("ycsb_player pid %lu (%s)   %.1f s   %s\n", segment->pid,
+           segment->backend, s.elapsedSeconds, state);
+
+    printf("ops      %lu   %.0f op/s now   %.0f op/s overall   %lu lines "
+           "dispatched\n", s.gets + s.sets, s.recentOpsPerSecond,
+           s.opsPerSecond, s.lines);
+    printf("gets     %lu   %lu misses (%.3f%%)\n", s.gets, s.getMisses,
+           percent(s.getMisses, s.gets));
+    printf("sets     %lu   %lu failures\n", s.sets, s.setFailures);
+    printf("dispatch %.1f%% input-starved   %.1f%% blocked on full queues   "
+           "%lu queued\n", s.inputStarved * 100, s.queueBlocked * 100,
+           s.queueDepth);
+    if (s.server.valid) {
+        printf("server   %lu evictions   %.3f%% hits   %lu bytes   %lu items"
+               "   %.1f cpu s\n", s.server.evictions,
+               percent(s.server.getHits, s.server.cmdGet), s.server.bytes,
+               s.server.items, s.server.cpuSeconds);
+    }
+
+    if (s.get.count + s.set.count + s.batch.count > 0) {
+        printf("\n  %-14s %10s %9s %9s %9s %9s %10s\n", "latency (ns)",
+               "count", "mean", "p50", "p99", "p99.9", "max");
+        printLatency("get", s.recentGet);
+        printLatency("set", s.recentSet);
+        printLatency("batch", s.recentBatch);
+        printLatency("get (total)", s.get);
+        printLatency("set (total)", s.set);
+        printLatency("batch (total)", s.batch);
+    }
+
+    printf("\n  %6s %12s %8s %12s %8s %7s %9s %9s %9s %9s\n", "worker",
+           "gets", "miss%", "sets", "setfail", "queued", "get p50",
+           "get p99", "set p50", "set p99");
+    for (uint32_t i = 0; i < s.nWorkers; i++) {
+        const LiveStats::Worker& w = s.workers[i];
+        printf("  %6u %12lu %8.3f %12lu %8lu %7lu %9lu %9lu %9lu %9lu\n", i,
+               w.gets, percent(w.getMisses, w.gets), w.sets, w.setFailures,
+               w.queueDepth, w.get.p50, w.get.p99, w.set.p50, w.set.p99);
+    }
+}
+
+int
+main(int argc, char** argv)
+{
+    int opt;
+    char* progname = argv[0];
+    bool once = false;
+    double delay = 1.0;
+
+    while ((opt = getopt(argc, argv, "1d:")) != -1) {
+        switch (opt) {
+        case '1':
+            once = true;
+            break;
+        case 'd':
+            delay = atof(optarg);
+            break;
+        default:
+            fprintf(stderr, "usage: %s [-1] [-d seconds] stats-segment\n",
+                    progname);
+            exit(1);
+        }
+    }
+    argc -= optind;
+    argv += optind;
+
+    if (argc != 1) {
+        fprintf(stderr, "usage: %s [-1] [-d seconds] stats-segment\n",
+                progname);
+        exit(1);
+    }
+
+    const LiveStats::Segment* segment = attach(argv[0]);
+    std::unique_ptr<LiveStats::Snapshot> snapshot(new LiveStats::Snapshot());
+    while (true) {
+        while (!LiveStats::read(segment, snapshot.get()))
+            usleep(100);
+        if (!once)
+            printf("\033[H\033[2J");
+        show(segment, *snapshot);
+        fflush(stdout);
+        if (once || snapshot->finished)
+            break;
+        usleep((useconds_t)(delay * 1e6));
+    }
+    return 0;
+}